@@ -0,0 +1,107 @@
+﻿#include "filebrowser.h"
+#include <QVBoxLayout>
+#include <QHBoxLayout>
+#include <QHeaderView>
+#include <QDateTime>
+
+FileBrowser::FileBrowser(QWidget *parent)
+    : QDialog(parent)
+{
+    setWindowTitle("文件列表");
+    resize(560, 400);
+
+    table = new QTableWidget(this);
+    table->setColumnCount(4);
+    table->setHorizontalHeaderLabels({"文件名", "大小", "上传者", "时间"});
+    table->setSelectionBehavior(QAbstractItemView::SelectRows);
+    table->setSelectionMode(QAbstractItemView::SingleSelection);
+    table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    table->horizontalHeader()->setSectionResizeMode(0, QHeaderView::Stretch);
+    table->verticalHeader()->setVisible(false);
+
+    QPushButton *refreshBtn = new QPushButton("刷新", this);
+    prevBtn = new QPushButton("上一页", this);
+    nextBtn = new QPushButton("下一页", this);
+    downloadBtn = new QPushButton("下载", this);
+    pageLb = new QLabel(this);
+
+    QHBoxLayout *buttons = new QHBoxLayout;
+    buttons->addWidget(refreshBtn);
+    buttons->addWidget(prevBtn);
+    buttons->addWidget(nextBtn);
+    buttons->addWidget(pageLb);
+    buttons->addStretch();
+    buttons->addWidget(downloadBtn);
+    QVBoxLayout *layout = new QVBoxLayout(this);
+    layout->addWidget(table);
+    layout->addLayout(buttons);
+
+    connect(refreshBtn, &QPushButton::clicked, this, &FileBrowser::refresh);
+    connect(prevBtn, &QPushButton::clicked, this, &FileBrowser::prevPage);
+    connect(nextBtn, &QPushButton::clicked, this, &FileBrowser::nextPage);
+    connect(downloadBtn, &QPushButton::clicked, this, &FileBrowser::chooseCurrent);
+    connect(table, &QTableWidget::cellDoubleClicked, this, &FileBrowser::chooseCurrent);
+    prevBtn->setEnabled(false);
+    nextBtn->setEnabled(false);
+}
+
+void FileBrowser::refresh()
+{
+    pageStarts.clear();
+    currentStart.clear();
+    emit requestPage(currentStart);
+}
+
+void FileBrowser::nextPage()
+{
+    if (nextStart.isEmpty())
+        return;
+    pageStarts.append(currentStart);
+    currentStart = nextStart;
+    emit requestPage(currentStart);
+}
+
+void FileBrowser::prevPage()
+{
+    if (pageStarts.isEmpty())
+        return;
+    currentStart = pageStarts.takeLast();
+    emit requestPage(currentStart);
+}
+
+void FileBrowser::showPage(const QString &reply)
+{
+    QStringList lines = reply.split("\n", Qt::SkipEmptyParts);
+    if (lines.isEmpty())
+        return;
+    QString next = lines.takeFirst().section(' ', 1, 1);
+    nextStart = next == "-" ? QString() : next;
+
+    table->setRowCount(0);
+    for (const QString &line : lines)
+    {
+        QStringList fields = line.split(' ');
+        if (fields.size() < 5)
+            continue;
+        int row = table->rowCount();
+        table->insertRow(row);
+        table->setItem(row, 0, new QTableWidgetItem(fields[0]));
+        QTableWidgetItem *size = new QTableWidgetItem(QLocale().formattedDataSize(fields[1].toLongLong()));
+        size->setData(Qt::UserRole, fields[1].toULongLong());
+        table->setItem(row, 1, size);
+        table->setItem(row, 2, new QTableWidgetItem(fields[3] == "-" ? QString() : fields[3]));
+        QDateTime time = QDateTime::fromSecsSinceEpoch(fields[4].toLongLong());
+        table->setItem(row, 3, new QTableWidgetItem(time.toString("yyyy-MM-dd hh:mm")));
+    }
+    prevBtn->setEnabled(!pageStarts.isEmpty());
+    nextBtn->setEnabled(!nextStart.isEmpty());
+    pageLb->setText(QString("第 %1 页").arg(pageStarts.size() + 1));
+}
+
+void FileBrowser::chooseCurrent()
+{
+    int row = table->currentRow();
+    if (row < 0)
+        return;
+    emit fileChosen(table->item(row, 0)->text(), table->item(row, 1)->data(Qt::UserRole).toULongLong());
+}
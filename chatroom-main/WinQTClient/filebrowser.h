@@ -0,0 +1,47 @@
+﻿#ifndef FILEBROWSER_H
+#define FILEBROWSER_H
+
+#include <QDialog>
+#include <QTableWidget>
+#include <QPushButton>
+#include <QLabel>
+#include <QStringList>
+
+#define FILEBROWSER_PAGE_SIZE 50
+
+// 服务器文件目录的浏览窗口，一页一页地向服务器要 "LIST"
+// 服务器回复 "CATALOG <下一页的起点，没有了为 ->\n" + 每行 "名字 大小 SHA-256 上传者 时间"
+class FileBrowser : public QDialog
+{
+    Q_OBJECT
+public:
+    explicit FileBrowser(QWidget *parent = nullptr);
+
+    // 从第一页重新开始
+    void refresh();
+    // 显示服务器的一页回复
+    void showPage(const QString &reply);
+
+signals:
+    // 需要 after 之后的一页，由主窗口发给服务器
+    void requestPage(const QString &after);
+    // 用户选中了一个文件准备下载
+    void fileChosen(const QString &name, qulonglong size);
+
+private slots:
+    void nextPage();
+    void prevPage();
+    void chooseCurrent();
+
+private:
+    QTableWidget *table;
+    QPushButton *prevBtn;
+    QPushButton *nextBtn;
+    QPushButton *downloadBtn;
+    QLabel *pageLb;
+    QStringList pageStarts;  // 之前每一页的起点，上一页时弹出
+    QString currentStart;
+    QString nextStart;
+};
+
+#endif // FILEBROWSER_H
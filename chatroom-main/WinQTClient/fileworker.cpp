@@ -1,13 +1,48 @@
 ﻿#include "fileworker.h"
 #include <QFileInfo>
+#include <QDir>
+#include <QDirIterator>
 #include <QTimer>
 #include <QDebug>
 #include <QThread>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QVector>
 
 // 定义常量，用于表示千字节和兆字节的大小
 #define KB 1024
 #define MB (1024 * 1024)
 
+// 压缩帧: 1 字节类型 + 4 字节大端长度 + 数据，与服务器 compress.h 保持一致
+#define FRAME_RAW 'R'
+#define FRAME_ZLIB 'Z'
+#define FRAME_HEADER_SIZE 5
+#define COMPRESS_CHUNK (64 * KB)
+#define UPLOAD_CHUNK (64 * KB)
+#define COMPRESS_BYPASS_RATIO 0.9
+
+// 增量上传，与服务器 delta.h 保持一致
+#define DELTA_SIG_SIZE 20
+#define DELTA_STRONG_SIZE 16
+#define DELTA_COPY 'C'
+#define DELTA_END 'E'
+#define DELTA_LITERAL_CHUNK (64 * KB)
+#define DELTA_READ_AHEAD (4 * MB)
+
+// 文件夹上传，与服务器 batch.h 保持一致
+#define BATCH_FILE 'F'
+#define BATCH_END 'E'
+#define BATCH_FILES_MAX 100000
+
+// 服务器过载时回复 "BUSY <毫秒> <原因>"，转成给用户的提示；不是 BUSY 返回空
+static QString busyText(const QByteArray &reply)
+{
+    if (!reply.startsWith("BUSY "))
+        return QString();
+    int secs = qMax(1, (reply.split(' ').value(1).toInt() + 999) / 1000);
+    return QString("服务器繁忙，请 %1 秒后重试").arg(secs);
+}
+
 // FileWorker类的构造函数，用于初始化类的成员变量
 // ip: 服务器的IP地址
 // port: 服务器的端口号
@@ -20,6 +55,7 @@ FileWorker::FileWorker(QString &ip, quint16 port, const QString &filePath, bool
 {
     // 初始化文件指针为nullptr
     file = nullptr;
+    socket = nullptr;
 }
 
 // FileWorker类的析构函数，用于释放资源
@@ -50,8 +86,21 @@ FileWorker::~FileWorker()
 // 开始文件传输的函数
 void FileWorker::startTransfer()
 {
+    if (mux)
+    {
+        muxStart();
+        return;
+    }
     // 如果是上传操作
-    if (isUpload)
+    if (isUpload && folder)
+    {
+        batchUpload();
+    }
+    else if (isUpload && delta)
+    {
+        deltaUpload();
+    }
+    else if (isUpload)
     {
         // 调用上传函数
         upload();
@@ -63,6 +112,75 @@ void FileWorker::startTransfer()
     }
 }
 
+// 设置是否压缩传输
+void FileWorker::setCompression(bool enable)
+{
+    compress = enable;
+}
+
+// 设置 TLS 配置
+void FileWorker::setTls(const QSslConfiguration &conf)
+{
+    useTls = true;
+    sslConfig = conf;
+}
+
+// 设置多路复用通道
+void FileWorker::setMux(MuxChannel *channel)
+{
+    mux = channel;
+}
+
+// 设置是否增量上传
+void FileWorker::setDelta(bool enable)
+{
+    delta = enable;
+}
+
+// 设置是否上传整个文件夹
+void FileWorker::setFolder(bool enable)
+{
+    folder = enable;
+}
+
+// 设置 P2P 下载的提供者，由服务器的 "PEER" 回复给出
+void FileWorker::setPeer(const QString &host, quint16 port, const QString &token, const QString &sha256)
+{
+    peerHost = host;
+    peerPort = port;
+    peerToken = token;
+    expectedSha = sha256;
+}
+
+// 建立到服务器的传输连接，TLS 模式下等待握手完成
+bool FileWorker::connectToServer(int msecs)
+{
+    return connectTo(ip, port, useTls, msecs);
+}
+
+bool FileWorker::connectTo(const QString &host, quint16 port, bool tls, int msecs)
+{
+    if (tls)
+    {
+        QSslSocket *sslSocket = new QSslSocket(this);
+        sslSocket->setSslConfiguration(sslConfig);
+        sslSocket->connectToHostEncrypted(host, port);
+        socket = sslSocket;
+        if (!sslSocket->waitForEncrypted(msecs))
+            return false;
+    }
+    else
+    {
+        socket = new QTcpSocket(this);
+        socket->connectToHost(host, port);
+        if (!socket->waitForConnected(msecs) || socket->state() != QAbstractSocket::ConnectedState)
+            return false;
+    }
+    // 命令头和应答都很短，连上就关掉 Nagle，不用等头发出去之后再设置
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    return true;
+}
+
 // 暂停文件传输的函数
 void FileWorker::pauseTransfer()
 {
@@ -75,11 +193,22 @@ void FileWorker::resumeTransfer()
 {
     // 将暂停标志置为false
     pause = false;
+    if (mux)
+        muxFill();
 }
 
 // 取消文件传输的函数
 void FileWorker::cancelTransfer()
 {
+    // 多路复用时只关闭自己的流，连接还要继续聊天
+    // 已经结束的 worker 仍在主线程里连着取消信号，直接忽略
+    if (mux)
+    {
+        if (!muxStream)
+            return;
+        mux->closeStream(muxStream, "CANCEL");
+        muxFinish();
+    }
     // 如果文件指针不为空
     if (file)
     {
@@ -109,22 +238,13 @@ void FileWorker::upload()
         return;
     }
 
-    // 创建一个QTcpSocket对象，用于与服务器建立连接
-    socket = new QTcpSocket(this);
-    // 如果socket创建失败
-    if (!socket)
-    {
-        // 直接返回
-        return;
-    }
-    // 连接到指定的服务器IP和端口
-    socket->connectToHost(ip, port);
-    // 如果连接超时或者连接状态不是已连接状态
-    if (!socket->waitForConnected(3000) ||
-        socket->state() != QAbstractSocket::ConnectedState)
+    // 连接到指定的服务器IP和端口，如果连接超时或者连接状态不是已连接状态
+    if (!connectToServer(3000))
     {
         // 删除socket对象
         delete socket;
+        socket = nullptr;
+        emit transferFailed("无法连接到服务器");
         // 直接返回
         return;
     }
@@ -136,7 +256,7 @@ void FileWorker::upload()
     // 获取文件的总大小
     qint64 total = file.size();
     // 构造文件元信息，包含上传指令、文件名和文件大小
-    QString fileMeta = QString("UPLOAD %1 %2").arg(fileInfo.fileName()).arg(file.size());
+    QString fileMeta = QString("%1UPLOAD %2 %3").arg(compress ? "Z" : "").arg(fileInfo.fileName()).arg(file.size());
     // 输出文件元信息
     qDebug() << fileMeta;
     // 将文件元信息发送给服务器
@@ -147,9 +267,15 @@ void FileWorker::upload()
 
     // 等待服务器确认，避免数据丢失
     socket->waitForReadyRead(1000);
+    // 服务器过载时不接收上传，直接回复 BUSY 并关闭连接
+    QString busy = busyText(socket->peek(64));
+    if (!busy.isEmpty())
+    {
+        file.close();
+        emit transferFailed(busy);
+        return;
+    }
 
-    // 设置socket的低延迟选项
-    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
     // 创建一个QElapsedTimer对象，用于计时
     timer = new QElapsedTimer();
     // 开始计时
@@ -161,8 +287,8 @@ void FileWorker::upload()
     // 当文件未读取到末尾且socket处于连接状态时
     while (!file.atEnd() && socket->state() == QAbstractSocket::ConnectedState)
     {
-        // 从文件中读取4096字节的数据
-        QByteArray chunk = file.read(4096);
+        // 每次读一大块，一次写入就能填满发送缓冲区
+        QByteArray chunk = file.read(compress ? COMPRESS_CHUNK : UPLOAD_CHUNK);
         // 如果读取的数据为空
         if (chunk.isEmpty())
         {
@@ -173,6 +299,8 @@ void FileWorker::upload()
             // 直接返回
             return;
         }
+        if (compress)
+            chunk = encodeFrame(chunk);
         // 记录需要写入的字节数
         qint64 bytesToWrite = chunk.size();
         // 当还有字节需要写入时
@@ -208,12 +336,14 @@ void FileWorker::upload()
         double seconds = timer->elapsed() / 1000.0;
         // 用于存储速度信息的字符串
         QString speed;
+        // 压缩时按原始字节计算速度和进度
+        qint64 rawSent = file.pos();
         // 调用speedStr函数计算速度信息
-        speedStr(bytesSent, seconds, speed);
+        speedStr(rawSent, seconds, speed);
         // 发送速度更新的信号
         emit speedUpdated(speed);
         // 计算上传进度
-        int progress = static_cast<int>((bytesSent * 100) / total);
+        int progress = static_cast<int>((rawSent * 100) / total);
         // 发送进度更新的信号
         emit progressUpdated(progress);
 //        qDebug() << "Progress: " << progress << "DEBUG 5 Speed: " << speed;
@@ -228,23 +358,469 @@ void FileWorker::upload()
     emit transferComplete();
 }
 
-// 下载文件的函数
-void FileWorker::download()
+// 写出全部数据，超时或出错返回 false
+bool FileWorker::writeAll(QByteArray data)
 {
-    socket = new QTcpSocket(this);
-    if (!socket)
-        return;
+    while (!data.isEmpty())
+    {
+        qint64 written = socket->write(data);
+        if (written == -1 || !socket->waitForBytesWritten(30000))
+            return false;
+        data = data.mid(written);
+    }
+    return true;
+}
+
+// 读一行服务器的应答(不含换行符)，超时返回空
+QByteArray FileWorker::readLine(int msecs)
+{
+    while (!socket->canReadLine())
+    {
+        if (!socket->waitForReadyRead(msecs))
+            return QByteArray();
+    }
+    return socket->readLine().trimmed();
+}
 
-    socket->connectToHost(ip, port);
-    if (!socket->waitForConnected(5000) || socket->state() != QAbstractSocket::ConnectedState)
+// rsync 弱校验，低 16 位字节和，高 16 位加权和
+static void weakSum(const uchar *p, int len, quint32 &a, quint32 &b)
+{
+    a = 0;
+    b = 0;
+    for (int i = 0; i < len; i++)
+    {
+        a += p[i];
+        b += quint32(len - i) * p[i];
+    }
+}
+
+static void appendBe32(QByteArray &out, quint32 v)
+{
+    out.append(char(v >> 24));
+    out.append(char(v >> 16));
+    out.append(char(v >> 8));
+    out.append(char(v));
+}
+
+// 增量上传: 取旧版本的块签名，在新文件的每个偏移上用滚动校验找相同的块
+// 找到的块发拷贝指令，中间没匹配上的部分作为原样数据(可压缩)发送
+void FileWorker::deltaUpload()
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        emit transferFailed("Failed to open file!");
+        return;
+    }
+    if (!connectToServer(3000))
     {
+        delete socket;
+        socket = nullptr;
         emit transferFailed("无法连接到服务器");
+        return;
+    }
+    QFileInfo fileInfo(filePath);
+    qint64 total = file.size();
+    QString request = QString("DELTA %1 %2\n").arg(fileInfo.fileName()).arg(total);
+    socket->write(request.toUtf8());
+
+    // **1. 旧版本的签名: "SIGS <块大小> <块数>\n" + 每块 20 字节**
+    QByteArray line = readLine(10000);
+    if (line.isEmpty())
+        line = socket->readAll();  // BUSY 不带换行，服务器发完就关闭连接
+    QList<QByteArray> head = line.split(' ');
+    if (head.size() != 3 || head[0] != "SIGS")
+    {
+        if (!busyText(line).isEmpty())
+        {
+            emit transferFailed(busyText(line));
+            return;
+        }
+        emit transferFailed(head.isEmpty() || head[0].isEmpty() ? "服务器无响应" : QString::fromUtf8(head.join(' ')));
+        return;
+    }
+    int block = head[1].toInt();
+    int count = head[2].toInt();
+    QByteArray sigs;
+    while (sigs.size() < count * DELTA_SIG_SIZE)
+    {
+        if (socket->bytesAvailable() == 0 && !socket->waitForReadyRead(10000))
+        {
+            emit transferFailed("服务器无响应");
+            return;
+        }
+        sigs.append(socket->read(qint64(count) * DELTA_SIG_SIZE - sigs.size()));
+    }
+    // 只匹配满块，最后不满的一块当作原样数据
+    QHash<quint32, QVector<int>> weakIndex;
+    const uchar *sig = reinterpret_cast<const uchar *>(sigs.constData());
+    for (int i = 0; i < count; i++)
+    {
+        const uchar *p = sig + i * DELTA_SIG_SIZE;
+        quint32 weak = (quint32(p[0]) << 24) | (quint32(p[1]) << 16) | (quint32(p[2]) << 8) | quint32(p[3]);
+        weakIndex[weak].append(i);
+    }
+
+    if (!compress)
+        compressDecided = compressBypass = true;  // encodeFrame 只生成原样帧
+    timer = new QElapsedTimer();
+    timer->start();
+    QCryptographicHash sha(QCryptographicHash::Sha256);
+    QByteArray out;
+    qint64 wireBytes = 0;
+    int copyFirst = -1;
+    int copyCount = 0;
+
+    auto flushCopy = [&]() {
+        if (copyCount == 0)
+            return;
+        out.append(DELTA_COPY);
+        appendBe32(out, copyFirst);
+        appendBe32(out, copyCount);
+        copyCount = 0;
+    };
+    auto sendOut = [&]() {
+        wireBytes += out.size();
+        bool ok = writeAll(out);
+        out.clear();
+        return ok;
+    };
+
+    // **2. 滑动窗口: buf 从文件的 bufStart 开始，pos 是窗口起点，literal 是还没发送的原样数据起点**
+    QByteArray buf;
+    qint64 bufStart = 0;
+    int pos = 0;
+    int literal = 0;
+    bool haveSum = false;
+    quint32 a = 0, b = 0;
+    bool eof = false;
+    while (true)
+    {
+        if (!eof && buf.size() - pos < block + 1)
+        {
+            // 丢掉已经处理完的数据，再读一段
+            int drop = qMin(pos, literal);
+            buf.remove(0, drop);
+            bufStart += drop;
+            pos -= drop;
+            literal -= drop;
+            QByteArray more = file.read(DELTA_READ_AHEAD);
+            eof = more.isEmpty();
+            sha.addData(more);
+            buf.append(more);
+            reportProgress(bufStart + pos, total);
+            continue;
+        }
+        if (count == 0 || buf.size() - pos < block)
+            break;
+
+        const uchar *p = reinterpret_cast<const uchar *>(buf.constData()) + pos;
+        if (!haveSum)
+        {
+            weakSum(p, block, a, b);
+            haveSum = true;
+        }
+        int hit = -1;
+        auto it = weakIndex.constFind((a & 0xffff) | (b << 16));
+        if (it != weakIndex.constEnd())
+        {
+            QByteArray md5 = QCryptographicHash::hash(QByteArray::fromRawData(buf.constData() + pos, block), QCryptographicHash::Md5);
+            for (int i : it.value())
+            {
+                if (memcmp(md5.constData(), sig + i * DELTA_SIG_SIZE + 4, DELTA_STRONG_SIZE) == 0)
+                {
+                    hit = i;
+                    break;
+                }
+            }
+        }
+        if (hit >= 0)
+        {
+            // 前面没匹配上的部分作为原样数据发送，相邻的块合并成一条拷贝指令
+            if (pos > literal)
+            {
+                flushCopy();
+                for (int off = literal; off < pos; off += DELTA_LITERAL_CHUNK)
+                    out.append(encodeFrame(buf.mid(off, qMin(DELTA_LITERAL_CHUNK, pos - off))));
+            }
+            if (copyCount > 0 && copyFirst + copyCount == hit)
+                copyCount++;
+            else
+            {
+                flushCopy();
+                copyFirst = hit;
+                copyCount = 1;
+            }
+            pos += block;
+            literal = pos;
+            haveSum = false;
+        }
+        else
+        {
+            // 窗口右移一个字节
+            if (buf.size() - pos > block)
+            {
+                quint32 outByte = p[0];
+                quint32 inByte = p[block];
+                a = a - outByte + inByte;
+                b = b - quint32(block) * outByte + a;
+            }
+            pos++;
+            if (pos - literal >= DELTA_LITERAL_CHUNK)
+            {
+                flushCopy();
+                out.append(encodeFrame(buf.mid(literal, DELTA_LITERAL_CHUNK)));
+                literal += DELTA_LITERAL_CHUNK;
+            }
+        }
+        if (out.size() >= DELTA_LITERAL_CHUNK && !sendOut())
+        {
+            emit transferFailed("Write Error:" + socket->errorString());
+            return;
+        }
+    }
+
+    // **3. 剩下的全部是原样数据，最后发结束指令和整个文件的哈希**
+    flushCopy();
+    while (true)
+    {
+        for (int off = literal; off < buf.size(); off += DELTA_LITERAL_CHUNK)
+            out.append(encodeFrame(buf.mid(off, qMin(DELTA_LITERAL_CHUNK, buf.size() - off))));
+        bufStart += buf.size();
+        buf.clear();
+        literal = 0;
+        if (!sendOut())
+        {
+            emit transferFailed("Write Error:" + socket->errorString());
+            return;
+        }
+        reportProgress(bufStart, total);
+        if (eof)
+            break;
+        buf = file.read(DELTA_READ_AHEAD);
+        eof = buf.isEmpty();
+        sha.addData(buf);
+    }
+    out.append(DELTA_END);
+    out.append(sha.result());
+    if (!sendOut())
+    {
+        emit transferFailed("Write Error:" + socket->errorString());
+        return;
+    }
+
+    QByteArray reply = readLine(60000);
+    socket->close();
+    qDebug() << "Delta upload:" << total << "bytes, sent" << wireBytes << "reply" << reply;
+    if (reply.startsWith("OK"))
+        emit transferComplete();
+    else
+        emit transferFailed(reply.isEmpty() ? "服务器无响应" : QString::fromUtf8(reply));
+}
+
+static void appendBe(QByteArray &out, quint64 v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        out.append(char(v >> (i * 8)));
+}
+
+// 服务器只接受不以 '.' 开头、不含空白和反斜杠的名字
+static bool validName(const QString &name)
+{
+    if (name.isEmpty() || name.startsWith('.'))
+        return false;
+    for (QChar c : name)
+    {
+        if (c.unicode() <= ' ' || c.unicode() == 0x7f || c == '\\')
+            return false;
+    }
+    return true;
+}
+
+// 文件夹上传: "BATCH <目录名> <文件数> <总字节数>\n"，后面是按传输帧分好的归档流
+// 每个文件一个头 'F' | 路径长度 | 相对路径 | 大小，紧跟文件内容，很多小文件压在同一帧里，没有逐个文件的往返
+void FileWorker::batchUpload()
+{
+    // **1. 先列出所有文件，头里要带文件数和总大小**
+    QDir root(filePath);
+    QString folderName = QFileInfo(filePath).fileName();
+    if (!validName(folderName))
+    {
+        emit transferFailed("文件夹名不能以 '.' 开头或含空格: " + folderName);
+        return;
+    }
+    QStringList paths;
+    QList<qint64> sizes;
+    qint64 total = 0;
+    QDirIterator it(filePath, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        QString path = it.next();
+        QString rel = root.relativeFilePath(path);
+        for (const QString &part : rel.split('/'))
+        {
+            if (!validName(part))
+            {
+                emit transferFailed("文件名不能以 '.' 开头或含空格: " + rel);
+                return;
+            }
+        }
+        paths.append(rel);
+        sizes.append(it.fileInfo().size());
+        total += sizes.last();
+    }
+    if (paths.isEmpty())
+    {
+        emit transferFailed("文件夹是空的");
+        return;
+    }
+    if (paths.size() > BATCH_FILES_MAX)
+    {
+        emit transferFailed(QString("文件太多，最多 %1 个").arg(BATCH_FILES_MAX));
+        return;
+    }
+
+    if (!connectToServer(3000))
+    {
         delete socket;
+        socket = nullptr;
+        emit transferFailed("无法连接到服务器");
+        return;
+    }
+    socket->write(QString("BATCH %1 %2 %3\n").arg(folderName).arg(paths.size()).arg(total).toUtf8());
+
+    // **2. 归档流攒够一块就编码成一帧发出去**
+    if (!compress)
+        compressDecided = compressBypass = true;  // encodeFrame 只生成原样帧
+    timer = new QElapsedTimer();
+    timer->start();
+    QByteArray stream;
+    qint64 done = 0;
+    qint64 wireBytes = 0;
+    auto sendFrames = [&](bool last) {
+        while (stream.size() >= COMPRESS_CHUNK || (last && !stream.isEmpty()))
+        {
+            QByteArray frame = encodeFrame(stream.left(COMPRESS_CHUNK));
+            stream.remove(0, qMin(stream.size(), COMPRESS_CHUNK));
+            wireBytes += frame.size();
+            if (!writeAll(frame))
+                return false;
+        }
+        return true;
+    };
+    // 服务器中途拒绝时先回复原因再关闭连接
+    auto fail = [&](const QString &error) {
+        QByteArray reply = readLine(1000);
+        socket->close();
+        if (reply.startsWith("ERROR") || reply.startsWith("BUSY "))
+            emit transferFailed(busyText(reply).isEmpty() ? QString::fromUtf8(reply) : busyText(reply));
+        else
+            emit transferFailed(error);
+    };
+
+    for (int i = 0; i < paths.size(); i++)
+    {
+        QFile file(root.filePath(paths[i]));
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            socket->close();
+            emit transferFailed("无法打开文件: " + paths[i]);
+            return;
+        }
+        QByteArray path = paths[i].toUtf8();
+        stream.append(BATCH_FILE);
+        appendBe(stream, path.size(), 2);
+        stream.append(path);
+        appendBe(stream, sizes[i], 8);
+        // 列出之后文件又变了就按列出时的大小发，不够时算失败
+        qint64 left = sizes[i];
+        while (left > 0)
+        {
+            QByteArray chunk = file.read(qMin<qint64>(left, COMPRESS_CHUNK));
+            if (chunk.isEmpty())
+            {
+                socket->close();
+                emit transferFailed("读取文件失败: " + paths[i]);
+                return;
+            }
+            stream.append(chunk);
+            left -= chunk.size();
+            done += chunk.size();
+            if (!sendFrames(false))
+            {
+                fail("Write Error:" + socket->errorString());
+                return;
+            }
+            reportProgress(done, total);
+        }
+    }
+    stream.append(BATCH_END);
+    appendBe(stream, paths.size(), 4);
+    if (!sendFrames(true))
+    {
+        fail("Write Error:" + socket->errorString());
         return;
     }
 
-    QString header = QString("DOWNLOAD %1").arg(filePath);
-    socket->write(header.toUtf8());
+    // **3. 服务器全部落盘后回复 "OK <文件数>"**
+    QByteArray reply = readLine(60000);
+    socket->close();
+    qDebug() << "Folder upload:" << paths.size() << "files" << total << "bytes, sent" << wireBytes << "reply" << reply;
+    if (reply.startsWith("OK"))
+        emit transferComplete();
+    else if (!busyText(reply).isEmpty())
+        emit transferFailed(busyText(reply));
+    else
+        emit transferFailed(reply.isEmpty() ? "服务器无响应" : QString::fromUtf8(reply));
+}
+
+// 下载文件的函数
+// P2P: 先直接从提供者那里下载，连不上、被拒绝或校验失败再走服务器
+void FileWorker::download()
+{
+    QString error;
+    if (!peerToken.isEmpty())
+    {
+        QByteArray request = QString("P2P %1\n").arg(peerToken).toUtf8();
+        if (receiveFile(peerHost, peerPort, false, false, request, error))
+        {
+            emit transferComplete();
+            return;
+        }
+        qDebug() << "P2P 下载失败，改从服务器下载:" << error;
+    }
+    QString header = QString("%1DOWNLOAD %2").arg(compress ? "Z" : "").arg(filePath);
+    if (receiveFile(ip, port, useTls, compress, header.toUtf8(), error))
+        emit transferComplete();
+    else
+        emit transferFailed(error);
+}
+
+// 连接 host:port 发送请求，按 "文件大小\n" + 数据的格式接收文件
+// 知道文件的 SHA-256 时边收边算，对不上算失败
+bool FileWorker::receiveFile(const QString &host, quint16 port, bool tls, bool compressed, const QByteArray &request, QString &error)
+{
+    if (file)
+    {
+        file->close();
+        delete file;
+        file = nullptr;
+    }
+    if (socket)
+    {
+        socket->abort();
+        delete socket;
+        socket = nullptr;
+    }
+    if (!connectTo(host, port, tls, 5000))
+    {
+        error = "无法连接到服务器";
+        delete socket;
+        socket = nullptr;
+        return false;
+    }
+
+    socket->write(request);
     socket->flush();
 
     // **等待服务器的文件大小响应**
@@ -256,16 +832,21 @@ void FileWorker::download()
 
     if (response.isEmpty())  // **如果服务器未响应，报错**
     {
-        emit transferFailed("服务器无响应");
-        return;
+        error = "服务器无响应";
+        return false;
     }
 
     qDebug() << "收到服务器响应：" << response;
 
     if (response.startsWith("ERROR"))
     {
-        emit transferFailed("服务器无法找到文件");
-        return;
+        error = "服务器无法找到文件";
+        return false;
+    }
+    if (response.startsWith("BUSY "))
+    {
+        error = busyText(response);
+        return false;
     }
 
     // **解析文件大小**
@@ -274,19 +855,26 @@ void FileWorker::download()
     qint64 filesize = parts[0].trimmed().toLongLong(&ok);
     if (!ok || filesize <= 0)
     {
-        emit transferFailed("无效的文件大小: " + QString::number(filesize));
-        return;
+        error = "无效的文件大小: " + QString::number(filesize);
+        return false;
     }
 
     qDebug() << "服务器发送的文件大小：" << filesize;
 
+    // **文件大小后面可能已经跟着一部分文件数据**
+    QByteArray pending = response.mid(response.indexOf('\n') + 1);
+    QByteArray frames;
+
+    // 文件夹上传的文件名带目录，先建好
+    QDir().mkpath(QFileInfo(filePath).path());
     file = new QFile(filePath);
     if (!file->open(QIODevice::WriteOnly))
     {
-        emit transferFailed("无法打开文件进行写入");
-        return;
+        error = "无法打开文件进行写入";
+        return false;
     }
 
+    QCryptographicHash sha(QCryptographicHash::Sha256);
     bytesReceived = 0;
     timer = new QElapsedTimer();
     timer->start();
@@ -294,26 +882,51 @@ void FileWorker::download()
     // **开始接收文件数据**
     while (bytesReceived < filesize)
     {
-        if (!socket->waitForReadyRead(60000) && socket->bytesAvailable() == 0)
+        QByteArray chunk;
+        if (!pending.isEmpty())
         {
-            qDebug() << "等待超时，可能服务器断开连接";
-            break;
+            chunk = pending;
+            pending.clear();
         }
+        else
+        {
+            if (!socket->waitForReadyRead(60000) && socket->bytesAvailable() == 0)
+            {
+                qDebug() << "等待超时，可能服务器断开连接";
+                break;
+            }
 
-        // **逐步读取数据**
-        QByteArray chunk = socket->read(qMin(filesize - bytesReceived, (qint64)65536));
-        if (chunk.isEmpty())
+            // **逐步读取数据**
+            chunk = socket->read(compressed ? (qint64)65536 : qMin(filesize - bytesReceived, (qint64)65536));
+            if (chunk.isEmpty())
+            {
+                qDebug() << "收到空数据，可能连接已断开";
+                break;
+            }
+        }
+
+        if (compressed)
         {
-            qDebug() << "收到空数据，可能连接已断开";
-            break;
+            frames.append(chunk);
+            chunk.clear();
+            if (!decodeFrames(frames, chunk))
+            {
+                error = "压缩数据损坏";
+                break;
+            }
+            // 还没收到完整的帧
+            if (chunk.isEmpty())
+                continue;
         }
 
         qint64 bytesWritten = file->write(chunk);
         if (bytesWritten != chunk.size())
         {
-            emit transferFailed("文件写入错误");
+            error = "文件写入错误";
             break;
         }
+        if (!expectedSha.isEmpty())
+            sha.addData(chunk);
 
         bytesReceived += bytesWritten;
         file->flush();
@@ -341,18 +954,237 @@ void FileWorker::download()
     file->close();
     socket->close();
 
-    if (bytesReceived >= filesize)
+    if (bytesReceived < filesize)
+    {
+        if (error.isEmpty())
+            error = "文件下载不完整，已接收 " + QString::number(bytesReceived) + " / " + QString::number(filesize);
+        qDebug() << socket->errorString();
+        return false;
+    }
+    if (!expectedSha.isEmpty() && sha.result().toHex() != expectedSha.toLatin1())
+    {
+        error = "文件校验失败";
+        return false;
+    }
+    qDebug() << "文件下载完成";
+    return true;
+}
+
+
+// 在多路复用通道上打开文件流
+void FileWorker::muxStart()
+{
+    connect(mux, &MuxChannel::streamOpened, this, &FileWorker::onStreamOpened);
+    connect(mux, &MuxChannel::streamData, this, &FileWorker::onStreamData);
+    connect(mux, &MuxChannel::streamWritable, this, &FileWorker::onStreamWritable);
+    connect(mux, &MuxChannel::streamClosed, this, &FileWorker::onStreamClosed);
+    timer = new QElapsedTimer();
+    timer->start();
+
+    if (isUpload)
+    {
+        file = new QFile(filePath);
+        if (!file->open(QIODevice::ReadOnly))
+        {
+            muxFinish();
+            emit transferFailed("Failed to open file!");
+            return;
+        }
+        QFileInfo fileInfo(filePath);
+        filesize = file->size();
+        QString request = QString("%1UPLOAD %2 %3").arg(compress ? "Z" : "").arg(fileInfo.fileName()).arg(file->size());
+        muxStream = mux->openStream(request.toUtf8());
+        muxFill();
+    }
+    else
+    {
+        QString request = QString("%1DOWNLOAD %2").arg(compress ? "Z" : "").arg(filePath);
+        muxStream = mux->openStream(request.toUtf8());
+    }
+}
+
+// 窗口允许时继续读文件排队发送
+void FileWorker::muxFill()
+{
+    if (muxFilling || pause || !muxStream || !isUpload || !file)
+        return;
+    // sendData 可能同步触发 streamWritable，防止重入
+    muxFilling = true;
+    while (!file->atEnd() && mux->writable(muxStream) > 0)
+    {
+        QByteArray chunk = file->read(COMPRESS_CHUNK);
+        if (chunk.isEmpty())
+            break;
+        if (compress)
+            chunk = encodeFrame(chunk);
+        mux->sendData(muxStream, chunk);
+        reportProgress(file->pos(), file->size());
+    }
+    muxFilling = false;
+}
+
+// 断开与通道的连接并关闭文件
+void FileWorker::muxFinish()
+{
+    disconnect(mux, nullptr, this, nullptr);
+    muxStream = 0;
+    if (file)
+    {
+        file->close();
+        delete file;
+        file = nullptr;
+    }
+}
+
+void FileWorker::onStreamOpened(quint32 stream, const QByteArray &payload)
+{
+    if (stream != muxStream || isUpload)
+        return;
+    // 服务器回复文件大小
+    filesize = payload.toULongLong();
+    bytesReceived = 0;
+    QDir().mkpath(QFileInfo(filePath).path());
+    file = new QFile(filePath);
+    if (!file->open(QIODevice::WriteOnly))
     {
+        mux->closeStream(muxStream, "CANCEL");
+        muxFinish();
+        emit transferFailed("无法打开文件进行写入");
+    }
+}
+
+void FileWorker::onStreamData(quint32 stream, const QByteArray &payload)
+{
+    if (stream != muxStream || isUpload || !file)
+        return;
+    QByteArray raw = payload;
+    if (compress)
+    {
+        muxFrames.append(payload);
+        raw.clear();
+        if (!decodeFrames(muxFrames, raw))
+        {
+            mux->closeStream(muxStream, "CANCEL");
+            muxFinish();
+            emit transferFailed("压缩数据损坏");
+            return;
+        }
+    }
+    if (file->write(raw) != raw.size())
+    {
+        mux->closeStream(muxStream, "CANCEL");
+        muxFinish();
+        emit transferFailed("文件写入错误");
+        return;
+    }
+    bytesReceived += raw.size();
+    // 已经写入文件，归还窗口
+    mux->grantWindow(stream, payload.size());
+    reportProgress(bytesReceived, filesize);
+}
+
+void FileWorker::onStreamWritable(quint32 stream)
+{
+    if (stream == muxStream)
+        muxFill();
+}
+
+void FileWorker::onStreamClosed(quint32 stream, const QByteArray &status)
+{
+    if (stream != muxStream)
+        return;
+    bool ok = status == "OK" && (isUpload || bytesReceived >= qint64(filesize));
+    muxFinish();
+    if (ok)
+    {
+        reportProgress(filesize, filesize);
         emit transferComplete();
-        qDebug() << "文件下载完成";
     }
+    else if (status == "ERROR")
+        emit transferFailed("服务器无法找到文件");
+    else if (status.startsWith("BUSY "))
+        emit transferFailed(busyText(status));
     else
+        emit transferFailed(QString::fromUtf8(status));
+}
+
+// 发送速度和进度
+void FileWorker::reportProgress(qint64 done, qint64 total)
+{
+    QString speed;
+    speedStr(done, timer->elapsed() / 1000.0, speed);
+    emit speedUpdated(speed);
+    emit progressUpdated(total > 0 ? static_cast<int>(done * 100 / total) : 100);
+}
+
+// 把一块文件数据编码成一帧
+// 首块压缩率太差(已压缩的文件)时，后续所有块都不再尝试压缩
+QByteArray FileWorker::encodeFrame(const QByteArray &chunk)
+{
+    QByteArray packed;
+    bool useZlib = false;
+    if (!compressBypass)
     {
-        emit transferFailed("文件下载不完整，已接收 " + QString::number(bytesReceived) + " / " + QString::number(filesize));
-        qDebug() << socket->errorString();
+        packed = qCompress(chunk, 1);
+        if (!compressDecided)
+        {
+            compressDecided = true;
+            compressBypass = packed.size() >= chunk.size() * COMPRESS_BYPASS_RATIO;
+            useZlib = !compressBypass;
+        }
+        else
+        {
+            useZlib = packed.size() < chunk.size();
+        }
     }
+
+    const QByteArray &payload = useZlib ? packed : chunk;
+    QByteArray frame;
+    frame.reserve(FRAME_HEADER_SIZE + payload.size());
+    frame.append(useZlib ? FRAME_ZLIB : FRAME_RAW);
+    quint32 len = payload.size();
+    frame.append(char(len >> 24));
+    frame.append(char(len >> 16));
+    frame.append(char(len >> 8));
+    frame.append(char(len));
+    frame.append(payload);
+    return frame;
 }
 
+// 从 pending 中解出所有完整的帧，原始数据追加到 out
+// 数据损坏时返回 false
+bool FileWorker::decodeFrames(QByteArray &pending, QByteArray &out)
+{
+    int pos = 0;
+    while (pending.size() - pos >= FRAME_HEADER_SIZE)
+    {
+        const uchar *p = reinterpret_cast<const uchar *>(pending.constData() + pos);
+        char type = char(p[0]);
+        int len = int((quint32(p[1]) << 24) | (quint32(p[2]) << 16) | (quint32(p[3]) << 8) | quint32(p[4]));
+        if (len < 0 || pending.size() - pos - FRAME_HEADER_SIZE < len)
+            break;
+
+        QByteArray payload = pending.mid(pos + FRAME_HEADER_SIZE, len);
+        if (type == FRAME_RAW)
+        {
+            out.append(payload);
+        }
+        else if (type == FRAME_ZLIB)
+        {
+            QByteArray raw = qUncompress(payload);
+            if (raw.isEmpty())
+                return false;
+            out.append(raw);
+        }
+        else
+        {
+            return false;
+        }
+        pos += FRAME_HEADER_SIZE + len;
+    }
+    pending.remove(0, pos);
+    return true;
+}
 
 // 计算速度信息的函数
 // bytes: 已传输的字节数
@@ -3,8 +3,10 @@
 
 #include <QObject>
 #include <QTcpSocket>
+#include <QSslSocket>
 #include <QFile>
 #include <QElapsedTimer>
+#include "muxchannel.h"
 
 class FileWorker : public QObject
 {
@@ -12,6 +14,18 @@ class FileWorker : public QObject
 public:
     explicit FileWorker(QString &ip, quint16 port, const QString &filePath, bool isUpload, qint64 bytesReceived=0,size_t filesize = 0);
     ~FileWorker();
+    // 服务器在 CAPS 协商中支持 zlib 时启用压缩传输
+    void setCompression(bool enable);
+    // 使用聊天连接的 TLS 配置(含会话票据)建立加密的传输连接
+    void setTls(const QSslConfiguration &conf);
+    // 走聊天连接的多路复用通道，不再单独建立连接，此时 worker 留在主线程
+    void setMux(MuxChannel *channel);
+    // 增量上传: 服务器上有同名旧版本时只发送改动的部分，走单独的传输连接
+    void setDelta(bool enable);
+    // 文件夹上传: filePath 是目录，整棵目录树作为一条归档流在单独的传输连接上发送
+    void setFolder(bool enable);
+    // P2P 下载: 先直接连提供者，失败再从服务器下载；sha256 用来校验收到的文件
+    void setPeer(const QString &host, quint16 port, const QString &token, const QString &sha256);
 signals:
     void progressUpdated(int value);
     void speedUpdated(QString speed);
@@ -22,10 +36,17 @@ public slots:
     void pauseTransfer();
     void resumeTransfer();
     void cancelTransfer();
+private slots:
+    void onStreamOpened(quint32 stream, const QByteArray &payload);
+    void onStreamData(quint32 stream, const QByteArray &payload);
+    void onStreamWritable(quint32 stream);
+    void onStreamClosed(quint32 stream, const QByteArray &status);
 private:
 
     bool pause = false;
     void upload();
+    void deltaUpload();
+    void batchUpload();
     void download();
     QTcpSocket *socket;
     QString ip;
@@ -36,7 +57,35 @@ private:
     QElapsedTimer *timer;
     qint64 bytesReceived;
     size_t filesize;
+    bool compress = false;
+    bool compressDecided = false;
+    bool compressBypass = false;
 
+    bool delta = false;
+    bool folder = false;
+    QString peerHost;
+    quint16 peerPort = 0;
+    QString peerToken;
+    QString expectedSha;
+    bool useTls = false;
+    QSslConfiguration sslConfig;
+
+    MuxChannel *mux = nullptr;
+    quint32 muxStream = 0;
+    bool muxFilling = false;
+    QByteArray muxFrames;
+
+    void muxStart();
+    void muxFill();
+    void muxFinish();
+    void reportProgress(qint64 done, qint64 total);
+    bool connectToServer(int msecs);
+    bool connectTo(const QString &host, quint16 port, bool tls, int msecs);
+    bool receiveFile(const QString &host, quint16 port, bool tls, bool compressed, const QByteArray &request, QString &error);
+    bool writeAll(QByteArray data);
+    QByteArray readLine(int msecs);
+    QByteArray encodeFrame(const QByteArray &chunk);
+    bool decodeFrames(QByteArray &pending, QByteArray &out);
     void speedStr(qint64 bytes, double time, QString &str);
 };
 
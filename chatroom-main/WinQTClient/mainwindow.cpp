@@ -1,8 +1,23 @@
 ﻿#include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include <QDebug>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QRandomGenerator>
 #include <thread>
 
+// 小于这个大小的文件直接完整上传，增量的签名交换不划算
+#define DELTA_MIN_SIZE (1024 * 1024)
+// 问服务器有没有 P2P 提供者，超时就直接从服务器下载(旧服务器不回复)
+#define PEER_REPLY_TIMEOUT 2000
+// 连接(含 TLS 握手)超时
+#define CONNECT_TIMEOUT 3000
+// 断线重连的退避: 第一次很快，之后每次翻倍，另加最多一半的随机抖动
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 30000
+// 最多留这么多条没确认的消息，更早的当作服务器已经收到；和服务器的 RESUME_REPLAY_MAX 一致
+#define RESUME_REPLAY_MAX 256
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
@@ -18,22 +33,40 @@ MainWindow::MainWindow(QWidget *parent)
     closeBtn = ui->btn_close;
     downloadBtn = ui->btn_accept;
     uploadBtn = ui->btn_upload;
+    uploadFolderBtn = ui->btn_upload_folder;
     cancelBtn = ui->btn_cancel;
+    tlsCheck = ui->checkBox_tls;
     filenameLb = ui->label_filename;
     filesizeLb = ui->label_filesize;
     speedLb = ui->label_speed;
     progressBar = ui->progressBar;
     tableList = ui->table_userlist;
+    filesBtn = ui->btn_files;
+    fileBrowser = new FileBrowser(this);
+    peerServer = new PeerServer(this);
 
     statusBar()->showMessage("Not connected to server");
     sendBtn->setDisabled(true);
+    filesBtn->setDisabled(true);
+    connect(filesBtn, &QPushButton::clicked, this, &MainWindow::showFiles);
+    connect(fileBrowser, &FileBrowser::requestPage, this, &MainWindow::requestFiles);
+    connect(fileBrowser, &FileBrowser::fileChosen, this, &MainWindow::onFileChosen);
     progressBar->setVisible(false);
     workerThread = nullptr;
+
+    connectTimer = new QTimer(this);
+    connectTimer->setSingleShot(true);
+    connect(connectTimer, &QTimer::timeout, this, &MainWindow::onConnectTimeout);
+    reconnectTimer = new QTimer(this);
+    reconnectTimer->setSingleShot(true);
+    connect(reconnectTimer, &QTimer::timeout, this, &MainWindow::startConnect);
 }
 
 MainWindow::~MainWindow()
 {
+    closing = true;
     if (client_sock) {
+        client_sock->disconnect(this);
         client_sock->disconnectFromHost();
         delete client_sock;
     }
@@ -52,59 +85,338 @@ MainWindow::~MainWindow()
 
 void MainWindow::on_btn_connect_clicked()
 {
-    client_sock = new QTcpSocket(this);
     ip = ipEdit->text();
     port = portEdit->text().toUInt();
     username = userEdit->text();
+    useTls = tlsCheck->isChecked();
+    // 手动连接是一个新会话
+    sessionToken.clear();
+    resumable = false;
+    unacked.clear();
+    sentCount = 0;
+    unsent = 0;
+    autoReconnect = false;
+    reconnectDelay = RECONNECT_MIN_MS;
+    reconnectTimer->stop();
+    connectBtn->setDisabled(true);
+    connect(sendBtn, &QPushButton::clicked, this, &MainWindow::sendMsg, Qt::UniqueConnection);
+    connect(uploadBtn, &QPushButton::clicked, this, &MainWindow::upload, Qt::UniqueConnection);
+    connect(uploadFolderBtn, &QPushButton::clicked, this, &MainWindow::uploadFolder, Qt::UniqueConnection);
+    connect(downloadBtn, &QPushButton::clicked, this, &MainWindow::download, Qt::UniqueConnection);
+    connect(cancelBtn, &QPushButton::clicked, this, &MainWindow::cancel, Qt::UniqueConnection);
+    startConnect();
+}
+
+// **异步连接，不阻塞界面**，连上(TLS 握手完成)后在 onConnected 里协商能力
+// 超时或出错走 connectFailed，已经进过聊天室的话继续重连
+void MainWindow::startConnect()
+{
+    dropConnection();
+    QSslSocket *ssl_sock = nullptr;
+    if (useTls)
+    {
+        // TLS 模式下握手完成才算连接成功
+        ssl_sock = new QSslSocket(this);
+        ssl_sock->setSslConfiguration(tlsConfiguration());
+        connect(ssl_sock, &QSslSocket::encrypted, this, &MainWindow::onConnected);
+        connect(ssl_sock, QOverload<const QList<QSslError> &>::of(&QSslSocket::sslErrors), this, &MainWindow::onSslErrors);
+        client_sock = ssl_sock;
+    }
+    else
+    {
+        client_sock = new QTcpSocket(this);
+        connect(client_sock, &QTcpSocket::connected, this, &MainWindow::onConnected);
+    }
     connect(client_sock, &QTcpSocket::readyRead, this, &MainWindow::receiveMsg);
-    connect(client_sock, &QTcpSocket::connected, this, &MainWindow::onConnected);
     connect(client_sock, &QTcpSocket::disconnected, this, &MainWindow::onDisconnected);
     connect(client_sock, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &MainWindow::onError);
-    client_sock->connectToHost(ip, port);
-    if (!client_sock->waitForConnected(3000))
+    connecting = true;
+    statusBar()->showMessage(autoReconnect ? "正在重新连接..." : "正在连接...");
+    if (ssl_sock)
+        ssl_sock->connectToHostEncrypted(ip, port);
+    else
+        client_sock->connectToHost(ip, port);
+    connectTimer->start(CONNECT_TIMEOUT);
+}
+
+void MainWindow::onConnectTimeout()
+{
+    connectFailed("connection timed out");
+}
+
+// 连接没建立起来
+void MainWindow::connectFailed(const QString &reason)
+{
+    qDebug() << "Connect failed:" << reason;
+    dropConnection();
+    if (autoReconnect && !closing)
     {
-        QMessageBox::critical(this, "Error", "Failed to connect to server");
+        scheduleReconnect();
+        return;
     }
-    else
+    statusBar()->showMessage("Not connected to server");
+    QMessageBox::critical(this, "Error", "Failed to connect to server: " + reason);
+    connectBtn->setEnabled(true);
+}
+
+// 丢掉当前连接，它之后的信号都不再处理
+void MainWindow::dropConnection()
+{
+    connectTimer->stop();
+    connecting = false;
+    inChat = false;
+    if (muxChannel)
     {
-        connect(sendBtn, &QPushButton::clicked, this, &MainWindow::sendMsg);
-        QMessageBox::information(this, "Connected", "Connected to server Success");
-        connectBtn->setDisabled(true);
-        getUserList();
+        muxChannel->deleteLater();
+        muxChannel = nullptr;
+    }
+    recvBuffer.clear();
+    if (client_sock)
+    {
+        client_sock->disconnect(this);
+        client_sock->abort();
+        client_sock->deleteLater();
+        client_sock = nullptr;
     }
-    qDebug() << "Connected Success!\n";
-    sendBtn->setDisabled(false);
-    connect(uploadBtn, &QPushButton::clicked, this, &MainWindow::upload);
-    connect(downloadBtn, &QPushButton::clicked, this, &MainWindow::download);
-    connect(cancelBtn, &QPushButton::clicked, this, &MainWindow::cancel);
+}
+
+// 指数退避加随机抖动，很多客户端同时断线时不会一起涌回来；服务器说了 BUSY 就至少等那么久
+void MainWindow::scheduleReconnect()
+{
+    int delay = qMax(reconnectDelay, busyRetry);
+    busyRetry = 0;
+    delay += QRandomGenerator::global()->bounded(delay / 2 + 1);
+    reconnectDelay = qMin(reconnectDelay * 2, RECONNECT_MAX_MS);
+    statusBar()->showMessage(QString("连接断开，%1 毫秒后重连").arg(delay));
+    reconnectTimer->start(delay);
 }
 
 void MainWindow::sendMsg()
 {
-    if (!client_sock->isOpen())
+    // 断线重连期间写的消息先记着，恢复会话后发出
+    if (!inChat && !resumable)
     {
         chathistory->append("Error: Not connected to server");
         return;
     }
 
-    QString message = u8"[" + username + "]: " + input->text().trimmed();
+    QString text = input->text().trimmed();
+    // "/search 关键词" 在服务器上检索聊天记录，结果只回给自己
+    if (text.startsWith("/search "))
+    {
+        QString query = text.mid(8).trimmed();
+        if (!inChat)
+            chathistory->append("Error: Not connected to server");
+        else if (!query.isEmpty())
+            sendRequest(("SEARCH " + query).toUtf8());
+        input->clear();
+        return;
+    }
+    QString message = u8"[" + username + "]: " + text;
     if (!message.isEmpty())
     {
-        client_sock->write(message.toUtf8());
+        sendChat(message.toUtf8());
         input->clear();
     }
 }
 
+// 问候语之后的房间消息留到确认服务器收到为止，断线重连后重发
+// 服务器恢复会话时也只数房间消息，请求要用 sendRequest()，否则两边的条数对不上
+void MainWindow::sendChat(const QByteArray &msg)
+{
+    if (resumable)
+    {
+        unacked.append(msg);
+        sentCount++;
+        if (!inChat)
+            unsent++;
+        if (unacked.size() > RESUME_REPLAY_MAX)
+        {
+            unacked.removeFirst();
+            unsent = qMin(unsent, unacked.size());
+        }
+    }
+    if (inChat)
+        writeChat(msg);
+}
+
+// 请求(PONG、USERLIST、LIST、OFFER、PEER、SEARCH)不留着重发，断线时直接放弃
+void MainWindow::sendRequest(const QByteArray &msg)
+{
+    if (inChat)
+        writeChat(msg);
+}
+
+// 多路复用时聊天消息也要封装成帧；协商了 resume 时每条以 '\0' 结尾，服务器才能一条条数清楚
+void MainWindow::writeChat(const QByteArray &msg)
+{
+    if (muxChannel)
+        muxChannel->sendChat(msg);
+    else if (serverResume)
+        client_sock->write(msg + QByteArray(1, '\0'));
+    else
+        client_sock->write(msg);
+}
+
 void MainWindow::receiveMsg()
 {
-    QByteArray data = client_sock->readAll();
+    if (muxChannel)
+    {
+        muxChannel->feed(client_sock->readAll());
+        return;
+    }
+    recvBuffer.append(client_sock->readAll());
+    while (!recvBuffer.isEmpty())
+    {
+        // 能力协商的回复: "CAPS zlib"
+        if (recvBuffer.startsWith("CAPS"))
+        {
+            int end = recvBuffer.indexOf('\0');
+            if (end < 0)
+                end = recvBuffer.size();
+            QList<QByteArray> caps = recvBuffer.left(end).split(' ');
+            serverZlib = caps.contains("zlib");
+            serverP2p = caps.contains("p2p");
+            serverResume = caps.contains("resume");
+            recvBuffer.remove(0, end + 1);
+            if (caps.contains("mux"))
+            {
+                // 之后收发的都是多路复用帧，文件传输也走这条连接
+                muxChannel = new MuxChannel(client_sock, this);
+                connect(muxChannel, &MuxChannel::chatReceived, this, &MainWindow::onChatMessage);
+                QByteArray rest = recvBuffer;
+                recvBuffer.clear();
+                enterChat();
+                muxChannel->feed(rest);
+                return;
+            }
+            enterChat();
+            continue;
+        }
+        // 压缩过的消息: "ZMSG <n>\n" + n 字节 qCompress 数据
+        if (recvBuffer.startsWith("ZMSG "))
+        {
+            int nl = recvBuffer.indexOf('\n');
+            if (nl < 0)
+                return;
+            int n = recvBuffer.mid(5, nl - 5).toInt();
+            if (recvBuffer.size() - nl - 1 < n)
+                return;  // 等待剩余数据
+            QByteArray packed = recvBuffer.mid(nl + 1, n);
+            recvBuffer.remove(0, nl + 1 + n);
+            handleMessage(qUncompress(packed));
+            continue;
+        }
+        // 以 '\0' 分隔的消息一条条处理，不带分隔符的整段算一条
+        int end = recvBuffer.indexOf('\0');
+        if (end < 0)
+        {
+            handleMessage(recvBuffer);
+            recvBuffer.clear();
+        }
+        else
+        {
+            handleMessage(recvBuffer.left(end));
+            recvBuffer.remove(0, end + 1);
+        }
+    }
+}
+
+// 多路复用流 0 上的一条消息
+void MainWindow::onChatMessage(const QByteArray &msg)
+{
+    if (msg.startsWith("ZMSG "))
+    {
+        int nl = msg.indexOf('\n');
+        if (nl > 0)
+            handleMessage(qUncompress(msg.mid(nl + 1)));
+        return;
+    }
+    handleMessage(msg);
+}
+
+void MainWindow::handleMessage(const QByteArray &data)
+{
     QString msg = QString::fromUtf8(data);
-    if (msg.startsWith("FILE"))
+    if (msg == "PING")
+    {
+        // 服务器的心跳，回应后不显示
+        sendRequest("PONG");
+    }
+    else if (msg.startsWith("CATALOG "))
+    {
+        // LIST 的回复，交给文件列表窗口
+        fileBrowser->showPage(msg);
+    }
+    else if (msg.startsWith("SEARCHRESULT "))
+    {
+        // "SEARCHRESULT 条数\n" + 每行 "编号 时间(秒) 消息"，新的在前
+        QStringList lines = msg.section(QChar('\0'), 0, 0).split('\n', Qt::SkipEmptyParts);
+        chathistory->append(QString(u8"搜索结果: %1 条").arg(lines.size() - 1));
+        for (int i = 1; i < lines.size(); i++)
+        {
+            QString id = lines[i].section(' ', 0, 0);
+            qint64 secs = lines[i].section(' ', 1, 1).toLongLong();
+            QString when = QDateTime::fromSecsSinceEpoch(secs).toString("yyyy-MM-dd hh:mm");
+            chathistory->append("  " + when + "  " + lines[i].section(' ', 2));
+        }
+    }
+    else if (msg.startsWith("BUSY "))
+    {
+        // "BUSY 毫秒 原因": 消息发得太快被丢弃，或者服务器过载拒绝了连接
+        QStringList parts = msg.section(QChar('\0'), 0, 0).split(' ');
+        int secs = qMax(1, (parts.value(1).toInt() + 999) / 1000);
+        if (parts.value(2) == "rate")
+            chathistory->append(QString(u8"发送太快，有消息被丢弃，请 %1 秒后再发").arg(secs));
+        else
+        {
+            // 重连时至少等这么久
+            busyRetry = parts.value(1).toInt();
+            chathistory->append(QString(u8"服务器繁忙，请 %1 秒后重试").arg(secs));
+        }
+    }
+    else if (msg.startsWith("SESSION "))
+    {
+        // 问候语之后服务器发的会话令牌，断线重连时用
+        sessionToken = msg.section(QChar('\0'), 0, 0).section(' ', 1, 1).toUtf8();
+    }
+    else if (msg.startsWith("RESUMED "))
+    {
+        onResumed(msg.section(QChar('\0'), 0, 0).section(' ', 1, 1).toULongLong());
+    }
+    else if (msg.startsWith("RESUMEFAIL"))
+    {
+        // 会话已经过期(或服务器重启过)，重新进入
+        chathistory->append(u8"会话已失效，重新进入群聊");
+        greet();
+    }
+    else if (msg.startsWith("FILE"))
     {
         filenameLb->setText(msg.split(" ")[1].trimmed());
         filesizeLb->setText(msg.split(" ")[2].trimmed());
         downloadFileSize = filesizeLb->text().toULong();
         downloadBtn->setEnabled(true);
+        // 自己上传的文件进了目录，可以直接提供给别人了
+        QString name = filenameLb->text();
+        if (pendingOffers.contains(name))
+            offerFile(name, pendingOffers.take(name));
+    }
+    else if (msg.startsWith("PEERTOKEN "))
+    {
+        // 服务器让一个下载者来找我们，带着这个令牌
+        QStringList parts = msg.section(QChar('\0'), 0, 0).split(' ');
+        if (parts.size() == 3)
+            peerServer->allow(parts[1], parts[2]);
+    }
+    else if (msg.startsWith("PEER "))
+    {
+        // "PEER 文件名 ip 端口 令牌 大小 SHA-256" 或 "PEER 文件名 -"
+        QStringList parts = msg.section(QChar('\0'), 0, 0).split(' ');
+        if (parts.size() >= 3 && parts[1] == pendingPeerFile)
+        {
+            pendingPeerFile.clear();
+            startDownload(parts[1], parts.size() == 7 ? parts : QStringList());
+        }
     }
     else if (msg.startsWith("USERLIST"))
     {
@@ -133,13 +445,77 @@ void MainWindow::receiveMsg()
 
 void MainWindow::onConnected()
 {
+    connecting = false;
+    connectTimer->stop();
     statusBar()->showMessage("连接成功");
+    // 聊天消息都很短，不能等 Nagle 攒满一个报文段
+    client_sock->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    // 先协商能力，服务器回复它支持的部分后再进入聊天
+    client_sock->write("CAPS zlib mux ping p2p resume\n");
+    sendBtn->setDisabled(false);
+    filesBtn->setDisabled(false);
+}
+
+// 能力协商完成: 有会话令牌时先试着恢复，否则发送问候语并请求用户列表
+void MainWindow::enterChat()
+{
+    if (serverResume && !sessionToken.isEmpty())
+    {
+        writeChat("RESUME " + sessionToken);
+        return;
+    }
+    greet();
+}
+
+// 作为新会话进入；断线期间写下、还没发出去的消息跟在问候语后面发
+void MainWindow::greet()
+{
+    QList<QByteArray> pending = unacked.mid(unacked.size() - unsent);
+    unacked.clear();
+    sentCount = 0;
+    unsent = 0;
+    sessionToken.clear();
     QString greeting = username + u8" 进入了群聊";
-    client_sock->write(greeting.toUtf8());
+    writeChat(greeting.toUtf8());
+    resumable = serverResume;
+    inChat = true;
+    autoReconnect = true;
+    reconnectDelay = RECONNECT_MIN_MS;
+    for (const QByteArray &msg : pending)
+        sendChat(msg);
+    getUserList();
+}
+
+// "RESUMED <条数>": 服务器收到了问候语之后的多少条消息，后面的重发
+void MainWindow::onResumed(quint64 received)
+{
+    quint64 acked = sentCount - unacked.size();
+    int drop = received > acked ? int(qMin<quint64>(received - acked, unacked.size())) : 0;
+    unacked.erase(unacked.begin(), unacked.begin() + drop);
+    unsent = 0;
+    inChat = true;
+    reconnectDelay = RECONNECT_MIN_MS;
+    for (const QByteArray &msg : unacked)
+        writeChat(msg);
+    statusBar()->showMessage("已重新连接");
+    chathistory->append(QString(u8"已重新连接，补发 %1 条消息").arg(unacked.size()));
 }
 
 void MainWindow::onDisconnected()
 {
+    // 握手过程中断开的由 connectFailed 处理
+    if (connecting)
+    {
+        connectFailed("connection closed");
+        return;
+    }
+    dropConnection();
+    if (autoReconnect && !closing)
+    {
+        chathistory->append(u8"与服务器的连接断开，正在重连...");
+        scheduleReconnect();
+        return;
+    }
     statusBar()->showMessage("断开链接");
     chathistory->append("Disconnected from the server.");
     connectBtn->setEnabled(true);
@@ -148,8 +524,34 @@ void MainWindow::onDisconnected()
 void MainWindow::onError(QAbstractSocket::SocketError sockErr)
 {
     Q_UNUSED(sockErr);
+    if (connecting)
+    {
+        connectFailed(client_sock->errorString());
+        return;
+    }
     statusBar()->showMessage("Connection error: " + client_sock->errorString());
-    chathistory->append("Error: " + client_sock->errorString());
+    // 断线重连时不刷屏，onDisconnected 会提示
+    if (!autoReconnect)
+        chathistory->append("Error: " + client_sock->errorString());
+}
+
+void MainWindow::onSslErrors(const QList<QSslError> &errors)
+{
+    for (const QSslError &err : errors)
+        chathistory->append("TLS Error: " + err.errorString());
+}
+
+// 客户端 TLS 配置
+// 自签名的服务器证书放到程序目录下的 server_ca.pem 即可被信任
+QSslConfiguration MainWindow::tlsConfiguration()
+{
+    QSslConfiguration conf = QSslConfiguration::defaultConfiguration();
+    // 保留会话票据，文件传输的新连接复用聊天连接的会话，跳过完整握手
+    conf.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    QList<QSslCertificate> ca = QSslCertificate::fromPath(QCoreApplication::applicationDirPath() + "/server_ca.pem");
+    if (!ca.isEmpty())
+        conf.setCaCertificates(conf.caCertificates() + ca);
+    return conf;
 }
 
 void MainWindow::on_btn_close_clicked()
@@ -163,6 +565,9 @@ void MainWindow::upload()
     if (filePath.isEmpty()) return;
     QFileInfo file(filePath);
     filenameLb->setText(file.fileName());
+    transferName = file.fileName();
+    transferPath = filePath;
+    transferUpload = true;
 
     cancelBtn->setEnabled(true);
     progressBar->setVisible(true);
@@ -170,16 +575,66 @@ void MainWindow::upload()
     progressBar->setTextVisible(true);
 
 
-    workerThread = new QThread(this);
     fileworker = new FileWorker(ip, port, filePath, true);
+    fileworker->setCompression(serverZlib);
+    // 大文件先试增量上传，服务器上没有旧版本时就是一次完整上传
+    // 签名和指令是一问一答，不走多路复用通道，用单独的传输连接
+    bool delta = file.size() >= DELTA_MIN_SIZE;
+    fileworker->setDelta(delta);
+    if (muxChannel && !delta)
+        fileworker->setMux(muxChannel);
+    else if (useTls)
+        fileworker->setTls(client_sock ? qobject_cast<QSslSocket *>(client_sock)->sslConfiguration() : tlsConfiguration());
+    connect(fileworker, &FileWorker::progressUpdated, this, &MainWindow::updateProgressBar);
+    connect(fileworker, &FileWorker::speedUpdated, this, &MainWindow::updateSpeed);
+    connect(this, &MainWindow::cancelTransfer, fileworker, &FileWorker::cancelTransfer);
+    connect(fileworker, &FileWorker::transferComplete, this, &MainWindow::onTransferComplete);
+    connect(fileworker, &FileWorker::transferFailed, this, &MainWindow::onTransferFailed);
+
+    // 多路复用时传输由主线程的事件驱动，不需要工作线程
+    if (muxChannel && !delta)
+    {
+        fileworker->startTransfer();
+        return;
+    }
+    workerThread = new QThread(this);
     fileworker->moveToThread(workerThread);
     connect(workerThread, &QThread::started, fileworker, &FileWorker::startTransfer);
+    workerThread->start();
+}
+
+// 整个文件夹在一个传输连接上作为一条归档流上传，不走多路复用通道
+// 服务器把文件登记为 "文件夹名/相对路径"，只在最后通知一次
+void MainWindow::uploadFolder()
+{
+    QString dirPath = QFileDialog::getExistingDirectory(this, "Select Folder to upload");
+    if (dirPath.isEmpty()) return;
+    QFileInfo dir(dirPath);
+    filenameLb->setText(dir.fileName());
+    // 文件夹不做 P2P 提供
+    transferName.clear();
+    transferPath = dirPath;
+    transferUpload = true;
+
+    cancelBtn->setEnabled(true);
+    progressBar->setVisible(true);
+    progressBar->setValue(0);
+    progressBar->setTextVisible(true);
+
+    fileworker = new FileWorker(ip, port, dirPath, true);
+    fileworker->setCompression(serverZlib);
+    fileworker->setFolder(true);
+    if (useTls)
+        fileworker->setTls(client_sock ? qobject_cast<QSslSocket *>(client_sock)->sslConfiguration() : tlsConfiguration());
     connect(fileworker, &FileWorker::progressUpdated, this, &MainWindow::updateProgressBar);
     connect(fileworker, &FileWorker::speedUpdated, this, &MainWindow::updateSpeed);
     connect(this, &MainWindow::cancelTransfer, fileworker, &FileWorker::cancelTransfer);
     connect(fileworker, &FileWorker::transferComplete, this, &MainWindow::onTransferComplete);
     connect(fileworker, &FileWorker::transferFailed, this, &MainWindow::onTransferFailed);
 
+    workerThread = new QThread(this);
+    fileworker->moveToThread(workerThread);
+    connect(workerThread, &QThread::started, fileworker, &FileWorker::startTransfer);
     workerThread->start();
 }
 
@@ -209,23 +664,60 @@ void MainWindow::download()
         QMessageBox::critical(this, "Error", "No file ready to download");
         return;
     }
+    // 服务器支持 P2P 时先问有没有别的客户端可以直接提供，收到回复或超时后再开始
+    if (serverP2p)
+    {
+        if (!pendingPeerFile.isEmpty())
+            return;
+        pendingPeerFile = filename;
+        sendRequest(("PEER " + filename).toUtf8());
+        QTimer::singleShot(PEER_REPLY_TIMEOUT, this, [this, filename]() {
+            if (pendingPeerFile != filename)
+                return;
+            pendingPeerFile.clear();
+            startDownload(filename, QStringList());
+        });
+        return;
+    }
+    startDownload(filename, QStringList());
+}
 
+// peer 是服务器的 "PEER" 回复，为空时从服务器下载
+void MainWindow::startDownload(const QString &filename, const QStringList &peer)
+{
+    transferName = filename;
+    transferPath = filename;
+    transferUpload = false;
     cancelBtn->setEnabled(true);
     progressBar->setVisible(true);
     progressBar->setValue(0);
     progressBar->setTextVisible(true);
 
-    workerThread = new QThread();
     fileworker = new FileWorker(ip, port, filename, false, downloadFileSize);
-    fileworker->moveToThread(workerThread);
+    fileworker->setCompression(serverZlib);
+    // 直连提供者时不走多路复用通道，失败后的回退也用单独的传输连接
+    bool direct = !peer.isEmpty();
+    if (direct)
+        fileworker->setPeer(peer[2], peer[3].toUShort(), peer[4], peer[6]);
+    if (muxChannel && !direct)
+        fileworker->setMux(muxChannel);
+    else if (useTls)
+        fileworker->setTls(client_sock ? qobject_cast<QSslSocket *>(client_sock)->sslConfiguration() : tlsConfiguration());
 
-    connect(workerThread, &QThread::started, fileworker, &FileWorker::startTransfer);
     connect(fileworker, &FileWorker::progressUpdated, this, &MainWindow::updateProgressBar);
     connect(fileworker, &FileWorker::speedUpdated, this, &MainWindow::updateSpeed);
     connect(this, &MainWindow::cancelTransfer, fileworker, &FileWorker::cancelTransfer);
     connect(fileworker, &FileWorker::transferComplete, this, &MainWindow::onTransferComplete);
     connect(fileworker, &FileWorker::transferFailed, this, &MainWindow::onTransferFailed);
 
+    if (muxChannel && !direct)
+    {
+        fileworker->startTransfer();
+        return;
+    }
+    workerThread = new QThread();
+    fileworker->moveToThread(workerThread);
+    connect(workerThread, &QThread::started, fileworker, &FileWorker::startTransfer);
     workerThread->start();
 }
 
@@ -241,8 +733,16 @@ void MainWindow::updateSpeed(QString speed)
 
 void MainWindow::onTransferComplete()
 {
+    // 上传的文件等服务器的 FILE 通知(已经进了目录)再提供，下载的文件现在就是目录里的版本
+    if (serverP2p && !transferName.isEmpty())
+    {
+        if (transferUpload)
+            pendingOffers[transferName] = transferPath;
+        else
+            offerFile(transferName, transferPath);
+    }
     QMessageBox::information(this, "Transfer Complete", "File transfer completed successful.");
-    workerThread->quit();
+    if (workerThread) workerThread->quit();
     progressBar->setValue(100);
     cancelBtn->setEnabled(false);
 }
@@ -250,24 +750,69 @@ void MainWindow::onTransferComplete()
 void MainWindow::onTransferFailed(const QString &errorMsg)
 {
     QMessageBox::critical(this, "Transfer Failed", errorMsg);
-    workerThread->quit();
+    if (workerThread) workerThread->quit();
     cancelBtn->setEnabled(false);
     progressBar->setValue(0);
 }
 
 void MainWindow::getUserList()
 {
-    if (client_sock->state() == QAbstractSocket::ConnectedState)
+    if (inChat)
     {
         QString request = "USERLIST";
-        client_sock->write(request.toUtf8());
+        sendRequest(request.toUtf8());
     }
 }
 
+// 声明自己可以直接提供这个文件
+void MainWindow::offerFile(const QString &name, const QString &path)
+{
+    quint16 peerPort = peerServer->start();
+    if (!peerPort || !inChat)
+        return;
+    peerServer->share(name, QFileInfo(path).absoluteFilePath());
+    sendRequest(QString("OFFER %1 %2").arg(name).arg(peerPort).toUtf8());
+}
+
+void MainWindow::showFiles()
+{
+    fileBrowser->show();
+    fileBrowser->raise();
+    fileBrowser->refresh();
+}
+
+// 目录按文件名分页，after 为空时从头开始
+void MainWindow::requestFiles(const QString &after)
+{
+    if (!inChat)
+        return;
+    QString request = QString("LIST %1").arg(FILEBROWSER_PAGE_SIZE);
+    if (!after.isEmpty())
+        request += " " + after;
+    sendRequest(request.toUtf8());
+}
+
+void MainWindow::onFileChosen(const QString &name, qulonglong size)
+{
+    filenameLb->setText(name);
+    filesizeLb->setText(QString::number(size));
+    downloadFileSize = size;
+    downloadBtn->setEnabled(true);
+    download();
+}
+
 void MainWindow::closeEvent(QCloseEvent *event)
 {
+    closing = true;
+    reconnectTimer->stop();
+    if (!inChat)
+        return;
     QString wave = username + u8" 退出了群聊";
-    if (client_sock->isOpen()) client_sock->write(wave.toUtf8());
+    sendChat(wave.toUtf8());
+    // 主动退出，服务器不用再保留会话
+    if (resumable)
+        writeChat("BYE");
+    client_sock->flush();
 }
 
 void MainWindow::on_lineEdit_ip_textChanged(const QString &arg1)
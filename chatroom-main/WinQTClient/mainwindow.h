@@ -2,6 +2,8 @@
 #define MAINWINDOW_H
 #include <QMainWindow>
 #include <QTcpSocket>
+#include <QSslSocket>
+#include <QCheckBox>
 #include <QTextEdit>
 #include <QLineEdit>
 #include <QPushButton>
@@ -19,6 +21,8 @@
 #include <QElapsedTimer>
 #include <QThread>
 #include "fileworker.h"
+#include "filebrowser.h"
+#include "peerserver.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -43,10 +47,14 @@ private slots:
     void receiveMsg();
     void onConnected();
     void onDisconnected();
+    void startConnect();
+    void onConnectTimeout();
     void onError(QAbstractSocket::SocketError sockErr);
+    void onSslErrors(const QList<QSslError> &errors);
     void on_btn_close_clicked();
 
     void upload();
+    void uploadFolder();
     void download();
     void cancel();
 
@@ -57,12 +65,31 @@ private slots:
     void onTransferFailed(const QString &errorMsg);
 
     void getUserList();
+    void onChatMessage(const QByteArray &msg);
+
+    void showFiles();
+    void requestFiles(const QString &after);
+    void onFileChosen(const QString &name, qulonglong size);
 
 protected:
     void closeEvent(QCloseEvent *event) override;
 private:
+    void handleMessage(const QByteArray &data);
+    void sendChat(const QByteArray &msg);
+    void sendRequest(const QByteArray &msg);
+    void writeChat(const QByteArray &msg);
+    void greet();
+    void onResumed(quint64 received);
+    void connectFailed(const QString &reason);
+    void dropConnection();
+    void scheduleReconnect();
+    void startDownload(const QString &filename, const QStringList &peer);
+    void offerFile(const QString &name, const QString &path);
+    void enterChat();
+    QSslConfiguration tlsConfiguration();
+
     Ui::MainWindow *ui;
-    QTcpSocket *client_sock;
+    QTcpSocket *client_sock = nullptr;
     QTcpSocket *file_sock;
     QTextEdit *chathistory;
     QLineEdit *input;
@@ -74,12 +101,17 @@ private:
     QPushButton *closeBtn;
     QPushButton *downloadBtn;
     QPushButton *uploadBtn;
+    QPushButton *uploadFolderBtn;
     QPushButton *cancelBtn;
+    QPushButton *filesBtn;
+    QCheckBox *tlsCheck;
     QLabel *filenameLb;
     QLabel *filesizeLb;
     QLabel *speedLb;
     QProgressBar *progressBar;
     QTableWidget *tableList;
+    FileBrowser *fileBrowser;
+    PeerServer *peerServer;
     QFile *file = nullptr;
     QThread *workerThread;
     FileWorker *fileworker;
@@ -89,5 +121,30 @@ private:
     bool isUpload;
     QElapsedTimer *timer;
     size_t downloadFileSize;
+    bool serverZlib = false;
+    bool serverP2p = false;
+    QString pendingPeerFile;               // 在等 "PEER" 回复的下载
+    QHash<QString, QString> pendingOffers; // 上传完等 FILE 通知的文件 -> 本地路径
+    QString transferName;
+    QString transferPath;
+    bool transferUpload = false;
+    bool useTls = false;
+    MuxChannel *muxChannel = nullptr;
+    QByteArray recvBuffer;
+    // 连接管理: 异步连接，进过聊天室后断线自动重连(指数退避)，服务器支持时带令牌恢复会话
+    QTimer *connectTimer;
+    QTimer *reconnectTimer;
+    int reconnectDelay = 0;
+    int busyRetry = 0;                     // 服务器 BUSY 回复建议的等待时间
+    bool connecting = false;               // 连接或 TLS 握手还没完成
+    bool inChat = false;                   // 已经问候过或恢复了会话，可以直接发消息
+    bool autoReconnect = false;
+    bool closing = false;
+    bool serverResume = false;
+    bool resumable = false;                // 问候语之后的消息都记着，重连后重发服务器没收到的
+    QByteArray sessionToken;
+    QList<QByteArray> unacked;             // 还不确定服务器收到的房间消息，最旧的在前
+    quint64 sentCount = 0;                 // 问候语之后一共发了多少条房间消息
+    int unsent = 0;                        // unacked 末尾断线期间写下、还没发出去的条数
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,149 @@
+﻿#include "muxchannel.h"
+#include <QtEndian>
+
+// 发送缓冲低于该值才继续写文件数据
+#define MUX_LOW_WATERMARK (64 * 1024)
+
+MuxChannel::MuxChannel(QTcpSocket *socket, QObject *parent)
+    : QObject(parent), socket(socket)
+{
+    connect(socket, &QTcpSocket::bytesWritten, this, &MuxChannel::flush);
+}
+
+void MuxChannel::writeFrame(char type, quint32 stream, const QByteArray &payload)
+{
+    char header[MUX_HEADER_SIZE];
+    header[0] = type;
+    qToBigEndian<quint32>(stream, reinterpret_cast<uchar *>(header + 1));
+    qToBigEndian<quint32>(quint32(payload.size()), reinterpret_cast<uchar *>(header + 5));
+    socket->write(header, MUX_HEADER_SIZE);
+    socket->write(payload);
+}
+
+void MuxChannel::sendChat(const QByteArray &msg)
+{
+    writeFrame(MUX_DATA, MUX_CHAT_STREAM, msg);
+}
+
+quint32 MuxChannel::openStream(const QByteArray &request)
+{
+    quint32 stream = nextStream++;
+    windows[stream] = MUX_INITIAL_WINDOW;
+    queued[stream] = 0;
+    writeFrame(MUX_OPEN, stream, request);
+    return stream;
+}
+
+void MuxChannel::sendData(quint32 stream, const QByteArray &data)
+{
+    if (!windows.contains(stream))
+        return;
+    queues[stream].append(data);
+    queued[stream] += data.size();
+    flush();
+}
+
+void MuxChannel::grantWindow(quint32 stream, quint32 bytes)
+{
+    QByteArray inc(4, 0);
+    qToBigEndian<quint32>(bytes, reinterpret_cast<uchar *>(inc.data()));
+    writeFrame(MUX_WINDOW, stream, inc);
+}
+
+void MuxChannel::closeStream(quint32 stream, const QByteArray &reason)
+{
+    if (!windows.contains(stream))
+        return;
+    dropStream(stream);
+    writeFrame(MUX_CLOSE, stream, reason);
+}
+
+void MuxChannel::dropStream(quint32 stream)
+{
+    windows.remove(stream);
+    queues.remove(stream);
+    queued.remove(stream);
+}
+
+qint64 MuxChannel::writable(quint32 stream) const
+{
+    if (!windows.contains(stream))
+        return 0;
+    return windows.value(stream) - queued.value(stream);
+}
+
+// 轮流给每个有窗口的流写一块，直到发送缓冲达到水位线
+void MuxChannel::flush()
+{
+    bool progress = true;
+    while (progress && socket->bytesToWrite() < MUX_LOW_WATERMARK)
+    {
+        progress = false;
+        for (auto it = queues.begin(); it != queues.end(); ++it)
+        {
+            QList<QByteArray> &queue = it.value();
+            if (queue.isEmpty() || windows.value(it.key()) < queue.first().size())
+                continue;
+            QByteArray data = queue.takeFirst();
+            windows[it.key()] -= data.size();
+            queued[it.key()] -= data.size();
+            writeFrame(MUX_DATA, it.key(), data);
+            progress = true;
+        }
+    }
+
+    // 先收集再通知，槽函数里可能会关闭流
+    QList<quint32> ready;
+    for (auto it = queues.begin(); it != queues.end(); ++it)
+    {
+        if (it.value().isEmpty() && windows.value(it.key()) > 0)
+            ready.append(it.key());
+    }
+    for (quint32 stream : ready)
+        emit streamWritable(stream);
+}
+
+void MuxChannel::feed(const QByteArray &data)
+{
+    pending.append(data);
+    int pos = 0;
+    while (pending.size() - pos >= MUX_HEADER_SIZE)
+    {
+        const uchar *p = reinterpret_cast<const uchar *>(pending.constData() + pos);
+        char type = char(p[0]);
+        quint32 stream = qFromBigEndian<quint32>(p + 1);
+        int len = int(qFromBigEndian<quint32>(p + 5));
+        if (len < 0 || pending.size() - pos - MUX_HEADER_SIZE < len)
+            break;
+        QByteArray payload = pending.mid(pos + MUX_HEADER_SIZE, len);
+        pos += MUX_HEADER_SIZE + len;
+
+        if (stream == MUX_CHAT_STREAM)
+        {
+            if (type == MUX_DATA)
+                emit chatReceived(payload);
+        }
+        else if (type == MUX_DATA)
+        {
+            emit streamData(stream, payload);
+        }
+        else if (type == MUX_OPEN)
+        {
+            emit streamOpened(stream, payload);
+        }
+        else if (type == MUX_WINDOW && payload.size() == 4)
+        {
+            if (windows.contains(stream))
+            {
+                windows[stream] += qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(payload.constData()));
+                flush();
+            }
+        }
+        else if (type == MUX_CLOSE)
+        {
+            dropStream(stream);
+            emit streamClosed(stream, payload);
+        }
+    }
+    pending.remove(0, pos);
+}
@@ -0,0 +1,62 @@
+﻿#ifndef MUXCHANNEL_H
+#define MUXCHANNEL_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QMap>
+#include <QList>
+#include <QByteArray>
+
+// 多路复用帧: 1 字节类型 + 4 字节大端流号 + 4 字节大端长度 + 数据，与服务器 mux.h 保持一致
+#define MUX_HEADER_SIZE 9
+#define MUX_DATA 'D'
+#define MUX_OPEN 'O'
+#define MUX_WINDOW 'W'
+#define MUX_CLOSE 'C'
+#define MUX_CHAT_STREAM 0
+#define MUX_INITIAL_WINDOW (256 * 1024)
+
+// 聊天和所有文件流共用一条连接
+// 聊天消息立即写出；文件数据受每个流的窗口限制，且只在发送缓冲较空时写出，聊天不会排在大块数据后面
+class MuxChannel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MuxChannel(QTcpSocket *socket, QObject *parent = nullptr);
+
+    void sendChat(const QByteArray &msg);
+    // 打开一个文件流，request 为 "UPLOAD name size" 或 "DOWNLOAD name"
+    quint32 openStream(const QByteArray &request);
+    // 排队一块文件数据
+    void sendData(quint32 stream, const QByteArray &data);
+    // 已处理完收到的数据，归还窗口给服务器
+    void grantWindow(quint32 stream, quint32 bytes);
+    void closeStream(quint32 stream, const QByteArray &reason);
+    // 该流还能再排队多少字节
+    qint64 writable(quint32 stream) const;
+    // 喂入从 socket 读到的数据
+    void feed(const QByteArray &data);
+
+signals:
+    void chatReceived(const QByteArray &msg);
+    void streamOpened(quint32 stream, const QByteArray &payload);
+    void streamData(quint32 stream, const QByteArray &payload);
+    void streamWritable(quint32 stream);
+    void streamClosed(quint32 stream, const QByteArray &status);
+
+private slots:
+    void flush();
+
+private:
+    void writeFrame(char type, quint32 stream, const QByteArray &payload);
+    void dropStream(quint32 stream);
+
+    QTcpSocket *socket;
+    QByteArray pending;
+    quint32 nextStream = 1;
+    QMap<quint32, qint64> windows;            // 服务器允许我们再发送的字节数
+    QMap<quint32, QList<QByteArray>> queues;  // 等待窗口的数据
+    QMap<quint32, qint64> queued;             // 每个流排队的字节数
+};
+
+#endif // MUXCHANNEL_H
@@ -0,0 +1,144 @@
+﻿#include "peerserver.h"
+#include <QDebug>
+
+#define PEER_TOKEN_TTL 60           // 令牌的有效期，秒
+#define PEER_CHUNK (64 * 1024)
+#define PEER_MAX_QUEUED (256 * 1024)  // 发送缓冲里最多排这么多，按对方的速度读文件
+#define PEER_REQUEST_MAX 256
+
+PeerServer::PeerServer(QObject *parent)
+    : QObject(parent)
+{
+    server = new QTcpServer(this);
+    connect(server, &QTcpServer::newConnection, this, &PeerServer::onNewConnection);
+}
+
+PeerServer::~PeerServer()
+{
+    for (auto it = uploads.begin(); it != uploads.end(); ++it)
+        delete it.value().file;
+}
+
+quint16 PeerServer::start()
+{
+    if (!server->isListening() && !server->listen(QHostAddress::Any, 0))
+    {
+        qDebug() << "P2P listen failed:" << server->errorString();
+        return 0;
+    }
+    return server->serverPort();
+}
+
+quint16 PeerServer::port() const
+{
+    return server->isListening() ? server->serverPort() : 0;
+}
+
+void PeerServer::share(const QString &name, const QString &path)
+{
+    shared[name] = path;
+}
+
+void PeerServer::allow(const QString &name, const QString &token)
+{
+    if (!shared.contains(name))
+        return;
+    // 顺便清掉过期的令牌
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    for (auto it = grants.begin(); it != grants.end();)
+    {
+        if (it.value().expires < now)
+            it = grants.erase(it);
+        else
+            ++it;
+    }
+    grants[token] = Grant{name, now.addSecs(PEER_TOKEN_TTL)};
+}
+
+void PeerServer::onNewConnection()
+{
+    while (QTcpSocket *sock = server->nextPendingConnection())
+    {
+        uploads.insert(sock, Upload());
+        connect(sock, &QTcpSocket::readyRead, this, &PeerServer::onReadyRead);
+        connect(sock, &QTcpSocket::bytesWritten, this, &PeerServer::onBytesWritten);
+        connect(sock, &QTcpSocket::disconnected, this, &PeerServer::onDisconnected);
+    }
+}
+
+// "P2P <令牌>\n"
+void PeerServer::onReadyRead()
+{
+    QTcpSocket *sock = qobject_cast<QTcpSocket *>(sender());
+    if (!sock || !uploads.contains(sock) || uploads[sock].started)
+        return;
+    if (!sock->canReadLine())
+    {
+        if (sock->bytesAvailable() > PEER_REQUEST_MAX)
+            finish(sock);
+        return;
+    }
+    QList<QByteArray> request = sock->readLine().trimmed().split(' ');
+    Upload &upload = uploads[sock];
+    upload.started = true;
+    QString token = request.size() == 2 && request[0] == "P2P" ? QString::fromLatin1(request[1]) : QString();
+    auto grant = grants.find(token);
+    if (grant == grants.end() || grant.value().expires < QDateTime::currentDateTimeUtc())
+    {
+        sock->write("ERROR");
+        sock->disconnectFromHost();
+        return;
+    }
+    QString name = grant.value().name;
+    grants.erase(grant);
+    upload.file = new QFile(shared.value(name));
+    if (!upload.file->open(QIODevice::ReadOnly))
+    {
+        sock->write("ERROR");
+        sock->disconnectFromHost();
+        return;
+    }
+    qDebug() << "P2P upload:" << name << "to" << sock->peerAddress().toString();
+    sock->write(QByteArray::number(upload.file->size()) + "\n");
+    onBytesWritten();
+}
+
+// 发送缓冲不满时继续读文件
+void PeerServer::onBytesWritten()
+{
+    QTcpSocket *sock = qobject_cast<QTcpSocket *>(sender());
+    if (!sock || !uploads.contains(sock))
+        return;
+    QFile *file = uploads[sock].file;
+    if (!file)
+        return;
+    while (sock->bytesToWrite() < PEER_MAX_QUEUED && !file->atEnd())
+    {
+        QByteArray chunk = file->read(PEER_CHUNK);
+        if (chunk.isEmpty())
+            break;
+        sock->write(chunk);
+    }
+    if (file->atEnd() && sock->bytesToWrite() == 0)
+        sock->disconnectFromHost();
+}
+
+void PeerServer::onDisconnected()
+{
+    QTcpSocket *sock = qobject_cast<QTcpSocket *>(sender());
+    if (sock)
+        finish(sock);
+}
+
+void PeerServer::finish(QTcpSocket *sock)
+{
+    auto it = uploads.find(sock);
+    if (it != uploads.end())
+    {
+        delete it.value().file;
+        uploads.erase(it);
+    }
+    sock->disconnect(this);
+    sock->abort();
+    sock->deleteLater();
+}
@@ -0,0 +1,56 @@
+﻿#ifndef PEERSERVER_H
+#define PEERSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QFile>
+#include <QHash>
+#include <QDateTime>
+
+// 点对点传输的提供端: 把上传过或下载校验过的文件直接发给其他客户端
+// 服务器做会合，转来 "PEERTOKEN <文件名> <令牌>"；对方连上来发 "P2P <令牌>\n"，
+// 按 DOWNLOAD 的格式回复: 文件大小 + "\n" + 文件数据
+// 令牌只能用一次，一段时间没用就作废；不认识的令牌回复 "ERROR"
+class PeerServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PeerServer(QObject *parent = nullptr);
+    ~PeerServer();
+
+    // 在随机端口上监听，返回端口，失败返回 0
+    quint16 start();
+    quint16 port() const;
+    // 可以提供的文件: 服务器上的文件名 -> 本地路径
+    void share(const QString &name, const QString &path);
+    // 服务器为一次下载分配的令牌
+    void allow(const QString &name, const QString &token);
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onBytesWritten();
+    void onDisconnected();
+
+private:
+    struct Grant
+    {
+        QString name;
+        QDateTime expires;
+    };
+    struct Upload
+    {
+        QFile *file = nullptr;
+        bool started = false;
+    };
+
+    void finish(QTcpSocket *sock);
+
+    QTcpServer *server;
+    QHash<QString, QString> shared;     // 文件名 -> 本地路径
+    QHash<QString, Grant> grants;       // 令牌 -> 文件名
+    QHash<QTcpSocket *, Upload> uploads;
+};
+
+#endif // PEERSERVER_H
@@ -10,13 +10,19 @@ CONFIG -= shared
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    filebrowser.cpp \
     fileworker.cpp \
     main.cpp \
-    mainwindow.cpp
+    mainwindow.cpp \
+    muxchannel.cpp \
+    peerserver.cpp
 
 HEADERS += \
+    filebrowser.h \
     fileworker.h \
-    mainwindow.h
+    mainwindow.h \
+    muxchannel.h \
+    peerserver.h
 
 FORMS += \
     mainwindow.ui
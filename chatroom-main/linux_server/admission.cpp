@@ -0,0 +1,258 @@
+#include "admission.h"
+#include "cpupool.h"
+#include "log.h"
+#include <algorithm>
+#include <unordered_map>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+// 令牌桶，rate 为 0 不限
+struct TokenBucket
+{
+    double tokens = -1; // 第一次使用时装满
+    int64_t last = 0;
+
+    bool take(double rate, int64_t now, int &wait_ms)
+    {
+        if (rate <= 0)
+            return true;
+        double burst = rate * 2;
+        if (tokens < 0)
+            tokens = burst;
+        else
+            tokens = std::min(burst, tokens + (now - last) * rate / 1000);
+        last = now;
+        if (tokens >= 1)
+        {
+            tokens -= 1;
+            return true;
+        }
+        wait_ms = (int)((1 - tokens) * 1000 / rate) + 1;
+        return false;
+    }
+
+    // 拿到令牌后请求又被别处拒绝，还回去
+    void refund(double rate)
+    {
+        if (rate > 0)
+            tokens = std::min(rate * 2, tokens + 1);
+    }
+};
+
+struct IpState
+{
+    int conns = 0;
+    TokenBucket accepts;
+};
+
+struct ConnRate
+{
+    uint32_t ip;
+    TokenBucket messages;
+    int64_t last_notice = 0;
+    unsigned allowance = 0;     // 不受限速的消息条数
+    int64_t allow_until = 0;
+};
+
+static int max_conns = -1;
+static int max_per_ip = ADMIT_DEFAULT_PER_IP;
+static double accept_rate = ADMIT_DEFAULT_ACCEPT_RATE;
+static double ip_accept_rate = ADMIT_DEFAULT_IP_ACCEPT_RATE;
+static double msg_rate = ADMIT_DEFAULT_MSG_RATE;
+
+static int total_conns = 0;
+static TokenBucket accepts;
+static std::unordered_map<uint32_t, IpState> ips;
+static std::unordered_map<int, ConnRate> sessions;
+
+static int64_t overload_until = 0; // 过载状态持续到这个时间
+static uint64_t rejected = 0;
+
+static int jitter(int ms)
+{
+    return ms + (int)(random() % (ms + 1));
+}
+
+void admit_set_limits(int conns, int per_ip, double rate, double ip_rate, double msgs)
+{
+    max_conns = conns;
+    max_per_ip = per_ip;
+    accept_rate = rate;
+    ip_accept_rate = ip_rate;
+    msg_rate = msgs;
+}
+
+static int conn_limit()
+{
+    if (max_conns >= 0)
+        return max_conns;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+        return 0;
+    max_conns = std::max<int>(ADMIT_FD_RESERVE, (int)std::min<rlim_t>(rl.rlim_cur, 1 << 20) - ADMIT_FD_RESERVE);
+    return max_conns;
+}
+
+bool admit_overloaded()
+{
+    return reactor_now() < overload_until;
+}
+
+// 本机地址: 压测工具和本机的反向代理都从这里连进来，不按单个 IP 限制
+static bool is_loopback(uint32_t ip)
+{
+    return (ip >> 24) == 127;
+}
+
+bool admit_connection(int fd, uint32_t ip, int &retry_ms, const char *&reason)
+{
+    int64_t now = reactor_now();
+    IpState &state = ips[ip];
+    bool per_ip = !is_loopback(ip);
+    int wait_ms = 0;
+    reason = NULL;
+    if (admit_overloaded())
+    {
+        reason = "overload";
+        retry_ms = jitter(ADMIT_RETRY_MS);
+    }
+    else if (conn_limit() > 0 && total_conns >= conn_limit())
+    {
+        reason = "server full";
+        retry_ms = jitter(ADMIT_RETRY_MS);
+    }
+    else if (per_ip && max_per_ip > 0 && state.conns >= max_per_ip)
+    {
+        reason = "too many connections";
+        retry_ms = jitter(ADMIT_RETRY_MS);
+    }
+    // 先查每个 IP 的桶: 一个地址的风暴不会耗光全局的配额
+    else if (per_ip && !state.accepts.take(ip_accept_rate, now, wait_ms))
+    {
+        reason = "accept rate";
+        retry_ms = jitter(std::max(wait_ms, 100));
+    }
+    else if (!accepts.take(accept_rate, now, wait_ms))
+    {
+        // 被全局的桶拒绝不算这个 IP 用掉了配额
+        if (per_ip)
+            state.accepts.refund(ip_accept_rate);
+        reason = "accept rate";
+        retry_ms = jitter(std::max(wait_ms, 100));
+    }
+    if (reason)
+    {
+        rejected++;
+        struct in_addr addr = {htonl(ip)};
+        log_warn("Rejected connection from %s: %s", inet_ntoa(addr), reason);
+        return false;
+    }
+    state.conns++;
+    total_conns++;
+    sessions[fd].ip = ip;
+    return true;
+}
+
+void admit_release(int fd)
+{
+    auto it = sessions.find(fd);
+    if (it == sessions.end())
+        return;
+    auto ip = ips.find(it->second.ip);
+    if (ip != ips.end())
+        ip->second.conns--;
+    sessions.erase(it);
+    total_conns--;
+}
+
+bool admit_message(int fd, int &retry_ms, bool &notify)
+{
+    notify = false;
+    auto it = sessions.find(fd);
+    if (it == sessions.end())
+        return true;
+    int64_t now = reactor_now();
+    if (it->second.allowance > 0 && now < it->second.allow_until)
+    {
+        it->second.allowance--;
+        return true;
+    }
+    int wait_ms = 0;
+    if (it->second.messages.take(msg_rate, now, wait_ms))
+        return true;
+    retry_ms = wait_ms;
+    if (now - it->second.last_notice >= 1000)
+    {
+        it->second.last_notice = now;
+        notify = true;
+        log_warn("client: %d message rate exceeded", fd);
+    }
+    return false;
+}
+
+void admit_allow(int fd, unsigned messages)
+{
+    auto it = sessions.find(fd);
+    if (it == sessions.end())
+        return;
+    it->second.allowance = messages;
+    it->second.allow_until = reactor_now() + ADMIT_ALLOW_MS;
+}
+
+bool admit_heavy(int &retry_ms)
+{
+    if (!admit_overloaded())
+        return true;
+    rejected++;
+    retry_ms = jitter(ADMIT_RETRY_MS);
+    return false;
+}
+
+std::string admit_busy(int retry_ms, const char *reason)
+{
+    return "BUSY " + std::to_string(retry_ms) + " " + reason;
+}
+
+Task admit_monitor()
+{
+    int64_t last_log = 0;
+    while (true)
+    {
+        int64_t before = reactor_now();
+        co_await reactor_sleep(ADMIT_SAMPLE_MS);
+        int64_t now = reactor_now();
+        int64_t lag = now - before - ADMIT_SAMPLE_MS;
+        size_t queued = reactor_queued_bytes();
+        int backlog = cpupool_inflight();
+        const char *cause = lag > ADMIT_LAG_MS ? "reactor lag" : queued > ADMIT_QUEUE_MAX ? "send queues"
+                            : backlog > ADMIT_CPU_BACKLOG ? "cpu backlog" : NULL;
+        if (cause)
+        {
+            if (!admit_overloaded() || now - last_log >= 1000)
+            {
+                log_warn("Overload (%s): lag %lld ms, queued %zu KB, cpu backlog %d, %d connections", cause,
+                         (long long)lag, queued / 1024, backlog, total_conns);
+                last_log = now;
+            }
+            overload_until = now + ADMIT_HOLD_MS;
+        }
+        else if (overload_until != 0 && now >= overload_until)
+        {
+            log_warn("Overload cleared, %llu requests rejected", (unsigned long long)rejected);
+            overload_until = 0;
+            rejected = 0;
+        }
+        // 没有连接、桶也已经装满的 IP 不再保留
+        if (ips.size() > 4096)
+        {
+            for (auto it = ips.begin(); it != ips.end();)
+            {
+                if (it->second.conns == 0 && now - it->second.accepts.last > 2000)
+                    it = ips.erase(it);
+                else
+                    it++;
+            }
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include "reactor.h"
+
+// 过载保护: 在接受连接和处理请求的入口尽早拒绝新工作，已经在线的客户端照常聊天
+//   连接数: 全局上限(默认按 fd 上限留出余量)和每个 IP 的上限
+//   接受速率: 全局和每个 IP 各一个令牌桶，重连风暴时每个 IP 每秒只放进几个
+//   本机地址(127.0.0.0/8)只受全局的限制: 本机的压测工具和反向代理从一个地址开很多连接
+//   消息速率: 每个聊天会话一个令牌桶，超出的消息丢弃，每秒最多回复一次 BUSY
+//   负载: 每 ADMIT_SAMPLE_MS 采样一次反应器延迟(定时器晚醒了多久)、所有发送队列的积压、计算线程池排队的任务，
+//     任一超过阈值进入过载状态；过载时拒绝新连接和开销大的请求(上传、下载、检索)，聊天不受影响
+// 拒绝时回复 "BUSY <毫秒> <原因>"，客户端至少等这么久再重试；建议时间带随机抖动，重连不会再次扎堆
+// 只在反应器线程上调用
+
+#define ADMIT_SAMPLE_MS 100
+#define ADMIT_LAG_MS 100                     // 定时器晚醒超过这么久认为反应器线程忙不过来
+#define ADMIT_QUEUE_MAX (256 * 1024 * 1024)  // 所有连接发送队列的积压
+#define ADMIT_CPU_BACKLOG 256                // 计算线程池里排队的任务
+#define ADMIT_HOLD_MS 2000                   // 负载降下来后再保持过载状态这么久，避免来回切换
+#define ADMIT_RETRY_MS 2000                  // 过载时建议的重试间隔，另加最多一倍的随机抖动
+#define ADMIT_FD_RESERVE 64                  // 连接数上限比 fd 上限少这么多，留给文件和内部 socket
+#define ADMIT_ALLOW_MS 5000                  // admit_allow() 放行的额度保留这么久
+
+#define ADMIT_DEFAULT_PER_IP 64
+#define ADMIT_DEFAULT_ACCEPT_RATE 200   // 每秒新连接，突发为两倍
+#define ADMIT_DEFAULT_IP_ACCEPT_RATE 10
+#define ADMIT_DEFAULT_MSG_RATE 50       // 每个会话每秒消息数，突发为两倍
+
+// 0 表示不限；max_conns 为负数时按 fd 上限计算
+void admit_set_limits(int max_conns, int max_per_ip, double accept_rate, double ip_accept_rate, double msg_rate);
+// 新连接: 允许时登记并返回 true；拒绝时给出建议的重试时间和原因
+bool admit_connection(int fd, uint32_t ip, int &retry_ms, const char *&reason);
+// 连接关闭，没有登记过的 fd(热升级接手的连接)忽略
+void admit_release(int fd);
+// 一条聊天消息: 超出速率返回 false，notify 为 true 时应该回复一次 BUSY
+bool admit_message(int fd, int &retry_ms, bool &notify);
+// 接下来 ADMIT_ALLOW_MS 内的 messages 条消息不受消息速率限制(恢复会话后客户端重发的消息)
+void admit_allow(int fd, unsigned messages);
+// 开销大的请求，过载时返回 false
+bool admit_heavy(int &retry_ms);
+bool admit_overloaded();
+// "BUSY <毫秒> <原因>"
+std::string admit_busy(int retry_ms, const char *reason);
+// 定期采样负载，启动反应器后运行
+Task admit_monitor();
+
+#endif // ADMISSION_H
@@ -0,0 +1,82 @@
+#include "batch.h"
+#include <algorithm>
+
+static uint32_t get_be16(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 8) | (uint32_t)u[1];
+}
+
+static uint32_t get_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+static uint64_t get_be64(const char *p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+bool BatchDecoder::feed(const char *src, size_t len, std::vector<BatchOp> &ops)
+{
+    // 上一次交出去的数据已经用完了
+    pending.erase(0, pos);
+    pos = 0;
+    pending.append(src, len);
+    while (!done)
+    {
+        size_t avail = pending.size() - pos;
+        if (in_file)
+        {
+            size_t n = (size_t)std::min<uint64_t>(remaining, avail);
+            if (n == 0)
+                break;
+            BatchOp op{BATCH_OP_DATA};
+            op.data = pending.data() + pos;
+            op.len = n;
+            ops.push_back(std::move(op));
+            pos += n;
+            remaining -= n;
+            if (remaining == 0)
+            {
+                ops.push_back(BatchOp{BATCH_OP_END});
+                in_file = false;
+            }
+            continue;
+        }
+        if (avail == 0)
+            break;
+        char type = pending[pos];
+        if (type == BATCH_FILE)
+        {
+            if (avail < 3)
+                break;
+            size_t path_len = get_be16(pending.data() + pos + 1);
+            if (avail < 3 + path_len + 8)
+                break;
+            BatchOp op{BATCH_OP_BEGIN};
+            op.path.assign(pending.data() + pos + 3, path_len);
+            op.size = get_be64(pending.data() + pos + 3 + path_len);
+            ops.push_back(std::move(op));
+            pos += 3 + path_len + 8;
+            remaining = ops.back().size;
+            in_file = remaining > 0;
+            if (!in_file)
+                ops.push_back(BatchOp{BATCH_OP_END});
+        }
+        else if (type == BATCH_END)
+        {
+            if (avail < 5)
+                break;
+            count = get_be32(pending.data() + pos + 1);
+            pos += 5;
+            done = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// 文件夹上传: 整棵目录树在一个传输连接上作为一条归档流发送，每个文件前面一个头，没有逐个文件的往返
+// 1. 客户端: "BATCH <目录名> <文件数> <总字节数>\n"，总字节数是所有文件大小之和
+// 2. 后面是归档流，按 compress.h 的传输帧('R'/'Z' + 4 字节长度 + 数据)分帧，很多小文件压在同一帧里
+//    归档流: 每个文件 'F' | 2 字节路径长度 | 相对路径('/' 分隔) | 8 字节大小 | 数据
+//            最后   'E' | 4 字节文件数
+//    整数都是大端
+// 3. 服务器把文件登记为 "<目录名>/<相对路径>"，全部落盘后回复 "OK <文件数>\n"，失败回复 "ERROR <原因>\n"
+//    中途失败时已经收下的文件都不保留
+
+#define BATCH_FILE 'F'
+#define BATCH_END 'E'
+#define BATCH_FILES_MAX 100000
+#define BATCH_SMALL_MAX (256 * 1024)  // 不超过这么大的文件整个放在内存里，成批写盘(见 diskio.h 的 DiskPack)
+
+enum BatchOpType
+{
+    BATCH_OP_BEGIN,  // 一个文件开始: path、size
+    BATCH_OP_DATA,   // 当前文件的一段数据
+    BATCH_OP_END,    // 当前文件收齐了，大小为 0 的文件紧跟在 BEGIN 后面
+};
+
+struct BatchOp
+{
+    explicit BatchOp(int type) : type(type) {}
+
+    int type;
+    std::string path;
+    uint64_t size = 0;
+    const char *data = nullptr;
+    size_t len = 0;
+    std::string sha256;  // END，由调用者算好填进来
+};
+
+// 解析归档流，处理跨 recv() 的半个头
+struct BatchDecoder
+{
+    bool done = false;
+    uint32_t count = 0;       // 'E' 带来的文件数
+    std::string pending;
+    size_t pos = 0;
+    uint64_t remaining = 0;   // 当前文件还没到的字节数
+    bool in_file = false;
+
+    // 解出的事件追加到 ops，DATA 的 data 指向内部缓冲区，下次 feed 之前有效；格式错误返回 false
+    bool feed(const char *src, size_t len, std::vector<BatchOp> &ops);
+};
+
+#endif // BATCH_H
@@ -0,0 +1,180 @@
+// 编译: g++ -std=c++17 -O2 chat_latency.cpp -o chat_latency -lpthread
+// 测试后台有大文件下载时聊天消息的往返延迟，用来验证限速和调度是否让聊天优先
+// 聊天连接用多路复用协议，靠帧边界区分每条回显；下载连接用普通 DOWNLOAD 命令，反复下载直到测试结束
+// 每 10ms 发一条，超过服务器默认的每会话消息速率，服务器要用 --msg-rate 0 启动；连本机时不受每个 IP 的连接限制
+// 用法: ./chat_latency <ip> <port> <服务器上的文件名> [下载连接数] [消息条数]
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+static const char *ip;
+static int port;
+static std::atomic<bool> stop(false);
+static std::atomic<uint64_t> downloaded(0);
+
+static int tcp_connect()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror("connect() error");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+static bool send_all(int sock, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(sock, data, len, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int sock, char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, data, len, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void downloader(std::string filename)
+{
+    char buf[64 * 1024];
+    while (!stop)
+    {
+        int sock = tcp_connect();
+        std::string cmd = "DOWNLOAD " + filename;
+        send_all(sock, cmd.c_str(), cmd.size());
+        ssize_t n;
+        while (!stop && (n = recv(sock, buf, sizeof(buf), 0)) > 0)
+            downloaded += n;
+        close(sock);
+    }
+}
+
+static void write_frame(int sock, uint32_t stream, const std::string &payload)
+{
+    char header[9];
+    header[0] = 'D';
+    uint32_t be = htonl(stream);
+    memcpy(header + 1, &be, 4);
+    be = htonl(payload.size());
+    memcpy(header + 5, &be, 4);
+    std::string frame(header, 9);
+    frame += payload;
+    send_all(sock, frame.data(), frame.size());
+}
+
+// 读一个流 0 上的帧，返回 false 表示连接断开
+static bool read_chat(int sock, std::string &payload)
+{
+    while (true)
+    {
+        char header[9];
+        if (!recv_all(sock, header, 9))
+            return false;
+        uint32_t stream, len;
+        memcpy(&stream, header + 1, 4);
+        memcpy(&len, header + 5, 4);
+        payload.resize(ntohl(len));
+        if (!recv_all(sock, &payload[0], payload.size()))
+            return false;
+        if (header[0] == 'D' && ntohl(stream) == 0)
+            return true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " <ip> <port> <file> [downloads] [messages]" << std::endl;
+        return 1;
+    }
+    ip = argv[1];
+    port = atoi(argv[2]);
+    std::string filename = argv[3];
+    int downloads = argc > 4 ? atoi(argv[4]) : 4;
+    int messages = argc > 5 ? atoi(argv[5]) : 200;
+
+    int sock = tcp_connect();
+    std::string caps = "CAPS mux\n";
+    send_all(sock, caps.c_str(), caps.size());
+    char c;
+    do
+    {
+        if (!recv_all(sock, &c, 1))
+        {
+            std::cerr << "CAPS 协商失败" << std::endl;
+            return 1;
+        }
+    } while (c != '\0');
+    // 第一条消息以用户名开头
+    std::string name = "bench" + std::to_string(getpid());
+    write_frame(sock, 0, name + " joined");
+
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < downloads; i++)
+        threads.emplace_back(downloader, filename);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));  // 等下载跑满带宽
+
+    std::vector<double> samples;
+    for (int i = 0; i < messages; i++)
+    {
+        std::string tag = name + " ping " + std::to_string(i);
+        auto start = std::chrono::steady_clock::now();
+        write_frame(sock, 0, tag);
+        std::string payload;
+        // 跳过别人的消息，直到收到自己的回显
+        while (payload != tag)
+        {
+            if (!read_chat(sock, payload))
+            {
+                std::cerr << "连接断开" << std::endl;
+                return 1;
+            }
+        }
+        samples.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    stop = true;
+    shutdown(sock, SHUT_RDWR);
+    for (auto &t : threads)
+        t.join();
+    close(sock);
+
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(samples.size() * p))]; };
+    printf("下载连接: %d, 下载吞吐: %.1f MB/s\n", downloads, downloaded / seconds / (1024 * 1024));
+    printf("聊天往返延迟(ms): p50 %.2f  p99 %.2f  max %.2f\n", pct(0.5), pct(0.99), samples.back());
+    return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# 在一组网络条件下回放同一份轨迹，每种条件输出一行吞吐和聊天送达延迟，用来比较传输相关的改动
+# 需要先编译 netem_proxy 和 replay，服务器已经在 <服务器端口> 上运行(不开 TLS)
+# 服务器要用 --msg-rate 0 启动，否则回放的消息会被限速丢掉；代理在本机，不受每个 IP 的连接限制
+# 条件可以用环境变量覆盖: DELAYS(ms)、RATES(KB/s，0 不限)、LOSSES、SPEED(回放速度，默认 max)
+# 用法: ./impair_matrix.sh <轨迹文件> <服务器端口> [代理端口]
+TRACE=$1
+SERVER_PORT=$2
+PROXY_PORT=${3:-19999}
+DELAYS=${DELAYS:-"0 10 50"}
+RATES=${RATES:-"0 10000 1000"}
+LOSSES=${LOSSES:-"0 0.01"}
+SPEED=${SPEED:-max}
+DIR=$(dirname "$0")
+
+if [ -z "$TRACE" ] || [ -z "$SERVER_PORT" ]; then
+    echo "Usage: $0 <trace> <server-port> [proxy-port]" >&2
+    exit 1
+fi
+
+printf "%-8s %-10s %-6s | %-12s %-12s %-12s %-12s\n" delay_ms rate_KB/s loss "seconds" "recv_MB/s" "chat_p50_ms" "chat_p99_ms"
+for delay in $DELAYS; do
+    for rate in $RATES; do
+        for loss in $LOSSES; do
+            "$DIR/netem_proxy" "$PROXY_PORT" 127.0.0.1 "$SERVER_PORT" --delay "$delay" --rate "$rate" --loss "$loss" --seed 1 \
+                < /dev/null > /dev/null 2>&1 &
+            proxy=$!
+            sleep 0.2
+            out=$("$DIR/replay" "$TRACE" 127.0.0.1 "$PROXY_PORT" "$SPEED")
+            kill "$proxy"
+            wait "$proxy" 2> /dev/null
+            seconds=$(echo "$out" | sed -n 's/.*用时 \([0-9.]*\) s.*/\1/p')
+            recv=$(echo "$out" | sed -n 's/.*接收 [0-9.]* MB (\([0-9.]*\) MB\/s).*/\1/p')
+            p50=$(echo "$out" | sed -n '/聊天送达延迟/{n;s/.* p50 \([0-9.]*\) .*/\1/p}')
+            p99=$(echo "$out" | sed -n '/聊天送达延迟/{n;s/.* p99 \([0-9.]*\) .*/\1/p}')
+            printf "%-8s %-10s %-6s | %-12s %-12s %-12s %-12s\n" "$delay" "$rate" "$loss" "$seconds" "$recv" "${p50:--}" "${p99:--}"
+        done
+    done
+done
@@ -0,0 +1,475 @@
+// 编译: g++ -std=c++17 -O2 netem_proxy.cpp -o netem_proxy
+// 本机的网络损伤代理: 客户端连代理，代理转发给服务器，两个方向分别加上延迟、抖动、带宽限制、丢包和连接重置
+// 用来在类似公网的条件下比较传输相关的改动，不需要额外的机器或 tc/netem 权限
+//   --delay ms       每个方向的单程延迟(往返多 2 倍)
+//   --jitter ms      每块数据的延迟在 delay ± jitter 内随机，同一方向上不乱序
+//   --rate KB/s      服务器到客户端(下载方向)的带宽，0 不限
+//   --up-rate KB/s   客户端到服务器(上传方向)的带宽，默认同 --rate
+//   --loss p         每块数据以概率 p 丢失一次，按 TCP 重传的效果多等一个 RTO(200ms + 往返延迟)
+//   --reset-prob p   每转发 1 MB 以概率 p 重置连接(两边都收到 RST)
+//   --reset-after n  每个连接转发 n 字节后重置
+//   --queue-kb n     每个方向最多缓存这么多数据，满了就不再读，靠 TCP 流控压住发送方
+//   --seed n         随机数种子，同样的参数和种子得到同样的抖动和丢包
+// 运行中可以从标准输入改参数，便于脚本切换条件而不断开连接:
+//   "delay 50"、"jitter 5"、"rate 1000"、"up-rate 200"、"loss 0.01"、"reset-prob 0"、"reset-after 0"、
+//   "reset"(立即重置所有连接)、"stats"(打印每个连接的统计)
+// 每个连接结束时打印两个方向的字节数、用时和下载方向的平均速率
+// 用法: ./netem_proxy <监听端口> <服务器 ip> <服务器端口> [选项...]
+#include <iostream>
+#include <string>
+#include <deque>
+#include <map>
+#include <random>
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define MIN_RTO_US 200000      // Linux 的最小重传超时
+#define MIN_CHUNK 1460         // 限速时每块数据至少一个 MSS
+#define MAX_CHUNK (64 * 1024)
+#define SHAPE_INTERVAL_US 10000  // 限速时一块数据大约是 10ms 的量，带宽曲线不会太粗
+
+struct Config
+{
+    int64_t delay_us = 0;
+    int64_t jitter_us = 0;
+    uint64_t rate_down = 0;  // 字节/秒，0 不限
+    uint64_t rate_up = 0;
+    double loss = 0;
+    double reset_prob = 0;
+    uint64_t reset_after = 0;
+    size_t queue_limit = 4 * 1024 * 1024;
+};
+
+struct Chunk
+{
+    int64_t due;  // 可以发给对端的时间
+    std::string data;
+    size_t pos = 0;
+};
+
+// 一个方向: 从 from 读，延迟后写给 to
+struct Pipe
+{
+    std::deque<Chunk> queue;
+    size_t queued = 0;
+    int64_t link_free = 0;  // 限速的链路什么时候发完已经排队的数据
+    int64_t last_due = 0;
+    bool eof = false;       // from 已经关闭写端
+    bool shut = false;      // 已经把关闭转给 to
+    bool blocked = false;   // to 写满了，等可写
+    uint64_t bytes = 0;
+};
+
+struct Link
+{
+    int id;
+    int client;
+    int server;
+    bool connecting = true;
+    Pipe up;    // 客户端 -> 服务器
+    Pipe down;  // 服务器 -> 客户端
+    int64_t start;
+    uint64_t forwarded = 0;
+};
+
+static Config config;
+static std::mt19937_64 rng(1);
+static int epfd;
+static std::map<int, Link *> links;  // 两个 fd 都指向同一个 Link
+static int next_id = 1;
+static const char *server_ip;
+static int server_port;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double uniform()
+{
+    return std::uniform_real_distribution<double>(0, 1)(rng);
+}
+
+static void print_stats(const Link *l, const char *what)
+{
+    double seconds = (now_us() - l->start) / 1e6;
+    printf("conn %d %s: up %.2f MB, down %.2f MB, %.2f s, down %.2f MB/s\n", l->id, what, l->up.bytes / 1048576.0,
+           l->down.bytes / 1048576.0, seconds, seconds > 0 ? l->down.bytes / 1048576.0 / seconds : 0.0);
+    fflush(stdout);
+}
+
+static void close_link(Link *l, bool reset, const char *what)
+{
+    for (int fd : {l->client, l->server})
+    {
+        if (reset)
+        {
+            struct linger lg = {1, 0};  // 关闭时发 RST
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        links.erase(fd);
+        close(fd);
+    }
+    print_stats(l, what);
+    delete l;
+}
+
+static void set_events(int fd, bool in, bool out)
+{
+    struct epoll_event ev;
+    ev.events = (in ? (uint32_t)EPOLLIN : 0u) | (out ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void update_events(Link *l)
+{
+    set_events(l->client, !l->up.eof && l->up.queued < config.queue_limit, l->down.blocked);
+    set_events(l->server, !l->connecting && !l->down.eof && l->down.queued < config.queue_limit, l->connecting || l->up.blocked);
+}
+
+// 限速时每块读多少: 大约 SHAPE_INTERVAL 的量
+static size_t chunk_size(uint64_t rate)
+{
+    if (rate == 0)
+        return MAX_CHUNK;
+    return std::min<size_t>(MAX_CHUNK, std::max<size_t>(MIN_CHUNK, rate * SHAPE_INTERVAL_US / 1000000));
+}
+
+// 先按带宽排队发送，再加上传播延迟和抖动，丢包时多等一个 RTO
+static void schedule(Pipe &p, uint64_t rate, std::string data)
+{
+    int64_t now = now_us();
+    int64_t start = std::max(now, p.link_free);
+    int64_t tx = rate ? (int64_t)(data.size() * 1000000 / rate) : 0;
+    p.link_free = start + tx;
+    int64_t due = start + tx + config.delay_us;
+    if (config.jitter_us > 0)
+        due += (int64_t)((uniform() * 2 - 1) * config.jitter_us);
+    if (config.loss > 0 && uniform() < config.loss)
+        due += MIN_RTO_US + 2 * config.delay_us;
+    due = std::max(due, p.last_due);  // TCP 流不会乱序
+    p.last_due = due;
+    p.queued += data.size();
+    p.queue.push_back(Chunk{due, std::move(data)});
+}
+
+// 把到时间的数据写给对端，对端都收完并且来源已关闭时转发关闭
+// 返回 false 表示对端出错或按 --reset-after/--reset-prob 要重置连接
+static bool pump(Link *l, Pipe &p, int to)
+{
+    int64_t now = now_us();
+    p.blocked = false;
+    while (!p.queue.empty() && p.queue.front().due <= now)
+    {
+        Chunk &c = p.queue.front();
+        ssize_t n = send(to, c.data.data() + c.pos, c.data.size() - c.pos, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            p.blocked = true;
+            return true;
+        }
+        if (n <= 0)
+            return false;
+        c.pos += n;
+        p.bytes += n;
+        p.queued -= n;
+        if (c.pos == c.data.size())
+            p.queue.pop_front();
+        l->forwarded += n;
+        if (config.reset_after && l->forwarded >= config.reset_after)
+            return false;
+        if (config.reset_prob > 0 && uniform() < config.reset_prob * n / 1048576.0)
+            return false;
+    }
+    if (p.queue.empty() && p.eof && !p.shut)
+    {
+        shutdown(to, SHUT_WR);
+        p.shut = true;
+    }
+    return true;
+}
+
+// 从 from 读到缓存满或 EAGAIN，返回 false 表示读出错
+static bool fill(Pipe &p, int from, uint64_t rate)
+{
+    static char buf[MAX_CHUNK];
+    size_t size = chunk_size(rate);
+    while (!p.eof && p.queued < config.queue_limit)
+    {
+        ssize_t n = recv(from, buf, size, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0)
+            return false;
+        if (n == 0)
+        {
+            p.eof = true;
+            break;
+        }
+        schedule(p, rate, std::string(buf, n));
+    }
+    return true;
+}
+
+static void accept_client(int listener)
+{
+    while (true)
+    {
+        int client = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+        if (client == -1)
+            return;
+        int server = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(server_ip);
+        addr.sin_port = htons(server_port);
+        if (connect(server, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+        {
+            perror("connect() error");
+            close(client);
+            close(server);
+            continue;
+        }
+        // 小块数据马上转发，延迟只由代理自己控制
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Link *l = new Link{next_id++, client, server, true, Pipe(), Pipe(), now_us(), 0};
+        links[client] = l;
+        links[server] = l;
+        struct epoll_event ev;
+        ev.events = 0;
+        ev.data.fd = client;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev);
+        ev.data.fd = server;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, server, &ev);
+        update_events(l);
+    }
+}
+
+// 处理一个连接上的事件和到期的数据，连接结束或被重置时释放
+static void service(Link *l, int fd, uint32_t events)
+{
+    if (l->connecting && fd == l->server && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(l->server, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+        {
+            close_link(l, true, "connect failed");
+            return;
+        }
+        l->connecting = false;
+    }
+    bool ok = true;
+    if (fd == l->client && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        ok = fill(l->up, l->client, config.rate_up);
+    else if (fd == l->server && !l->connecting && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        ok = fill(l->down, l->server, config.rate_down);
+    if (ok && !l->connecting)
+        ok = pump(l, l->up, l->server) && pump(l, l->down, l->client);
+    if (!ok)
+    {
+        close_link(l, true, "reset");
+        return;
+    }
+    if (l->up.shut && l->down.shut)
+    {
+        close_link(l, false, "closed");
+        return;
+    }
+    update_events(l);
+}
+
+static std::map<int, Link *> unique_links()
+{
+    std::map<int, Link *> result;
+    for (auto &it : links)
+        result[it.second->id] = it.second;
+    return result;
+}
+
+static void print_config()
+{
+    printf("delay %lld ms, jitter %lld ms, rate %llu KB/s, up-rate %llu KB/s, loss %g, reset-prob %g/MB, reset-after %llu, queue %zu KB\n",
+           (long long)config.delay_us / 1000, (long long)config.jitter_us / 1000, (unsigned long long)config.rate_down / 1024,
+           (unsigned long long)config.rate_up / 1024, config.loss, config.reset_prob, (unsigned long long)config.reset_after,
+           config.queue_limit / 1024);
+    fflush(stdout);
+}
+
+// 命令行选项和标准输入的命令用同一套名字
+static bool set_option(const std::string &name, const std::string &value)
+{
+    double v = atof(value.c_str());
+    if (name == "delay")
+        config.delay_us = (int64_t)(v * 1000);
+    else if (name == "jitter")
+        config.jitter_us = (int64_t)(v * 1000);
+    else if (name == "rate")
+        config.rate_down = (uint64_t)(v * 1024);
+    else if (name == "up-rate")
+        config.rate_up = (uint64_t)(v * 1024);
+    else if (name == "loss")
+        config.loss = v;
+    else if (name == "reset-prob")
+        config.reset_prob = v;
+    else if (name == "reset-after")
+        config.reset_after = (uint64_t)v;
+    else if (name == "queue-kb")
+        config.queue_limit = std::max<size_t>(MAX_CHUNK, (size_t)v * 1024);
+    else if (name == "seed")
+        rng.seed((uint64_t)v);
+    else
+        return false;
+    return true;
+}
+
+static void handle_command(const std::string &line)
+{
+    std::istringstream iss(line);
+    std::string cmd, value;
+    iss >> cmd >> value;
+    if (cmd.empty())
+        return;
+    if (cmd == "reset")
+    {
+        for (auto &it : unique_links())
+            close_link(it.second, true, "reset");
+    }
+    else if (cmd == "stats")
+    {
+        for (auto &it : unique_links())
+            print_stats(it.second, "active");
+    }
+    else if (value.empty() || !set_option(cmd, value))
+        printf("unknown command: %s\n", line.c_str());
+    print_config();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " <listen-port> <server-ip> <server-port> [--delay ms] [--jitter ms] [--rate KB/s] [--up-rate KB/s]"
+                  << " [--loss p] [--reset-prob p] [--reset-after bytes] [--queue-kb n] [--seed n]" << std::endl;
+        return 1;
+    }
+    server_ip = argv[2];
+    server_port = atoi(argv[3]);
+    bool up_rate_set = false;
+    for (int i = 4; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc || !set_option(argv[i] + 2, argv[i + 1]))
+        {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            return 1;
+        }
+        up_rate_set |= strcmp(argv[i], "--up-rate") == 0;
+        i++;
+    }
+    if (!up_rate_set)
+        config.rate_up = config.rate_down;
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[1]));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 128) == -1)
+    {
+        perror("bind() error");
+        return 1;
+    }
+    epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listener;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);  // 标准输入是普通文件时加不上，只用命令行参数
+    printf("Proxy 127.0.0.1:%s -> %s:%d\n", argv[1], server_ip, server_port);
+    print_config();
+
+    std::string input;
+    struct epoll_event events[256];
+    while (true)
+    {
+        // **等到最早一块数据到期或有事件**
+        int64_t now = now_us();
+        int64_t next_due = INT64_MAX;
+        for (auto &it : links)
+        {
+            Link *l = it.second;
+            if (it.first != l->client || l->connecting)
+                continue;
+            for (Pipe *p : {&l->up, &l->down})
+                if (!p->queue.empty() && !p->blocked)
+                    next_due = std::min(next_due, p->queue.front().due);
+        }
+        int timeout = next_due == INT64_MAX ? -1 : (int)std::max<int64_t>(0, (next_due - now + 999) / 1000);
+        int n = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listener)
+            {
+                accept_client(listener);
+                continue;
+            }
+            if (fd == STDIN_FILENO)
+            {
+                char buf[4096];
+                ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+                if (r <= 0)
+                {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    continue;
+                }
+                input.append(buf, r);
+                size_t eol;
+                while ((eol = input.find('\n')) != std::string::npos)
+                {
+                    handle_command(input.substr(0, eol));
+                    input.erase(0, eol + 1);
+                }
+                continue;
+            }
+            auto it = links.find(fd);
+            if (it != links.end())
+                service(it->second, fd, events[i].events);
+        }
+
+        // **到期的数据**
+        now = now_us();
+        for (auto &it : unique_links())
+        {
+            Link *l = it.second;
+            bool due = false;
+            for (Pipe *p : {&l->up, &l->down})
+                due |= !p->queue.empty() && !p->blocked && p->queue.front().due <= now;
+            if (due && !l->connecting)
+                service(l, -1, 0);
+        }
+    }
+    return 0;
+}
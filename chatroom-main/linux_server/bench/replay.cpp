@@ -0,0 +1,602 @@
+// 编译: g++ -std=c++17 -O2 replay.cpp -o replay
+// 把 server --capture 录下的轨迹重新发给服务器: 每个录下的连接开一个连接，按录制时的时间点发出同样的数据
+// 速度 1 按原来的节奏，N 为 N 倍速，max 不等待(只保持顺序)；回放连的服务器不要开 TLS(轨迹里是明文)
+// 报告吞吐、发送相对计划的滞后，以及聊天消息的送达延迟: 发出一条聊天消息到它的广播到达每个回放连接的时间
+// 轨迹里的上传会真的写进目标服务器的存储目录，下载需要目标服务器上有同名文件
+// 加速回放时单个连接的消息会超过服务器默认的消息速率，目标服务器要用 --msg-rate 0 启动；
+// 不在本机时所有连接来自同一个地址，还要放开 --max-conns-per-ip 0 --ip-accept-rate 0
+// 用法: ./replay <轨迹文件> --info
+//       ./replay <轨迹文件> <ip> <port> [速度]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../capture.h"
+
+#define MUX_HEADER_SIZE 9         // 同 mux.h
+#define CHAT_COMPRESS_MIN 512     // 同 compress.h，更长的广播可能被压缩，匹配不上
+#define OUT_LIMIT (4 * 1024 * 1024)  // 一个连接积压这么多没发出去时暂停回放，等它写出
+#define PENDING_TTL_US (30 * 1000000LL)  // 发出这么久还没送达的消息不再等
+#define DRAIN_IDLE_US (3 * 1000000LL)    // 轨迹放完后这么久没有收到数据就结束
+#define BATCH 1024                 // max 速度下每轮最多发这么多条记录，中间处理一次读写
+
+struct Record
+{
+    char type;
+    uint32_t conn;
+    int64_t t_us;        // 距录制开始
+    const char *data;
+    size_t len;
+};
+
+enum Kind
+{
+    KIND_UNKNOWN,
+    KIND_CHAT,
+    KIND_MUX,
+    KIND_TRANSFER,
+};
+
+struct Conn
+{
+    int fd = -1;
+    bool connecting = true;
+    bool closing = false;  // 录制里这个连接已经结束，发完剩余数据后关闭写端
+    Kind kind = KIND_UNKNOWN;
+    bool caps_done = false;
+    bool mux_requested = false;
+    bool rx_caps_skip = false;  // 多路复用连接收到的第一行 CAPS 回复不是帧
+    std::string out;
+    size_t out_pos = 0;
+    std::string tx_parse;
+    std::string rx_parse;
+};
+
+// 对数分桶的直方图: 每个 2 的幂再分 8 格，误差约 12%
+struct Histogram
+{
+    std::vector<uint64_t> counts = std::vector<uint64_t>(8 + 61 * 8, 0);
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+
+    static size_t index(uint64_t v)
+    {
+        if (v < 8)
+            return v;
+        int e = 63 - __builtin_clzll(v);
+        return 8 + (e - 3) * 8 + ((v >> (e - 3)) & 7);
+    }
+    static uint64_t upper(size_t i)
+    {
+        if (i < 8)
+            return i;
+        size_t e = (i - 8) / 8 + 3;
+        uint64_t mant = (i - 8) % 8;
+        return ((8 + mant + 1) << (e - 3)) - 1;
+    }
+    void add(uint64_t v)
+    {
+        counts[index(v)]++;
+        total++;
+        sum += v;
+        min = std::min(min, v);
+        max = std::max(max, v);
+    }
+    uint64_t percentile(double p) const
+    {
+        uint64_t want = (uint64_t)(total * p);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen > want)
+                return std::min(upper(i), max);
+        }
+        return max;
+    }
+    void print(const char *title) const
+    {
+        printf("%s: %llu 个样本\n", title, (unsigned long long)total);
+        if (total == 0)
+            return;
+        printf("  min %.3f  mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f (ms)\n",
+               min / 1000.0, (double)sum / total / 1000.0, percentile(0.5) / 1000.0, percentile(0.9) / 1000.0,
+               percentile(0.99) / 1000.0, percentile(0.999) / 1000.0, max / 1000.0);
+        // 按 2 的幂合并成粗的柱状图
+        uint64_t peak = 0;
+        std::vector<uint64_t> coarse(64, 0);
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            size_t b = 64 - __builtin_clzll(upper(i) | 1);
+            coarse[b] += counts[i];
+            peak = std::max(peak, coarse[b]);
+        }
+        for (size_t b = 0; b < coarse.size(); b++)
+        {
+            if (coarse[b] == 0)
+                continue;
+            int bar = (int)(coarse[b] * 50 / peak);
+            printf("  < %10.3f ms %10llu %s\n", (double)(1ULL << b) / 1000.0, (unsigned long long)coarse[b], std::string(std::max(bar, 1), '#').c_str());
+        }
+    }
+};
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool get_varint(const unsigned char *&p, const unsigned char *end, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7)
+    {
+        unsigned char b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// 解析整个轨迹，数据指向映射的文件；尾部不完整的记录丢弃
+static bool load_trace(const char *path, std::vector<Record> &records)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size < CAPTURE_HEADER_SIZE)
+    {
+        perror("open trace");
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    const unsigned char *p = (const unsigned char *)map;
+    const unsigned char *end = p + st.st_size;
+    if (memcmp(p, CAPTURE_MAGIC, 4) != 0 || p[4] != CAPTURE_VERSION)
+    {
+        std::cerr << path << " is not a capture trace" << std::endl;
+        return false;
+    }
+    p += CAPTURE_HEADER_SIZE;
+    int64_t t = 0;
+    while (p < end)
+    {
+        const unsigned char *start = p;
+        Record r;
+        uint64_t delta, conn, len = 0;
+        r.type = (char)*p++;
+        if (!get_varint(p, end, delta) || !get_varint(p, end, conn))
+            break;
+        if (r.type == CAPTURE_DATA && (!get_varint(p, end, len) || len > (uint64_t)(end - p)))
+            break;
+        if (r.type != CAPTURE_OPEN && r.type != CAPTURE_DATA && r.type != CAPTURE_CLOSE)
+        {
+            std::cerr << "bad record at offset " << (start - (const unsigned char *)map) << std::endl;
+            break;
+        }
+        t += delta;
+        r.t_us = t;
+        r.conn = (uint32_t)conn;
+        r.data = (const char *)p;
+        r.len = len;
+        p += len;
+        records.push_back(r);
+    }
+    return true;
+}
+
+static void print_info(const std::vector<Record> &records)
+{
+    size_t conns = 0, data = 0;
+    uint64_t bytes = 0;
+    for (const Record &r : records)
+    {
+        conns += r.type == CAPTURE_OPEN;
+        data += r.type == CAPTURE_DATA;
+        bytes += r.len;
+    }
+    double seconds = records.empty() ? 0 : records.back().t_us / 1e6;
+    printf("轨迹: %zu 个连接, %zu 块数据, %.2f MB, 时长 %.2f s\n", conns, data, bytes / 1048576.0, seconds);
+}
+
+static const char *ip;
+static int port;
+static int epfd;
+static std::unordered_map<uint32_t, Conn> conns;
+static std::unordered_map<int, uint32_t> fd_conn;
+// 还在等送达的聊天消息 -> 发出的时间
+static std::unordered_map<std::string, int64_t> pending;
+static Histogram delivery;
+static Histogram lag;
+static uint64_t bytes_sent, bytes_received, messages_sent, connect_errors, resets;
+
+static void update_events(Conn &c)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | ((c.connecting || c.out_pos < c.out.size()) ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.fd = c.fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static void drop_conn(uint32_t id)
+{
+    auto it = conns.find(id);
+    if (it == conns.end())
+        return;
+    if (it->second.fd != -1)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, it->second.fd, NULL);
+        fd_conn.erase(it->second.fd);
+        close(it->second.fd);
+    }
+    conns.erase(it);
+}
+
+static void open_conn(uint32_t id)
+{
+    Conn &c = conns[id];
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(port);
+    if (connect(c.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+    {
+        connect_errors++;
+        close(c.fd);
+        c.fd = -1;
+        conns.erase(id);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.fd = c.fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    fd_conn[c.fd] = id;
+}
+
+static void flush_conn(uint32_t id, Conn &c)
+{
+    while (!c.connecting && c.out_pos < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            c.out_pos += n;
+            bytes_sent += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        resets++;
+        drop_conn(id);
+        return;
+    }
+    if (c.out_pos == c.out.size())
+    {
+        c.out.clear();
+        c.out_pos = 0;
+        if (c.closing)
+            shutdown(c.fd, SHUT_WR);
+    }
+    update_events(c);
+}
+
+static bool starts_with(const std::string &s, const char *prefix)
+{
+    return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static void register_message(const char *msg, size_t len, int64_t now)
+{
+    while (len > 0 && msg[len - 1] == '\0')
+        len--;
+    if (len == 0 || len + 1 >= CHAT_COMPRESS_MIN)
+        return;
+    pending[std::string(msg, len)] = now;
+    messages_sent++;
+}
+
+static void deliver(const char *msg, size_t len, int64_t now)
+{
+    while (len > 0 && msg[len - 1] == '\0')
+        len--;
+    auto it = pending.find(std::string(msg, len));
+    if (it != pending.end())
+        delivery.add(now - it->second);
+}
+
+// 发出去的数据: 判断连接类型，登记其中的聊天消息
+// 一条记录是服务器一次读到的数据，服务器把每次读到的末尾当作一条消息的结束
+static void parse_tx(Conn &c, const char *data, size_t len, int64_t now)
+{
+    if (c.kind == KIND_TRANSFER)
+        return;
+    c.tx_parse.append(data, len);
+    if (!c.caps_done && starts_with(c.tx_parse, "CAPS "))
+    {
+        size_t eol = c.tx_parse.find('\n');
+        std::string line = c.tx_parse.substr(0, eol);
+        c.mux_requested = (" " + line + " ").find(" mux ") != std::string::npos;
+        c.rx_caps_skip = c.mux_requested;
+        c.tx_parse.erase(0, eol == std::string::npos ? eol : eol + 1);
+    }
+    c.caps_done = true;
+    if (c.kind == KIND_UNKNOWN)
+    {
+        if (c.mux_requested)
+            c.kind = KIND_MUX;
+        else if (c.tx_parse.empty())
+            return;
+        else if (starts_with(c.tx_parse, "UPLOAD") || starts_with(c.tx_parse, "ZUPLOAD") || starts_with(c.tx_parse, "DOWNLOAD") ||
+                 starts_with(c.tx_parse, "ZDOWNLOAD") || starts_with(c.tx_parse, "DELTA "))
+        {
+            c.kind = KIND_TRANSFER;
+            c.tx_parse.clear();
+            return;
+        }
+        else
+            c.kind = KIND_CHAT;
+    }
+    if (c.kind == KIND_CHAT)
+    {
+        size_t start = 0;
+        while (start < c.tx_parse.size())
+        {
+            size_t end = c.tx_parse.find('\0', start);
+            if (end == std::string::npos)
+                end = c.tx_parse.size();
+            register_message(c.tx_parse.data() + start, end - start, now);
+            start = end + 1;
+        }
+        c.tx_parse.clear();
+        return;
+    }
+    // 多路复用: 流 0 上的数据帧是聊天消息
+    size_t pos = 0;
+    while (c.tx_parse.size() - pos >= MUX_HEADER_SIZE)
+    {
+        const unsigned char *h = (const unsigned char *)c.tx_parse.data() + pos;
+        uint32_t stream = (h[1] << 24) | (h[2] << 16) | (h[3] << 8) | h[4];
+        uint32_t flen = (h[5] << 24) | (h[6] << 16) | (h[7] << 8) | h[8];
+        if (c.tx_parse.size() - pos - MUX_HEADER_SIZE < flen)
+            break;
+        if (h[0] == 'D' && stream == 0)
+            register_message((const char *)h + MUX_HEADER_SIZE, flen, now);
+        pos += MUX_HEADER_SIZE + flen;
+    }
+    c.tx_parse.erase(0, pos);
+}
+
+// 收到的数据: 拆出广播，和还在等的聊天消息对上就记一次送达
+static void parse_rx(Conn &c, const char *data, size_t len, int64_t now)
+{
+    if (c.kind == KIND_TRANSFER)
+        return;
+    if (c.rx_caps_skip)
+    {
+        const char *nul = (const char *)memchr(data, '\0', len);
+        if (!nul)
+            return;
+        c.rx_caps_skip = false;
+        len -= nul + 1 - data;
+        data = nul + 1;
+    }
+    c.rx_parse.append(data, len);
+    size_t pos = 0;
+    if (c.kind == KIND_MUX)
+    {
+        while (c.rx_parse.size() - pos >= MUX_HEADER_SIZE)
+        {
+            const unsigned char *h = (const unsigned char *)c.rx_parse.data() + pos;
+            uint32_t stream = (h[1] << 24) | (h[2] << 16) | (h[3] << 8) | h[4];
+            uint32_t flen = (h[5] << 24) | (h[6] << 16) | (h[7] << 8) | h[8];
+            if (c.rx_parse.size() - pos - MUX_HEADER_SIZE < flen)
+                break;
+            if (h[0] == 'D' && stream == 0)
+                deliver((const char *)h + MUX_HEADER_SIZE, flen, now);
+            pos += MUX_HEADER_SIZE + flen;
+        }
+    }
+    else
+    {
+        size_t end;
+        while ((end = c.rx_parse.find('\0', pos)) != std::string::npos)
+        {
+            deliver(c.rx_parse.data() + pos, end - pos, now);
+            pos = end + 1;
+        }
+        // 不带 '\0' 的广播会和下一条连在一起，不能无限攒
+        if (c.rx_parse.size() - pos > 1024 * 1024)
+            pos = c.rx_parse.size();
+    }
+    c.rx_parse.erase(0, pos);
+}
+
+static void read_conn(uint32_t id, Conn &c, int64_t now)
+{
+    static char buf[256 * 1024];
+    while (true)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            bytes_received += n;
+            parse_rx(c, buf, n, now);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0)
+            resets++;
+        drop_conn(id);
+        return;
+    }
+}
+
+static void apply(const Record &r, int64_t now)
+{
+    if (r.type == CAPTURE_OPEN)
+    {
+        open_conn(r.conn);
+        return;
+    }
+    auto it = conns.find(r.conn);
+    if (it == conns.end())
+        return;  // 连接失败或已经被服务器关闭
+    Conn &c = it->second;
+    if (r.type == CAPTURE_CLOSE)
+    {
+        c.closing = true;
+        if (!c.connecting)
+            flush_conn(r.conn, c);
+        return;
+    }
+    c.out.append(r.data, r.len);
+    parse_tx(c, r.data, r.len, now);
+    if (!c.connecting)
+        flush_conn(r.conn, c);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || (argc < 4 && strcmp(argv[2], "--info") != 0))
+    {
+        std::cerr << "Usage: " << argv[0] << " <trace> --info | <trace> <ip> <port> [speed|max]" << std::endl;
+        return 1;
+    }
+    std::vector<Record> records;
+    if (!load_trace(argv[1], records))
+        return 1;
+    print_info(records);
+    if (strcmp(argv[2], "--info") == 0)
+        return 0;
+    ip = argv[2];
+    port = atoi(argv[3]);
+    std::string speed_name = argc > 4 ? argv[4] : "1";
+    double speed = 1;
+    if (argc > 4)
+        speed = strcmp(argv[4], "max") == 0 ? 0 : atof(argv[4]);
+    if (speed < 0)
+        speed = 1;
+    epfd = epoll_create1(0);
+
+    int64_t begin = now_us();
+    int64_t last_active = begin;  // 最后一次发出记录或收到数据
+    int64_t last_sweep = begin;
+    size_t next = 0;
+    struct epoll_event events[256];
+    while (true)
+    {
+        // **1. 发出到时间的记录，积压太多的连接先等它写出**
+        int64_t now = now_us();
+        size_t batch = 0;
+        while (next < records.size() && batch < BATCH)
+        {
+            const Record &r = records[next];
+            int64_t due = speed == 0 ? now : begin + (int64_t)(r.t_us / speed);
+            if (due > now)
+                break;
+            auto it = conns.find(r.conn);
+            if (it != conns.end() && it->second.out.size() - it->second.out_pos > OUT_LIMIT)
+                break;
+            lag.add(now - due);
+            apply(r, now);
+            last_active = now;
+            next++;
+            batch++;
+        }
+        if (next == records.size() && (conns.empty() || now - last_active > DRAIN_IDLE_US))
+            break;
+
+        // **2. 等到下一条记录的时间或有读写事件**
+        int timeout = 100;
+        if (next < records.size() && speed != 0)
+        {
+            int64_t due = begin + (int64_t)(records[next].t_us / speed);
+            timeout = (int)std::min<int64_t>(100, std::max<int64_t>(0, (due - now + 999) / 1000));
+        }
+        else if (next < records.size() && batch == BATCH)
+            timeout = 0;
+        int n = epoll_wait(epfd, events, 256, timeout);
+        now = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            auto f = fd_conn.find(events[i].data.fd);
+            if (f == fd_conn.end())
+                continue;
+            uint32_t id = f->second;
+            Conn &c = conns[id];
+            if (c.connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0)
+                {
+                    connect_errors++;
+                    drop_conn(id);
+                    continue;
+                }
+                c.connecting = false;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                flush_conn(id, c);
+                if (!conns.count(id))
+                    continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                last_active = now;
+                read_conn(id, c, now);
+            }
+        }
+
+        // **3. 太久没送达的消息不再等**
+        if (now - last_sweep > 1000000)
+        {
+            last_sweep = now;
+            for (auto it = pending.begin(); it != pending.end();)
+                it = now - it->second > PENDING_TTL_US ? pending.erase(it) : std::next(it);
+        }
+    }
+    double seconds = (now_us() - begin) / 1e6;
+    while (!conns.empty())
+        drop_conn(conns.begin()->first);
+
+    printf("回放: 速度 %s, 用时 %.2f s, %zu 条记录 (%.0f 条/s)\n", speed_name.c_str(), seconds,
+           records.size(), records.size() / seconds);
+    printf("发送 %.2f MB (%.2f MB/s), 接收 %.2f MB (%.2f MB/s)\n", bytes_sent / 1048576.0, bytes_sent / 1048576.0 / seconds,
+           bytes_received / 1048576.0, bytes_received / 1048576.0 / seconds);
+    printf("连接失败 %llu, 异常断开 %llu, 聊天消息 %llu 条\n", (unsigned long long)connect_errors, (unsigned long long)resets,
+           (unsigned long long)messages_sent);
+    lag.print("发送滞后(相对计划时间)");
+    delivery.print("聊天送达延迟(每个接收连接各算一次)");
+    return 0;
+}
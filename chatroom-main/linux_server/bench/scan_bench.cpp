@@ -0,0 +1,116 @@
+// 编译: g++ -std=c++17 -O2 scan_bench.cpp ../scan.cpp -o scan_bench
+// 接收缓冲区扫描的微基准: 一个装满短消息的缓冲区，对比原来逐条 find/substr 的做法和 scan.h 的整块扫描
+// 每种实现(avx2 / sse4.2 / scalar)分别测找分隔符、校验 UTF-8 和完整的切分 + 校验，memcpy 作为内存带宽的参考
+// 用法: ./scan_bench [缓冲区 KB] [重复次数]
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include "../scan.h"
+
+static volatile size_t sink;
+
+// 跑 rounds 遍 fn，返回 GB/s
+template <typename F>
+static double measure(size_t bytes, int rounds, F fn)
+{
+    fn();  // 预热
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+        fn();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (double)bytes * rounds / seconds / 1e9;
+}
+
+// 聊天里常见的消息: "[用户名]: 内容"，中英文混合，每条以 '\0' 结尾
+static std::string make_buffer(size_t size)
+{
+    static const char *words[] = {"hello", "ok", "文件", "下载完了", "test", "谢谢", "see you", "🙂", "meeting at 3pm", "好的"};
+    std::mt19937 rng(1);
+    std::string buf;
+    while (buf.size() < size)
+    {
+        std::string msg = "[user" + std::to_string(rng() % 100) + "]: ";
+        int n = 1 + rng() % 6;
+        for (int i = 0; i < n; i++)
+            msg += std::string(words[rng() % 10]) + " ";
+        if (buf.size() + msg.size() + 1 > size)
+            break;
+        buf += msg;
+        buf.push_back('\0');
+    }
+    buf.resize(size, 'x');
+    return buf;
+}
+
+// 原来的做法: 每条消息 find + substr 出一个 std::string 再比较，不校验 UTF-8
+static size_t old_path(const std::string &buf)
+{
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        size_t end = buf.find('\0', pos);
+        if (end == std::string::npos)
+            end = buf.size();
+        std::string message = buf.substr(pos, end - pos);
+        if (message.compare("USERLIST") != 0)
+            count++;
+        pos = end + 1;
+    }
+    return count;
+}
+
+// 新的做法: 一次找出所有分隔符、一次校验整个缓冲区，消息直接指向缓冲区
+static size_t new_path(const std::string &buf, std::vector<uint32_t> &ends)
+{
+    ends.clear();
+    scan_split(buf.data(), buf.size(), '\0', ends);
+    if (!utf8_valid(buf.data(), buf.size()))
+        return 0;
+    size_t count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= ends.size(); i++)
+    {
+        size_t end = i < ends.size() ? ends[i] : buf.size();
+        if (end > start && !(end - start == 8 && memcmp(buf.data() + start, "USERLIST", 8) == 0))
+            count++;
+        start = end + 1;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? atoi(argv[1]) : 64) * 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+    std::string buf = make_buffer(size);
+    std::string plain(size, 'a');  // 没有分隔符、全是 ASCII
+    std::string copy(size, '\0');
+    std::vector<uint32_t> ends;
+    ends.reserve(size);
+
+    std::cout << "buffer " << size / 1024 << " KB, " << old_path(buf) << " messages, default impl " << scan_impl() << std::endl;
+    std::cout << "memcpy           " << measure(size, rounds, [&] { memcpy(&copy[0], buf.data(), size); sink = copy[size / 2]; }) << " GB/s" << std::endl;
+    std::cout << "old find/substr  " << measure(size, rounds, [&] { sink = old_path(buf); }) << " GB/s" << std::endl;
+
+    const char *impls[] = {"avx2", "sse4.2", "scalar"};
+    for (const char *impl : impls)
+    {
+        if (!scan_force(impl))
+        {
+            std::cout << impl << ": not supported" << std::endl;
+            continue;
+        }
+        std::cout << impl << std::endl;
+        std::cout << "  split          " << measure(size, rounds, [&] { ends.clear(); sink = scan_split(buf.data(), size, '\0', ends); }) << " GB/s" << std::endl;
+        std::cout << "  find (none)    " << measure(size, rounds, [&] { sink = scan_find(plain.data(), size, '\0'); }) << " GB/s" << std::endl;
+        std::cout << "  utf8 mixed     " << measure(size, rounds, [&] { sink = utf8_valid(buf.data(), size); }) << " GB/s" << std::endl;
+        std::cout << "  utf8 ascii     " << measure(size, rounds, [&] { sink = utf8_valid(plain.data(), size); }) << " GB/s" << std::endl;
+        std::cout << "  split + utf8   " << measure(size, rounds, [&] { sink = new_path(buf, ends); }) << " GB/s" << std::endl;
+    }
+    return 0;
+}
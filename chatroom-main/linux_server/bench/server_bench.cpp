@@ -0,0 +1,196 @@
+// 编译: 先在上一级目录按 server.cpp 第一行的命令编出 libchatserver.a，再 g++ -std=c++20 -O2 server_bench.cpp ../libchatserver.a -o server_bench -lbenchmark -lpthread -lssl -lcrypto -lz
+// 服务器内部热点的微基准(Google Benchmark)，在进程内直接调用 server.cpp 的函数，链接和服务器相同的 libchatserver.a:
+//   ParseTransfer   handle_client 里传输命令的解析
+//   ChatBuffer      handle_chat_buffer: 拆分、校验、分派一次读到的多条聊天消息(没有在线用户，不含广播)
+//   Broadcast       send_msg_all 发给 N 个假客户端(socketpair 的一端登记在反应器上)，分普通、多路复用和压缩三种能力
+//   UserList        broadcast_userlist 拼 N 个用户的列表(fd 都是无效的，几乎不含发送)
+//   Registry        多个线程在同一把锁下登记/删除在线用户
+// 服务器的日志由后台线程写到标准输出，测量时把标准输出换成 /dev/null，结果写到原来的标准输出
+// 输出 JSON 便于在提交之间对比:
+//   ./server_bench --benchmark_out=before.json --benchmark_out_format=json
+//   (benchmark 源码里的 tools/compare.py benchmarks before.json after.json)
+#include <benchmark/benchmark.h>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "../server.h"
+#include "../compress.h"
+#include "../reactor.h"
+#include "../log.h"
+
+// 假客户端: 服务器端登记在反应器上，对端定期读空，发送队列不会积压
+struct Sinks
+{
+    std::vector<int> peers;
+    std::vector<AsyncSock *> socks;
+
+    Sinks(int n, unsigned caps)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) != 0)
+            {
+                perror("socketpair");
+                exit(EXIT_FAILURE);
+            }
+            socks.push_back(new AsyncSock(sv[0]));
+            peers.push_back(sv[1]);
+            (*map_clients)[sv[0]] = "127.0.0.1:bench" + std::to_string(i);
+            (*map_caps)[sv[0]] = caps;
+        }
+    }
+    ~Sinks()
+    {
+        for (size_t i = 0; i < socks.size(); i++)
+        {
+            int fd = socks[i]->fd();
+            map_clients->erase(fd);
+            map_caps->erase(fd);
+            delete socks[i];
+            close(fd);
+            close(peers[i]);
+        }
+    }
+    void drain()
+    {
+        static char buf[256 * 1024];
+        for (int fd : peers)
+            while (read(fd, buf, sizeof(buf)) > 0)
+                ;
+    }
+};
+
+static void ParseTransfer(benchmark::State& state)
+{
+    std::vector<std::string> messages = {
+        "UPLOAD report-2024.pdf 1048576\n" + std::string(4000, 'x'),
+        "ZUPLOAD backup.tar 73400320\n" + std::string(4000, 'x'),
+        "DOWNLOAD holiday photos.zip",
+        "ZDOWNLOAD big.bin",
+        "DELTA notes.txt 2097152\n",
+        "[alice]: not a transfer command",
+    };
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        TransferRequest request = parse_transfer_request(messages[i++ % messages.size()]);
+        benchmark::DoNotOptimize(request);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(ParseTransfer);
+
+static void ChatBuffer(benchmark::State& state)
+{
+    // 一次读到的 state.range(0) 条消息，中英文混合，每条以 '\0' 结尾
+    std::string buf;
+    for (int i = 0; i < state.range(0); i++)
+    {
+        buf += "[user" + std::to_string(i % 7) + "]: 下午三点开会 meeting at 3pm #" + std::to_string(i);
+        buf.push_back('\0');
+    }
+    std::vector<char> work(buf.size() + 1);
+    bool name_saved = true;
+    for (auto _ : state)
+    {
+        memcpy(work.data(), buf.data(), buf.size());
+        work[buf.size()] = '\0';
+        handle_chat_buffer(-1, work.data(), buf.size(), name_saved);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(ChatBuffer)->Arg(1)->Arg(16)->Arg(256);
+
+// range(0): 客户端数，range(1): 能力位，range(2): 消息长度
+static void Broadcast(benchmark::State& state)
+{
+    Sinks sinks(state.range(0), (unsigned)state.range(1));
+    std::string msg(state.range(2), 'm');
+    // 接近真实聊天: 压缩数据按内容有一定重复
+    for (size_t i = 0; i < msg.size(); i++)
+        msg[i] = "hello world, 你好 "[i % 18];
+    msg.push_back('\0');
+    int64_t n = 0;
+    for (auto _ : state)
+    {
+        send_msg_all((void*)msg.data(), msg.size());
+        if (++n % 64 == 0)
+        {
+            state.PauseTiming();
+            sinks.drain();
+            state.ResumeTiming();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * state.range(0) * msg.size());
+}
+BENCHMARK(Broadcast)
+    ->ArgNames({"clients", "caps", "len"})
+    ->Args({1, 0, 64})
+    ->Args({16, 0, 64})
+    ->Args({256, 0, 64})
+    ->Args({256, CAP_MUX, 64})
+    ->Args({256, CAP_ZLIB, 2048});
+
+static void UserList(benchmark::State& state)
+{
+    // 没有打开的 fd 号，发送时在 fd 检查处就返回
+    for (int i = 0; i < state.range(0); i++)
+        (*map_clients)[1000000 + i] = "10.0.0." + std::to_string(i % 250) + ":user" + std::to_string(i);
+    for (auto _ : state)
+        broadcast_userlist();
+    for (int i = 0; i < state.range(0); i++)
+        map_clients->erase(1000000 + i);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(UserList)->Arg(10)->Arg(100)->Arg(1000);
+
+// 和 accept_loop / 连接清理一样: 加锁、登记(或删除)、解锁；每个线程用自己的一段 fd 号
+static void Registry(benchmark::State& state)
+{
+    int base = 2000000 + state.thread_index() * 100000;
+    int i = 0;
+    for (auto _ : state)
+    {
+        int fd = base + (i++ % 1024);
+        pthread_mutex_lock(&mutex);
+        map_clients->insert(std::pair<int, std::string>(fd, "192.168.1.20"));
+        (*map_caps)[fd] = CAP_ZLIB | CAP_PING;
+        pthread_mutex_unlock(&mutex);
+        pthread_mutex_lock(&mutex);
+        map_clients->erase(fd);
+        map_caps->erase(fd);
+        pthread_mutex_unlock(&mutex);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(Registry)->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+int main(int argc, char** argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    server_init();
+    reactor_init();
+    // 服务器的日志打到 /dev/null，基准结果写到原来的标准输出
+    fflush(stdout);
+    int out_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    log_start(STDOUT_FILENO);
+    std::ofstream out("/proc/self/fd/" + std::to_string(out_fd));
+    benchmark::BenchmarkReporter* display = benchmark::CreateDefaultDisplayReporter();
+    display->SetOutputStream(&out);
+    benchmark::RunSpecifiedBenchmarks(display);
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,174 @@
+// 编译: g++ -std=c++17 -O2 tls_bench.cpp -o tls_bench -lssl -lcrypto
+// 本地测试 TLS 模式下的握手速率(完整握手 / 会话复用)和加密下载吞吐量
+// 用法: ./tls_bench <ip> <port> <服务器上的文件名> [握手次数] [下载次数]
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <chrono>
+#include <string>
+
+static const char *ip;
+static int port;
+
+static int tcp_connect()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror("connect() error");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+static SSL *tls_connect(SSL_CTX *ctx, SSL_SESSION *session, int &sock)
+{
+    sock = tcp_connect();
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, sock);
+    if (session)
+        SSL_set_session(ssl, session);
+    if (SSL_connect(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+    return ssl;
+}
+
+static void tls_close(SSL *ssl, int sock)
+{
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(sock);
+}
+
+// TLS 1.3 的票据只能用一次，服务器在握手后下发新票据，非阻塞读一次把它收下来
+static SSL_SESSION *next_session(SSL *ssl, int sock, SSL_SESSION *old)
+{
+    char c;
+    struct pollfd pfd = {sock, POLLIN, 0};
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (poll(&pfd, 1, 100) > 0)
+        SSL_read(ssl, &c, 1);
+    SSL_SESSION *session = SSL_get1_session(ssl);
+    SSL_SESSION_free(old);
+    return session;
+}
+
+// 下载一次文件，返回收到的字节数
+static size_t download(SSL_CTX *ctx, SSL_SESSION *session, const char *filename, SSL_SESSION **out_session)
+{
+    int sock;
+    SSL *ssl = tls_connect(ctx, session, sock);
+    std::string request = std::string("DOWNLOAD ") + filename;
+    SSL_write(ssl, request.c_str(), request.size());
+
+    char buf[65536];
+    std::string header;
+    size_t file_size = 0, received = 0;
+    bool got_size = false;
+    int n;
+    while ((n = SSL_read(ssl, buf, sizeof(buf))) > 0)
+    {
+        if (!got_size)
+        {
+            header.append(buf, n);
+            size_t nl = header.find('\n');
+            if (nl == std::string::npos)
+                continue;
+            if (header.compare(0, 5, "ERROR") == 0)
+            {
+                fprintf(stderr, "server cannot find %s\n", filename);
+                exit(EXIT_FAILURE);
+            }
+            got_size = true;
+            file_size = strtoull(header.c_str(), NULL, 10);
+            received = header.size() - nl - 1;
+        }
+        else
+        {
+            received += n;
+        }
+        if (got_size && received >= file_size)
+            break;
+    }
+    if (out_session)
+        *out_session = SSL_get1_session(ssl);
+    tls_close(ssl, sock);
+    return received;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <ip> <port> <filename> [handshakes] [downloads]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    ip = argv[1];
+    port = atoi(argv[2]);
+    const char *filename = argv[3];
+    int handshakes = argc > 4 ? atoi(argv[4]) : 500;
+    int downloads = argc > 5 ? atoi(argv[5]) : 5;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    // **1. 完整握手**
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < handshakes; i++)
+    {
+        int sock;
+        SSL *ssl = tls_connect(ctx, NULL, sock);
+        tls_close(ssl, sock);
+    }
+    double full = seconds_since(start);
+    printf("full handshake:    %8.1f /s  (%d in %.3f s)\n", handshakes / full, handshakes, full);
+
+    // **2. 会话票据复用，TLS 1.3 的票据在握手后才下发，先完整下载一次拿到票据**
+    SSL_SESSION *session = NULL;
+    download(ctx, NULL, filename, &session);
+    int reused = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < handshakes; i++)
+    {
+        int sock;
+        SSL *ssl = tls_connect(ctx, session, sock);
+        reused += SSL_session_reused(ssl);
+        session = next_session(ssl, sock, session);
+        tls_close(ssl, sock);
+    }
+    double resumed = seconds_since(start);
+    printf("resumed handshake: %8.1f /s  (%d/%d reused)\n", handshakes / resumed, reused, handshakes);
+
+    // **3. 加密下载吞吐量**
+    size_t total = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < downloads; i++)
+        total += download(ctx, session, filename, NULL);
+    double elapsed = seconds_since(start);
+    printf("download:          %8.1f MB/s  (%zu bytes in %.3f s)\n", total / elapsed / (1024 * 1024), total, elapsed);
+
+    SSL_SESSION_free(session);
+    SSL_CTX_free(ctx);
+    return 0;
+}
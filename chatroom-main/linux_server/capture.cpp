@@ -0,0 +1,143 @@
+#include "capture.h"
+#include "log.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+
+static int trace_fd = -1;
+static std::string pending;
+static int64_t last_us;
+static int64_t last_flush_us;
+static uint32_t next_conn = 1;
+static uint64_t written;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_varint(std::string &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+// 记录头: 类型、距上一条的时间、连接号
+static void put_record(char type, uint32_t conn)
+{
+    int64_t now = now_us();
+    pending.push_back(type);
+    put_varint(pending, now - last_us);
+    put_varint(pending, conn);
+    last_us = now;
+}
+
+static void maybe_flush()
+{
+    if (pending.size() >= CAPTURE_FLUSH_SIZE || last_us - last_flush_us >= CAPTURE_FLUSH_MS * 1000)
+        capture_flush();
+}
+
+bool capture_start(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+    {
+        log_error("capture open() error: %s", strerror(errno));
+        return false;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t start_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    pending = CAPTURE_MAGIC;
+    pending.push_back(CAPTURE_VERSION);
+    for (int i = 7; i >= 0; i--)
+        pending.push_back((char)(start_ms >> (i * 8)));
+    last_us = last_flush_us = now_us();
+    capture_flush();
+    log_info("Capturing client traffic to %s", path);
+    return trace_fd != -1;
+}
+
+bool capture_enabled()
+{
+    return trace_fd != -1;
+}
+
+uint32_t capture_conn_open()
+{
+    if (trace_fd == -1)
+        return 0;
+    uint32_t conn = next_conn++;
+    put_record(CAPTURE_OPEN, conn);
+    maybe_flush();
+    return conn;
+}
+
+void capture_data(uint32_t conn, const void *data, size_t len)
+{
+    if (conn == 0 || trace_fd == -1 || len == 0)
+        return;
+    put_record(CAPTURE_DATA, conn);
+    put_varint(pending, len);
+    pending.append((const char *)data, len);
+    maybe_flush();
+}
+
+void capture_conn_close(uint32_t conn)
+{
+    if (conn == 0 || trace_fd == -1)
+        return;
+    put_record(CAPTURE_CLOSE, conn);
+    maybe_flush();
+}
+
+// 在反应器线程上直接写: 一次最多几百 KB，只进页缓存
+void capture_flush()
+{
+    last_flush_us = now_us();
+    if (trace_fd == -1 || pending.empty())
+        return;
+    size_t off = 0;
+    while (off < pending.size())
+    {
+        ssize_t n = write(trace_fd, pending.data() + off, pending.size() - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            log_error("capture write() error: %s", strerror(errno));
+            close(trace_fd);
+            trace_fd = -1;
+            break;
+        }
+        off += n;
+    }
+    written += off;
+    pending.clear();
+    if (trace_fd != -1 && written >= CAPTURE_MAX_BYTES)
+    {
+        log_info("Capture file reached %llu bytes, capture stopped", (unsigned long long)written);
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+void capture_stop()
+{
+    capture_flush();
+    if (trace_fd != -1)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
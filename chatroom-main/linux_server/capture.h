@@ -0,0 +1,41 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 流量录制: 把客户端连接上收到的每一块数据连同时间和连接号写进一个二进制轨迹文件
+// bench/replay.cpp 按原来的节奏(或加速)把轨迹重新发给服务器，用真实的负载形状比较每次改动
+// 录的是解密后的明文(TLS 在 socket 层之下)，回放时连不开 TLS 的服务器
+//
+// 轨迹文件: "CTRC" + 1 字节版本 + 8 字节大端开始时间(Unix 毫秒)，之后每条记录:
+//   1 字节类型 | 变长整数: 距上一条记录的微秒数 | 变长整数: 连接号 | 'D' 时再加变长整数长度 + 数据
+//   'O' 新连接，'D' 收到的数据，'C' 连接结束
+// 变长整数每字节 7 位、低位在前，最高位表示后面还有；连接号从 1 开始依次分配，不随 fd 复用
+// 记录先攒在内存里，攒够 CAPTURE_FLUSH_SIZE 或每 CAPTURE_FLUSH_MS 写一次文件
+
+#define CAPTURE_MAGIC "CTRC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 13
+#define CAPTURE_OPEN 'O'
+#define CAPTURE_DATA 'D'
+#define CAPTURE_CLOSE 'C'
+
+#define CAPTURE_FLUSH_SIZE (256 * 1024)
+#define CAPTURE_FLUSH_MS 1000
+#define CAPTURE_MAX_BYTES (1024ULL * 1024 * 1024)  // 文件超过这个大小停止录制，不会写满磁盘
+
+// 开始录制，在反应器启动前调用
+bool capture_start(const char *path);
+bool capture_enabled();
+// 登记一个新的客户端连接，返回连接号；没有在录制时返回 0
+uint32_t capture_conn_open();
+// conn 为 0 时什么都不做
+void capture_data(uint32_t conn, const void *data, size_t len);
+void capture_conn_close(uint32_t conn);
+// 把攒着的记录写进文件
+void capture_flush();
+// 写完剩下的记录并关闭文件，之后不再录制
+void capture_stop();
+
+#endif // CAPTURE_H
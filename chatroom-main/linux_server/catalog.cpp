@@ -0,0 +1,362 @@
+#include "catalog.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <map>
+
+#define CATALOG_MAGIC "CCAT"
+#define CATALOG_VERSION 1
+#define CATALOG_HEADER_SIZE 8
+#define CATALOG_SHA_SIZE 32
+
+static std::string store_dir = ".";
+static int index_fd = -1;
+static std::map<std::string, CatalogEntry> entries;
+
+static void put_be(std::string &out, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        out.push_back((char)(v >> (i * 8)));
+}
+
+static uint64_t get_be(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static std::string hex_to_raw(const std::string &hex)
+{
+    std::string raw(CATALOG_SHA_SIZE, '\0');
+    for (size_t i = 0; i < CATALOG_SHA_SIZE && i * 2 + 1 < hex.size(); i++)
+    {
+        unsigned v = 0;
+        sscanf(hex.c_str() + i * 2, "%2x", &v);
+        raw[i] = (char)v;
+    }
+    return raw;
+}
+
+static std::string raw_to_hex(const unsigned char *raw)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (int i = 0; i < CATALOG_SHA_SIZE; i++)
+    {
+        hex.push_back(digits[raw[i] >> 4]);
+        hex.push_back(digits[raw[i] & 0xf]);
+    }
+    return hex;
+}
+
+static std::string encode_record(const CatalogEntry &entry)
+{
+    std::string body;
+    put_be(body, entry.size, 8);
+    put_be(body, (uint64_t)entry.mtime, 8);
+    body += hex_to_raw(entry.sha256);
+    put_be(body, entry.name.size(), 2);
+    body += entry.name;
+    std::string uploader = entry.uploader.substr(0, 0xffff);
+    put_be(body, uploader.size(), 2);
+    body += uploader;
+    uLong crc = crc32(0L, (const Bytef *)body.data(), body.size());
+
+    std::string record;
+    put_be(record, body.size() + 4, 4);
+    record += body;
+    put_be(record, crc, 4);
+    return record;
+}
+
+// 解析一条记录，不完整或校验失败返回 0，否则返回占用的字节数
+static size_t decode_record(const unsigned char *p, size_t avail, CatalogEntry &entry)
+{
+    if (avail < 4)
+        return 0;
+    size_t len = get_be(p, 4);
+    size_t fixed = 8 + 8 + CATALOG_SHA_SIZE + 2 + 2 + 4;
+    if (len < fixed || len > avail - 4)
+        return 0;
+    const unsigned char *body = p + 4;
+    size_t body_len = len - 4;
+    if (crc32(0L, body, body_len) != get_be(body + body_len, 4))
+        return 0;
+
+    entry.size = get_be(body, 8);
+    entry.mtime = (int64_t)get_be(body + 8, 8);
+    entry.sha256 = raw_to_hex(body + 16);
+    size_t pos = 16 + CATALOG_SHA_SIZE;
+    size_t name_len = get_be(body + pos, 2);
+    pos += 2;
+    if (pos + name_len + 2 > body_len)
+        return 0;
+    entry.name.assign((const char *)body + pos, name_len);
+    pos += name_len;
+    size_t uploader_len = get_be(body + pos, 2);
+    pos += 2;
+    if (pos + uploader_len != body_len)
+        return 0;
+    entry.uploader.assign((const char *)body + pos, uploader_len);
+    return 4 + len;
+}
+
+static std::string header()
+{
+    std::string h = CATALOG_MAGIC;
+    put_be(h, CATALOG_VERSION, 4);
+    return h;
+}
+
+static bool write_all(int fd, const std::string &data)
+{
+    size_t off = 0;
+    while (off < data.size())
+    {
+        ssize_t n = write(fd, data.data() + off, data.size() - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+// 索引被几个节点共用时，另一个节点压缩后 path 换成了新文件，fd 还指着旧的
+static bool index_replaced(int fd, const std::string &path)
+{
+    struct stat fd_st, path_st;
+    if (fstat(fd, &fd_st) != 0 || stat(path.c_str(), &path_st) != 0)
+        return false;
+    return fd_st.st_dev != path_st.st_dev || fd_st.st_ino != path_st.st_ino;
+}
+
+// 打开索引并拿到排它的 flock，拿到锁时已经被换掉的话重新打开
+static int open_locked(const std::string &path, int flags)
+{
+    while (true)
+    {
+        int fd = open(path.c_str(), flags, 0644);
+        if (fd == -1)
+            return -1;
+        if (flock(fd, LOCK_EX) != 0)
+            return fd;  // 不支持 flock 的文件系统上只能不加锁
+        if (!index_replaced(fd, path))
+            return fd;
+        close(fd);
+    }
+}
+
+// 追加一条记录: 拿着锁写，其他节点压缩时不会写进被换掉的旧文件
+static bool append_record(const std::string &record)
+{
+    std::string path = catalog_path(CATALOG_INDEX);
+    if (flock(index_fd, LOCK_EX) == 0 && index_replaced(index_fd, path))
+    {
+        close(index_fd);
+        index_fd = open_locked(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (index_fd == -1)
+            return false;
+    }
+    bool ok = write_all(index_fd, record);
+    flock(index_fd, LOCK_UN);
+    return ok;
+}
+
+// 只保留每个文件的最新记录，写到临时文件后改名替换
+// 调用时拿着旧索引的锁，其他节点的写入等改名之后写进新文件
+static bool rewrite_index(const std::string &path)
+{
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+    std::string data = header();
+    for (auto it = entries.begin(); it != entries.end(); it++)
+        data += encode_record(it->second);
+    bool ok = write_all(fd, data) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool catalog_open(const char *dir)
+{
+    store_dir = dir;
+    while (store_dir.size() > 1 && store_dir.back() == '/')
+        store_dir.pop_back();
+    if (mkdir(store_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        log_error("catalog mkdir() error: %s", strerror(errno));
+        return false;
+    }
+
+    std::string path = catalog_path(CATALOG_INDEX);
+    // 载入和压缩期间拿着锁，共用索引的其他节点不会在中间追加
+    int fd = open_locked(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log_error("catalog open() error: %s", strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    size_t good_end = 0;
+    size_t records = 0;
+    if (size == 0)
+    {
+        if (!write_all(fd, header()))
+        {
+            close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        void *map = size >= CATALOG_HEADER_SIZE ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED || memcmp(map, header().data(), CATALOG_HEADER_SIZE) != 0)
+        {
+            log_warn("catalog: %s is not a catalog index", path.c_str());
+            if (map != MAP_FAILED)
+                munmap(map, size);
+            close(fd);
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        const unsigned char *data = (const unsigned char *)map;
+        good_end = CATALOG_HEADER_SIZE;
+        while (good_end < size)
+        {
+            CatalogEntry entry;
+            size_t used = decode_record(data + good_end, size - good_end, entry);
+            if (used == 0)
+                break;
+            entries[entry.name] = entry;
+            good_end += used;
+            records++;
+        }
+        munmap(map, size);
+        if (good_end < size)
+        {
+            log_warn("catalog: discarding %zu bytes of incomplete records", size - good_end);
+            if (ftruncate(fd, good_end) != 0)
+                log_error("catalog ftruncate() error: %s", strerror(errno));
+        }
+    }
+    index_fd = fd;
+
+    // 同一个文件上传过很多次时索引里大部分是旧记录，启动时压缩一次
+    if (records > 2 * entries.size() + 64)
+    {
+        if (rewrite_index(path))
+        {
+            close(index_fd);
+            index_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        }
+        else
+            log_error("catalog rewrite error: %s", strerror(errno));
+    }
+    if (index_fd != -1)
+        flock(index_fd, LOCK_UN);
+    log_info("Catalog: %zu files in %s", entries.size(), store_dir.c_str());
+    return index_fd != -1;
+}
+
+bool catalog_valid_name(const std::string &name)
+{
+    if (name.empty() || name.size() > CATALOG_NAME_MAX || name[0] == '.')
+        return false;
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        unsigned char c = name[i];
+        if (c <= ' ' || c == 0x7f || c == '/' || c == '\\')
+            return false;
+    }
+    return true;
+}
+
+bool catalog_valid_path(const std::string &name)
+{
+    if (name.empty() || name.size() > CATALOG_NAME_MAX)
+        return false;
+    size_t start = 0;
+    for (int depth = 0; depth < CATALOG_DEPTH_MAX; depth++)
+    {
+        size_t slash = name.find('/', start);
+        if (!catalog_valid_name(name.substr(start, slash - start)))
+            return false;
+        if (slash == std::string::npos)
+            return true;
+        start = slash + 1;
+    }
+    return false;
+}
+
+bool catalog_make_parents(const std::string &name)
+{
+    for (size_t slash = name.find('/'); slash != std::string::npos; slash = name.find('/', slash + 1))
+    {
+        std::string dir = catalog_path(name.substr(0, slash));
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+std::string catalog_path(const std::string &name)
+{
+    if (store_dir == ".")
+        return name;
+    return store_dir + "/" + name;
+}
+
+void catalog_put(const CatalogEntry &entry, bool persist)
+{
+    entries[entry.name] = entry;
+    // 一条记录一次 write，O_APPEND 下多个节点共用索引也不会交错
+    // 不单独 fsync: 文件本身已经落盘，索引丢最后几条时重新上传即可
+    if (persist && index_fd != -1 && !append_record(encode_record(entry)))
+        log_error("catalog write() error: %s", strerror(errno));
+}
+
+bool catalog_stat(const std::string &name, CatalogEntry &entry)
+{
+    auto it = entries.find(name);
+    if (it == entries.end())
+        return false;
+    entry = it->second;
+    return true;
+}
+
+bool catalog_list(const std::string &after, size_t limit, std::vector<CatalogEntry> &out)
+{
+    auto it = after.empty() ? entries.begin() : entries.upper_bound(after);
+    for (; it != entries.end() && out.size() < limit; it++)
+        out.push_back(it->second);
+    return it != entries.end();
+}
+
+size_t catalog_size()
+{
+    return entries.size();
+}
@@ -0,0 +1,53 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// 文件目录: 上传的文件都放在存储目录里，另有一个索引文件记录每个文件的元数据
+// 索引只追加: 每次上传完成追加一条记录，同名的新记录覆盖旧记录
+// 启动时 mmap 索引按顺序读一遍，不扫描目录；无效记录太多时重写一次
+// 多个节点共用索引时，追加和重写都拿着索引的 flock；重写换了文件后，其他节点下次追加前发现并重新打开
+// 内存里按文件名排序，STAT 和分页 LIST 都是 O(log n)
+//
+// 索引文件: "CCAT" + 4 字节版本，之后每条记录:
+//   4 字节长度 | 8 字节大小 | 8 字节时间 | 32 字节 SHA-256 | 2 字节长度 + 文件名 | 2 字节长度 + 上传者 | 4 字节 CRC32
+// 整数都是大端；CRC 不对或不完整的尾部记录(写到一半时进程退出)丢弃
+
+#define CATALOG_INDEX ".catalog"
+#define CATALOG_NAME_MAX 255
+#define CATALOG_DEPTH_MAX 8
+#define CATALOG_PAGE_DEFAULT 50
+#define CATALOG_PAGE_MAX 200
+
+struct CatalogEntry
+{
+    std::string name;
+    uint64_t size = 0;
+    std::string sha256;    // 十六进制
+    std::string uploader;  // "ip" 或 "ip:用户名"
+    int64_t mtime = 0;     // 上传完成的时间，秒
+};
+
+// 打开存储目录(不存在时创建)并载入索引，在反应器启动前调用
+bool catalog_open(const char *dir);
+// 文件名只能是存储目录下的一个普通名字: 不含 '/'、空白和控制字符，不以 '.' 开头
+bool catalog_valid_name(const std::string &name);
+// 文件夹上传的文件: "目录/子目录/文件"，每一级都要满足 catalog_valid_name，最多 CATALOG_DEPTH_MAX 级
+// 下载时接受这种名字，普通上传仍然只接受 catalog_valid_name
+bool catalog_valid_path(const std::string &name);
+// 文件名在存储目录下的路径
+std::string catalog_path(const std::string &name);
+// 建好 name 在存储目录下的各级上级目录
+bool catalog_make_parents(const std::string &name);
+
+// 登记一个上传完成的文件；persist 为 false 只更新内存(其他节点已经写了共用的索引)
+void catalog_put(const CatalogEntry &entry, bool persist = true);
+bool catalog_stat(const std::string &name, CatalogEntry &entry);
+// 按文件名排序，取 after 之后的最多 limit 个，返回后面是否还有
+bool catalog_list(const std::string &after, size_t limit, std::vector<CatalogEntry> &entries);
+size_t catalog_size();
+
+#endif // CATALOG_H
@@ -0,0 +1,166 @@
+#include "compress.h"
+#include <zlib.h>
+#include <sstream>
+#include <stdint.h>
+
+// 追求低延迟，局域网下压缩耗时不能超过节省的传输时间
+#define ZLIB_LEVEL Z_BEST_SPEED
+// 单帧解压上限，防止伪造的长度头耗尽内存
+#define ZLIB_MAX_UNPACK (16 * 1024 * 1024)
+
+static void put_be32(std::string &out, uint32_t v)
+{
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+static uint32_t get_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+unsigned parse_caps(const std::string &line)
+{
+    std::istringstream iss(line);
+    std::string word;
+    unsigned caps = 0;
+    iss >> word; // "CAPS"
+    while (iss >> word)
+    {
+        if (word == "zlib")
+            caps |= CAP_ZLIB;
+        else if (word == "mux")
+            caps |= CAP_MUX;
+        else if (word == "ping")
+            caps |= CAP_PING;
+        else if (word == "p2p")
+            caps |= CAP_P2P;
+        else if (word == "resume")
+            caps |= CAP_RESUME;
+    }
+    return caps;
+}
+
+std::string caps_string(unsigned caps)
+{
+    std::string str = "CAPS";
+    if (caps & CAP_ZLIB)
+        str += " zlib";
+    if (caps & CAP_MUX)
+        str += " mux";
+    if (caps & CAP_PING)
+        str += " ping";
+    if (caps & CAP_P2P)
+        str += " p2p";
+    if (caps & CAP_RESUME)
+        str += " resume";
+    return str;
+}
+
+bool zlib_pack(const char *src, size_t len, std::string &out)
+{
+    uLongf dest_len = compressBound(len);
+    out.resize(4 + dest_len);
+    out[0] = (char)(len >> 24);
+    out[1] = (char)(len >> 16);
+    out[2] = (char)(len >> 8);
+    out[3] = (char)len;
+    if (compress2((Bytef *)&out[4], &dest_len, (const Bytef *)src, len, ZLIB_LEVEL) != Z_OK)
+        return false;
+    out.resize(4 + dest_len);
+    return true;
+}
+
+bool zlib_unpack(const char *src, size_t len, std::string &out)
+{
+    if (len < 4)
+        return false;
+    uLongf dest_len = get_be32(src);
+    if (dest_len > ZLIB_MAX_UNPACK)
+        return false;
+    out.resize(dest_len);
+    if (dest_len == 0)
+        return true;
+    if (uncompress((Bytef *)&out[0], &dest_len, (const Bytef *)src + 4, len - 4) != Z_OK)
+        return false;
+    out.resize(dest_len);
+    return true;
+}
+
+std::string pack_chat_msg(const char *msg, size_t len)
+{
+    std::string packed;
+    if (!zlib_pack(msg, len, packed))
+        return std::string();
+    return "ZMSG " + std::to_string(packed.size()) + "\n" + packed;
+}
+
+void FrameEncoder::encode(const char *src, size_t len, std::string &out)
+{
+    std::string packed;
+    bool use_zlib = false;
+
+    if (!bypass && zlib_pack(src, len, packed))
+    {
+        if (!decided)
+        {
+            // **首块采样: 压缩率太差说明是已压缩的数据(zip/jpg/视频)，后续全部直接发送**
+            decided = true;
+            bypass = packed.size() >= len * COMPRESS_BYPASS_RATIO;
+            use_zlib = !bypass;
+        }
+        else
+        {
+            use_zlib = packed.size() < len;
+        }
+    }
+
+    if (use_zlib)
+    {
+        out.push_back(FRAME_ZLIB);
+        put_be32(out, packed.size());
+        out.append(packed);
+    }
+    else
+    {
+        out.push_back(FRAME_RAW);
+        put_be32(out, len);
+        out.append(src, len);
+    }
+}
+
+bool FrameDecoder::feed(const char *src, size_t len, std::string &out)
+{
+    pending.append(src, len);
+    size_t pos = 0;
+    while (pending.size() - pos >= FRAME_HEADER_SIZE)
+    {
+        char type = pending[pos];
+        size_t payload_len = get_be32(pending.data() + pos + 1);
+        if (pending.size() - pos - FRAME_HEADER_SIZE < payload_len)
+            break;
+
+        const char *payload = pending.data() + pos + FRAME_HEADER_SIZE;
+        if (type == FRAME_RAW)
+        {
+            out.append(payload, payload_len);
+        }
+        else if (type == FRAME_ZLIB)
+        {
+            std::string raw;
+            if (!zlib_unpack(payload, payload_len, raw))
+                return false;
+            out.append(raw);
+        }
+        else
+        {
+            return false;
+        }
+        pos += FRAME_HEADER_SIZE + payload_len;
+    }
+    pending.erase(0, pos);
+    return true;
+}
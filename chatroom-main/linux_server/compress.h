@@ -0,0 +1,53 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+#include <stddef.h>
+
+// 客户端能力位，由 "CAPS ..." 命令协商
+#define CAP_ZLIB 0x1
+#define CAP_MUX 0x2    // 见 mux.h
+#define CAP_PING 0x4   // 客户端会回复服务器的 "PING"(回 "PONG")，连接空闲时靠心跳判断是否还活着
+#define CAP_P2P 0x8    // 客户端之间直接传文件，服务器只做会合，见 p2p.h
+#define CAP_RESUME 0x10 // 断线重连后带令牌接回原来的聊天会话，见 resume.h
+
+// 压缩传输帧: 1 字节类型 + 4 字节大端长度 + 数据
+#define FRAME_RAW 'R'
+#define FRAME_ZLIB 'Z'
+#define FRAME_HEADER_SIZE 5
+
+#define CHAT_COMPRESS_MIN 512       // 小于该长度的聊天消息直接发送，压缩反而更慢
+#define COMPRESS_BYPASS_RATIO 0.9   // 首块压缩后仍大于原始大小的 90% 则认为不可压缩
+
+// 解析 "CAPS zlib ..." 中的能力列表
+unsigned parse_caps(const std::string &line);
+// 生成服务器支持的能力列表，用于回复客户端
+std::string caps_string(unsigned caps);
+
+// 与 Qt 的 qCompress/qUncompress 格式兼容: 4 字节大端原始长度 + zlib 数据
+bool zlib_pack(const char *src, size_t len, std::string &out);
+bool zlib_unpack(const char *src, size_t len, std::string &out);
+
+// 聊天消息压缩: "ZMSG <n>\n" + n 字节 qCompress 数据
+std::string pack_chat_msg(const char *msg, size_t len);
+
+// 文件传输编码器，首块决定整个传输是否旁路压缩
+struct FrameEncoder
+{
+    bool decided = false;
+    bool bypass = false;
+
+    // 把 src 编码成一帧追加到 out
+    void encode(const char *src, size_t len, std::string &out);
+};
+
+// 文件传输解码器，处理跨 recv() 的半帧
+struct FrameDecoder
+{
+    std::string pending;
+
+    // 喂入收到的数据，解出的原始数据追加到 out；数据损坏时返回 false
+    bool feed(const char *src, size_t len, std::string &out);
+};
+
+#endif // COMPRESS_H
@@ -0,0 +1,196 @@
+#include "cpupool.h"
+#include "log.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+struct CpuJob
+{
+    std::function<void()> fn;
+    std::coroutine_handle<> handle;
+};
+
+struct Worker
+{
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    std::deque<CpuJob> jobs;  // 自己从尾部取，别人从头部偷
+};
+
+static std::vector<Worker *> workers;
+static std::atomic<int> pending(0);
+static unsigned next_worker = 0;  // 只在反应器线程里使用
+static int inflight = 0;          // 同上
+// 没有任务时工作线程睡在这里
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+// 完成队列，工作线程写，反应器读
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::coroutine_handle<>> done_list;
+static int done_fd = -1;
+
+static bool pop_local(Worker *w, CpuJob &job)
+{
+    pthread_mutex_lock(&w->lock);
+    bool ok = !w->jobs.empty();
+    if (ok)
+    {
+        job = std::move(w->jobs.back());
+        w->jobs.pop_back();
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static bool steal(Worker *self, CpuJob &job)
+{
+    size_t n = workers.size();
+    for (size_t i = 1; i < n; i++)
+    {
+        Worker *victim = workers[(self->id + i) % n];
+        pthread_mutex_lock(&victim->lock);
+        bool ok = !victim->jobs.empty();
+        if (ok)
+        {
+            job = std::move(victim->jobs.front());
+            victim->jobs.pop_front();
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (ok)
+            return true;
+    }
+    return false;
+}
+
+static void complete(std::coroutine_handle<> h)
+{
+    pthread_mutex_lock(&done_mutex);
+    bool was_empty = done_list.empty();
+    done_list.push_back(h);
+    pthread_mutex_unlock(&done_mutex);
+    // 反应器还没取走上一批时不用再通知
+    if (was_empty)
+    {
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) != sizeof(one))
+            log_error("eventfd write: %s", strerror(errno));
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *self = (Worker *)arg;
+    while (true)
+    {
+        CpuJob job;
+        if (pop_local(self, job) || steal(self, job))
+        {
+            pending--;
+            job.fn();
+            complete(job.handle);
+            continue;
+        }
+        pthread_mutex_lock(&idle_mutex);
+        while (pending.load() == 0)
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+    return NULL;
+}
+
+// 在反应器上等 eventfd，把完成的协程放回就绪队列
+static Task completion_loop(int fd)
+{
+    AsyncSock efd(fd);
+    std::vector<std::coroutine_handle<>> batch;
+    while (true)
+    {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+        {
+            co_await efd.readable();
+            continue;
+        }
+        pthread_mutex_lock(&done_mutex);
+        batch.swap(done_list);
+        pthread_mutex_unlock(&done_mutex);
+        for (size_t i = 0; i < batch.size(); i++)
+            reactor_post(batch[i]);
+        batch.clear();
+    }
+}
+
+void cpupool_init(int n)
+{
+    if (n <= 0)
+        return;
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done_fd == -1)
+    {
+        log_error("eventfd() error: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    completion_loop(done_fd);
+
+    for (int i = 0; i < n; i++)
+    {
+        Worker *w = new Worker;
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+        workers.push_back(w);
+    }
+    // 全部登记好再启动，偷任务时要遍历 workers
+    for (int i = 0; i < n; i++)
+        pthread_create(&workers[i]->thread, NULL, worker_main, workers[i]);
+    log_info("CPU pool: %d workers", n);
+}
+
+int cpupool_workers()
+{
+    return workers.size();
+}
+
+int cpupool_inflight()
+{
+    return inflight;
+}
+
+bool CpuAwaiter::await_ready()
+{
+    if (!workers.empty())
+        return false;
+    fn();
+    return true;
+}
+
+void CpuAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    // 轮流放进各个工作线程的队列，忙的线程的任务会被空闲线程偷走
+    queued = true;
+    inflight++;
+    Worker *w = workers[next_worker++ % workers.size()];
+    pthread_mutex_lock(&w->lock);
+    w->jobs.push_back(CpuJob{std::move(fn), h});
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&idle_mutex);
+    pending++;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+}
+
+// 协程回到反应器线程后才算完成，这之前它的状态可能还没更新完
+void CpuAwaiter::await_resume() noexcept
+{
+    if (queued)
+        inflight--;
+}
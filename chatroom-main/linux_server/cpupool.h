@@ -0,0 +1,33 @@
+#ifndef CPUPOOL_H
+#define CPUPOOL_H
+
+#include <coroutine>
+#include <functional>
+#include "reactor.h"
+
+// 计算线程池: 哈希、压缩/解压等 CPU 密集的步骤不在反应器线程上做
+// 每个工作线程有自己的双端队列，自己从尾部取，空闲时从别人的头部偷
+// 任务完成后通过 eventfd 通知反应器，在反应器线程上恢复等待的协程
+
+// workers 为 0 时不启动线程池，cpu_run() 直接在反应器线程上执行
+// 必须在 reactor_init() 之后调用
+void cpupool_init(int workers);
+int cpupool_workers();
+// 交给线程池、还没回到反应器的任务数
+int cpupool_inflight();
+
+struct CpuAwaiter
+{
+    std::function<void()> fn;
+    bool queued = false;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() noexcept;
+};
+
+// co_await cpu_run([&] { ... }): 在线程池里执行 fn，完成后回到反应器线程
+// fn 引用的数据在等待期间不能被别的协程改动(例如共用的接收缓冲区要先拷贝出来)
+inline CpuAwaiter cpu_run(std::function<void()> fn) { return CpuAwaiter{std::move(fn)}; }
+
+#endif // CPUPOOL_H
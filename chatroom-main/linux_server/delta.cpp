@@ -0,0 +1,134 @@
+#include "delta.h"
+#include "compress.h"
+#include <math.h>
+#include <algorithm>
+#include <openssl/evp.h>
+
+static uint32_t get_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+size_t delta_block_size(uint64_t file_size)
+{
+    size_t block = ((size_t)sqrt((double)file_size) + 1023) & ~(size_t)1023;
+    if (block < DELTA_BLOCK_MIN)
+        return DELTA_BLOCK_MIN;
+    if (block > DELTA_BLOCK_MAX)
+        return DELTA_BLOCK_MAX;
+    return block;
+}
+
+uint32_t delta_weak(const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+void delta_signatures(const char *data, size_t size, size_t block, std::string &out)
+{
+    out.clear();
+    out.reserve((size + block - 1) / block * DELTA_SIG_SIZE);
+    for (size_t off = 0; off < size; off += block)
+    {
+        size_t len = size - off < block ? size - off : block;
+        uint32_t weak = delta_weak(data + off, len);
+        out.push_back((char)(weak >> 24));
+        out.push_back((char)(weak >> 16));
+        out.push_back((char)(weak >> 8));
+        out.push_back((char)weak);
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int md_len = 0;
+        EVP_Digest(data + off, len, md, &md_len, EVP_md5(), NULL);
+        out.append((const char *)md, DELTA_STRONG_SIZE);
+    }
+}
+
+bool DeltaDecoder::feed(const char *src, size_t len, std::vector<DeltaOp> &ops)
+{
+    static const char digits[] = "0123456789abcdef";
+    pending.append(src, len);
+    size_t pos = 0;
+    uint64_t blocks = block ? (base_size + block - 1) / block : 0;
+    bool ok = true;
+    while (!done && pending.size() > pos)
+    {
+        char type = pending[pos];
+        size_t avail = pending.size() - pos;
+        if (type == DELTA_COPY)
+        {
+            if (avail < 9)
+                break;
+            uint64_t first = get_be32(pending.data() + pos + 1);
+            uint64_t count = get_be32(pending.data() + pos + 5);
+            if (count == 0 || first + count > blocks)
+            {
+                ok = false;
+                break;
+            }
+            uint64_t off = first * block;
+            uint64_t end = std::min<uint64_t>((first + count) * block, base_size);
+            ops.push_back(DeltaOp{base + off, (size_t)(end - off), std::string()});
+            pos += 9;
+        }
+        else if (type == FRAME_RAW || type == FRAME_ZLIB)
+        {
+            if (avail < FRAME_HEADER_SIZE)
+                break;
+            size_t payload_len = get_be32(pending.data() + pos + 1);
+            if (payload_len > DELTA_FRAME_MAX)
+            {
+                ok = false;
+                break;
+            }
+            if (avail - FRAME_HEADER_SIZE < payload_len)
+                break;
+            const char *payload = pending.data() + pos + FRAME_HEADER_SIZE;
+            DeltaOp op{nullptr, 0, std::string()};
+            if (type == FRAME_RAW)
+                op.literal.assign(payload, payload_len);
+            else if (!zlib_unpack(payload, payload_len, op.literal))
+            {
+                ok = false;
+                break;
+            }
+            op.len = op.literal.size();
+            ops.push_back(std::move(op));
+            pos += FRAME_HEADER_SIZE + payload_len;
+        }
+        else if (type == DELTA_END)
+        {
+            if (avail < 1 + 32)
+                break;
+            const unsigned char *md = (const unsigned char *)pending.data() + pos + 1;
+            sha256.clear();
+            for (int i = 0; i < 32; i++)
+            {
+                sha256 += digits[md[i] >> 4];
+                sha256 += digits[md[i] & 0xf];
+            }
+            done = true;
+            pos += 1 + 32;
+        }
+        else
+        {
+            ok = false;
+            break;
+        }
+    }
+    pending.erase(0, pos);
+    // 原样数据在 ops 填完之后再取指针，vector 扩容会移动 string
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        if (!ops[i].data)
+            ops[i].data = ops[i].literal.data();
+    }
+    return ok;
+}
@@ -0,0 +1,58 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// 增量上传(rsync 算法): 上传同名文件的新版本时只发送改动的部分
+// 1. 客户端: "DELTA <文件名> <新文件大小>\n"
+// 2. 服务器把目录里旧版本按块切分，回复 "SIGS <块大小> <块数>\n" + 每块 4 字节大端弱校验 + 16 字节 MD5
+//    没有旧版本时块数为 0，客户端把整个文件作为原样数据发送
+// 3. 客户端用滚动校验在新文件的每个偏移上找旧版本里相同的块，按顺序发送指令:
+//      'C' + 4 字节块号 + 4 字节块数     从旧版本拷贝连续的块
+//      'R'/'Z' + 4 字节长度 + 数据       原样数据，格式同 compress.h 的传输帧
+//      'E' + 32 字节 SHA-256             结束，新文件的哈希
+// 4. 服务器用旧版本的块和原样数据拼出新文件，哈希一致才替换旧版本，
+//    回复 "OK <SHA-256>\n" 或 "ERROR <原因>\n"
+// 改动很小时发送的字节数只和改动的大小有关，与文件大小无关
+
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (64 * 1024)
+#define DELTA_STRONG_SIZE 16                            // MD5
+#define DELTA_SIG_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_FRAME_MAX (4 * 1024 * 1024)               // 单个原样数据帧的上限
+#define DELTA_COPY 'C'
+#define DELTA_END 'E'
+
+// 块大小取文件大小的平方根(按 1 KB 取整)，签名和指令的开销随文件大小缓慢增长
+size_t delta_block_size(uint64_t file_size);
+// rsync 的弱校验: 低 16 位是字节和，高 16 位是加权和，可以逐字节滚动
+uint32_t delta_weak(const char *data, size_t len);
+// 旧版本所有块的签名，最后一块可以不满
+void delta_signatures(const char *data, size_t size, size_t block, std::string &out);
+
+// 一条拼接指令: 旧版本里的一段，或者一段原样数据
+struct DeltaOp
+{
+    const char *data;     // 指向旧版本的映射或 literal
+    size_t len;
+    std::string literal;
+};
+
+// 解析客户端发来的指令，处理跨 recv() 的半条指令
+struct DeltaDecoder
+{
+    const char *base = nullptr;  // 旧版本的映射，整个上传期间保持有效
+    uint64_t base_size = 0;
+    size_t block = 0;
+    bool done = false;
+    std::string sha256;          // 'E' 带来的哈希，十六进制
+    std::string pending;
+
+    // 解出的指令追加到 ops(data 指针在 ops 下次改动前有效)；指令无效或数据损坏时返回 false
+    bool feed(const char *src, size_t len, std::vector<DeltaOp> &ops);
+};
+
+#endif // DELTA_H
@@ -0,0 +1,31 @@
+#include "digest.h"
+
+Sha256::Sha256() : ctx(EVP_MD_CTX_new())
+{
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+}
+
+Sha256::~Sha256()
+{
+    EVP_MD_CTX_free(ctx);
+}
+
+void Sha256::update(const char *data, size_t len)
+{
+    EVP_DigestUpdate(ctx, data, len);
+}
+
+std::string Sha256::hex()
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    EVP_DigestFinal_ex(ctx, md, &md_len);
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned int i = 0; i < md_len; i++)
+    {
+        out += digits[md[i] >> 4];
+        out += digits[md[i] & 0xf];
+    }
+    return out;
+}
@@ -0,0 +1,25 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <string>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+// 上传时增量计算 SHA-256，随 FILE 通知发给客户端
+class Sha256
+{
+public:
+    Sha256();
+    ~Sha256();
+    Sha256(const Sha256 &) = delete;
+    Sha256 &operator=(const Sha256 &) = delete;
+
+    void update(const char *data, size_t len);
+    // 小写十六进制，之后不能再 update
+    std::string hex();
+
+private:
+    EVP_MD_CTX *ctx;
+};
+
+#endif // DIGEST_H
@@ -0,0 +1,471 @@
+#include "diskio.h"
+#include "log.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+enum DiskOp
+{
+    DISK_WRITE,
+    DISK_SYNC,
+    DISK_PACK,    // 一批小文件
+    DISK_SYNCFS,  // 整个文件系统，fd 是上面的一个目录
+};
+
+// 一个上传的文件，写盘线程上的块也持有它，最后一块写完才关闭
+struct DiskFile
+{
+    int fd = -1;
+    bool direct = false;
+    uint64_t next_off = 0;        // 下一块的写入位置
+    int in_flight = 0;            // 交给写盘线程还没回来的块
+    int err = 0;                  // 第一次写盘错误
+    std::vector<char *> buffers;  // 分配过的缓冲区
+    std::vector<char *> free_bufs;
+    std::coroutine_handle<> waiter;  // 等缓冲区或等写完的协程
+
+    ~DiskFile()
+    {
+        if (fd != -1)
+            ::close(fd);
+        for (size_t i = 0; i < buffers.size(); i++)
+            free(buffers[i]);
+    }
+};
+
+struct DiskPackBatch
+{
+    std::vector<std::pair<std::string, std::string>> files;  // 路径, 内容
+    size_t bytes = 0;
+};
+
+struct DiskJob
+{
+    std::shared_ptr<DiskFile> file;
+    int op;
+    char *buf;
+    size_t len;
+    uint64_t off;
+    int err;
+    DiskPackBatch *batch = nullptr;
+};
+
+static std::vector<pthread_t> threads;
+static bool use_direct = false;
+static int jobs_inflight = 0;  // 只在反应器线程里使用
+static int waiting = 0;        // 同上
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<DiskJob *> queue;
+
+// 完成队列，写盘线程写，反应器读
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<DiskJob *> done_list;
+static int done_fd = -1;
+
+// O_DIRECT 只能写对齐的整块，尾部不对齐的部分改回普通写
+static void clear_direct(DiskFile *f)
+{
+    int flags = fcntl(f->fd, F_GETFL);
+    if (flags != -1 && (flags & O_DIRECT))
+        fcntl(f->fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+static int write_full(DiskFile *f, const char *buf, size_t len, uint64_t off)
+{
+    if (f->direct && (len % DISK_ALIGN) != 0)
+        clear_direct(f);
+    while (len > 0)
+    {
+        ssize_t n = pwrite(f->fd, buf, len, off);
+        if (n > 0)
+        {
+            buf += n;
+            len -= n;
+            off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && f->direct)
+        {
+            // 文件系统不接受这种对齐，这个文件不再用 O_DIRECT
+            clear_direct(f);
+            f->direct = false;
+            continue;
+        }
+        return n < 0 ? errno : EIO;
+    }
+    return 0;
+}
+
+// 一批小文件，第一个错误之后不再写
+static int write_pack(DiskPackBatch *batch)
+{
+    for (auto &entry : batch->files)
+    {
+        DiskFile f;
+        f.fd = ::open(entry.first.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (f.fd == -1)
+            return errno;
+        int err = write_full(&f, entry.second.data(), entry.second.size(), 0);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+static void run_job(DiskJob *job)
+{
+    if (job->op == DISK_WRITE)
+        job->err = write_full(job->file.get(), job->buf, job->len, job->off);
+    else if (job->op == DISK_PACK)
+        job->err = write_pack(job->batch);
+    else if (job->op == DISK_SYNCFS)
+        job->err = syncfs(job->file->fd) == 0 ? 0 : errno;
+    else
+        job->err = fdatasync(job->file->fd) == 0 ? 0 : errno;
+}
+
+// 在反应器线程上收尾: 归还缓冲区，唤醒等待的协程
+static void finish(DiskJob *job)
+{
+    DiskFile *f = job->file.get();
+    f->in_flight--;
+    jobs_inflight--;
+    if (job->buf)
+        f->free_bufs.push_back(job->buf);
+    if (job->err && !f->err)
+        f->err = job->err;
+    delete job->batch;
+    if (f->waiter)
+    {
+        reactor_post(f->waiter);
+        f->waiter = nullptr;
+    }
+    delete job;  // 上传已经放弃时，最后一块回来后在这里关闭文件
+}
+
+static void *disk_main(void *)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue.empty())
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        DiskJob *job = queue.front();
+        queue.pop_front();
+        pthread_mutex_unlock(&queue_mutex);
+
+        run_job(job);
+
+        pthread_mutex_lock(&done_mutex);
+        bool was_empty = done_list.empty();
+        done_list.push_back(job);
+        pthread_mutex_unlock(&done_mutex);
+        if (was_empty)
+        {
+            uint64_t one = 1;
+            if (write(done_fd, &one, sizeof(one)) != sizeof(one))
+                log_error("eventfd write: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+static Task completion_loop(int fd)
+{
+    AsyncSock efd(fd);
+    std::vector<DiskJob *> batch;
+    while (true)
+    {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+        {
+            co_await efd.readable();
+            continue;
+        }
+        pthread_mutex_lock(&done_mutex);
+        batch.swap(done_list);
+        pthread_mutex_unlock(&done_mutex);
+        for (size_t i = 0; i < batch.size(); i++)
+            finish(batch[i]);
+        batch.clear();
+    }
+}
+
+static void queue_job(DiskJob *job)
+{
+    job->file->in_flight++;
+    jobs_inflight++;
+    if (threads.empty())
+    {
+        run_job(job);
+        finish(job);
+        return;
+    }
+    pthread_mutex_lock(&queue_mutex);
+    queue.push_back(job);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// 等下一块写完，只有拥有这个文件的协程会等
+struct DiskWaitAwaiter
+{
+    DiskFile *file;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        file->waiter = h;
+        waiting++;
+    }
+    void await_resume() noexcept { waiting--; }
+};
+
+void diskio_init(int n)
+{
+    if (n <= 0)
+        return;
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done_fd == -1)
+    {
+        log_error("eventfd() error: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    completion_loop(done_fd);
+    threads.resize(n);
+    for (int i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, disk_main, NULL);
+    log_info("Disk writers: %d threads%s", n, use_direct ? ", O_DIRECT" : "");
+}
+
+void diskio_set_direct(bool direct)
+{
+    use_direct = direct;
+}
+
+int diskio_inflight()
+{
+    return jobs_inflight + waiting;
+}
+
+bool DiskWriter::open(const std::string &path, uint64_t file_size, uint64_t offset)
+{
+    close();
+    done = false;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (offset == 0 ? O_TRUNC : 0);
+    int fd = -1;
+    bool direct = false;
+    if (use_direct && offset % DISK_ALIGN == 0)
+    {
+        fd = ::open(path.c_str(), flags | O_DIRECT, 0666);
+        direct = fd != -1;
+    }
+    if (fd == -1)
+        fd = ::open(path.c_str(), flags, 0666);
+    if (fd == -1)
+        return false;
+    // 一次分配好整个文件，写的时候不再逐块分配，也能尽量连续；空间不够现在就失败
+    if (file_size > offset && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, file_size - offset) != 0 &&
+        errno == ENOSPC)
+    {
+        ::close(fd);
+        errno = ENOSPC;
+        return false;
+    }
+    file = std::make_shared<DiskFile>();
+    file->fd = fd;
+    file->direct = direct;
+    file->next_off = offset;
+    return true;
+}
+
+void DiskWriter::submit()
+{
+    DiskJob *job = new DiskJob{file, DISK_WRITE, fill, fill_len, file->next_off, 0};
+    file->next_off += fill_len;
+    fill = nullptr;
+    fill_len = 0;
+    queue_job(job);
+}
+
+Co<bool> DiskWriter::write(const char *data, size_t len)
+{
+    if (!file)
+        co_return false;
+    while (len > 0)
+    {
+        if (!fill)
+        {
+            while (file->free_bufs.empty() && file->buffers.size() >= DISK_BUFFERS && !file->err)
+                co_await DiskWaitAwaiter{file.get()};
+            if (file->err)
+                break;
+            if (!file->free_bufs.empty())
+            {
+                fill = file->free_bufs.back();
+                file->free_bufs.pop_back();
+            }
+            else
+            {
+                void *buf = NULL;
+                if (posix_memalign(&buf, DISK_ALIGN, DISK_BUF_SIZE) != 0)
+                {
+                    file->err = ENOMEM;
+                    break;
+                }
+                fill = (char *)buf;
+                file->buffers.push_back(fill);
+            }
+        }
+        size_t n = std::min(len, (size_t)DISK_BUF_SIZE - fill_len);
+        memcpy(fill + fill_len, data, n);
+        fill_len += n;
+        data += n;
+        len -= n;
+        if (fill_len == DISK_BUF_SIZE)
+            submit();
+    }
+    if (file->err)
+    {
+        errno = file->err;
+        co_return false;
+    }
+    co_return true;
+}
+
+Co<bool> DiskWriter::commit(bool sync)
+{
+    if (!file)
+        co_return false;
+    // 尾部不对齐时要关掉 O_DIRECT，先等前面的整块写完
+    if (file->direct && fill_len % DISK_ALIGN != 0)
+    {
+        while (file->in_flight > 0)
+            co_await DiskWaitAwaiter{file.get()};
+    }
+    if (fill_len > 0)
+        submit();
+    while (file->in_flight > 0)
+        co_await DiskWaitAwaiter{file.get()};
+    // 整个文件只同步一次
+    if (!file->err && sync)
+    {
+        queue_job(new DiskJob{file, DISK_SYNC, nullptr, 0, 0, 0});
+        while (file->in_flight > 0)
+            co_await DiskWaitAwaiter{file.get()};
+    }
+    int err = file->err;
+    close();
+    if (err)
+    {
+        errno = err;
+        co_return false;
+    }
+    done = true;
+    co_return true;
+}
+
+void DiskWriter::close()
+{
+    if (!file)
+        return;
+    if (fill)
+        file->free_bufs.push_back(fill);
+    fill = nullptr;
+    fill_len = 0;
+    file.reset();
+}
+
+bool DiskWriter::flush_sync()
+{
+    if (!file || fill_len == 0)
+        return true;
+    int err = write_full(file.get(), fill, fill_len, file->next_off);
+    file->next_off += fill_len;
+    fill_len = 0;
+    if (err)
+    {
+        file->err = err;
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+void DiskPack::submit()
+{
+    if (!batch)
+        return;
+    queue_job(new DiskJob{file, DISK_PACK, nullptr, 0, 0, 0, batch});
+    batch = nullptr;
+}
+
+Co<bool> DiskPack::add(std::string path, std::string data)
+{
+    if (!file)
+        file = std::make_shared<DiskFile>();
+    if (!batch)
+    {
+        while (file->in_flight >= DISK_BUFFERS && !file->err)
+            co_await DiskWaitAwaiter{file.get()};
+        if (file->err)
+        {
+            errno = file->err;
+            co_return false;
+        }
+        batch = new DiskPackBatch;
+    }
+    batch->bytes += data.size();
+    batch->files.emplace_back(std::move(path), std::move(data));
+    if (batch->bytes >= DISK_PACK_SIZE || batch->files.size() >= DISK_PACK_FILES)
+        submit();
+    co_return true;
+}
+
+Co<bool> DiskPack::finish(const std::string &dir, bool sync)
+{
+    if (!file)
+        file = std::make_shared<DiskFile>();
+    submit();
+    while (file->in_flight > 0)
+        co_await DiskWaitAwaiter{file.get()};
+    if (!file->err && sync)
+    {
+        file->fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (file->fd == -1)
+            file->err = errno;
+        else
+        {
+            queue_job(new DiskJob{file, DISK_SYNCFS, nullptr, 0, 0, 0});
+            while (file->in_flight > 0)
+                co_await DiskWaitAwaiter{file.get()};
+        }
+    }
+    int err = file->err;
+    close();
+    if (err)
+    {
+        errno = err;
+        co_return false;
+    }
+    co_return true;
+}
+
+void DiskPack::close()
+{
+    delete batch;
+    batch = nullptr;
+    file.reset();
+}
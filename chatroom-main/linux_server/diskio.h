@@ -0,0 +1,94 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <coroutine>
+#include <memory>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include "reactor.h"
+
+// 上传的写盘阶段: 收到的数据先拷进大块缓冲区，写满一块交给专门的写盘线程 pwrite
+// 每个上传最多 DISK_BUFFERS 块，一块在填、其余在写，网络接收和写盘完全重叠
+// 磁盘卡住时只有缓冲区都在写的那个上传会等，反应器和线程池不受影响
+// 打开时按文件大小 fallocate 预分配，提交时写完剩余数据再 fdatasync 一次
+
+#define DISK_BUF_SIZE (1024 * 1024)
+#define DISK_BUFFERS 3
+#define DISK_ALIGN 4096   // O_DIRECT 要求缓冲区、长度和偏移都按块对齐
+
+// threads 为 0 时在反应器线程上直接写(没有写盘线程)
+// 必须在 reactor_init() 之后调用
+void diskio_init(int threads);
+// 打开文件时使用 O_DIRECT，不经过页缓存；文件系统不支持时自动退回普通写
+void diskio_set_direct(bool direct);
+// 还没写完的块和等在写盘阶段的协程数，热升级时要等它们归零
+int diskio_inflight();
+
+struct DiskFile;
+
+class DiskWriter
+{
+public:
+    DiskWriter() = default;
+    ~DiskWriter() { close(); }
+    DiskWriter(const DiskWriter &) = delete;
+    DiskWriter &operator=(const DiskWriter &) = delete;
+
+    // 从 offset 开始写(热升级接着写已有的前 offset 字节)，预分配到 file_size
+    bool open(const std::string &path, uint64_t file_size, uint64_t offset = 0);
+    bool is_open() const { return (bool)file; }
+    bool committed() const { return done; }
+
+    // 拷贝进缓冲区，只有所有缓冲区都在写时才等待；之前的写盘出错返回 false
+    // data 在等待期间必须保持有效(不能是共用的接收缓冲区)
+    Co<bool> write(const char *data, size_t len);
+    // 写完所有数据并 fdatasync，成功后关闭文件；sync 为 false 时不单独同步(之后由 DiskPack::finish 一起落盘)
+    Co<bool> commit(bool sync = true);
+    // 放弃: 不再等待，已经交出去的块在后台写完后释放
+    void close();
+    // 热升级交接时同步写出正在填的缓冲区，此时不能有在写的块
+    bool flush_sync();
+
+private:
+    // 把正在填的缓冲区交给写盘线程
+    void submit();
+
+    std::shared_ptr<DiskFile> file;
+    char *fill = nullptr;
+    size_t fill_len = 0;
+    bool done = false;
+};
+
+// 批量上传的小文件: 整个文件的内容攒在内存里，凑够 DISK_PACK_SIZE 字节或 DISK_PACK_FILES 个文件
+// 交给写盘线程一次写出一批(逐个 open/write/close)，不逐个预分配、不逐个 fdatasync
+// 最多 DISK_BUFFERS 批在写，再多时 add 等待；finish 等所有批写完，再对整个文件系统 syncfs 一次
+#define DISK_PACK_SIZE (4 * 1024 * 1024)
+#define DISK_PACK_FILES 1024
+
+struct DiskPackBatch;
+
+class DiskPack
+{
+public:
+    DiskPack() = default;
+    ~DiskPack() { close(); }
+    DiskPack(const DiskPack &) = delete;
+    DiskPack &operator=(const DiskPack &) = delete;
+
+    // 一个完整的小文件，path 的上级目录必须已经存在；之前的批写盘出错返回 false
+    Co<bool> add(std::string path, std::string data);
+    // 写出剩下的批并等待全部完成；sync 为 true 时再 syncfs(dir 所在的文件系统)，
+    // 之前 commit(false) 的 DiskWriter 也一起落盘
+    Co<bool> finish(const std::string &dir, bool sync = true);
+    // 放弃还没交出去的批，已经交出去的在后台写完
+    void close();
+
+private:
+    void submit();
+
+    std::shared_ptr<DiskFile> file;  // 只用来给在写的批计数和等待
+    DiskPackBatch *batch = nullptr;
+};
+
+#endif // DISKIO_H
@@ -0,0 +1,141 @@
+#include "filecache.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <list>
+#include <map>
+#include <algorithm>
+
+#define FILECACHE_READAHEAD (2 * 1024 * 1024)
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_limit = FILECACHE_DEFAULT_LIMIT;
+static size_t cache_bytes = 0;
+// 队首是最近使用的文件
+static std::list<FileRef> lru;
+static std::map<std::string, std::list<FileRef>::iterator> entries;
+
+CachedFile::~CachedFile()
+{
+    if (data)
+        munmap((void *)data, size);
+    close(fd);
+}
+
+static FileRef open_file(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct stat file_stat;
+    int err = 0;
+    if (fstat(fd, &file_stat) != 0)
+        err = errno;
+    else if (!S_ISREG(file_stat.st_mode))
+        err = EISDIR;  // 只提供普通文件
+    if (err)
+    {
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    CachedFile *file = new CachedFile;
+    file->filename = filename;
+    file->fd = fd;
+    file->size = file_stat.st_size;
+    file->data = NULL;
+    if (file->size > 0)
+    {
+        void *map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            err = errno;
+            delete file;
+            errno = err;
+            return NULL;
+        }
+        madvise(map, file->size, MADV_SEQUENTIAL);
+        file->data = (const char *)map;
+    }
+    return FileRef(file);
+}
+
+// 调用者持有 cache_mutex
+static void evict_locked()
+{
+    while (cache_bytes > cache_limit && !lru.empty())
+    {
+        FileRef &victim = lru.back();
+        cache_bytes -= victim->size;
+        entries.erase(victim->filename);
+        lru.pop_back();
+    }
+}
+
+static void erase_locked(const std::string &filename)
+{
+    auto it = entries.find(filename);
+    if (it == entries.end())
+        return;
+    cache_bytes -= (*it->second)->size;
+    lru.erase(it->second);
+    entries.erase(it);
+}
+
+void filecache_set_limit(size_t bytes)
+{
+    pthread_mutex_lock(&cache_mutex);
+    cache_limit = bytes;
+    evict_locked();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+FileRef filecache_open(const std::string &filename)
+{
+    pthread_mutex_lock(&cache_mutex);
+    auto it = entries.find(filename);
+    if (it != entries.end())
+    {
+        // 命中，移到队首
+        lru.splice(lru.begin(), lru, it->second);
+        FileRef file = lru.front();
+        pthread_mutex_unlock(&cache_mutex);
+        return file;
+    }
+
+    // 在锁内打开，同时到达的下载只会打开一次
+    FileRef file = open_file(filename);
+    if (file && file->size <= cache_limit)
+    {
+        lru.push_front(file);
+        entries[filename] = lru.begin();
+        cache_bytes += file->size;
+        evict_locked();
+    }
+    int err = errno;
+    pthread_mutex_unlock(&cache_mutex);
+    errno = err;
+    return file;
+}
+
+void filecache_prefetch(const std::string &filename)
+{
+    FileRef file = filecache_open(filename);
+    if (!file || file->size == 0)
+        return;
+    // 通知发出时大家还没开始下载，整个文件交给内核异步预读；开头一段同步读好，第一个下载立即有数据
+    posix_fadvise(file->fd, 0, file->size, POSIX_FADV_WILLNEED);
+    readahead(file->fd, 0, std::min(file->size, (size_t)FILECACHE_READAHEAD));
+}
+
+void filecache_invalidate(const std::string &filename)
+{
+    pthread_mutex_lock(&cache_mutex);
+    erase_locked(filename);
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,39 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+// 热点文件缓存: 上传后房间里的人几乎同时下载同一个文件
+// 缓存打开的 fd、整个文件的只读 mmap 和大小，多个下载共用一份映射，不再各自 open/fstat/fread
+// 按映射字节数做 LRU 淘汰；被淘汰的文件在最后一个下载结束后才真正 munmap/close
+
+#define FILECACHE_DEFAULT_LIMIT (256UL * 1024 * 1024)
+
+struct CachedFile
+{
+    std::string filename;
+    int fd;
+    size_t size;
+    const char *data;  // 整个文件的映射，空文件为 NULL
+
+    ~CachedFile();
+};
+
+typedef std::shared_ptr<const CachedFile> FileRef;
+
+void filecache_set_limit(size_t bytes);
+// 打开失败返回空指针，errno 说明原因
+FileRef filecache_open(const std::string &filename);
+// 收到 FILE 通知前调用: 放进缓存并让内核提前把文件读进页缓存
+// 会同步读文件开头一段，不要在反应器线程上调用
+void filecache_prefetch(const std::string &filename);
+// 文件被替换后调用，已经在下载的连接继续使用旧的映射
+void filecache_invalidate(const std::string &filename);
+
+// 上传先写到临时文件，完成后 rename 替换
+// 原地截断正在被映射的文件会让下载线程 SIGBUS，rename 后旧的映射仍然指向旧文件
+#define UPLOAD_TMP_SUFFIX ".part"
+
+#endif // FILECACHE_H
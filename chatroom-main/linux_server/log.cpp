@@ -0,0 +1,316 @@
+#include "log.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+std::atomic<int> log_min_level{LOG_INFO};
+static std::atomic<unsigned> log_rate{LOG_DEFAULT_RATE};
+
+// 一个线程的缓冲区: head 只由所属线程推进，tail 只由后台线程推进
+struct LogRing
+{
+    char data[LOG_RING_SIZE];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> closed{false}; // 线程已退出，取空后由后台线程释放
+    int tid;
+};
+
+// 缓冲区表只在线程第一次写日志和后台线程释放时加锁
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<LogRing*> rings;
+
+static pthread_t flusher;
+static std::atomic<bool> running{false};
+static int out_fd = STDOUT_FILENO;
+
+// 线程退出时只做标记，剩下的记录还要写出去
+struct RingOwner
+{
+    LogRing* ring = nullptr;
+    ~RingOwner()
+    {
+        if (ring)
+            ring->closed.store(true, std::memory_order_release);
+    }
+};
+static thread_local RingOwner ring_owner;
+
+static LogRing* thread_ring()
+{
+    if (!ring_owner.ring)
+    {
+        LogRing* ring = new LogRing;
+        ring->tid = (int)syscall(SYS_gettid);
+        pthread_mutex_lock(&rings_mutex);
+        rings.push_back(ring);
+        pthread_mutex_unlock(&rings_mutex);
+        ring_owner.ring = ring;
+    }
+    return ring_owner.ring;
+}
+
+bool log_admit(LogSite& site, uint32_t& suppressed)
+{
+    suppressed = 0;
+    unsigned rate = log_rate.load(std::memory_order_relaxed);
+    if (rate == 0)
+        return true;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t window = site.window.load(std::memory_order_relaxed);
+    if (window != ts.tv_sec && site.window.compare_exchange_strong(window, ts.tv_sec, std::memory_order_relaxed))
+    {
+        site.count.store(0, std::memory_order_relaxed);
+        suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    }
+    if (site.count.fetch_add(1, std::memory_order_relaxed) < rate)
+        return true;
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void log_commit(char* record, size_t size, LogSite& site, uint32_t suppressed, LogFormatFn format)
+{
+    size = (size + 7) & ~(size_t)7;
+    LogRecordHeader header;
+    header.size = (uint32_t)size;
+    header.suppressed = suppressed;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    header.site = &site;
+    header.format = format;
+    memcpy(record, &header, sizeof(header));
+
+    LogRing* ring = thread_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < size)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // 记录长度是 8 的倍数，缓冲区也是，记录只可能在整 8 字节处折回
+    size_t pos = head & (LOG_RING_SIZE - 1);
+    size_t first = std::min(size, (size_t)LOG_RING_SIZE - pos);
+    memcpy(ring->data + pos, record, first);
+    memcpy(ring->data, record + first, size - first);
+    ring->head.store(head + size, std::memory_order_release);
+}
+
+void log_set_level(LogLevel level)
+{
+    log_min_level.store(level, std::memory_order_relaxed);
+}
+
+LogLevel log_level()
+{
+    return (LogLevel)log_min_level.load(std::memory_order_relaxed);
+}
+
+static const char* level_names[] = {"debug", "info", "warn", "error"};
+
+bool log_parse_level(const char* name, LogLevel& level)
+{
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+    {
+        if (strcmp(name, level_names[i]) == 0)
+        {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* log_level_name(LogLevel level)
+{
+    return level_names[level];
+}
+
+void log_set_rate(unsigned per_second)
+{
+    log_rate.store(per_second, std::memory_order_relaxed);
+}
+
+// **后台线程: 格式化**
+
+struct LogLine
+{
+    int64_t time_us;
+    size_t offset;
+    size_t len;
+};
+
+static void append_line(std::string& text, std::vector<LogLine>& lines, int64_t time_us, LogLevel level, int tid,
+                        const char* msg, int msg_len)
+{
+    static const char* tags[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+    // 时间只在秒变化时重新换算
+    static time_t cached_sec = -1;
+    static char cached_date[32];
+    time_t sec = time_us / 1000000;
+    if (sec != cached_sec)
+    {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(cached_date, sizeof(cached_date), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = sec;
+    }
+    char prefix[96];
+    int n = snprintf(prefix, sizeof(prefix), "%s.%06d %s [%d] ", cached_date, (int)(time_us % 1000000), tags[level], tid);
+    LogLine line{time_us, text.size(), 0};
+    text.append(prefix, n);
+    text.append(msg, msg_len);
+    text.push_back('\n');
+    line.len = text.size() - line.offset;
+    lines.push_back(line);
+}
+
+// 取空一个缓冲区，返回取到的记录数
+static size_t drain_ring(LogRing* ring, std::string& text, std::vector<LogLine>& lines)
+{
+    alignas(8) static char record[LOG_RECORD_MAX + 8];
+    static char msg[LOG_RECORD_MAX + 64];
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    size_t count = 0;
+    while (tail < head)
+    {
+        size_t pos = tail & (LOG_RING_SIZE - 1);
+        // 记录头本身也可能在缓冲区末尾折回，只有开头的 size 一定是连续的
+        uint32_t size;
+        memcpy(&size, ring->data + pos, sizeof(size));
+        size_t first = std::min((size_t)size, (size_t)LOG_RING_SIZE - pos);
+        memcpy(record, ring->data + pos, first);
+        memcpy(record + first, ring->data, size - first);
+        LogRecordHeader header;
+        memcpy(&header, record, sizeof(header));
+        tail += size;
+
+        int len = header.format(header.site->fmt, record + sizeof(header), msg, sizeof(msg));
+        len = std::max(0, std::min(len, (int)sizeof(msg) - 1));
+        if (header.suppressed > 0)
+            len += snprintf(msg + len, sizeof(msg) - len, " (%u similar lines suppressed)", header.suppressed);
+        len = std::min(len, (int)sizeof(msg) - 1);
+        append_line(text, lines, header.time_us, header.site->level, ring->tid, msg, len);
+        count++;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+
+    uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+    {
+        int len = snprintf(msg, sizeof(msg), "%llu log records dropped, buffer full", (unsigned long long)dropped);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        append_line(text, lines, (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, LOG_WARN, ring->tid, msg, len);
+    }
+    return count;
+}
+
+// 各线程的记录按时间排好，拼成一块写出去
+static size_t flush_once()
+{
+    static std::string text, out;
+    static std::vector<LogLine> lines;
+    text.clear();
+    lines.clear();
+    size_t count = 0;
+
+    pthread_mutex_lock(&rings_mutex);
+    std::vector<LogRing*> snapshot = rings;
+    pthread_mutex_unlock(&rings_mutex);
+    for (LogRing* ring : snapshot)
+    {
+        // 先看 closed 再取空，取空之后就不会再有新记录
+        bool closed = ring->closed.load(std::memory_order_acquire);
+        count += drain_ring(ring, text, lines);
+        if (closed)
+        {
+            pthread_mutex_lock(&rings_mutex);
+            rings.erase(std::find(rings.begin(), rings.end(), ring));
+            pthread_mutex_unlock(&rings_mutex);
+            delete ring;
+        }
+    }
+    if (lines.empty())
+        return 0;
+
+    std::stable_sort(lines.begin(), lines.end(),
+                     [](const LogLine& a, const LogLine& b) { return a.time_us < b.time_us; });
+    out.clear();
+    for (const LogLine& line : lines)
+        out.append(text, line.offset, line.len);
+    size_t done = 0;
+    while (done < out.size())
+    {
+        ssize_t n = write(out_fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return count;
+}
+
+static void* flusher_main(void*)
+{
+    while (running.load(std::memory_order_acquire))
+    {
+        if (flush_once() == 0)
+        {
+            struct timespec ts = {0, LOG_FLUSH_MS * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void log_atexit()
+{
+    log_stop();
+}
+
+void log_start(int fd)
+{
+    if (running.load())
+        return;
+    out_fd = fd;
+    running.store(true, std::memory_order_release);
+    // 后台线程不接收信号，信号留给主线程的 signalfd
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&flusher, NULL, flusher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        running.store(false);
+        fprintf(stderr, "log pthread_create() error: %s\n", strerror(err));
+        return;
+    }
+    static bool registered = false;
+    if (!registered)
+    {
+        atexit(log_atexit);
+        registered = true;
+    }
+}
+
+void log_stop()
+{
+    if (running.exchange(false))
+        pthread_join(flusher, NULL);
+    flush_once();
+}
@@ -0,0 +1,175 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// 异步日志，替代热路径上的 printf/cout:
+//   调用线程只把格式串指针和参数的原始值拷进本线程的环形缓冲区(单生产者单消费者，无锁)，不格式化、不做系统调用
+//   后台线程定期取空所有线程的缓冲区，按时间排序、格式化成文本行，一次 write 出去
+//   缓冲区满了丢弃新记录并计数，调用者永远不会被阻塞
+//   级别低于当前级别的语句连参数都不求值；同一条语句每秒最多 log_set_rate() 行，多出来的只计数，下一次输出时附上
+// 用法和 printf 一样，末尾不加 '\n': log_info("client: %d idle timeout", fd)
+// 编译时按 printf 检查格式串；字符串参数传 const char*(std::string 要 .c_str())，最多保留 LOG_STR_MAX 字节
+
+#define LOG_RING_SIZE (256 * 1024) // 每个线程的缓冲区，2 的幂
+#define LOG_RECORD_MAX 4096        // 一条记录(头 + 参数)的上限
+#define LOG_STR_MAX 1024           // 字符串参数截断到这么长
+#define LOG_FLUSH_MS 20            // 后台线程没有记录可写时睡这么久
+#define LOG_DEFAULT_RATE 1000      // 每条语句每秒默认最多输出的行数
+
+enum LogLevel
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+};
+
+// 每条日志语句一个，记录级别、格式串和限速计数
+struct LogSite
+{
+    LogLevel level;
+    const char* fmt;
+    std::atomic<int64_t> window{0}; // 正在计数的那一秒
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> suppressed{0};
+};
+
+// 后台线程用它把参数解码出来再交给 snprintf
+typedef int (*LogFormatFn)(const char* fmt, const char* args, char* out, size_t cap);
+
+extern std::atomic<int> log_min_level;
+
+// 启动后台线程，日志写到 fd；进程退出时(atexit)把剩下的记录写完
+void log_start(int fd);
+// 停止后台线程并写完所有记录
+void log_stop();
+void log_set_level(LogLevel level);
+LogLevel log_level();
+// "debug" / "info" / "warn" / "error"，不认识返回 false
+bool log_parse_level(const char* name, LogLevel& level);
+const char* log_level_name(LogLevel level);
+// 每条语句每秒最多输出的行数，0 不限
+void log_set_rate(unsigned per_second);
+
+// 下面是宏展开用的，不直接调用
+bool log_admit(LogSite& site, uint32_t& suppressed);
+void log_commit(char* record, size_t size, LogSite& site, uint32_t suppressed, LogFormatFn format);
+
+// 记录头，后面跟着编码后的参数
+struct LogRecordHeader
+{
+    uint32_t size; // 整条记录的字节数，8 字节对齐
+    uint32_t suppressed;
+    int64_t time_us;
+    LogSite* site;
+    LogFormatFn format;
+};
+
+// 参数按解码时的类型存: 字符串存长度 + 内容 + '\0'，浮点数存 double，其它(整数、枚举、指针)原样
+template <class T>
+using log_arg_t = std::conditional_t<
+    std::is_same_v<std::decay_t<T>, char*> || std::is_same_v<std::decay_t<T>, const char*>, const char*,
+    std::conditional_t<std::is_floating_point_v<std::decay_t<T>>, double, std::decay_t<T>>>;
+
+template <class T>
+inline void log_encode(char* buf, size_t& n, const T& value)
+{
+    typedef log_arg_t<T> S;
+    static_assert(std::is_arithmetic_v<S> || std::is_enum_v<S> || std::is_pointer_v<S>,
+                  "log arguments must be numbers, pointers or C strings");
+    if constexpr (std::is_same_v<S, const char*>)
+    {
+        const char* s = value ? value : "(null)";
+        // 后面的数值参数留出余量，整条记录不会超过 LOG_RECORD_MAX
+        size_t room = n + 3 + 512 < LOG_RECORD_MAX ? LOG_RECORD_MAX - n - 3 - 512 : 0;
+        uint16_t len = (uint16_t)strnlen(s, room < LOG_STR_MAX ? room : LOG_STR_MAX);
+        memcpy(buf + n, &len, 2);
+        memcpy(buf + n + 2, s, len);
+        buf[n + 2 + len] = '\0';
+        n += 3 + len;
+    }
+    else
+    {
+        S v = (S)value;
+        memcpy(buf + n, &v, sizeof(v));
+        n += sizeof(v);
+    }
+}
+
+template <class S>
+inline S log_decode(const char*& p)
+{
+    if constexpr (std::is_same_v<S, const char*>)
+    {
+        uint16_t len;
+        memcpy(&len, p, 2);
+        const char* s = p + 2;
+        p += 3 + len;
+        return s;
+    }
+    else
+    {
+        S v;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return v;
+    }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+template <class... S>
+int log_format(const char* fmt, const char* args, char* out, size_t cap)
+{
+    if constexpr (sizeof...(S) == 0)
+    {
+        return snprintf(out, cap, fmt);
+    }
+    else
+    {
+        // 花括号里的初始化按从左到右的顺序求值，和编码顺序一致
+        std::tuple<S...> values{log_decode<S>(args)...};
+        return std::apply([&](S... v) { return snprintf(out, cap, fmt, v...); }, values);
+    }
+}
+#pragma GCC diagnostic pop
+
+template <class... A>
+void log_write(LogSite& site, const A&... args)
+{
+    static_assert(sizeof...(A) <= 32, "too many log arguments");
+    uint32_t suppressed;
+    if (!log_admit(site, suppressed))
+        return;
+    alignas(8) char record[LOG_RECORD_MAX];
+    size_t n = sizeof(LogRecordHeader);
+    (log_encode(record, n, args), ...);
+    log_commit(record, n, site, suppressed, &log_format<log_arg_t<A>...>);
+}
+
+#define LOG_AT(lvl, fmt, ...)                                                  \
+    do                                                                         \
+    {                                                                          \
+        if ((lvl) >= log_min_level.load(std::memory_order_relaxed))            \
+        {                                                                      \
+            static LogSite log_site_{(lvl), fmt};                              \
+            if (false)                                                         \
+                printf(fmt, ##__VA_ARGS__);                                    \
+            log_write(log_site_, ##__VA_ARGS__);                               \
+        }                                                                      \
+    } while (0)
+
+#define log_debug(fmt, ...) LOG_AT(LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define log_info(fmt, ...) LOG_AT(LOG_INFO, fmt, ##__VA_ARGS__)
+#define log_warn(fmt, ...) LOG_AT(LOG_WARN, fmt, ##__VA_ARGS__)
+#define log_error(fmt, ...) LOG_AT(LOG_ERROR, fmt, ##__VA_ARGS__)
+
+#endif // LOG_H
@@ -0,0 +1,339 @@
+// 服务器入口: 解析启动参数，准备监听 socket(或从旧进程接手)，启动各模块和反应器
+// 连接处理在 server.cpp，编译命令见 server.cpp 第一行
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <vector>
+#include <algorithm>
+#include "reactor.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "filecache.h"
+#include "cpupool.h"
+#include "upgrade.h"
+#include "relay.h"
+#include "diskio.h"
+#include "catalog.h"
+#include "scan.h"
+#include "capture.h"
+#include "search.h"
+#include "admission.h"
+#include "resume.h"
+#include "server.h"
+#include "log.h"
+
+// 限速配置文件，收到 SIGHUP 时重新读取
+static const char* ratelimit_path = NULL;
+
+// **SIGHUP 通过 signalfd 交给反应器，重新加载限速配置；SIGUSR1/SIGUSR2 调整日志级别**
+Task signal_loop(int sigfd)
+{
+    AsyncSock sigsock(sigfd);
+    while (true)
+    {
+        struct signalfd_siginfo info;
+        if (read(sigfd, &info, sizeof(info)) != sizeof(info))
+        {
+            co_await sigsock.readable();
+            continue;
+        }
+        if (info.ssi_signo == SIGHUP && ratelimit_path)
+            bulk_load_config(ratelimit_path);
+        // SIGUSR1 多输出一级，SIGUSR2 少输出一级
+        if (info.ssi_signo == SIGUSR1 || info.ssi_signo == SIGUSR2)
+        {
+            int level = log_level() + (info.ssi_signo == SIGUSR1 ? -1 : 1);
+            level = std::max((int)LOG_DEBUG, std::min((int)LOG_ERROR, level));
+            log_set_level((LogLevel)level);
+            log_warn("Log level: %s", log_level_name((LogLevel)level));
+        }
+        // 录制时 Ctrl-C 也要把最后一段记录写进文件
+        if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+        {
+            capture_stop();
+            log_info("Capture finished");
+            exit(EXIT_SUCCESS);
+        }
+    }
+}
+
+// **录制的记录攒在内存里，空闲时也定期写进文件**
+Task capture_flush_loop()
+{
+    while (capture_enabled())
+    {
+        co_await reactor_sleep(CAPTURE_FLUSH_MS);
+        capture_flush();
+    }
+}
+
+// 计算线程池大小，默认每个核一个
+static int cpu_workers = -1;
+// 写盘线程数
+static int disk_threads = 2;
+// 上传文件和索引所在的目录
+static const char* store_dir = ".";
+// 热升级: 旧进程在 upgrade_path 上等待接手，新进程从 takeover_path 接手
+static const char* upgrade_path = NULL;
+static const char* takeover_path = NULL;
+// 流量录制的轨迹文件
+static const char* capture_path = NULL;
+// 多节点: 本节点号和总线端口，0 表示单机运行
+static int node_id = 0;
+static int node_bus_port = 0;
+
+// 交接后处理不能交出去的连接(TLS): 聊天会话断开让客户端重连到新进程，传输等它们完成
+Task drain_and_exit()
+{
+    int64_t deadline = reactor_now() + UPGRADE_DRAIN_TIMEOUT;
+    pthread_mutex_lock(&mutex);
+    for (auto it = map_clients->begin(); it != map_clients->end(); it++)
+        shutdown(it->first, SHUT_RDWR);
+    pthread_mutex_unlock(&mutex);
+    while (session_count() > 0 && reactor_now() < deadline)
+        co_await reactor_sleep(100);
+    log_info("Old server drained, exiting");
+    capture_stop();
+    exit(EXIT_SUCCESS);
+}
+
+void on_handoff(bool all)
+{
+    // 节点的总线端口交给新进程
+    relay_stop();
+    // 连接全部交出去了，旧进程里挂起的协程不能再运行
+    if (all)
+    {
+        log_info("All connections handed over, exiting");
+        capture_stop();
+        exit(EXIT_SUCCESS);
+    }
+    drain_and_exit();
+}
+
+// 交接时补充服务器层面的状态
+void fill_session_state(int fd, SessionState& state)
+{
+    pthread_mutex_lock(&mutex);
+    auto name = map_clients->find(fd);
+    if (name != map_clients->end())
+        state.name = name->second;
+    pthread_mutex_unlock(&mutex);
+}
+
+int run_server(int port)
+{
+    int server_sock;
+    struct sockaddr_in server_addr;
+    std::vector<std::pair<int, SessionState>> restored;
+
+    server_init();
+
+    if (takeover_path)
+    {
+        // 监听 socket 和连接都从旧进程接手，端口参数不再使用
+        server_sock = upgrade_takeover(takeover_path, restored);
+        if (server_sock == -1)
+            error_handling("takeover failed");
+    }
+    else
+    {
+        // prepare server socket
+        server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        server_addr.sin_port = htons(port);
+        if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1)
+            error_handling("bind() error");
+        if (listen(server_sock, 5) == -1)
+            error_handling("listen() error");
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    if (capture_path)
+    {
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (!catalog_open(store_dir))
+        error_handling("catalog_open() error");
+    // 每个节点都收到整个房间的消息，各自记一份历史
+    std::string history = SEARCH_HISTORY;
+    if (node_id > 0)
+        history += "." + std::to_string(node_id);
+    if (!search_open(catalog_path(history)))
+        error_handling("search_open() error");
+    if (capture_path && !capture_start(capture_path))
+        error_handling("capture_start() error");
+
+    reactor_init();
+    // 工作线程在屏蔽 SIGHUP 之后创建，信号只由 signalfd 接收
+    if (cpu_workers < 0)
+        cpu_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    cpupool_init(cpu_workers);
+    log_info("Message scanning: %s", scan_impl());
+    diskio_init(disk_threads);
+    // 断线的用户等不到重连才算离开
+    resume_init(publish_presence);
+    accept_loop(server_sock);
+    admit_monitor();
+    signal_loop(sigfd);
+    capture_flush_loop();
+
+    for (size_t i = 0; i < restored.size(); i++)
+    {
+        int client_sock = restored[i].first;
+        SessionState& state = restored[i].second;
+        // 传输连接不在用户列表里，不接收广播
+        if (state.kind == SESSION_CHAT || state.kind == SESSION_MUX)
+        {
+            pthread_mutex_lock(&mutex);
+            (*map_clients)[client_sock] = state.name;
+            (*map_caps)[client_sock] = state.caps;
+            pthread_mutex_unlock(&mutex);
+        }
+        handle_client(client_sock, std::make_unique<SessionState>(std::move(state)));
+    }
+    if (node_id > 0)
+    {
+        relay_init(node_id, node_bus_port, on_relay_message);
+        publish_presence();
+    }
+    if (upgrade_path)
+        upgrade_listen(upgrade_path, server_sock, fill_session_state, on_handoff);
+    reactor_run();
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    // **日志由后台线程写到标准输出，启动之前的错误直接打到 stderr**
+    log_start(STDOUT_FILENO);
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <port> [--tls <cert.pem> <key.pem>] [--ratelimit <file>] [--cache-mb <n>] [--cpu-workers <n>] [--disk-threads <n>] [--disk-direct] [--store <dir>] [--upgrade-sock <path>] [--takeover <path>] [--capture <trace>] [--node <id> <bus-port> [--peer <id> <ip:port>]...] [--log-level debug|info|warn|error] [--log-rate <lines/s>] [--max-conns <n>] [--max-conns-per-ip <n>] [--accept-rate <n/s>] [--ip-accept-rate <n/s>] [--msg-rate <n/s>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // 过载保护的限制，0 表示不限
+    int max_conns = -1;
+    int max_per_ip = ADMIT_DEFAULT_PER_IP;
+    double accept_rate = ADMIT_DEFAULT_ACCEPT_RATE;
+    double ip_accept_rate = ADMIT_DEFAULT_IP_ACCEPT_RATE;
+    double msg_rate = ADMIT_DEFAULT_MSG_RATE;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--tls") == 0 && i + 2 < argc)
+        {
+            if (!tls_init(argv[i + 1], argv[i + 2]))
+                error_handling("tls_init() error");
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc)
+        {
+            filecache_set_limit((size_t)atoi(argv[++i]) * 1024 * 1024);
+        }
+        else if (strcmp(argv[i], "--upgrade-sock") == 0 && i + 1 < argc)
+        {
+            upgrade_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc)
+        {
+            takeover_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+        {
+            capture_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--node") == 0 && i + 2 < argc)
+        {
+            node_id = atoi(argv[i + 1]);
+            node_bus_port = atoi(argv[i + 2]);
+            if (node_id <= 0)
+                error_handling("node id must be positive");
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--peer") == 0 && i + 2 < argc)
+        {
+            std::string addr = argv[i + 2];
+            size_t colon = addr.rfind(':');
+            if (colon == std::string::npos || !relay_add_peer(atoi(argv[i + 1]), addr.substr(0, colon), atoi(addr.c_str() + colon + 1)))
+                error_handling("bad --peer address");
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--cpu-workers") == 0 && i + 1 < argc)
+        {
+            cpu_workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--disk-threads") == 0 && i + 1 < argc)
+        {
+            disk_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--disk-direct") == 0)
+        {
+            diskio_set_direct(true);
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc)
+        {
+            LogLevel level;
+            if (!log_parse_level(argv[++i], level))
+                error_handling("bad --log-level");
+            log_set_level(level);
+        }
+        else if (strcmp(argv[i], "--log-rate") == 0 && i + 1 < argc)
+        {
+            log_set_rate((unsigned)atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--max-conns") == 0 && i + 1 < argc)
+        {
+            max_conns = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-conns-per-ip") == 0 && i + 1 < argc)
+        {
+            max_per_ip = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc)
+        {
+            accept_rate = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ip-accept-rate") == 0 && i + 1 < argc)
+        {
+            ip_accept_rate = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--msg-rate") == 0 && i + 1 < argc)
+        {
+            msg_rate = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc)
+        {
+            store_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--ratelimit") == 0 && i + 1 < argc)
+        {
+            ratelimit_path = argv[++i];
+            if (!bulk_load_config(ratelimit_path))
+                error_handling("ratelimit config error");
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    admit_set_limits(max_conns, max_per_ip, accept_rate, ip_accept_rate, msg_rate);
+    run_server(atoi(argv[1]));
+    return 0;
+}
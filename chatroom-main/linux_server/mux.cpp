@@ -0,0 +1,432 @@
+#include "mux.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "cpupool.h"
+#include "upgrade.h"
+#include "catalog.h"
+#include "log.h"
+#include "admission.h"
+#include <sstream>
+#include <algorithm>
+
+static void put_be32(std::string &out, uint32_t v)
+{
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+static uint32_t get_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+std::string mux_frame(char type, uint32_t stream, const char *payload, size_t len)
+{
+    std::string frame;
+    frame.reserve(MUX_HEADER_SIZE + len);
+    frame.push_back(type);
+    put_be32(frame, stream);
+    put_be32(frame, len);
+    frame.append(payload, len);
+    return frame;
+}
+
+std::string mux_frame(char type, uint32_t stream, const std::string &payload)
+{
+    return mux_frame(type, stream, payload.data(), payload.size());
+}
+
+void MuxDecoder::feed(const char *src, size_t len)
+{
+    // 已消费的部分攒多了再一起删除，避免每帧都移动内存
+    if (pos > 0 && pos >= pending.size() / 2)
+    {
+        pending.erase(0, pos);
+        pos = 0;
+    }
+    pending.append(src, len);
+}
+
+bool MuxDecoder::next(MuxFrame &frame, bool &error)
+{
+    error = false;
+    if (pending.size() - pos < MUX_HEADER_SIZE)
+        return false;
+    const char *p = pending.data() + pos;
+    size_t len = get_be32(p + 5);
+    if (len > MUX_MAX_FRAME)
+    {
+        error = true;
+        return false;
+    }
+    if (pending.size() - pos - MUX_HEADER_SIZE < len)
+        return false;
+    frame.type = p[0];
+    frame.stream = get_be32(p + 1);
+    frame.payload.assign(p + MUX_HEADER_SIZE, len);
+    pos += MUX_HEADER_SIZE + len;
+    return true;
+}
+
+MuxSession::MuxSession(AsyncSock &client_sock, std::function<void(const std::string &, size_t, const std::string &)> on_upload_done)
+    : sock(client_sock), upload_done(on_upload_done)
+{
+}
+
+MuxSession::~MuxSession()
+{
+    while (!streams.empty())
+        close_stream(streams.begin()->first);
+}
+
+Co<bool> MuxSession::send_frame(char type, uint32_t id, std::string payload)
+{
+    std::string frame = mux_frame(type, id, payload);
+    co_return co_await sock.write_all(frame);
+}
+
+void MuxSession::close_stream(uint32_t id)
+{
+    auto it = streams.find(id);
+    if (it == streams.end())
+        return;
+    MuxStream *stream = it->second;
+    if (stream->in)
+        bulk_unregister(stream->transfer);
+    if (stream->upload)
+    {
+        stream->out.close();
+        std::string path = catalog_path(stream->filename);
+        std::string tmp_name = path + UPLOAD_TMP_SUFFIX;
+        // 没传完或没能落盘的上传不留半个文件
+        if (!stream->out.committed() || rename(tmp_name.c_str(), path.c_str()) != 0)
+            remove(tmp_name.c_str());
+    }
+    delete stream;
+    streams.erase(it);
+}
+
+Co<bool> MuxSession::open_stream(uint32_t id, std::string request)
+{
+    if (id == MUX_CHAT_STREAM || streams.count(id))
+        co_return co_await send_frame(MUX_CLOSE, id, "ERROR bad stream");
+    if (streams.size() >= MUX_MAX_STREAMS)
+        co_return co_await send_frame(MUX_CLOSE, id, "ERROR too many streams");
+    int retry_ms;
+    if (!admit_heavy(retry_ms))
+        co_return co_await send_frame(MUX_CLOSE, id, admit_busy(retry_ms, "overload"));
+
+    std::string cmd = request;
+    bool compressed = !cmd.empty() && cmd[0] == 'Z';
+    if (compressed)
+        cmd.erase(0, 1);
+
+    MuxStream *stream = new MuxStream;
+    stream->id = id;
+    stream->compressed = compressed;
+    stream->done = 0;
+    stream->window = MUX_INITIAL_WINDOW;
+    stream->last_active = reactor_now();
+
+    if (cmd.substr(0, 7) == "UPLOAD ")
+    {
+        std::istringstream iss(cmd);
+        std::string name;
+        iss >> name >> stream->filename >> stream->file_size;
+        stream->upload = true;
+        if (!iss || !catalog_valid_name(stream->filename))
+        {
+            delete stream;
+            co_return co_await send_frame(MUX_CLOSE, id, "ERROR bad file name");
+        }
+        if (!stream->out.open(catalog_path(stream->filename) + UPLOAD_TMP_SUFFIX, stream->file_size))
+        {
+            delete stream;
+            co_return co_await send_frame(MUX_CLOSE, id, "ERROR cannot write file");
+        }
+        log_info("Mux upload %u: %s %zu bytes", id, stream->filename.c_str(), stream->file_size);
+        streams[id] = stream;
+        if (stream->file_size == 0)
+        {
+            std::string filename = stream->filename;
+            std::string sha256 = stream->digest.hex();
+            co_await stream->out.commit();
+            close_stream(id);
+            if (!(co_await send_frame(MUX_CLOSE, id, "OK")))
+                co_return false;
+            upload_done(filename, 0, sha256);
+        }
+        co_return true;
+    }
+
+    if (cmd.substr(0, 9) == "DOWNLOAD ")
+    {
+        stream->upload = false;
+        stream->filename = cmd.substr(9);
+        if (catalog_valid_path(stream->filename))
+            stream->in = filecache_open(catalog_path(stream->filename));
+        if (!stream->in)
+        {
+            delete stream;
+            co_return co_await send_frame(MUX_CLOSE, id, "ERROR");
+        }
+        stream->file_size = stream->in->size;
+        stream->transfer = bulk_register(sock.fd());
+        log_info("Mux download %u: %s %zu bytes", id, stream->filename.c_str(), stream->file_size);
+        streams[id] = stream;
+        if (!(co_await send_frame(MUX_OPEN, id, std::to_string(stream->file_size))))
+            co_return false;
+        if (stream->file_size == 0)
+        {
+            close_stream(id);
+            co_return co_await send_frame(MUX_CLOSE, id, "OK");
+        }
+        co_return true;
+    }
+
+    delete stream;
+    co_return co_await send_frame(MUX_CLOSE, id, "ERROR bad request");
+}
+
+Co<bool> MuxSession::upload_data(MuxStream &stream, const std::string &payload)
+{
+    stream.last_active = reactor_now();
+    // 解压和哈希在线程池里做，payload 属于调用者，等待期间不会变
+    std::string raw;
+    const char *error = NULL;
+    co_await cpu_run([&] {
+        if (stream.compressed && !stream.decoder.feed(payload.data(), payload.size(), raw))
+        {
+            error = "ERROR corrupted data";
+            return;
+        }
+        const std::string &data = stream.compressed ? raw : payload;
+        // 超出声明大小的数据不写也不哈希，否则存下的文件和目录里登记的大小对不上
+        if (data.size() > stream.file_size - stream.done)
+        {
+            error = "ERROR size mismatch";
+            return;
+        }
+        stream.digest.update(data.data(), data.size());
+    });
+    if (error)
+    {
+        // close_stream 删掉没写完的临时文件
+        uint32_t id = stream.id;
+        log_warn("Mux upload %u rejected: %s %s", id, stream.filename.c_str(), error);
+        close_stream(id);
+        co_return co_await send_frame(MUX_CLOSE, id, error);
+    }
+    const std::string &data = stream.compressed ? raw : payload;
+    if (!(co_await stream.out.write(data.data(), data.size())))
+    {
+        uint32_t id = stream.id;
+        close_stream(id);
+        co_return co_await send_frame(MUX_CLOSE, id, "ERROR cannot write file");
+    }
+    stream.done += data.size();
+
+    if (stream.done >= stream.file_size)
+    {
+        uint32_t id = stream.id;
+        if (!(co_await stream.out.commit()))
+        {
+            close_stream(id);
+            co_return co_await send_frame(MUX_CLOSE, id, "ERROR cannot write file");
+        }
+        std::string filename = stream.filename;
+        size_t file_size = stream.file_size;
+        std::string sha256 = stream.digest.hex();
+        close_stream(id);
+        log_info("Mux upload complete %u: %s %s", id, filename.c_str(), sha256.c_str());
+        if (!(co_await send_frame(MUX_CLOSE, id, "OK")))
+            co_return false;
+        upload_done(filename, file_size, sha256);
+        co_return true;
+    }
+
+    // **数据已经进入写盘缓冲区，归还窗口给客户端**
+    std::string inc;
+    put_be32(inc, payload.size());
+    co_return co_await send_frame(MUX_WINDOW, stream.id, inc);
+}
+
+Co<bool> MuxSession::handle_frame(const MuxFrame &frame)
+{
+    if (frame.type == MUX_OPEN)
+        co_return co_await open_stream(frame.stream, frame.payload);
+
+    auto it = streams.find(frame.stream);
+    if (it == streams.end())
+        co_return true;  // 流可能刚被关闭，迟到的帧直接丢弃
+    MuxStream *stream = it->second;
+
+    if (frame.type == MUX_DATA && stream->upload)
+        co_return co_await upload_data(*stream, frame.payload);
+    if (frame.type == MUX_WINDOW && frame.payload.size() == 4)
+    {
+        stream->window += get_be32(frame.payload.data());
+        stream->last_active = reactor_now();
+    }
+    else if (frame.type == MUX_CLOSE)
+    {
+        log_info("Mux stream %u closed by client: %s", frame.stream, frame.payload.c_str());
+        close_stream(frame.stream);
+    }
+    co_return true;
+}
+
+bool MuxSession::has_pending_send() const
+{
+    for (auto it = streams.begin(); it != streams.end(); it++)
+    {
+        if (!it->second->upload && it->second->window > 0)
+            return true;
+    }
+    return false;
+}
+
+Co<bool> MuxSession::pump(int &timeout)
+{
+    std::string frame;
+    bool sent = false;
+    timeout = -1;
+    for (auto it = streams.begin(); it != streams.end();)
+    {
+        MuxStream *stream = it->second;
+        ++it;  // close_stream 会删除当前元素
+        if (stream->upload || stream->window <= 0)
+            continue;
+
+        size_t want = std::min((size_t)MUX_SLICE, stream->file_size - stream->done);
+        int wait_ms;
+        if (!bulk_try_acquire(stream->transfer, want, wait_ms))
+        {
+            // 被限速，不能阻塞，连接线程还要收聊天消息
+            // 等的是服务器自己，不算卡住
+            timeout = timeout < 0 ? wait_ms : std::min(timeout, wait_ms);
+            stream->last_active = reactor_now();
+            continue;
+        }
+        sent = true;
+        const char *data = stream->in->data + stream->done;
+        size_t n = want;
+
+        frame.clear();
+        if (stream->compressed)
+            co_await cpu_run([&] { stream->encoder.encode(data, n, frame); });
+        else
+            frame.assign(data, n);
+        stream->window -= frame.size();
+        stream->done += n;
+        stream->last_active = reactor_now();
+        if (!(co_await send_frame(MUX_DATA, stream->id, frame)))
+            co_return false;
+
+        if (stream->done >= stream->file_size)
+        {
+            uint32_t id = stream->id;
+            close_stream(id);
+            log_info("Mux download complete %u", id);
+            if (!(co_await send_frame(MUX_CLOSE, id, "OK")))
+                co_return false;
+        }
+    }
+    if (sent && has_pending_send())
+        timeout = 0;
+    co_return true;
+}
+
+Co<bool> MuxSession::reap_stalled(int64_t now, int stall_ms)
+{
+    for (auto it = streams.begin(); it != streams.end();)
+    {
+        MuxStream *stream = it->second;
+        ++it;
+        if (now - stream->last_active < stall_ms)
+            continue;
+        uint32_t id = stream->id;
+        log_info("Mux stream %u stalled: %s", id, stream->filename.c_str());
+        close_stream(id);
+        if (!(co_await send_frame(MUX_CLOSE, id, "ERROR timeout")))
+            co_return false;
+    }
+    co_return true;
+}
+
+std::string MuxSession::save()
+{
+    StateWriter w;
+    w.u64(streams.size());
+    for (auto it = streams.begin(); it != streams.end(); it++)
+    {
+        MuxStream *stream = it->second;
+        if (stream->out.is_open())
+            stream->out.flush_sync();
+        w.u64(stream->id);
+        w.u8(stream->upload);
+        w.u8(stream->compressed);
+        w.str(stream->filename);
+        w.u64(stream->file_size);
+        w.u64(stream->done);
+        w.u64((uint64_t)stream->window);
+        w.u8(stream->encoder.decided);
+        w.u8(stream->encoder.bypass);
+        w.str(stream->decoder.pending);
+    }
+    return w.data;
+}
+
+Co<bool> MuxSession::restore(const std::string &data)
+{
+    StateReader r(data);
+    uint64_t count = r.u64();
+    for (uint64_t i = 0; i < count && r.ok; i++)
+    {
+        MuxStream *stream = new MuxStream;
+        stream->id = r.u64();
+        stream->upload = r.u8();
+        stream->compressed = r.u8();
+        stream->filename = r.str();
+        stream->file_size = r.u64();
+        stream->done = r.u64();
+        stream->window = (int64_t)r.u64();
+        stream->encoder.decided = r.u8();
+        stream->encoder.bypass = r.u8();
+        stream->decoder.pending = r.str();
+        stream->last_active = reactor_now();
+        streams[stream->id] = stream;
+
+        // 上传接着写旧进程的临时文件，已写的部分重新算哈希；下载重新打开同一个文件
+        bool ok;
+        if (stream->upload)
+        {
+            std::string tmp_name = catalog_path(stream->filename) + UPLOAD_TMP_SUFFIX;
+            ok = stream->out.open(tmp_name, stream->file_size, stream->done);
+            if (ok)
+                ok = co_await digest_file(stream->digest, tmp_name, stream->done);
+        }
+        else
+        {
+            stream->in = filecache_open(catalog_path(stream->filename));
+            if (stream->in && stream->in->size != stream->file_size)
+                stream->in.reset();  // 交接期间文件被新的上传替换了
+            ok = (bool)stream->in;
+            if (ok)
+                stream->transfer = bulk_register(sock.fd());
+        }
+        log_info("Mux %s %u resumed: %s %zu/%zu", stream->upload ? "upload" : "download",
+               stream->id, stream->filename.c_str(), stream->done, stream->file_size);
+        if (!ok)
+        {
+            uint32_t id = stream->id;
+            close_stream(id);
+            if (!(co_await send_frame(MUX_CLOSE, id, "ERROR cannot resume")))
+                co_return false;
+        }
+    }
+    co_return r.ok;
+}
@@ -0,0 +1,101 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <string>
+#include <map>
+#include <functional>
+#include <stdio.h>
+#include <stdint.h>
+#include "compress.h"
+#include "filecache.h"
+#include "reactor.h"
+#include "digest.h"
+#include "diskio.h"
+
+// 多路复用: 聊天、用户列表和多个文件流共用客户端的一条长连接
+// 帧: 1 字节类型 + 4 字节大端流号 + 4 字节大端长度 + 数据
+#define MUX_HEADER_SIZE 9
+#define MUX_DATA 'D'    // 流 0 上是一条聊天/控制消息，其他流上是文件数据
+#define MUX_OPEN 'O'    // 客户端: "UPLOAD name size" / "DOWNLOAD name"，服务器回复下载文件大小
+#define MUX_WINDOW 'W'  // 4 字节大端窗口增量
+#define MUX_CLOSE 'C'   // "OK" / "CANCEL" / "ERROR ..."
+
+#define MUX_CHAT_STREAM 0
+#define MUX_INITIAL_WINDOW (256 * 1024)  // 每个流初始的发送窗口
+#define MUX_SLICE (16 * 1024)            // 下载每次只发一小片，聊天帧可以插在中间
+#define MUX_MAX_FRAME (1024 * 1024)
+#define MUX_MAX_STREAMS 16
+
+struct MuxFrame
+{
+    char type;
+    uint32_t stream;
+    std::string payload;
+};
+
+std::string mux_frame(char type, uint32_t stream, const char *payload, size_t len);
+std::string mux_frame(char type, uint32_t stream, const std::string &payload);
+
+// 从字节流中拆帧
+struct MuxDecoder
+{
+    std::string pending;
+    size_t pos = 0;
+
+    void feed(const char *src, size_t len);
+    // 取出下一个完整的帧；没有完整帧返回 false，帧太大时 error 为 true
+    bool next(MuxFrame &frame, bool &error);
+};
+
+struct MuxStream
+{
+    uint32_t id;
+    bool upload;
+    bool compressed;
+    std::string filename;
+    size_t file_size;
+    size_t done;       // 已读写的原始字节数
+    int64_t window;    // 下载: 还能发送的字节数
+    int transfer;      // 下载: 带宽调度中的传输号
+    int64_t last_active;  // 上次有进展的时间，用于关闭卡住的流
+    DiskWriter out;     // 上传: 写临时文件，完成后改名
+    FileRef in;         // 下载: 缓存中的文件
+    FrameEncoder encoder;
+    FrameDecoder decoder;
+    Sha256 digest;      // 上传: 原始数据的哈希
+};
+
+// 一条多路复用连接上的所有文件流，只由该连接的协程访问
+class MuxSession
+{
+public:
+    // on_upload_done 在上传完成后调用，用于广播 "FILE name size sha256"
+    MuxSession(AsyncSock &client_sock, std::function<void(const std::string &, size_t, const std::string &)> on_upload_done);
+    ~MuxSession();
+
+    // 处理一个文件流的帧，返回 false 表示连接已不可用
+    Co<bool> handle_frame(const MuxFrame &frame);
+    // 是否有下载流还有窗口可以发送
+    bool has_pending_send() const;
+    // 每个有窗口的下载流发送一片，轮转保证公平
+    // timeout 返回下次等待读的超时: 0 立即继续，>0 被限速，-1 没有可发送的数据
+    Co<bool> pump(int &timeout);
+    // 关闭 stall_ms 内没有任何进展的文件流(客户端不再发数据或不再给窗口)
+    Co<bool> reap_stalled(int64_t now, int stall_ms);
+
+    // 热升级: 保存所有文件流的进度，新进程里 restore() 后继续传输
+    std::string save();
+    Co<bool> restore(const std::string &data);
+
+private:
+    Co<bool> open_stream(uint32_t id, std::string request);
+    Co<bool> upload_data(MuxStream &stream, const std::string &payload);
+    Co<bool> send_frame(char type, uint32_t id, std::string payload);
+    void close_stream(uint32_t id);
+
+    AsyncSock &sock;
+    std::function<void(const std::string &, size_t, const std::string &)> upload_done;
+    std::map<uint32_t, MuxStream *> streams;
+};
+
+#endif // MUX_H
@@ -0,0 +1,84 @@
+#include "p2p.h"
+#include <openssl/rand.h>
+#include <map>
+#include <vector>
+
+struct OfferList
+{
+    std::vector<PeerOffer> offers;
+    size_t next = 0;   // 轮流分配，下载分散到所有提供者
+};
+
+// 只在反应器线程上使用
+static std::map<std::string, OfferList> offers;
+
+void p2p_offer(const std::string &filename, const PeerOffer &offer)
+{
+    OfferList &list = offers[filename];
+    for (size_t i = 0; i < list.offers.size(); i++)
+    {
+        if (list.offers[i].fd == offer.fd)
+        {
+            list.offers[i] = offer;
+            return;
+        }
+    }
+    if (list.offers.size() >= P2P_MAX_OFFERS)
+        list.offers.erase(list.offers.begin());
+    list.offers.push_back(offer);
+}
+
+void p2p_withdraw(int fd)
+{
+    for (auto it = offers.begin(); it != offers.end();)
+    {
+        std::vector<PeerOffer> &list = it->second.offers;
+        for (size_t i = 0; i < list.size();)
+        {
+            if (list[i].fd == fd)
+                list.erase(list.begin() + i);
+            else
+                i++;
+        }
+        if (list.empty())
+            it = offers.erase(it);
+        else
+            it++;
+    }
+}
+
+bool p2p_find(const std::string &filename, const std::string &sha256, PeerOffer &offer)
+{
+    auto it = offers.find(filename);
+    if (it == offers.end())
+        return false;
+    OfferList &list = it->second;
+    for (size_t i = 0; i < list.offers.size();)
+    {
+        if (list.offers[i].sha256 != sha256)
+            list.offers.erase(list.offers.begin() + i);
+        else
+            i++;
+    }
+    if (list.offers.empty())
+    {
+        offers.erase(it);
+        return false;
+    }
+    offer = list.offers[list.next++ % list.offers.size()];
+    return true;
+}
+
+std::string p2p_token()
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char raw[P2P_TOKEN_BYTES];
+    RAND_bytes(raw, sizeof(raw));
+    std::string token;
+    for (size_t i = 0; i < sizeof(raw); i++)
+    {
+        token += digits[raw[i] >> 4];
+        token += digits[raw[i] & 0xf];
+    }
+    return token;
+}
@@ -0,0 +1,35 @@
+#ifndef P2P_H
+#define P2P_H
+
+#include <string>
+#include <stdint.h>
+
+// 点对点传输的会合点: 文件数据在两个客户端之间直接传，服务器只交换地址和一次性令牌
+// 协商了 p2p 能力的客户端在聊天连接上:
+//   "OFFER <文件名> <端口>"   上传完成或下载校验通过后，声明自己可以在这个端口提供目录里的当前版本
+//   "PEER <文件名>"           下载前询问，回复 "PEER <文件名> <ip> <端口> <令牌> <大小> <SHA-256>"，
+//                             没有可用的提供者时回复 "PEER <文件名> -"，客户端改从服务器下载
+// 同时通知提供者 "PEERTOKEN <文件名> <令牌>"，下载者直连后发送 "P2P <令牌>\n"，
+// 提供者按 DOWNLOAD 的格式回复: 文件大小 + "\n" + 文件数据；下载者按 SHA-256 校验，失败改走服务器
+// 提供者只登记在本节点上，聊天连接断开或文件换了新版本后不再使用
+
+#define P2P_TOKEN_BYTES 16
+#define P2P_MAX_OFFERS 16   // 每个文件最多记这么多提供者
+
+struct PeerOffer
+{
+    int fd;               // 提供者的聊天连接
+    std::string ip;
+    int port;
+    std::string sha256;   // 提供的是哪个版本
+};
+
+void p2p_offer(const std::string &filename, const PeerOffer &offer);
+// 聊天连接断开，撤回它的所有登记
+void p2p_withdraw(int fd);
+// 轮流选一个提供当前版本(sha256)的提供者，旧版本的登记顺便删掉
+bool p2p_find(const std::string &filename, const std::string &sha256, PeerOffer &offer);
+// 随机的一次性令牌，十六进制
+std::string p2p_token();
+
+#endif // P2P_H
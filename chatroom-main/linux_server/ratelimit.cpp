@@ -0,0 +1,263 @@
+#include "ratelimit.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <map>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+#define BULK_MIN_BURST (2 * BULK_QUANTUM)
+#define BULK_MAX_WAIT 1000  // ms
+
+struct Bucket
+{
+    double rate;    // 字节/秒，0 表示不限速
+    double burst;
+    double tokens;
+};
+
+struct Transfer
+{
+    int conn;
+    size_t want;
+    int64_t deficit;
+    bool queued;
+    bool granted;
+};
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sched_once = PTHREAD_ONCE_INIT;
+static Bucket global_bucket = {0, 0, 0};
+static double conn_rate = 0;
+// client socket fd, 连接的令牌桶
+static std::map<int, Bucket> conn_buckets;
+// client socket fd, 该连接上的传输数
+static std::map<int, int> conn_refs;
+static std::map<int, Transfer> transfers;
+// 等待发送的传输，队首是 DRR 当前轮到的传输
+static std::deque<int> backlog;
+static int next_transfer = 1;
+static struct timespec last_refill;
+
+static void sched_init()
+{
+    // 补充令牌用单调时钟，不受系统时间调整影响
+    clock_gettime(CLOCK_MONOTONIC, &last_refill);
+}
+
+static void set_rate(Bucket &bucket, double rate)
+{
+    bucket.rate = rate;
+    bucket.burst = std::max(rate / 5, (double)BULK_MIN_BURST);
+    bucket.tokens = std::min(bucket.tokens, bucket.burst);
+}
+
+static bool has_tokens(const Bucket &bucket, size_t bytes)
+{
+    return bucket.rate == 0 || bucket.tokens >= bytes;
+}
+
+static void take_tokens(Bucket &bucket, size_t bytes)
+{
+    if (bucket.rate > 0)
+        bucket.tokens -= bytes;
+}
+
+// 还要等多少毫秒桶里才有 bytes 个令牌
+static int wait_for(const Bucket &bucket, size_t bytes)
+{
+    if (has_tokens(bucket, bytes))
+        return 0;
+    return (int)((bytes - bucket.tokens) * 1000 / bucket.rate) + 1;
+}
+
+// 调用者持有 sched_mutex
+static void refill()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - last_refill.tv_sec) + (now.tv_nsec - last_refill.tv_nsec) / 1e9;
+    last_refill = now;
+    if (global_bucket.rate > 0)
+        global_bucket.tokens = std::min(global_bucket.burst, global_bucket.tokens + global_bucket.rate * elapsed);
+    for (auto it = conn_buckets.begin(); it != conn_buckets.end(); it++)
+    {
+        Bucket &bucket = it->second;
+        if (bucket.rate > 0)
+            bucket.tokens = std::min(bucket.burst, bucket.tokens + bucket.rate * elapsed);
+    }
+}
+
+// 按 DRR 顺序给尽可能多的等待者发放配额，调用者持有 sched_mutex
+static void schedule()
+{
+    refill();
+    size_t skips = 0;
+    while (!backlog.empty() && skips < backlog.size() * 4)
+    {
+        int id = backlog.front();
+        Transfer &t = transfers[id];
+        if (t.deficit < (int64_t)t.want)
+        {
+            // 本轮配额不够，补一个 quantum 后排到队尾
+            t.deficit += BULK_QUANTUM;
+            backlog.pop_front();
+            backlog.push_back(id);
+            skips++;
+            continue;
+        }
+        if (!has_tokens(global_bucket, t.want))
+            break;  // 全局桶空了，谁都不能发
+        Bucket &conn = conn_buckets[t.conn];
+        if (!has_tokens(conn, t.want))
+        {
+            // 只是这个连接超速，让给别人，保留已攒的配额
+            backlog.pop_front();
+            backlog.push_back(id);
+            skips++;
+            continue;
+        }
+        take_tokens(global_bucket, t.want);
+        take_tokens(conn, t.want);
+        t.deficit -= t.want;
+        t.granted = true;
+        t.queued = false;
+        backlog.pop_front();
+        skips = 0;
+    }
+}
+
+void bulk_set_limits(uint64_t global_rate, uint64_t conn_rate_)
+{
+    pthread_once(&sched_once, sched_init);
+    pthread_mutex_lock(&sched_mutex);
+    set_rate(global_bucket, global_rate);
+    conn_rate = conn_rate_;
+    for (auto it = conn_buckets.begin(); it != conn_buckets.end(); it++)
+        set_rate(it->second, conn_rate);
+    schedule();
+    pthread_mutex_unlock(&sched_mutex);
+    log_info("Rate limit: global %llu B/s, per connection %llu B/s",
+             (unsigned long long)global_rate, (unsigned long long)conn_rate_);
+}
+
+static uint64_t parse_rate(const std::string &str)
+{
+    char *end;
+    double value = strtod(str.c_str(), &end);
+    switch (*end)
+    {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+    }
+    return value > 0 ? (uint64_t)value : 0;
+}
+
+bool bulk_load_config(const char *path)
+{
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+        log_error("ratelimit config: %s", strerror(errno));
+        return false;
+    }
+    uint64_t global_rate = 0, conn_rate_ = 0;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream iss(line);
+        std::string key, value;
+        if (!(iss >> key >> value) || key[0] == '#')
+            continue;
+        if (key == "global")
+            global_rate = parse_rate(value);
+        else if (key == "conn")
+            conn_rate_ = parse_rate(value);
+    }
+    bulk_set_limits(global_rate, conn_rate_);
+    return true;
+}
+
+int bulk_register(int conn)
+{
+    pthread_once(&sched_once, sched_init);
+    pthread_mutex_lock(&sched_mutex);
+    int id = next_transfer++;
+    transfers[id] = Transfer{conn, 0, 0, false, false};
+    if (conn_refs[conn]++ == 0)
+    {
+        Bucket bucket = {0, 0, 0};
+        set_rate(bucket, conn_rate);
+        bucket.tokens = bucket.burst;
+        conn_buckets[conn] = bucket;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return id;
+}
+
+void bulk_unregister(int transfer)
+{
+    pthread_mutex_lock(&sched_mutex);
+    auto it = transfers.find(transfer);
+    if (it != transfers.end())
+    {
+        int conn = it->second.conn;
+        if (it->second.queued)
+            backlog.erase(std::find(backlog.begin(), backlog.end(), transfer));
+        transfers.erase(it);
+        if (--conn_refs[conn] == 0)
+        {
+            conn_refs.erase(conn);
+            conn_buckets.erase(conn);
+        }
+        // 让出的位置可能让别人满足条件
+        schedule();
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+// 调用者持有 sched_mutex
+static bool try_acquire_locked(Transfer &t, int id, size_t bytes, int &wait_ms)
+{
+    if (!t.granted && !t.queued)
+    {
+        t.want = bytes;
+        t.queued = true;
+        backlog.push_back(id);
+    }
+    if (!t.granted)
+        schedule();
+    if (t.granted)
+    {
+        t.granted = false;
+        return true;
+    }
+    wait_ms = std::max(wait_for(global_bucket, bytes), wait_for(conn_buckets[t.conn], bytes));
+    wait_ms = std::min(std::max(wait_ms, 1), BULK_MAX_WAIT);
+    return false;
+}
+
+bool bulk_try_acquire(int transfer, size_t bytes, int &wait_ms)
+{
+    pthread_mutex_lock(&sched_mutex);
+    auto it = transfers.find(transfer);
+    bool ok = it == transfers.end() || try_acquire_locked(it->second, transfer, bytes, wait_ms);
+    pthread_mutex_unlock(&sched_mutex);
+    return ok;
+}
+
+void bulk_charge_chat(size_t bytes)
+{
+    pthread_mutex_lock(&sched_mutex);
+    // 可以透支，聊天从不等待
+    take_tokens(global_bucket, bytes);
+    pthread_mutex_unlock(&sched_mutex);
+}
@@ -0,0 +1,37 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 文件传输的带宽调度
+// 全局和每个连接各有一个令牌桶限制批量数据；所有等待发送的传输按差额轮询(DRR)轮流获得配额
+// 聊天和控制消息不经过调度，发送后只从全局桶里扣除，保证聊天优先
+
+#define BULK_QUANTUM (64 * 1024)  // DRR 每轮给一个传输增加的配额
+
+// 速率单位为字节/秒，0 表示不限速
+void bulk_set_limits(uint64_t global_rate, uint64_t conn_rate);
+// 读取配置文件，每行 "global <rate>" 或 "conn <rate>"，rate 可带 K/M/G 后缀
+bool bulk_load_config(const char *path);
+
+// 登记一个传输，conn 是所属连接的 fd
+int bulk_register(int conn);
+void bulk_unregister(int transfer);
+
+// 不阻塞: 可以发送返回 true；否则返回 false 并给出建议的等待时间(毫秒)
+// 同一个传输下次必须以相同的 bytes 重试
+bool bulk_try_acquire(int transfer, size_t bytes, int &wait_ms);
+
+// 聊天消息已经发出，从全局桶中扣除
+void bulk_charge_chat(size_t bytes);
+
+// 作用域内登记一个传输
+struct BulkTransfer
+{
+    int id;
+    explicit BulkTransfer(int conn) : id(bulk_register(conn)) {}
+    ~BulkTransfer() { bulk_unregister(id); }
+};
+
+#endif // RATELIMIT_H
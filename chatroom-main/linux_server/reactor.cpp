@@ -0,0 +1,504 @@
+#include "reactor.h"
+#include "tls.h"
+#include "capture.h"
+#include "log.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+
+#define REACTOR_EVENTS 256
+#define OUTQ_LIMIT (4 * 1024 * 1024)   // 发送队列积压超过该值认为客户端已经卡死
+#define OUTQ_COMPACT (64 * 1024)
+
+// 分层时间轮: 4 层，每层 256 个槽，精度 1ms，最长 2^32ms(约 49 天)
+// 第 0 层每个槽是 1ms，第 n 层每个槽覆盖第 n-1 层一整圈
+// 添加和取消都是 O(1)，第 0 层转完一圈时把上一层的一个槽拆分到下面
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELAY ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static int epfd = -1;
+static std::unordered_map<int, AsyncSock *> socks;
+static TimerEntry *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static int64_t wheel_tick;     // 下一个要处理的毫秒，之前的都已到期处理
+static size_t timer_count;
+// 下一轮要恢复的协程
+static std::deque<std::coroutine_handle<>> ready_queue;
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t reactor_now()
+{
+    return now_ms();
+}
+
+// 按离 wheel_tick 的距离选层，同一层里按到期时间取槽
+static void wheel_insert(TimerEntry *timer)
+{
+    if (timer->deadline < wheel_tick)
+        timer->deadline = wheel_tick;
+    if (timer->deadline - wheel_tick >= WHEEL_MAX_DELAY)
+        timer->deadline = wheel_tick + WHEEL_MAX_DELAY - 1;
+    int64_t delta = timer->deadline - wheel_tick;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= ((int64_t)1 << (WHEEL_BITS * (level + 1))))
+        level++;
+    TimerEntry **slot = &wheel[level][(timer->deadline >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void wheel_remove(TimerEntry *timer)
+{
+    if (!timer->pprev)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = nullptr;
+    timer->pprev = nullptr;
+    timer_count--;
+}
+
+static void add_timer(TimerEntry *timer, int ms, std::coroutine_handle<> h)
+{
+    timer->deadline = now_ms() + ms;
+    timer->handle = h;
+    timer->fired = false;
+    wheel_insert(timer);
+    timer_count++;
+}
+
+// 把上层一个槽里的定时器重新放到下层，返回槽号，为 0 说明这一层也转完了一圈
+static int wheel_cascade(int level)
+{
+    int index = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    TimerEntry *timer = wheel[level][index];
+    wheel[level][index] = nullptr;
+    while (timer)
+    {
+        TimerEntry *next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+static void fire_timer(TimerEntry *timer)
+{
+    ready_queue.push_back(timer->handle);
+    timer->fired = true;
+    // 读写等待超时，这个 fd 之后的事件不能再唤醒它
+    if (timer->waiter)
+    {
+        *timer->waiter = nullptr;
+        *timer->waiter_timer = nullptr;
+    }
+}
+
+// 处理到 now 为止到期的所有槽
+static void wheel_advance(int64_t now)
+{
+    if (timer_count == 0)
+    {
+        wheel_tick = std::max(wheel_tick, now + 1);
+        return;
+    }
+    while (wheel_tick <= now)
+    {
+        int index = wheel_tick & WHEEL_MASK;
+        for (int level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+        {
+            if (wheel_cascade(level) != 0)
+                break;
+        }
+        TimerEntry *timer = wheel[0][index];
+        while (timer)
+        {
+            TimerEntry *next = timer->next;
+            wheel_remove(timer);
+            fire_timer(timer);
+            timer = next;
+        }
+        wheel_tick++;
+    }
+}
+
+// 到下一个可能有定时器到期的时刻的毫秒数
+// 第 0 层这一圈里没有定时器时最多睡到这一圈结束，再由拆分决定
+static int wheel_timeout(int64_t now)
+{
+    if (timer_count == 0)
+        return -1;
+    int64_t tick = wheel_tick;
+    int64_t end = (wheel_tick | WHEEL_MASK) + 1;
+    while (tick < end && !wheel[0][tick & WHEEL_MASK])
+        tick++;
+    return (int)std::max<int64_t>(0, tick - now);
+}
+
+void reactor_init()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        log_error("epoll_create1() error: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    wheel_tick = now_ms();
+}
+
+void reactor_run()
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    while (true)
+    {
+        int timeout = ready_queue.empty() ? wheel_timeout(now_ms()) : 0;
+
+        int n = epoll_wait(epfd, events, REACTOR_EVENTS, timeout);
+        if (n == -1 && errno != EINTR)
+        {
+            log_error("epoll_wait() error: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            auto it = socks.find(events[i].data.fd);
+            if (it != socks.end())
+                it->second->on_event(events[i].events);
+        }
+
+        // 到期的定时器
+        wheel_advance(now_ms());
+
+        // 只恢复这一轮之前排队的，让出的协程下一轮再跑
+        size_t count = ready_queue.size();
+        while (count-- > 0)
+        {
+            std::coroutine_handle<> h = ready_queue.front();
+            ready_queue.pop_front();
+            h.resume();
+        }
+    }
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    add_timer(&timer, ms, h);
+}
+
+void reactor_post(std::coroutine_handle<> h)
+{
+    ready_queue.push_back(h);
+}
+
+void YieldAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    ready_queue.push_back(h);
+}
+
+bool ReadyAwaiter::await_ready() const noexcept
+{
+    return sock->broken;
+}
+
+void ReadyAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    std::coroutine_handle<> &waiter = write ? sock->writer : sock->reader;
+    TimerEntry *&waiter_timer = write ? sock->writer_timer : sock->reader_timer;
+    waiter = h;
+    waiter_timer = nullptr;
+    if (timeout_ms >= 0)
+    {
+        timer.waiter = &waiter;
+        timer.waiter_timer = &waiter_timer;
+        add_timer(&timer, timeout_ms, h);
+        waiter_timer = &timer;
+    }
+}
+
+bool ReadyAwaiter::await_resume() noexcept
+{
+    return !timer.fired;
+}
+
+size_t reactor_queued_bytes()
+{
+    size_t total = 0;
+    for (auto &entry : socks)
+        total += entry.second->outq.size() - entry.second->outq_pos;
+    return total;
+}
+
+AsyncSock::AsyncSock(int fd)
+    : sock(fd), wr_ready(true), broken(false), write_timeout(-1), capture_conn(0), outq_pos(0),
+      reader_timer(nullptr), writer_timer(nullptr)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        log_error("epoll_ctl() error: %s", strerror(errno));
+        broken = true;
+    }
+    socks[fd] = this;
+}
+
+AsyncSock::~AsyncSock()
+{
+    // detach() 之后 fd 号可能已经给了别的连接
+    auto it = socks.find(sock);
+    if (it == socks.end() || it->second != this)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+    socks.erase(it);
+}
+
+void AsyncSock::detach()
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+    socks.erase(sock);
+    if (reader_timer)
+        wheel_remove(reader_timer);
+    if (writer_timer)
+        wheel_remove(writer_timer);
+    reader = nullptr;
+    writer = nullptr;
+    reader_timer = nullptr;
+    writer_timer = nullptr;
+    broken = true;
+}
+
+AsyncSock *AsyncSock::find(int fd)
+{
+    auto it = socks.find(fd);
+    return it == socks.end() ? NULL : it->second;
+}
+
+// 唤醒等待的协程: 取消它的超时，放进下一轮的就绪队列
+// 不直接 resume，协程可能在里面结束并释放这个 AsyncSock
+void AsyncSock::wake(bool write)
+{
+    std::coroutine_handle<> &h = write ? writer : reader;
+    TimerEntry *&timer = write ? writer_timer : reader_timer;
+    if (!h)
+        return;
+    if (timer)
+    {
+        wheel_remove(timer);
+        timer = nullptr;
+    }
+    ready_queue.push_back(h);
+    h = nullptr;
+}
+
+void AsyncSock::on_event(uint32_t events)
+{
+    bool rd = events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+    bool wr = events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+    if (wr)
+    {
+        wr_ready = true;
+        if (outq_pos < outq.size())
+            flush();
+    }
+    if (rd || broken)
+        wake(false);
+    if ((wr && outq_pos == outq.size()) || broken)
+        wake(true);
+}
+
+bool AsyncSock::flush()
+{
+    while (!broken && outq_pos < outq.size())
+    {
+        ssize_t sent = sock_send(sock, outq.data() + outq_pos, outq.size() - outq_pos);
+        if (sent > 0)
+        {
+            outq_pos += sent;
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            wr_ready = false;
+            break;
+        }
+        broken = true;
+    }
+    if (outq_pos == outq.size())
+    {
+        outq.clear();
+        outq_pos = 0;
+    }
+    else if (outq_pos >= OUTQ_COMPACT)
+    {
+        // 已写出的部分丢掉，未写出的部分保持在队首，TLS 重试时数据不变
+        outq.erase(0, outq_pos);
+        outq_pos = 0;
+    }
+    return !broken;
+}
+
+ssize_t AsyncSock::try_read(void *buf, size_t len)
+{
+    ssize_t n = sock_recv(sock, buf, len);
+    if (n > 0 && capture_conn)
+        capture_data(capture_conn, buf, n);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        errno = EAGAIN;
+        if (broken)
+            errno = ECONNRESET;  // 发送失败的连接不再等待读
+    }
+    return n;
+}
+
+Co<ssize_t> AsyncSock::read(void *buf, size_t len, int timeout_ms)
+{
+    int64_t deadline = now_ms() + timeout_ms;
+    while (true)
+    {
+        ssize_t n = try_read(buf, len);
+        if (n >= 0 || errno != EAGAIN)
+            co_return n;
+        int remaining = timeout_ms < 0 ? -1 : (int)std::max<int64_t>(0, deadline - now_ms());
+        bool ok = co_await readable(remaining);
+        if (!ok)
+        {
+            errno = ETIMEDOUT;
+            co_return -1;
+        }
+    }
+}
+
+// 等待可写，超过 write_timeout 没有进展就放弃这个连接
+Co<bool> AsyncSock::wait_writable()
+{
+    bool ok = co_await writable(write_timeout);
+    if (ok)
+        co_return true;
+    log_warn("Client %d write stalled, disconnecting", sock);
+    broken = true;
+    shutdown(sock, SHUT_RDWR);
+    wake(false);
+    errno = ETIMEDOUT;
+    co_return false;
+}
+
+bool AsyncSock::queue(const void *data, size_t len)
+{
+    if (broken)
+        return false;
+    if (outq.size() - outq_pos + len > OUTQ_LIMIT)
+    {
+        log_warn("Client %d send queue overflow, disconnecting", sock);
+        broken = true;
+        shutdown(sock, SHUT_RDWR);  // 连接协程读到错误后自己清理
+        wake(false);
+        wake(true);
+        return false;
+    }
+    outq.append((const char *)data, len);
+    if (wr_ready && !flush())
+    {
+        wake(false);
+        return false;
+    }
+    if (outq_pos == outq.size())
+        wake(true);
+    return true;
+}
+
+Co<bool> AsyncSock::write_all(const void *data, size_t len)
+{
+    // 队列为空时先直接写，只有写不完的部分才拷贝进队列
+    const char *ptr = (const char *)data;
+    while (!broken && wr_ready && outq_pos == outq.size() && len > 0)
+    {
+        ssize_t sent = sock_send(sock, ptr, len);
+        if (sent > 0)
+        {
+            ptr += sent;
+            len -= sent;
+        }
+        else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            wr_ready = false;
+        else
+            broken = true;
+    }
+    outq.append(ptr, len);
+    while (true)
+    {
+        if (!flush())
+            co_return false;
+        if (outq_pos == outq.size())
+            co_return true;
+        if (!(co_await wait_writable()))
+            co_return false;
+    }
+}
+
+Co<ssize_t> AsyncSock::sendfile(int file_fd, off_t offset, size_t len)
+{
+    // 先把排在前面的消息写完，文件数据不能插到它们中间
+    while (outq_pos < outq.size())
+    {
+        if (!flush())
+            co_return -1;
+        if (outq_pos < outq.size() && !(co_await wait_writable()))
+            co_return -1;
+    }
+    while (true)
+    {
+        // 和 write_all 一样，连接已经断了就不再往里推文件数据
+        if (broken)
+            co_return -1;
+        ssize_t sent = sock_sendfile(sock, file_fd, offset, len);
+        if (sent >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            co_return sent;
+        wr_ready = false;
+        if (!(co_await wait_writable()))
+            co_return -1;
+    }
+}
+
+Co<bool> AsyncSock::tls_accept()
+{
+    int64_t deadline = now_ms() + TLS_HANDSHAKE_TIMEOUT;
+    while (true)
+    {
+        int ret = tls_accept_step(sock);
+        if (ret == TLS_DONE)
+            co_return true;
+        int remaining = (int)(deadline - now_ms());
+        if (ret == TLS_FAILED || remaining <= 0)
+            co_return false;
+        bool ok;
+        if (ret == TLS_WANT_READ)
+            ok = co_await readable(remaining);
+        else
+            ok = co_await writable(remaining);
+        if (!ok)
+        {
+            log_warn("TLS handshake timeout: %d", sock);
+            co_return false;
+        }
+    }
+}
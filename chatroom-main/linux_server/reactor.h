@@ -0,0 +1,242 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// 单线程 epoll 反应器 + C++20 协程
+// 每个连接是一个协程，等待 I/O 时挂起，不再占用一个线程和 8MB 栈
+
+// Co<T>: 可以 co_await 的子协程，被等待时才开始执行，结束后回到等待者
+template <typename T>
+class Co;
+
+namespace detail
+{
+template <typename Promise>
+struct FinalAwaiter
+{
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+    {
+        return h.promise().continuation;
+    }
+    void await_resume() noexcept {}
+};
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+} // namespace detail
+
+template <typename T>
+class Co
+{
+public:
+    struct promise_type : detail::PromiseBase
+    {
+        T value{};
+
+        Co get_return_object() { return Co(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        detail::FinalAwaiter<promise_type> final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    Co(Co &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    ~Co()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume() { return std::move(handle.promise().value); }
+
+private:
+    explicit Co(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <>
+class Co<void>
+{
+public:
+    struct promise_type : detail::PromiseBase
+    {
+        Co get_return_object() { return Co(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        detail::FinalAwaiter<promise_type> final_suspend() noexcept { return {}; }
+        void return_void() {}
+    };
+
+    Co(Co &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    ~Co()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    void await_resume() {}
+
+private:
+    explicit Co(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Task: 顶层协程，创建后立即执行，结束时自己释放
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+void reactor_init();
+// 运行事件循环，不返回
+void reactor_run();
+// 下一轮恢复协程 h，只能在反应器线程调用
+void reactor_post(std::coroutine_handle<> h);
+// 单调时钟，毫秒
+int64_t reactor_now();
+// 所有连接发送队列里还没写出的字节数，过载检测使用
+size_t reactor_queued_bytes();
+
+class AsyncSock;
+
+// 时间轮上的定时器，嵌在等待者里，挂起期间一直有效，不用分配内存
+struct TimerEntry
+{
+    TimerEntry *next = nullptr;
+    TimerEntry **pprev = nullptr;  // 指向前一个节点的 next，不在轮上时为 NULL
+    int64_t deadline = 0;
+    std::coroutine_handle<> handle;
+    // 等待读写超时的连接上登记的等待者，到期时清掉，sleep 为 NULL
+    std::coroutine_handle<> *waiter = nullptr;
+    TimerEntry **waiter_timer = nullptr;
+    bool fired = false;
+};
+
+// co_await reactor_sleep(ms)
+struct SleepAwaiter
+{
+    int ms;
+    TimerEntry timer;
+    bool await_ready() const noexcept { return ms <= 0; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() noexcept {}
+};
+inline SleepAwaiter reactor_sleep(int ms) { return SleepAwaiter{ms, {}}; }
+
+// co_await reactor_yield(): 让其他连接先跑一轮
+struct YieldAwaiter
+{
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() noexcept {}
+};
+inline YieldAwaiter reactor_yield() { return YieldAwaiter{}; }
+
+// 等待 fd 下一次变为可读/可写，调用前必须已经读写到 EAGAIN(边沿触发)
+// timeout_ms < 0 表示不超时；co_await 结果为 false 表示超时
+struct ReadyAwaiter
+{
+    AsyncSock *sock;
+    bool write;
+    int timeout_ms;
+    TimerEntry timer;
+
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() noexcept;
+};
+
+// 登记在反应器上的非阻塞 fd，读写都经过 tls.h 的 socket 层
+// 写入先进入发送队列: 广播可以随时追加完整的消息，不会和正在发送的数据交错
+class AsyncSock
+{
+public:
+    explicit AsyncSock(int fd);
+    ~AsyncSock();
+    AsyncSock(const AsyncSock &) = delete;
+    AsyncSock &operator=(const AsyncSock &) = delete;
+
+    int fd() const { return sock; }
+    // 按 fd 找到登记的连接，广播时使用
+    static AsyncSock *find(int fd);
+
+    ReadyAwaiter readable(int timeout_ms = -1) { return ReadyAwaiter{this, false, timeout_ms, {}}; }
+    ReadyAwaiter writable(int timeout_ms = -1) { return ReadyAwaiter{this, true, timeout_ms, {}}; }
+
+    // 不等待: 没有数据返回 -1 且 errno 为 EAGAIN
+    ssize_t try_read(void *buf, size_t len);
+    // 等到有数据: >0 读到的字节数，0 对端关闭，-1 出错
+    // timeout_ms 内没有数据返回 -1 且 errno 为 ETIMEDOUT
+    Co<ssize_t> read(void *buf, size_t len, int timeout_ms = -1);
+    // write_all/sendfile 等待可写超过该时间认为对方卡死，返回失败且 errno 为 ETIMEDOUT
+    void set_write_timeout(int timeout_ms) { write_timeout = timeout_ms; }
+    // 追加到发送队列并等到全部写出
+    Co<bool> write_all(const void *data, size_t len);
+    Co<bool> write_all(const std::string &data) { return write_all(data.data(), data.size()); }
+    // 只追加到发送队列，由反应器在可写时发送；积压太多时断开这个连接并返回 false
+    bool queue(const void *data, size_t len);
+    // 发送队列写空后零拷贝发送文件，返回本次发送的字节数
+    Co<ssize_t> sendfile(int file_fd, off_t offset, size_t len);
+    // TLS 服务器端握手
+    Co<bool> tls_accept();
+    // 读到的数据同时写进流量录制的这个连接号下，见 capture.h
+    void set_capture(uint32_t conn) { capture_conn = conn; }
+
+    // 发送队列里还没写出的数据，热升级交接时使用
+    std::string pending_output() const { return outq.substr(outq_pos); }
+    // 从反应器上摘下，等待者不会再被唤醒，fd 不关闭
+    void detach();
+
+private:
+    friend struct ReadyAwaiter;
+    friend void reactor_run();
+    friend size_t reactor_queued_bytes();
+
+    void on_event(uint32_t events);
+    // 尽量写出发送队列，出错返回 false
+    bool flush();
+    void wake(bool write);
+    Co<bool> wait_writable();
+
+    int sock;
+    bool wr_ready;  // 上次写之后没遇到 EAGAIN，可以直接写
+    bool broken;
+    int write_timeout;
+    uint32_t capture_conn;
+    std::string outq;
+    size_t outq_pos;
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+    TimerEntry *reader_timer;
+    TimerEntry *writer_timer;
+};
+
+#endif // REACTOR_H
@@ -0,0 +1,469 @@
+#include "relay.h"
+#include "reactor.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <deque>
+#include <map>
+
+#define RELAY_BUF_SIZE 65536
+
+struct Peer
+{
+    int id = 0;
+    struct sockaddr_in addr {};
+    AsyncSock *link = nullptr;   // 当前可用的总线连接
+    uint64_t epoch = 0;          // 对方的启动纪元，0 表示还没连上过
+    uint64_t last_seq = 0;       // 收到对方的最后一条广播
+    std::string batch;           // 本轮要发给对方的帧
+    std::string users;           // 对方节点上的在线用户
+    bool has_users = false;
+};
+
+static int self_id = 0;
+static int bus_port = 0;
+static int bus_fd = -1;
+static bool stopped = false;
+static uint64_t self_epoch = 0;
+static uint64_t next_seq = 1;
+static std::function<void(const std::string &)> deliver;
+// 按节点号排序，合并用户列表时按这个顺序
+static std::map<int, Peer> peers;
+static std::deque<std::pair<uint64_t, std::string>> history;
+static std::string self_users;
+static bool presence_dirty = false;
+static bool flush_scheduled = false;
+// 反应器是单线程的，读到的数据在下一次挂起前就拆成帧
+static char rx_buf[RELAY_BUF_SIZE];
+
+static void put_u32(std::string &out, uint32_t v)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((char)(v >> shift));
+}
+
+static void put_u64(std::string &out, uint64_t v)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out.push_back((char)(v >> shift));
+}
+
+static uint64_t get_be(const char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+static void put_frame(std::string &out, char type, const char *data, size_t len, uint64_t seq = 0, bool with_seq = false)
+{
+    put_u32(out, 1 + (with_seq ? 8 : 0) + len);
+    out.push_back(type);
+    if (with_seq)
+        put_u64(out, seq);
+    out.append(data, len);
+}
+
+// 总线连接上的接收缓冲，可能一次读到多个帧
+struct LinkReader
+{
+    std::string buf;
+    size_t pos = 0;
+};
+
+// 读一帧，对端关闭、出错、超时或帧不合法返回 false
+static Co<bool> read_frame(AsyncSock &sock, LinkReader &rd, char &type, std::string &payload, int timeout_ms)
+{
+    while (true)
+    {
+        if (rd.buf.size() - rd.pos >= 4)
+        {
+            uint32_t len = get_be(rd.buf.data() + rd.pos, 4);
+            if (len == 0 || len > RELAY_MAX_FRAME)
+                co_return false;
+            if (rd.buf.size() - rd.pos >= 4 + (size_t)len)
+            {
+                type = rd.buf[rd.pos + 4];
+                payload.assign(rd.buf, rd.pos + 5, len - 1);
+                rd.pos += 4 + len;
+                if (rd.pos == rd.buf.size())
+                {
+                    rd.buf.clear();
+                    rd.pos = 0;
+                }
+                co_return true;
+            }
+        }
+        if (rd.pos > 0)
+        {
+            rd.buf.erase(0, rd.pos);
+            rd.pos = 0;
+        }
+        ssize_t n = co_await sock.read(rx_buf, sizeof(rx_buf), timeout_ms);
+        if (n <= 0)
+            co_return false;
+        rd.buf.append(rx_buf, n);
+    }
+}
+
+static std::string hello_frame(const Peer &peer)
+{
+    std::string payload;
+    put_u64(payload, self_id);
+    put_u64(payload, self_epoch);
+    put_u64(payload, peer.epoch);
+    put_u64(payload, peer.last_seq);
+    std::string frame;
+    put_frame(frame, 'H', payload.data(), payload.size());
+    return frame;
+}
+
+struct Hello
+{
+    int id;
+    uint64_t epoch;
+    uint64_t known_epoch;   // 对方知道的本节点纪元
+    uint64_t last_seq;      // 对方收到本节点的最后序号
+};
+
+static Co<bool> read_hello(AsyncSock &sock, LinkReader &rd, Hello &hello)
+{
+    char type;
+    std::string payload;
+    if (!(co_await read_frame(sock, rd, type, payload, RELAY_CONNECT_TIMEOUT)))
+        co_return false;
+    if (type != 'H' || payload.size() != 32)
+        co_return false;
+    hello.id = (int)get_be(payload.data(), 8);
+    hello.epoch = get_be(payload.data() + 8, 8);
+    hello.known_epoch = get_be(payload.data() + 16, 8);
+    hello.last_seq = get_be(payload.data() + 24, 8);
+    co_return hello.id > 0 && hello.id != self_id;
+}
+
+// 一轮反应器循环里追加的帧合并成一次写入
+static Task flush_batches()
+{
+    co_await reactor_yield();
+    flush_scheduled = false;
+    for (auto it = peers.begin(); it != peers.end(); it++)
+    {
+        Peer &peer = it->second;
+        if (!peer.link)
+            continue;
+        if (presence_dirty)
+            put_frame(peer.batch, 'P', self_users.data(), self_users.size());
+        if (!peer.batch.empty())
+            peer.link->queue(peer.batch.data(), peer.batch.size());
+        peer.batch.clear();
+    }
+    presence_dirty = false;
+}
+
+static void schedule_flush()
+{
+    if (flush_scheduled)
+        return;
+    flush_scheduled = true;
+    flush_batches();
+}
+
+// 握手完成后运行，直到连接断开
+static Co<void> run_link(Peer &peer, AsyncSock &sock, LinkReader &rd, const Hello &hello)
+{
+    // 新连接替换旧连接(对方重启后旧连接可能还没发现断开)
+    if (peer.link && peer.link != &sock)
+        shutdown(peer.link->fd(), SHUT_RDWR);
+    peer.link = &sock;
+    peer.batch.clear();
+    if (hello.epoch != peer.epoch)
+    {
+        peer.epoch = hello.epoch;
+        peer.last_seq = 0;
+    }
+    log_info("Relay link to node %d up", peer.id);
+
+    // 对方连过本节点的这次运行，补发它断线期间错过的广播
+    if (hello.known_epoch == self_epoch)
+    {
+        if (!history.empty() && history.front().first > hello.last_seq + 1)
+            log_warn("Relay: node %d missed %llu messages beyond history", peer.id,
+                    (unsigned long long)(history.front().first - hello.last_seq - 1));
+        for (auto it = history.begin(); it != history.end(); it++)
+        {
+            if (it->first > hello.last_seq)
+                put_frame(peer.batch, 'M', it->second.data(), it->second.size(), it->first, true);
+        }
+    }
+    put_frame(peer.batch, 'P', self_users.data(), self_users.size());
+    schedule_flush();
+
+    char type;
+    std::string payload;
+    while (!stopped && (co_await read_frame(sock, rd, type, payload, RELAY_DEAD_TIMEOUT)))
+    {
+        if (type == 'M' && payload.size() >= 8)
+        {
+            // 重连补发可能和断线前收到的重叠，序号不大于已收到的丢弃
+            uint64_t seq = get_be(payload.data(), 8);
+            if (seq <= peer.last_seq)
+                continue;
+            peer.last_seq = seq;
+            deliver(payload.substr(8));
+        }
+        else if (type == 'P')
+        {
+            peer.users = payload;
+            peer.has_users = true;
+        }
+        else if (type != 'K')
+        {
+            log_warn("Relay: bad frame from node %d", peer.id);
+            break;
+        }
+    }
+
+    if (peer.link == &sock)
+    {
+        peer.link = nullptr;
+        peer.batch.clear();
+        peer.users.clear();
+        peer.has_users = false;
+        log_info("Relay link to node %d down", peer.id);
+    }
+}
+
+// 主动连接节点号更小的对端，断开后重连
+static Task dial_loop(Peer &peer)
+{
+    while (!stopped)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+        {
+            log_error("relay socket() error: %s", strerror(errno));
+            co_await reactor_sleep(RELAY_RECONNECT_MS);
+            continue;
+        }
+        int rc = connect(fd, (struct sockaddr *)&peer.addr, sizeof(peer.addr));
+        if (rc == 0 || errno == EINPROGRESS)
+        {
+            AsyncSock sock(fd);
+            bool ok = true;
+            if (rc != 0)
+                ok = co_await sock.writable(RELAY_CONNECT_TIMEOUT);
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (ok && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0)
+            {
+                sock.set_write_timeout(RELAY_DEAD_TIMEOUT);
+                std::string hello = hello_frame(peer);
+                sock.queue(hello.data(), hello.size());
+                LinkReader rd;
+                Hello reply;
+                if ((co_await read_hello(sock, rd, reply)) && reply.id == peer.id)
+                    co_await run_link(peer, sock, rd, reply);
+            }
+        }
+        close(fd);
+        if (!stopped)
+            co_await reactor_sleep(RELAY_RECONNECT_MS);
+    }
+}
+
+// 节点号更大的对端连过来，先读它的握手才知道是谁
+static Task accept_link(int fd)
+{
+    {
+        AsyncSock sock(fd);
+        sock.set_write_timeout(RELAY_DEAD_TIMEOUT);
+        LinkReader rd;
+        Hello hello;
+        bool ok = co_await read_hello(sock, rd, hello);
+        if (ok && hello.id > self_id && !stopped)
+        {
+            Peer &peer = peers[hello.id];
+            peer.id = hello.id;
+            std::string reply = hello_frame(peer);
+            sock.queue(reply.data(), reply.size());
+            co_await run_link(peer, sock, rd, hello);
+        }
+        else if (ok)
+        {
+            log_warn("Relay: unexpected connection from node %d", hello.id);
+        }
+    }
+    close(fd);
+}
+
+static Task bus_accept_loop()
+{
+    // 热升级时旧进程可能还占着端口，等它让出来
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    // 总线连接断开后留下的 TIME_WAIT 不能挡住重启后的监听
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(bus_port);
+    bool warned = false;
+    while (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        if (errno != EADDRINUSE || stopped)
+        {
+            log_error("relay bind() error: %s", strerror(errno));
+            close(fd);
+            co_return;
+        }
+        if (!warned)
+            log_warn("Relay: bus port %d in use, waiting", bus_port);
+        warned = true;
+        co_await reactor_sleep(100);
+    }
+    if (listen(fd, 16) == -1)
+    {
+        log_error("relay listen() error: %s", strerror(errno));
+        close(fd);
+        co_return;
+    }
+    bus_fd = fd;
+    {
+        AsyncSock listener(fd);
+        while (!stopped)
+        {
+            int link_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (link_fd != -1)
+            {
+                accept_link(link_fd);
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                co_await listener.readable();
+            else if (errno == EMFILE || errno == ENFILE)
+                co_await reactor_sleep(100);
+        }
+    }
+    bus_fd = -1;
+    close(fd);
+}
+
+// 总线空闲时也定期发保活，对方据此发现死连接
+static Task keepalive_loop()
+{
+    while (!stopped)
+    {
+        co_await reactor_sleep(RELAY_KEEPALIVE);
+        for (auto it = peers.begin(); it != peers.end(); it++)
+        {
+            if (it->second.link)
+                put_frame(it->second.batch, 'K', "", 0);
+        }
+        schedule_flush();
+    }
+}
+
+void relay_init(int node_id, int port, std::function<void(const std::string &)> on_message)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    self_epoch = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    self_id = node_id;
+    bus_port = port;
+    deliver = std::move(on_message);
+    bus_accept_loop();
+    // 只有一方主动连接，两个节点之间只有一条总线连接
+    for (auto it = peers.begin(); it != peers.end(); it++)
+    {
+        if (it->first < self_id)
+            dial_loop(it->second);
+    }
+    keepalive_loop();
+}
+
+bool relay_add_peer(int node_id, const std::string &host, int port)
+{
+    Peer &peer = peers[node_id];
+    peer.id = node_id;
+    peer.addr.sin_family = AF_INET;
+    peer.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &peer.addr.sin_addr) != 1)
+    {
+        peers.erase(node_id);
+        return false;
+    }
+    return true;
+}
+
+bool relay_enabled()
+{
+    return self_id > 0 && !stopped;
+}
+
+void relay_stop()
+{
+    if (self_id == 0 || stopped)
+        return;
+    stopped = true;
+    if (bus_fd != -1)
+        shutdown(bus_fd, SHUT_RDWR);
+    for (auto it = peers.begin(); it != peers.end(); it++)
+    {
+        if (it->second.link)
+            shutdown(it->second.link->fd(), SHUT_RDWR);
+    }
+}
+
+void relay_broadcast(const char *msg, size_t len)
+{
+    if (!relay_enabled())
+        return;
+    uint64_t seq = next_seq++;
+    history.emplace_back(seq, std::string(msg, len));
+    if (history.size() > RELAY_HISTORY)
+        history.pop_front();
+    bool linked = false;
+    for (auto it = peers.begin(); it != peers.end(); it++)
+    {
+        if (!it->second.link)
+            continue;
+        put_frame(it->second.batch, 'M', msg, len, seq, true);
+        linked = true;
+    }
+    if (linked)
+        schedule_flush();
+}
+
+void relay_set_presence(const std::string &users)
+{
+    if (!relay_enabled() || users == self_users)
+        return;
+    self_users = users;
+    presence_dirty = true;
+    schedule_flush();
+}
+
+std::string relay_merge_users(const std::string &local_users)
+{
+    std::string merged;
+    bool self_done = false;
+    for (auto it = peers.begin(); it != peers.end(); it++)
+    {
+        if (!self_done && it->first > self_id)
+        {
+            merged += local_users;
+            self_done = true;
+        }
+        if (it->second.has_users)
+            merged += it->second.users;
+    }
+    if (!self_done)
+        merged += local_users;
+    return merged;
+}
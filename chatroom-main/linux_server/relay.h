@@ -0,0 +1,45 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <string>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// 多节点: 每个节点有自己的客户端，节点之间用内部 TCP 总线两两相连(全互连)
+// 转发房间广播和在线用户，客户端连到任意节点都在同一个聊天室里
+//
+// 总线帧: 4 字节大端长度 + 1 字节类型 + 内容
+//   'H' 握手: 节点号、启动纪元、我知道的对方纪元、收到对方的最后序号
+//       断线重连时对方从这个序号之后补发；纪元变了说明对方重启过，序号从头开始
+//   'M' 广播: 序号 + 消息，按序号去重
+//   'P' 在线用户: "ip:用户名\n" 列表，整表替换
+//   'K' 保活，总线上太久没有数据认为对方已死
+// 一轮反应器循环里产生的帧合并成一次写入
+// 文件通知(FILE)也会转发，节点之间需要共用同一个文件目录
+
+#define RELAY_MAX_FRAME (1024 * 1024)
+#define RELAY_HISTORY 1024           // 保留最近的广播，断线重连后补发
+#define RELAY_RECONNECT_MS 1000
+#define RELAY_CONNECT_TIMEOUT 3000
+#define RELAY_KEEPALIVE 5000
+#define RELAY_DEAD_TIMEOUT (3 * RELAY_KEEPALIVE)
+
+// node_id 大于 0 且不能重复；bus_port 为本节点总线监听端口，在 reactor_init() 之后调用
+// on_message 在收到其他节点的广播时调用，只应发给本节点的客户端
+void relay_init(int node_id, int bus_port, std::function<void(const std::string &)> on_message);
+// 节点号比自己小的对端由自己连接，比自己大的等对方连过来，不用配置
+// host 为 IPv4 地址，失败返回 false
+bool relay_add_peer(int node_id, const std::string &host, int port);
+bool relay_enabled();
+// 热升级交接后让出总线端口，新进程接手节点
+void relay_stop();
+
+// 把本节点的一条广播转发给其他节点
+void relay_broadcast(const char *msg, size_t len);
+// 本节点的在线用户列表变了，同一轮内多次调用只发最后一次
+void relay_set_presence(const std::string &users);
+// 按节点号合并所有节点的在线用户，每个节点上看到的顺序一致
+std::string relay_merge_users(const std::string &local_users);
+
+#endif // RELAY_H
@@ -0,0 +1,165 @@
+#include "resume.h"
+#include "reactor.h"
+#include "log.h"
+#include <openssl/rand.h>
+#include <string.h>
+#include <unordered_map>
+
+struct ResumeSession
+{
+    int fd = -1;            // 当前的连接，-1 表示断开后保留中
+    std::string user;
+    uint64_t received = 0;
+    std::vector<std::string> missed;
+    size_t missed_bytes = 0;
+    uint64_t generation = 0; // 每次保留换一个，过期定时器认出会话已经被接走又断开过
+};
+
+// 只在反应器线程上使用
+static std::unordered_map<std::string, ResumeSession> sessions;
+static std::unordered_map<int, std::string> live;  // fd -> 令牌
+static size_t parked = 0;
+static uint64_t next_generation = 0;
+static std::function<void()> expired;
+
+void resume_init(std::function<void()> on_expire)
+{
+    expired = std::move(on_expire);
+}
+
+static std::string new_token()
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char raw[RESUME_TOKEN_BYTES];
+    RAND_bytes(raw, sizeof(raw));
+    std::string token;
+    for (size_t i = 0; i < sizeof(raw); i++)
+    {
+        token += digits[raw[i] >> 4];
+        token += digits[raw[i] & 0xf];
+    }
+    return token;
+}
+
+std::string resume_open(int fd, const std::string &user)
+{
+    resume_close(fd);
+    std::string token = new_token();
+    ResumeSession &session = sessions[token];
+    session.fd = fd;
+    session.user = user;
+    live[fd] = token;
+    return token;
+}
+
+void resume_count(int fd)
+{
+    auto it = live.find(fd);
+    if (it != live.end())
+        sessions[it->second].received++;
+}
+
+static Task expire_later(std::string token, uint64_t generation)
+{
+    co_await reactor_sleep(RESUME_GRACE_MS);
+    auto it = sessions.find(token);
+    if (it == sessions.end() || it->second.fd != -1 || it->second.generation != generation)
+        co_return;
+    log_info("Session of %s expired", it->second.user.c_str());
+    sessions.erase(it);
+    parked--;
+    if (expired)
+        expired();
+}
+
+bool resume_park(int fd)
+{
+    auto it = live.find(fd);
+    if (it == live.end())
+        return false;
+    std::string token = it->second;
+    live.erase(it);
+    ResumeSession &session = sessions[token];
+    session.fd = -1;
+    session.generation = ++next_generation;
+    parked++;
+    expire_later(token, session.generation);
+    return true;
+}
+
+void resume_close(int fd)
+{
+    auto it = live.find(fd);
+    if (it == live.end())
+        return;
+    sessions.erase(it->second);
+    live.erase(it);
+}
+
+bool resume_take(const std::string &token, int fd, std::string &user, uint64_t &received,
+                 std::vector<std::string> &missed, int &old_fd)
+{
+    auto it = sessions.find(token);
+    if (it == sessions.end() || it->second.fd == fd)
+        return false;
+    ResumeSession &session = it->second;
+    old_fd = session.fd;
+    if (old_fd >= 0)
+        live.erase(old_fd);
+    else
+        parked--;
+    resume_close(fd);
+    session.fd = fd;
+    session.generation = ++next_generation;
+    live[fd] = token;
+    user = session.user;
+    received = session.received;
+    missed.swap(session.missed);
+    session.missed.clear();
+    session.missed_bytes = 0;
+    return true;
+}
+
+void resume_backlog(const char *msg, size_t len)
+{
+    if (parked == 0)
+        return;
+    len = strnlen(msg, len);
+    bool dropped = false;
+    for (auto it = sessions.begin(); it != sessions.end();)
+    {
+        ResumeSession &session = it->second;
+        if (session.fd != -1)
+        {
+            it++;
+            continue;
+        }
+        // 错过太多，补发不如让客户端重新进来
+        if (session.missed_bytes + len > RESUME_BACKLOG_MAX)
+        {
+            log_info("Session of %s dropped, missed too many messages", session.user.c_str());
+            it = sessions.erase(it);
+            parked--;
+            dropped = true;
+            continue;
+        }
+        session.missed.emplace_back(msg, len);
+        session.missed_bytes += len;
+        it++;
+    }
+    if (dropped && expired)
+        expired();
+}
+
+std::string resume_parked_users()
+{
+    std::string users;
+    if (parked == 0)
+        return users;
+    for (auto &entry : sessions)
+    {
+        if (entry.second.fd == -1)
+            users += entry.second.user + "\n";
+    }
+    return users;
+}
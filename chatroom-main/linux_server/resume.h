@@ -0,0 +1,48 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// 聊天会话恢复: 网络断一下后客户端带着令牌重连，接着用原来的名字和会话，不用重新问候，也不用重新拉用户列表
+// 协商了 resume 能力的客户端在聊天连接上:
+//   问候语之后服务器回复 "SESSION <令牌>"，从问候语的下一条起数收到了客户端多少条房间消息:
+//   只数以 '\0' 结尾(或一个 MUX 帧)的完整消息，USERLIST/LIST/STAT/OFFER/PEER/SEARCH/PONG 等请求不算，
+//   被限速丢掉的也算；客户端只把房间消息留着等确认，两边数的是同一组消息
+//   重连并协商能力后，第一条消息发 "RESUME <令牌>"，服务器回复 "RESUMED <收到的条数>"，
+//   再补发断线期间错过的房间消息；客户端重发这个条数之后的消息，最多 RESUME_REPLAY_MAX 条，不受消息限速
+//   令牌不认识(过期、服务器重启)时回复 "RESUMEFAIL"，客户端重新问候
+//   "BYE" 表示主动退出，不再保留会话
+// 连接断开后会话保留 RESUME_GRACE_MS，期间还在用户列表里；错过的房间消息攒在会话里，超过 RESUME_BACKLOG_MAX 放弃会话
+// 旧连接还没发现断开时新连接就来恢复，旧连接直接关掉
+// 会话只在本进程里，热升级后旧令牌失效，客户端下次重连时重新问候
+// 只在反应器线程上调用
+
+#define RESUME_TOKEN_BYTES 16
+#define RESUME_GRACE_MS 30000
+#define RESUME_BACKLOG_MAX (1024 * 1024)
+#define RESUME_REPLAY_MAX 256     // 客户端最多留这么多条没确认的消息，和客户端一致
+
+// on_expire 在保留的会话过期(用户真正离开)时调用，在 reactor_init() 之后调用
+void resume_init(std::function<void()> on_expire);
+// 问候语之后登记会话，user 是 map_clients 里的 "ip:用户名"，返回令牌
+std::string resume_open(int fd, const std::string &user);
+// 这个连接又收到一条完整的房间消息
+void resume_count(int fd);
+// 连接断开: 登记过的会话保留下来，返回 true
+bool resume_park(int fd);
+// 主动退出，不再保留
+void resume_close(int fd);
+// 把会话接到新连接 fd 上，给出原来的 "ip:用户名"、收到的条数和错过的消息
+// 旧连接还开着时 old_fd 是它的 fd，否则为 -1
+bool resume_take(const std::string &token, int fd, std::string &user, uint64_t &received,
+                 std::vector<std::string> &missed, int &old_fd);
+// 房间消息，给所有保留中的会话攒着
+void resume_backlog(const char *msg, size_t len);
+// 保留中的会话的用户，每行一个 "ip:用户名"
+std::string resume_parked_users();
+
+#endif // RESUME_H
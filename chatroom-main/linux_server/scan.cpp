@@ -0,0 +1,435 @@
+#include "scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// ---------- 逐字节的版本，其他平台和不支持 SSE4.2 的 CPU 使用 ----------
+
+static size_t find_scalar(const char *data, size_t len, char c)
+{
+    const void *p = memchr(data, c, len);
+    return p ? (const char *)p - data : len;
+}
+
+static size_t split_scalar(const char *data, size_t len, char c, std::vector<uint32_t> &out)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] == c)
+        {
+            out.push_back((uint32_t)i);
+            count++;
+        }
+    }
+    return count;
+}
+
+static bool utf8_scalar(const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i = 0;
+    while (i < len)
+    {
+        unsigned char c = p[i];
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        size_t n;
+        uint32_t cp;
+        if (c >= 0xc2 && c <= 0xdf)
+        {
+            n = 2;
+            cp = c & 0x1f;
+        }
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            n = 3;
+            cp = c & 0x0f;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            n = 4;
+            cp = c & 0x07;
+        }
+        else
+            return false;
+        if (len - i < n)
+            return false;
+        for (size_t k = 1; k < n; k++)
+        {
+            if ((p[i + k] & 0xc0) != 0x80)
+                return false;
+            cp = (cp << 6) | (p[i + k] & 0x3f);
+        }
+        // 过长编码、代理项、超出 Unicode 范围
+        if ((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10ffff)) ||
+            (cp >= 0xd800 && cp <= 0xdfff))
+            return false;
+        i += n;
+    }
+    return true;
+}
+
+#ifdef SCAN_X86
+
+// ---------- UTF-8 查表法 ----------
+// 前一个字节的高 4 位、低 4 位和当前字节的高 4 位各查一张表，三个结果按位与，非零就是错误
+// 每一位代表一种错误，只有三张表在同一位上都允许时才算出错
+#define TOO_SHORT (1 << 0)   // 11______ 0_______ / 11______ 11______
+#define TOO_LONG (1 << 1)    // 0_______ 10______
+#define OVERLONG_3 (1 << 2)  // 11100000 100_____
+#define TOO_LARGE (1 << 3)   // 11110100 1001____ / 11110100 101_____ / 11110101+ 10______
+#define SURROGATE (1 << 4)   // 11101101 101_____
+#define OVERLONG_2 (1 << 5)  // 1100000_ 10______
+#define TOO_LARGE_1000 (1 << 6)  // 11110101+ 1000____
+#define OVERLONG_4 (1 << 6)  // 11110000 1000____
+#define TWO_CONTS (1 << 7)   // 10______ 10______，第三、四个字节时合法
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+alignas(16) static const uint8_t byte_1_high[16] = {
+    // 0_______ 前一个是 ASCII
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    // 10______ 前一个是后续字节
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    // 1100____ / 1101____ 两字节的首字节
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    // 1110____ 三字节的首字节
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    // 1111____ 四字节的首字节
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+alignas(16) static const uint8_t byte_1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,  // ____0000
+    CARRY | OVERLONG_2,                            // ____0001
+    CARRY,                                         // ____001_
+    CARRY,
+    CARRY | TOO_LARGE,                             // ____0100
+    CARRY | TOO_LARGE | TOO_LARGE_1000,            // ____0101
+    CARRY | TOO_LARGE | TOO_LARGE_1000,            // ____011_
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,            // ____1___
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,  // ____1101
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+alignas(16) static const uint8_t byte_2_high[16] = {
+    // ________ 0_______
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    // ________ 1000____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    // ________ 1001____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    // ________ 101_____
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    // ________ 11______
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// 块的最后三个字节如果是多字节序列的开头，序列一定没有在块内结束
+alignas(32) static const uint8_t incomplete_max[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1,
+};
+
+// ---------- SSE4.2，每次 16 字节 ----------
+
+__attribute__((target("sse4.2"))) static size_t find_sse42(const char *data, size_t len, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == c)
+            return i;
+    }
+    return len;
+}
+
+__attribute__((target("sse4.2"))) static size_t split_sse42(const char *data, size_t len, char c, std::vector<uint32_t> &out)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    size_t count = out.size();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        while (mask)
+        {
+            out.push_back((uint32_t)(i + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == c)
+            out.push_back((uint32_t)i);
+    }
+    return out.size() - count;
+}
+
+struct Utf8Sse42
+{
+    __m128i error, prev_input, prev_incomplete;
+
+    __attribute__((target("sse4.2"))) void init()
+    {
+        error = prev_input = prev_incomplete = _mm_setzero_si128();
+    }
+
+    __attribute__((target("sse4.2"))) static __m128i high_nibble(__m128i v)
+    {
+        return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+    }
+
+    __attribute__((target("sse4.2"))) void check(__m128i input)
+    {
+        // 整块都是 ASCII 时只需检查上一块有没有没结束的序列
+        if (_mm_movemask_epi8(input) == 0)
+        {
+            error = _mm_or_si128(error, prev_incomplete);
+            return;
+        }
+        __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+        __m128i sc = _mm_and_si128(
+            _mm_and_si128(_mm_shuffle_epi8(_mm_load_si128((const __m128i *)byte_1_high), high_nibble(prev1)),
+                          _mm_shuffle_epi8(_mm_load_si128((const __m128i *)byte_1_low), _mm_and_si128(prev1, _mm_set1_epi8(0x0f)))),
+            _mm_shuffle_epi8(_mm_load_si128((const __m128i *)byte_2_high), high_nibble(input)));
+        // 三字节序列的第三个字节、四字节序列的第三四个字节必须是后续字节
+        __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+        __m128i is_third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+        __m128i is_fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+        __m128i must23 = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8((char)0x80));
+        error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+        prev_incomplete = _mm_subs_epu8(input, _mm_loadu_si128((const __m128i *)(incomplete_max + 16)));
+        prev_input = input;
+    }
+};
+
+__attribute__((target("sse4.2"))) static bool utf8_sse42(const char *data, size_t len)
+{
+    Utf8Sse42 v;
+    v.init();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+        v.check(_mm_loadu_si128((const __m128i *)(data + i)));
+    if (i < len)
+    {
+        // 尾部补 0(ASCII)凑成一整块
+        alignas(16) char tail[16] = {0};
+        memcpy(tail, data + i, len - i);
+        v.check(_mm_load_si128((const __m128i *)tail));
+    }
+    v.error = _mm_or_si128(v.error, v.prev_incomplete);
+    return _mm_testz_si128(v.error, v.error);
+}
+
+// ---------- AVX2，每次 32 字节 ----------
+
+__attribute__((target("avx2"))) static size_t find_avx2(const char *data, size_t len, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == c)
+            return i;
+    }
+    return len;
+}
+
+__attribute__((target("avx2"))) static size_t split_avx2(const char *data, size_t len, char c, std::vector<uint32_t> &out)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t count = out.size();
+    size_t i = 0;
+    // 一次 64 字节拼成一个 64 位掩码，逐位取出分隔符的位置
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle)) |
+                        ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)) << 32);
+        while (mask)
+        {
+            out.push_back((uint32_t)(i + __builtin_ctzll(mask)));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] == c)
+            out.push_back((uint32_t)i);
+    }
+    return out.size() - count;
+}
+
+struct Utf8Avx2
+{
+    __m256i error, prev_input, prev_incomplete;
+    __m256i table_1_high, table_1_low, table_2_high, max_value;
+
+    __attribute__((target("avx2"))) void init()
+    {
+        error = prev_input = prev_incomplete = _mm256_setzero_si256();
+        table_1_high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)byte_1_high));
+        table_1_low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)byte_1_low));
+        table_2_high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)byte_2_high));
+        max_value = _mm256_load_si256((const __m256i *)incomplete_max);
+    }
+
+    __attribute__((target("avx2"))) static __m256i high_nibble(__m256i v)
+    {
+        return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+    }
+
+    // 把上一块的最后 N 个字节移进来，跨两个 128 位通道
+    template <int N>
+    __attribute__((target("avx2"))) __m256i prev(__m256i input)
+    {
+        return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - N);
+    }
+
+    __attribute__((target("avx2"))) void check(__m256i input)
+    {
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            error = _mm256_or_si256(error, prev_incomplete);
+            return;
+        }
+        __m256i prev1 = prev<1>(input);
+        __m256i sc = _mm256_and_si256(
+            _mm256_and_si256(_mm256_shuffle_epi8(table_1_high, high_nibble(prev1)),
+                             _mm256_shuffle_epi8(table_1_low, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)))),
+            _mm256_shuffle_epi8(table_2_high, high_nibble(input)));
+        __m256i is_third = _mm256_subs_epu8(prev<2>(input), _mm256_set1_epi8((char)(0xe0 - 0x80)));
+        __m256i is_fourth = _mm256_subs_epu8(prev<3>(input), _mm256_set1_epi8((char)(0xf0 - 0x80)));
+        __m256i must23 = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must23, sc));
+        prev_incomplete = _mm256_subs_epu8(input, max_value);
+        prev_input = input;
+    }
+};
+
+__attribute__((target("avx2"))) static bool utf8_avx2(const char *data, size_t len)
+{
+    Utf8Avx2 v;
+    v.init();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+        v.check(_mm256_loadu_si256((const __m256i *)(data + i)));
+    if (i < len)
+    {
+        alignas(32) char tail[32] = {0};
+        memcpy(tail, data + i, len - i);
+        v.check(_mm256_load_si256((const __m256i *)tail));
+    }
+    v.error = _mm256_or_si256(v.error, v.prev_incomplete);
+    return _mm256_testz_si256(v.error, v.error);
+}
+
+#endif // SCAN_X86
+
+// ---------- 运行时选择 ----------
+
+struct ScanImpl
+{
+    const char *name;
+    size_t (*find)(const char *, size_t, char);
+    size_t (*split)(const char *, size_t, char, std::vector<uint32_t> &);
+    bool (*utf8)(const char *, size_t);
+};
+
+static const ScanImpl impls[] = {
+#ifdef SCAN_X86
+    {"avx2", find_avx2, split_avx2, utf8_avx2},
+    {"sse4.2", find_sse42, split_sse42, utf8_sse42},
+#endif
+    {"scalar", find_scalar, split_scalar, utf8_scalar},
+};
+
+static bool supported(const ScanImpl &impl)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(impl.name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(impl.name, "sse4.2") == 0)
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return strcmp(impl.name, "scalar") == 0;
+}
+
+static const ScanImpl *pick()
+{
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    {
+        if (supported(impls[i]))
+            return &impls[i];
+    }
+    return &impls[sizeof(impls) / sizeof(impls[0]) - 1];
+}
+
+static const ScanImpl *current = pick();
+
+const char *scan_impl()
+{
+    return current->name;
+}
+
+bool scan_force(const char *name)
+{
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    {
+        if (strcmp(impls[i].name, name) == 0 && supported(impls[i]))
+        {
+            current = &impls[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t scan_find(const char *data, size_t len, char c)
+{
+    return current->find(data, len, c);
+}
+
+size_t scan_split(const char *data, size_t len, char c, std::vector<uint32_t> &out)
+{
+    return current->split(data, len, c, out);
+}
+
+bool utf8_valid(const char *data, size_t len)
+{
+    return current->utf8(data, len);
+}
@@ -0,0 +1,24 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// 接收缓冲区的向量化扫描: 一次找出整个缓冲区里的所有分隔符、校验整个缓冲区是不是合法的 UTF-8
+// 每次处理 32 字节(AVX2)或 16 字节(SSE4.2)，运行时按 CPU 选择实现，其他平台用逐字节的版本
+// UTF-8 校验用查表法(Keiser & Lemire): 每个字节和前三个字节一起查三张 16 项的表，没有分支
+
+// 当前使用的实现: "avx2"、"sse4.2" 或 "scalar"
+const char *scan_impl();
+// 强制使用某个实现(微基准对比用)，CPU 不支持时返回 false
+bool scan_force(const char *impl);
+
+// 第一个 c 的位置，没有返回 len
+size_t scan_find(const char *data, size_t len, char c);
+// 所有 c 的位置按顺序追加到 out，返回个数
+size_t scan_split(const char *data, size_t len, char c, std::vector<uint32_t> &out);
+// 整个缓冲区是否是合法的 UTF-8(拒绝过长编码、代理项和大于 U+10FFFF 的码点)
+bool utf8_valid(const char *data, size_t len);
+
+#endif // SCAN_H
@@ -0,0 +1,638 @@
+#include "search.h"
+#include "cpupool.h"
+#include "log.h"
+#include <algorithm>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define SEARCH_MAGIC "CHIS"
+#define SEARCH_VERSION 1
+#define SEARCH_HEADER_SIZE 8
+
+static void put_be(std::string &out, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        out.push_back((char)(v >> (i * 8)));
+}
+
+static uint64_t get_be(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_varint(std::string &out, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static uint32_t get_varint(const unsigned char *&p)
+{
+    uint32_t v = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        unsigned char b = *p++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (b < 0x80)
+            return v;
+    }
+}
+
+// **段**
+
+// 一段连续消息的倒排索引，编号都相对 base
+struct Segment
+{
+    uint32_t base = 0;
+    std::vector<uint64_t> offsets; // 每条消息的记录在历史文件里的位置
+    int level = 0;                 // 合并过几次
+    bool frozen = false;
+
+    virtual ~Segment() {}
+    uint32_t count() const { return (uint32_t)offsets.size(); }
+    // 取出一个词的倒排表(升序)，没有这个词返回 false
+    virtual bool lookup(const std::string &term, std::vector<uint32_t> &ids) const = 0;
+};
+
+// 可写段: 只在反应器线程上追加；写满后不再改动，冻结期间照样可以在别的线程上查询
+struct OpenSegment : Segment
+{
+    std::unordered_map<std::string, std::vector<uint32_t>> postings;
+
+    bool lookup(const std::string &term, std::vector<uint32_t> &ids) const override
+    {
+        auto it = postings.find(term);
+        if (it == postings.end())
+            return false;
+        ids = it->second;
+        return true;
+    }
+};
+
+// 只读段: 第 i 个词是 terms[term_start[i], term_start[i+1])，倒排表是 postings[post_start[i], post_start[i+1])
+struct FrozenSegment : Segment
+{
+    std::string terms;
+    std::vector<uint32_t> term_start{0};
+    std::string postings;
+    std::vector<uint32_t> post_start{0};
+
+    size_t term_count() const { return term_start.size() - 1; }
+    std::string_view term(size_t i) const
+    {
+        return std::string_view(terms.data() + term_start[i], term_start[i + 1] - term_start[i]);
+    }
+    void decode(size_t i, uint32_t add, std::vector<uint32_t> &ids) const
+    {
+        const unsigned char *p = (const unsigned char *)postings.data() + post_start[i];
+        const unsigned char *end = (const unsigned char *)postings.data() + post_start[i + 1];
+        uint32_t id = 0;
+        while (p < end)
+        {
+            id += get_varint(p);
+            ids.push_back(id + add);
+        }
+    }
+    bool lookup(const std::string &key, std::vector<uint32_t> &ids) const override
+    {
+        size_t lo = 0, hi = term_count();
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (term(mid) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == term_count() || term(lo) != key)
+            return false;
+        ids.clear();
+        decode(lo, 0, ids);
+        return true;
+    }
+    // 追加一个词，ids 升序
+    void add_term(std::string_view key, const std::vector<uint32_t> &ids)
+    {
+        terms.append(key.data(), key.size());
+        term_start.push_back((uint32_t)terms.size());
+        uint32_t prev = 0;
+        for (uint32_t id : ids)
+        {
+            put_varint(postings, id - prev);
+            prev = id;
+        }
+        post_start.push_back((uint32_t)postings.size());
+    }
+};
+
+typedef std::shared_ptr<const Segment> SegmentPtr;
+
+static std::shared_ptr<FrozenSegment> freeze(const OpenSegment &open)
+{
+    auto seg = std::make_shared<FrozenSegment>();
+    seg->base = open.base;
+    seg->offsets = open.offsets;
+    seg->frozen = true;
+    std::vector<const std::pair<const std::string, std::vector<uint32_t>> *> sorted;
+    sorted.reserve(open.postings.size());
+    for (auto &entry : open.postings)
+        sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) { return a->first < b->first; });
+    for (auto entry : sorted)
+        seg->add_term(entry->first, entry->second);
+    return seg;
+}
+
+// 把相邻的几个只读段合并成一个，词典归并，倒排表接起来
+static std::shared_ptr<FrozenSegment> merge(const std::vector<std::shared_ptr<const FrozenSegment>> &parts)
+{
+    auto seg = std::make_shared<FrozenSegment>();
+    seg->base = parts[0]->base;
+    seg->level = parts[0]->level + 1;
+    seg->frozen = true;
+    struct Ref
+    {
+        std::string_view term;
+        size_t part;
+        size_t index;
+    };
+    std::vector<Ref> refs;
+    for (size_t p = 0; p < parts.size(); p++)
+    {
+        seg->offsets.insert(seg->offsets.end(), parts[p]->offsets.begin(), parts[p]->offsets.end());
+        for (size_t i = 0; i < parts[p]->term_count(); i++)
+            refs.push_back({parts[p]->term(i), p, i});
+    }
+    // 同一个词按段的先后排，接起来的编号仍然升序
+    std::sort(refs.begin(), refs.end(), [](const Ref &a, const Ref &b) {
+        return a.term != b.term ? a.term < b.term : a.part < b.part;
+    });
+    std::vector<uint32_t> ids;
+    for (size_t i = 0; i < refs.size();)
+    {
+        ids.clear();
+        size_t j = i;
+        for (; j < refs.size() && refs[j].term == refs[i].term; j++)
+            parts[refs[j].part]->decode(refs[j].index, parts[refs[j].part]->base - seg->base, ids);
+        seg->add_term(refs[i].term, ids);
+        i = j;
+    }
+    return seg;
+}
+
+// **索引状态，只在反应器线程上访问**
+
+static int history_fd = -1;
+static uint32_t next_id = 0;
+static std::shared_ptr<OpenSegment> open_segment;
+// 旧的在前: 只读段、冻结中的可写段
+static std::vector<SegmentPtr> segments;
+static bool merging = false;
+static bool loading = false; // 启动时重建索引，冻结和合并直接在当前线程做
+
+static void maybe_merge();
+
+static void replace_segment(const Segment *old, SegmentPtr seg)
+{
+    for (auto &s : segments)
+    {
+        if (s.get() == old)
+        {
+            s = seg;
+            return;
+        }
+    }
+}
+
+static Task freeze_task(std::shared_ptr<const OpenSegment> open)
+{
+    std::shared_ptr<FrozenSegment> frozen;
+    co_await cpu_run([&] { frozen = freeze(*open); });
+    replace_segment(open.get(), frozen);
+    maybe_merge();
+}
+
+// 找最旧的一组同层、连续的只读段
+static bool pick_merge(size_t &first)
+{
+    for (size_t i = 0; i + SEARCH_MERGE_FANIN <= segments.size(); i++)
+    {
+        size_t n = 0;
+        while (n < SEARCH_MERGE_FANIN && segments[i + n]->frozen && segments[i + n]->level == segments[i]->level)
+            n++;
+        if (n == SEARCH_MERGE_FANIN)
+        {
+            first = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::vector<std::shared_ptr<const FrozenSegment>> take_parts(size_t first)
+{
+    std::vector<std::shared_ptr<const FrozenSegment>> parts;
+    for (size_t i = 0; i < SEARCH_MERGE_FANIN; i++)
+        parts.push_back(std::static_pointer_cast<const FrozenSegment>(segments[first + i]));
+    return parts;
+}
+
+static void install_merged(const std::vector<std::shared_ptr<const FrozenSegment>> &parts, SegmentPtr merged)
+{
+    // 合并期间只有冻结会替换段，合并的这几段位置不变，仍然连续
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        if (segments[i] == parts[0])
+        {
+            segments.erase(segments.begin() + i, segments.begin() + i + parts.size());
+            segments.insert(segments.begin() + i, merged);
+            return;
+        }
+    }
+}
+
+static Task merge_task(std::vector<std::shared_ptr<const FrozenSegment>> parts)
+{
+    std::shared_ptr<FrozenSegment> merged;
+    co_await cpu_run([&] { merged = merge(parts); });
+    install_merged(parts, merged);
+    log_debug("Search: merged %zu segments into %u messages (level %d)", parts.size(), merged->count(),
+              merged->level);
+    merging = false;
+    maybe_merge();
+}
+
+static void maybe_merge()
+{
+    size_t first;
+    if (loading)
+    {
+        while (pick_merge(first))
+        {
+            auto parts = take_parts(first);
+            install_merged(parts, merge(parts));
+        }
+        return;
+    }
+    if (merging || !pick_merge(first))
+        return;
+    merging = true;
+    merge_task(take_parts(first));
+}
+
+// 可写段写满，换一个新的
+static void seal_open_segment()
+{
+    std::shared_ptr<const OpenSegment> full = open_segment;
+    open_segment = std::make_shared<OpenSegment>();
+    open_segment->base = next_id;
+    if (loading)
+    {
+        segments.push_back(freeze(*full));
+        maybe_merge();
+        return;
+    }
+    segments.push_back(full);
+    freeze_task(full);
+}
+
+// **切词**
+
+static bool is_word_byte(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+void search_terms(const char *text, size_t len, std::vector<std::string> &terms)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    size_t i = 0;
+    while (i < len)
+    {
+        unsigned char c = p[i];
+        if (is_word_byte(c))
+        {
+            std::string word;
+            while (i < len && is_word_byte(p[i]))
+            {
+                if (word.size() < SEARCH_TERM_MAX)
+                    word.push_back((char)tolower(p[i]));
+                i++;
+            }
+            terms.push_back(std::move(word));
+        }
+        else if (c >= 0x80)
+        {
+            // 一个 UTF-8 字符: 首字节加后面的续字节
+            size_t start = i++;
+            while (i < len && (p[i] & 0xc0) == 0x80)
+                i++;
+            terms.emplace_back(text + start, i - start);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+static void index_message(uint64_t offset, const char *msg, size_t len)
+{
+    static std::vector<std::string> terms;
+    terms.clear();
+    search_terms(msg, len, terms);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    uint32_t id = open_segment->count();
+    for (auto &term : terms)
+        open_segment->postings[term].push_back(id);
+    open_segment->offsets.push_back(offset);
+    next_id++;
+    if (open_segment->count() == SEARCH_SEGMENT_DOCS)
+        seal_open_segment();
+}
+
+// **历史文件**
+
+static std::string encode_record(int64_t time_ms, const char *msg, size_t len)
+{
+    std::string body;
+    put_be(body, (uint64_t)time_ms, 8);
+    body.append(msg, len);
+    uLong crc = crc32(0L, (const Bytef *)body.data(), body.size());
+    std::string record;
+    put_be(record, body.size() + 4, 4);
+    record += body;
+    put_be(record, crc, 4);
+    return record;
+}
+
+// 不完整或校验失败返回 0，否则返回整条记录的字节数
+static size_t decode_record(const unsigned char *p, size_t avail, const char *&msg, size_t &msg_len)
+{
+    if (avail < 4)
+        return 0;
+    size_t len = get_be(p, 4);
+    if (len < 12 || len > avail - 4)
+        return 0;
+    const unsigned char *body = p + 4;
+    size_t body_len = len - 4;
+    if (crc32(0L, body, body_len) != get_be(body + body_len, 4))
+        return 0;
+    msg = (const char *)body + 8;
+    msg_len = body_len - 8;
+    return 4 + len;
+}
+
+static std::string header()
+{
+    std::string h = SEARCH_MAGIC;
+    put_be(h, SEARCH_VERSION, 4);
+    return h;
+}
+
+static bool write_all(int fd, const std::string &data)
+{
+    size_t off = 0;
+    while (off < data.size())
+    {
+        ssize_t n = write(fd, data.data() + off, data.size() - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+static bool pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// 在计算线程上读一条记录
+static bool read_record(int fd, uint64_t offset, int64_t &time_ms, std::string &text)
+{
+    unsigned char head[12];
+    if (!pread_all(fd, head, sizeof(head), offset))
+        return false;
+    size_t len = get_be(head, 4);
+    if (len < 12)
+        return false;
+    time_ms = (int64_t)get_be(head + 4, 8);
+    text.resize(len - 12);
+    return pread_all(fd, &text[0], text.size(), offset + sizeof(head));
+}
+
+bool search_open(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        log_error("search open() error: %s", strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    open_segment = std::make_shared<OpenSegment>();
+    loading = true;
+    size_t size = st.st_size;
+    if (size == 0)
+    {
+        if (!write_all(fd, header()))
+        {
+            close(fd);
+            return false;
+        }
+    }
+    else
+    {
+        void *map = size >= SEARCH_HEADER_SIZE ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED || memcmp(map, header().data(), SEARCH_HEADER_SIZE) != 0)
+        {
+            log_warn("search: %s is not a chat history file", path.c_str());
+            if (map != MAP_FAILED)
+                munmap(map, size);
+            close(fd);
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        const unsigned char *data = (const unsigned char *)map;
+        size_t good_end = SEARCH_HEADER_SIZE;
+        while (good_end < size)
+        {
+            const char *msg;
+            size_t msg_len;
+            size_t used = decode_record(data + good_end, size - good_end, msg, msg_len);
+            if (used == 0)
+                break;
+            index_message(good_end, msg, msg_len);
+            good_end += used;
+        }
+        munmap(map, size);
+        if (good_end < size)
+        {
+            log_warn("search: discarding %zu bytes of incomplete records", size - good_end);
+            if (ftruncate(fd, good_end) != 0)
+                log_error("search ftruncate() error: %s", strerror(errno));
+        }
+    }
+    loading = false;
+    history_fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_info("Search: %u messages in %zu segments, indexed in %.0f ms", next_id, segments.size() + 1,
+             (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    return true;
+}
+
+void search_add(const char *msg, size_t len)
+{
+    if (history_fd == -1)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    std::string record = encode_record((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, msg, len);
+    if (!write_all(history_fd, record))
+    {
+        log_error("search write() error: %s", strerror(errno));
+        return;
+    }
+    // O_APPEND 写完后文件位置就是记录的末尾；升级交接时旧进程可能也在追加，不能自己记位置
+    off_t end = lseek(history_fd, 0, SEEK_CUR);
+    if (end == (off_t)-1)
+        return;
+    index_message((uint64_t)end - record.size(), msg, len);
+}
+
+size_t search_size()
+{
+    return next_id;
+}
+
+// **查询**
+
+// 所有词都出现的消息(相对编号，升序)
+static bool intersect(const Segment &seg, const std::vector<std::string> &terms, std::vector<uint32_t> &out)
+{
+    std::vector<std::vector<uint32_t>> lists(terms.size());
+    for (size_t i = 0; i < terms.size(); i++)
+        if (!seg.lookup(terms[i], lists[i]))
+            return false;
+    // 从最短的开始求交
+    std::sort(lists.begin(), lists.end(), [](auto &a, auto &b) { return a.size() < b.size(); });
+    out = std::move(lists[0]);
+    std::vector<uint32_t> tmp;
+    for (size_t i = 1; i < lists.size() && !out.empty(); i++)
+    {
+        tmp.clear();
+        std::set_intersection(out.begin(), out.end(), lists[i].begin(), lists[i].end(), std::back_inserter(tmp));
+        out.swap(tmp);
+    }
+    return !out.empty();
+}
+
+static std::string ascii_lower(const std::string &s)
+{
+    std::string out = s;
+    for (auto &c : out)
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+    return out;
+}
+
+// 每个查询词都要原样出现(忽略 ASCII 大小写)，倒排表只保证每个字符都出现
+static bool verify(const std::string &text, const std::vector<std::string> &words)
+{
+    std::string lower = ascii_lower(text);
+    for (auto &word : words)
+        if (lower.find(word) == std::string::npos)
+            return false;
+    return true;
+}
+
+Co<void> search_run(const std::string &query, size_t limit, std::vector<SearchHit> &hits)
+{
+    std::vector<std::string> terms, words;
+    search_terms(query.data(), query.size(), terms);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    size_t start = 0;
+    while (start < query.size())
+    {
+        size_t end = query.find(' ', start);
+        if (end == std::string::npos)
+            end = query.size();
+        if (end > start)
+            words.push_back(ascii_lower(query.substr(start, end - start)));
+        start = end + 1;
+    }
+    if (terms.empty() || history_fd == -1)
+        co_return;
+
+    // 可写段还在变，先在反应器线程上查出候选；其它段用快照，交给计算线程
+    std::vector<std::pair<uint32_t, uint64_t>> recent;
+    std::vector<uint32_t> ids;
+    if (intersect(*open_segment, terms, ids))
+        for (uint32_t id : ids)
+            recent.emplace_back(open_segment->base + id, open_segment->offsets[id]);
+    std::vector<SegmentPtr> snapshot = segments;
+    int fd = history_fd;
+
+    co_await cpu_run([&] {
+        size_t checked = 0;
+        auto check = [&](uint32_t id, uint64_t offset) {
+            SearchHit hit;
+            hit.id = id;
+            if (read_record(fd, offset, hit.time_ms, hit.text) && verify(hit.text, words))
+                hits.push_back(std::move(hit));
+            return hits.size() < limit && ++checked < SEARCH_VERIFY_MAX;
+        };
+        for (auto it = recent.rbegin(); it != recent.rend(); it++)
+            if (!check(it->first, it->second))
+                return;
+        std::vector<uint32_t> found;
+        for (auto seg = snapshot.rbegin(); seg != snapshot.rend(); seg++)
+        {
+            if (!intersect(**seg, terms, found))
+                continue;
+            for (auto it = found.rbegin(); it != found.rend(); it++)
+                if (!check((*seg)->base + *it, (*seg)->offsets[*it]))
+                    return;
+        }
+    });
+}
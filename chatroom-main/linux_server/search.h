@@ -0,0 +1,51 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "reactor.h"
+
+// 聊天记录全文检索
+// 房间里的每条消息按顺序编号，追加到历史文件(一条记录一次 write)，同时进入倒排索引
+// 词: ASCII 字母数字的连续串转小写算一个词；其它字符(中文等)每个字符一个词
+// 索引分段:
+//   最新的消息在可写段里(哈希表，倒排表不压缩)，满 SEARCH_SEGMENT_DOCS 条后在计算线程池里冻结成只读段:
+//   词典排序后连续存放，倒排表是差值 varint 编码的编号
+//   只读段按合并次数分层，同一层攒够 SEARCH_MERGE_FANIN 个后在线程池里合并成一个，段数保持在对数级
+//   冻结和合并完成后才在反应器线程上替换段列表，查询拿的是段列表的快照，不会被打断
+// 查询: 所有词的倒排表求交，从最新的段往旧的找，找够条数就停(结果按时间从新到旧)，
+//   再读出正文确认每个查询词原样出现(中文词要求字符相邻)
+// 启动时顺序读一遍历史文件重建索引
+//
+// 历史文件: "CHIS" + 4 字节版本，之后每条记录:
+//   4 字节长度 | 8 字节时间(毫秒) | 消息 | 4 字节 CRC32
+// 整数都是大端；CRC 不对或不完整的尾部记录丢弃
+
+#define SEARCH_HISTORY ".history"
+#define SEARCH_SEGMENT_DOCS 4096  // 可写段的消息数
+#define SEARCH_MERGE_FANIN 8      // 同一层这么多段合并成一个
+#define SEARCH_TERM_MAX 64        // 更长的词截断
+#define SEARCH_LIMIT_DEFAULT 20
+#define SEARCH_VERIFY_MAX 20000   // 一次查询最多核对这么多条候选，限制最坏情况的耗时
+
+struct SearchHit
+{
+    uint32_t id;
+    int64_t time_ms;
+    std::string text;
+};
+
+// 打开(不存在时创建)历史文件并重建索引，在反应器启动前调用；不调用时 search_add 什么也不做
+bool search_open(const std::string &path);
+// 记下一条房间消息，只在反应器线程调用
+void search_add(const char *msg, size_t len);
+// 查询在计算线程池里执行；hits 按时间从新到旧，最多 limit 条
+Co<void> search_run(const std::string &query, size_t limit, std::vector<SearchHit> &hits);
+// 切词，建索引和查询共用
+void search_terms(const char *text, size_t len, std::vector<std::string> &terms);
+// 已经记下的消息数
+size_t search_size();
+
+#endif // SEARCH_H
@@ -1,4 +1,4 @@
-// 编译时要有 -lpthread
+// 编译: g++ -std=c++20 -O2 -c server.cpp reactor.cpp cpupool.cpp digest.cpp compress.cpp tls.cpp mux.cpp ratelimit.cpp filecache.cpp upgrade.cpp relay.cpp diskio.cpp catalog.cpp delta.cpp scan.cpp p2p.cpp capture.cpp sockopt.cpp log.cpp search.cpp admission.cpp resume.cpp batch.cpp && ar rcs libchatserver.a *.o && g++ -std=c++20 -O2 main.cpp libchatserver.a -o server -lpthread -lssl -lcrypto -lz
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
@@ -18,16 +18,62 @@
 #include <iomanip>
 #include <thread>
 #include <sys/stat.h>
+#include <sys/signalfd.h>
 #include <signal.h>
+#include <algorithm>
+#include <memory>
+#include "reactor.h"
+#include "compress.h"
+#include "tls.h"
+#include "mux.h"
+#include "ratelimit.h"
+#include "filecache.h"
+#include "cpupool.h"
+#include "digest.h"
+#include "upgrade.h"
+#include "relay.h"
+#include "diskio.h"
+#include "catalog.h"
+#include "delta.h"
+#include "scan.h"
+#include "p2p.h"
+#include "capture.h"
+#include "sockopt.h"
+#include "search.h"
+#include "admission.h"
+#include "resume.h"
+#include "batch.h"
+#include "log.h"
+#include "server.h"
 
 #define MAX_EVENTS 1000
 #define BUF_SIZE 65536
+#define CHAT_PENDING_MAX BUF_SIZE  // 没收完的一条聊天消息最多缓存这么多
 #define PORT 9999
 #define EPOLL_SIZE 50
 
+// 超时，单位毫秒
+#define LOGIN_TIMEOUT 30000              // 连上后这么久没说话(没有问候语或传输命令)直接断开
+#define HEARTBEAT_INTERVAL 30000         // 支持 ping 的客户端空闲这么久发一次 PING
+#define HEARTBEAT_MISSES 2               // 连续这么多次 PING 没有任何回应认为连接已死
+#define IDLE_TIMEOUT (30 * 60 * 1000)    // 不支持 ping 的客户端空闲这么久断开
+#define STALL_TIMEOUT 60000              // 文件传输这么久没有进展就中止
+
 pthread_mutex_t mutex;
 // client socket fd, client user，name(ip)
 std::map<int, std::string>* map_clients;
+// client socket fd, CAPS 协商出的能力位
+std::map<int, unsigned>* map_caps;
+// 反应器是单线程的，读到的数据在下一次挂起前就处理完，所有连接共用一个接收缓冲区
+// 空闲连接只剩协程帧，不再各自占一块缓冲区
+static char rx_buf[BUF_SIZE];
+
+void server_init()
+{
+    pthread_mutex_init(&mutex, NULL);
+    map_clients = new std::map<int, std::string>();
+    map_caps = new std::map<int, unsigned>();
+}
 
 void error_handling(const char* msg)
 {
@@ -48,167 +94,752 @@ bool is_fd_valid(int fd)
     return fcntl(fd, F_GETFD) != -1 || errno != EBADF;
 }
 
-void* send_msg_all(void* msg, int len)
+// 放进一个客户端的发送队列: 按它协商的能力压缩、封装成多路复用帧，返回入队的字节数
+// packed 缓存压缩结果，广播时所有支持 zlib 的客户端共用；调用者持有 mutex
+size_t queue_client_msg(int fd, const char* msg, int len, std::string& packed, bool& packed_tried)
 {
-    pthread_mutex_lock(&mutex);
-    for (auto it = map_clients->begin(); it != map_clients->end(); it++)
+    if (!is_fd_valid(fd))
+        return 0;
+    auto caps = map_caps->find(fd);
+    unsigned client_caps = caps == map_caps->end() ? 0 : caps->second;
+    const char* data = msg;
+    size_t data_len = len;
+    if (len >= CHAT_COMPRESS_MIN && (client_caps & CAP_ZLIB))
+    {
+        // 只压缩一次
+        if (!packed_tried)
+        {
+            packed_tried = true;
+            packed = pack_chat_msg(msg, len);
+        }
+        if (!packed.empty() && packed.size() < (size_t)len)
+        {
+            data = packed.data();
+            data_len = packed.size();
+        }
+    }
+    AsyncSock* sock = AsyncSock::find(fd);
+    if (!sock)
+        return 0;
+    // **放进对方的发送队列，慢客户端不会拖住广播**
+    if (client_caps & CAP_MUX)
     {
-        if (is_fd_valid(it->first))
-            write(it->first, msg, len);
+        // 多路复用连接上还有文件流，整帧入队，不会和文件数据交错
+        std::string frame = mux_frame(MUX_DATA, MUX_CHAT_STREAM, data, data_len);
+        sock->queue(frame.data(), frame.size());
+        return frame.size();
     }
+    sock->queue(data, data_len);
+    return data_len;
+}
+
+// 只发给本节点的客户端，其他节点转发过来的广播走这里
+void* send_msg_local(void* msg, int len)
+{
+    std::string packed;
+    bool packed_tried = false;
+    size_t total_sent = 0;
+    pthread_mutex_lock(&mutex);
+    for (auto it = map_clients->begin(); it != map_clients->end(); it++)
+        total_sent += queue_client_msg(it->first, (const char*)msg, len, packed, packed_tried);
     pthread_mutex_unlock(&mutex);
+    // 断线等待重连的会话攒着，恢复时补发
+    resume_backlog((const char*)msg, len);
+    // 聊天不受限速，但占用的带宽要算进全局桶
+    bulk_charge_chat(total_sent);
     return NULL;
 }
 
+// 只回复给一个客户端(查询结果)
+void send_msg_to(int client_sock, const std::string& msg)
+{
+    std::string packed;
+    bool packed_tried = false;
+    pthread_mutex_lock(&mutex);
+    size_t sent = queue_client_msg(client_sock, msg.c_str(), msg.size() + 1, packed, packed_tried);
+    pthread_mutex_unlock(&mutex);
+    bulk_charge_chat(sent);
+}
 
-void handle_file_upload(int client_sock, std::string filename, size_t file_size, const std::string& initial_data, size_t initial_size)
+// 房间里的消息(聊天、上传通知)记进历史供检索，文件通知是给客户端程序看的，不记
+static void record_history(const char* msg, size_t len)
 {
-    char buf[65536];
-    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
-    if (!file.is_open())
+    len = strnlen(msg, len);
+    if (len == 0 || (len >= 5 && memcmp(msg, "FILE ", 5) == 0))
+        return;
+    search_add(msg, len);
+}
+
+// 房间广播: 本节点的客户端 + 其他节点
+void* send_msg_all(void* msg, int len)
+{
+    record_history((const char*)msg, len);
+    send_msg_local(msg, len);
+    relay_broadcast((const char*)msg, len);
+    return NULL;
+}
+
+// 预读要打开、映射文件并同步读开头一段，交给线程池做，不卡住反应器上的其他连接
+static Task prefetch_upload(std::string path)
+{
+    co_await cpu_run([&] { filecache_prefetch(path); });
+}
+
+// 其他节点的广播，文件通知对应的文件在共用目录里，先换掉本节点的旧缓存
+void on_relay_message(const std::string& msg)
+{
+    if (msg.compare(0, 5, "FILE ") == 0)
     {
-        perror("fopen() error");
+        // 索引由上传所在的节点写进共用的目录，这里只更新内存
+        std::istringstream iss(msg.c_str() + 5);
+        CatalogEntry entry;
+        iss >> entry.name >> entry.size >> entry.sha256 >> entry.uploader;
+        entry.mtime = time(NULL);
+        if (catalog_valid_path(entry.name))
+        {
+            catalog_put(entry, false);
+            filecache_invalidate(catalog_path(entry.name));
+            // 带目录的名字只来自文件夹上传，和本节点一样不预读
+            if (catalog_valid_name(entry.name))
+                prefetch_upload(catalog_path(entry.name));
+        }
+    }
+    record_history(msg.data(), msg.size());
+    send_msg_local((void*)msg.data(), msg.size());
+}
+
+// 本节点的在线用户变了，告诉其他节点
+void publish_presence()
+{
+    if (!relay_enabled())
+        return;
+    std::string users;
+    pthread_mutex_lock(&mutex);
+    for (auto it = map_clients->begin(); it != map_clients->end(); it++)
+        users += it->second + "\n";
+    pthread_mutex_unlock(&mutex);
+    users += resume_parked_users();
+    relay_set_presence(users);
+}
+
+
+// 记进文件目录并通知所有人有新文件可以下载
+// 接下来大部分人会同时下载，先换掉旧的缓存并开始预读
+// 第 4 个字段是文件的 SHA-256，第 5 个是上传者，旧客户端只取前 3 个字段
+// notice 为 false 时不预读，也不在聊天里说(文件夹上传的文件，最后只说一次)
+void announce_upload(const std::string& filename, size_t file_size, const std::string& sha256, const std::string& uploader, bool notice = true)
+{
+    CatalogEntry entry;
+    entry.name = filename;
+    entry.size = file_size;
+    entry.sha256 = sha256;
+    entry.uploader = uploader;
+    entry.mtime = time(NULL);
+    catalog_put(entry);
+    filecache_invalidate(catalog_path(filename));
+    if (notice)
+        prefetch_upload(catalog_path(filename));
+    std::string msg = "FILE " + filename + " " + std::to_string(file_size) + " " + sha256 + " " + uploader;
+    send_msg_all((void *)msg.c_str(), msg.size() + 1);
+    if (!notice)
         return;
+    std::string notification = std::string("上传了文件: ") + filename;
+    send_msg_all((void *)notification.c_str(), notification.size() + 1);
+}
+
+// 拿不到配额时按调度器给出的时间睡眠后重试，睡眠期间反应器照常处理其他连接
+Co<void> acquire_bandwidth(int transfer, size_t bytes)
+{
+    int wait_ms;
+    while (!bulk_try_acquire(transfer, bytes, wait_ms))
+        co_await reactor_sleep(wait_ms);
+}
+
+// 解压(如果是压缩帧)并更新哈希，在线程池里执行，反应器继续处理其他连接
+// 解出的数据放在 raw 里，帧损坏返回 false
+Co<bool> digest_chunk(FrameDecoder& decoder, Sha256& digest, const std::string& chunk, std::string& raw, bool compressed)
+{
+    bool ok = true;
+    co_await cpu_run([&] {
+        raw.clear();
+        if (compressed && !decoder.feed(chunk.data(), chunk.size(), raw))
+        {
+            ok = false;
+            return;
+        }
+        const std::string& data = compressed ? raw : chunk;
+        digest.update(data.data(), data.size());
+    });
+    co_return ok;
+}
+
+// resume 不为空时接着旧进程的进度写临时文件(热升级)
+Co<void> handle_file_upload(AsyncSock& sock, std::string filename, size_t file_size, std::string initial_data, size_t initial_size, bool compressed = false, const SessionState* resume = nullptr)
+{
+    // 只能写进存储目录，不接受带路径的文件名
+    if (!catalog_valid_name(filename))
+    {
+        log_warn("Invalid upload filename: %s", filename.c_str());
+        co_return;
+    }
+    std::string path = catalog_path(filename);
+    std::string tmp_name = path + UPLOAD_TMP_SUFFIX;
+    // **写盘交给写盘线程，网络接收不再等磁盘**
+    DiskWriter file;
+    if (!file.open(tmp_name, file_size, resume ? resume->offset : 0))
+    {
+        log_error("open() error: %s", strerror(errno));
+        co_return;
     }
 
     size_t bytes_received = 0;
+    FrameDecoder decoder;
+    Sha256 digest;
+    std::string raw;
+
+    // 每个挂起点之前登记进度，热升级时交给新进程
+    Session* session = session_find(sock.fd());
+    session->state.kind = SESSION_UPLOAD;
+    session->state.filename = filename;
+    session->state.file_size = file_size;
+    session->state.compressed = compressed;
+    session->out = &file;
+    session->decoder = &decoder;
+    sock_set_role(sock.fd(), SOCK_ROLE_UPLOAD);
+    SockTuner tuner(sock.fd(), false);
+
+    if (resume)
+    {
+        bytes_received = resume->offset;
+        decoder.pending = resume->input;
+        session->state.offset = bytes_received;
+        if (!co_await digest_file(digest, tmp_name, bytes_received))
+        {
+            log_warn("Cannot resume upload: %s", filename.c_str());
+            remove(tmp_name.c_str());
+            co_return;
+        }
+        log_info("Upload resumed: %s %zu/%zu", filename.c_str(), bytes_received, file_size);
+    }
 
     // **1. 先写入已经解析出来的数据**
     if (initial_size > 0)
     {
-        file.write(initial_data.c_str(), initial_size);
-        bytes_received += initial_size;
-        std::cout << "Initial data written: " << initial_size << " bytes\n";
+        initial_data.resize(initial_size);
+        if (!co_await digest_chunk(decoder, digest, initial_data, raw, compressed))
+        {
+            log_warn("Corrupted compressed frame");
+            co_return;
+        }
+        const std::string& data = compressed ? raw : initial_data;
+        if (!co_await file.write(data.data(), data.size()))
+        {
+            log_error("write() error: %s", strerror(errno));
+            co_return;
+        }
+        bytes_received += data.size();
+        session->state.offset = bytes_received;
+        log_debug("Initial data written: %zu bytes", initial_size);
     }
 
     // **2. 继续 `recv()` 剩余数据**
+    std::string chunk;
     while (bytes_received < file_size)
     {
-        ssize_t bytes = recv(client_sock, buf, sizeof(buf), 0);
+        ssize_t bytes = co_await sock.read(rx_buf, sizeof(rx_buf), STALL_TIMEOUT);
         if (bytes > 0)
         {
-            file.write(buf, bytes);
-            bytes_received += bytes;
+            chunk.assign(rx_buf, bytes);  // rx_buf 是共用的，交给线程池前先拷贝
+            if (!co_await digest_chunk(decoder, digest, chunk, raw, compressed))
+            {
+                log_warn("Corrupted compressed frame");
+                break;
+            }
+            const std::string& data = compressed ? raw : chunk;
+            if (!co_await file.write(data.data(), data.size()))
+            {
+                log_error("write() error: %s", strerror(errno));
+                break;
+            }
+            bytes_received += data.size();
+            session->state.offset = bytes_received;
+            tuner.update(bytes_received);
         }
         else if (bytes < 0)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                continue;
-            std::cerr << "Recv failed: " << strerror(errno) << std::endl;
+            log_warn("Recv failed: %s", strerror(errno));
             break;
         }
         else
         {
-            std::cout << "Disconnected Connection closed by the peer" << std::endl;
+            log_info("Disconnected Connection closed by the peer");
             break;
         }
     }
 
-    file.close();
-    std::cout << "File upload complete: " << filename << " Received bytes: " << bytes_received << std::endl;
-	std::string msg = "FILE " + filename + " " + std::to_string(file_size);
-    send_msg_all((void *)msg.c_str(), msg.size() + 1);
-    std::string notification = u8"上传了文件: " + filename;
-    send_msg_all((void *)notification.c_str(), notification.size() + 1);
+    // 半途断开或卡住的上传不留半个文件，也不通知
+    if (bytes_received < file_size)
+    {
+        file.close();
+        log_warn("Upload aborted: %s %zu/%zu", filename.c_str(), bytes_received, file_size);
+        remove(tmp_name.c_str());
+        co_return;
+    }
+    // 剩余数据写完并落盘后才改名和通知
+    if (!co_await file.commit())
+    {
+        log_error("write() error: %s", strerror(errno));
+        remove(tmp_name.c_str());
+        co_return;
+    }
+    if (rename(tmp_name.c_str(), path.c_str()) != 0)
+    {
+        log_error("rename() error: %s", strerror(errno));
+        remove(tmp_name.c_str());
+        co_return;
+    }
+    std::string sha256 = digest.hex();
+    log_info("File upload complete: %s Received bytes: %zu SHA-256: %s", filename.c_str(), bytes_received, sha256.c_str());
+    // 传输连接已经不在用户列表里，上传者是登记在会话里的名字
+    announce_upload(filename, file_size, sha256, session->state.name);
 }
 
-void handle_file_download(int client_sock, const std::string &filename)
+// 增量上传和文件夹上传的一行应答，失败时说明原因，客户端据此决定是否改用完整上传
+static Co<void> reply_line(AsyncSock& sock, const std::string& reply)
 {
-    char buf[BUF_SIZE];
-    size_t bytes_sent = 0;
-    FILE* fp = fopen(filename.c_str(), "rb");
-    
-    if (!fp)
+    bool ok = co_await sock.write_all(reply + "\n");
+    if (!ok)
+        log_error("send() error: %s", strerror(errno));
+}
+
+// 增量上传: 发送旧版本的块签名，再按客户端的指令用旧版本的块和原样数据拼出新版本
+// 协议见 delta.h；旧版本整个上传期间用缓存里的映射，中途被替换也不影响
+Co<void> handle_delta_upload(AsyncSock& sock, std::string filename, size_t file_size, std::string initial_data)
+{
+    if (!catalog_valid_name(filename))
     {
-        perror("fopen() 错误");
-        send(client_sock, "ERROR", 5, 0);  // 发送错误信息
-        close(client_sock);
-        return;
+        log_warn("Invalid upload filename: %s", filename.c_str());
+        co_await reply_line(sock, "ERROR bad file name");
+        co_return;
     }
+    std::string path = catalog_path(filename);
+    std::string tmp_name = path + UPLOAD_TMP_SUFFIX;
+    Session* session = session_find(sock.fd());
+    session->state.kind = SESSION_DELTA;
+    session->state.filename = filename;
+    session->state.file_size = file_size;
 
-    int fd = fileno(fp);
-    if (fd == -1)
+    // **1. 旧版本的签名，计算交给线程池**
+    FileRef base;
+    CatalogEntry entry;
+    if (catalog_stat(filename, entry))
+        base = filecache_open(path);
+    DeltaDecoder decoder;
+    decoder.block = delta_block_size(base ? base->size : file_size);
+    std::string sigs;
+    if (base)
     {
-        perror("fileno() 错误");
-        fclose(fp);
-        close(client_sock);
-        return;
+        decoder.base = base->data;
+        decoder.base_size = base->size;
+        co_await cpu_run([&] { delta_signatures(decoder.base, decoder.base_size, decoder.block, sigs); });
     }
-
-    struct stat file_stat;
-    if (fstat(fd, &file_stat) != 0)
+    std::string head = "SIGS " + std::to_string(decoder.block) + " " + std::to_string(sigs.size() / DELTA_SIG_SIZE) + "\n";
+    bool ok = co_await sock.write_all(head + sigs);
+    if (!ok)
     {
-        perror("fstat() 错误");
-        fclose(fp);
-        close(client_sock);
-        return;
+        log_error("send() error: %s", strerror(errno));
+        co_return;
     }
 
-    size_t file_size = file_stat.st_size;
-    printf("开始发送文件: %s, 大小: %zu 字节\n", filename.c_str(), file_size);
-
-    // 发送文件大小
-    std::string file_size_str = std::to_string(file_size) + "\n";
-    if (send(client_sock, file_size_str.c_str(), file_size_str.size(), 0) < 0)
+    DiskWriter file;
+    if (!file.open(tmp_name, file_size))
     {
-        perror("发送文件大小失败");
-        fclose(fp);
-        close(client_sock);
-        return;
+        log_error("open() error: %s", strerror(errno));
+        co_await reply_line(sock, "ERROR cannot create file");
+        co_return;
     }
 
-    while (bytes_sent < file_size)
+    // **2. 按顺序执行拼接指令，解析、解压和哈希在线程池里做**
+    Sha256 digest;
+    std::vector<DeltaOp> ops;
+    std::string chunk = initial_data;
+    size_t bytes_written = 0;
+    size_t decoded_bytes = 0;  // 解出的指令一共要写多少字节
+    size_t literal_bytes = 0;
+    const char* error = NULL;
+    while (!decoder.done && !error)
     {
-        size_t bytes_read = fread(buf, 1, BUF_SIZE, fp);
-        if (bytes_read <= 0)
+        if (chunk.empty())
+        {
+            ssize_t bytes = co_await sock.read(rx_buf, sizeof(rx_buf), STALL_TIMEOUT);
+            if (bytes <= 0)
+            {
+                log_warn("Delta upload: %s", bytes < 0 ? strerror(errno) : "connection closed");
+                break;
+            }
+            chunk.assign(rx_buf, bytes);
+        }
+        bool valid = true;
+        bool oversize = false;
+        co_await cpu_run([&] {
+            ops.clear();
+            valid = decoder.feed(chunk.data(), chunk.size(), ops);
+            // 拷贝指令只有几个字节却能引用整个旧版本，先数总长度，超出声明的大小就不再哈希
+            for (size_t i = 0; i < ops.size(); i++)
+                decoded_bytes += ops[i].len;
+            if (decoded_bytes > file_size)
+            {
+                oversize = true;
+                return;
+            }
+            for (size_t i = 0; i < ops.size(); i++)
+                digest.update(ops[i].data, ops[i].len);
+        });
+        chunk.clear();
+        if (oversize)
+        {
+            error = "ERROR size mismatch";
+            break;
+        }
+        if (!valid)
         {
+            error = "ERROR bad delta";
             break;
         }
+        for (size_t i = 0; i < ops.size() && !error; i++)
+        {
+            if (bytes_written + ops[i].len > file_size)
+                error = "ERROR size mismatch";
+            else if (!(co_await file.write(ops[i].data, ops[i].len)))
+                error = "ERROR write failed";
+            bytes_written += ops[i].len;
+            if (ops[i].data == ops[i].literal.data())
+                literal_bytes += ops[i].len;
+        }
+        session->state.offset = bytes_written;
+    }
 
-        size_t bytes_to_send = bytes_read;
-        char *send_ptr = buf;
-        int retry_count = 0;  // 添加重试机制
+    // **3. 大小和哈希都对上才替换旧版本**
+    std::string sha256 = decoder.done ? digest.hex() : std::string();
+    if (!error && decoder.done && bytes_written != file_size)
+        error = "ERROR size mismatch";
+    if (!error && decoder.done && sha256 != decoder.sha256)
+        error = "ERROR checksum mismatch";
+    if (!error && decoder.done && !(co_await file.commit()))
+        error = "ERROR write failed";
+    if (!error && decoder.done && rename(tmp_name.c_str(), path.c_str()) != 0)
+        error = "ERROR write failed";
+    if (error || !decoder.done)
+    {
+        file.close();
+        remove(tmp_name.c_str());
+        log_warn("Delta upload aborted: %s %s", filename.c_str(), error ? error : "incomplete");
+        if (error)
+            co_await reply_line(sock, error);
+        co_return;
+    }
+    log_info("Delta upload complete: %s %zu bytes, literal %zu bytes, SHA-256: %s", filename.c_str(), file_size,
+             literal_bytes, sha256.c_str());
+    co_await reply_line(sock, "OK " + sha256);
+    announce_upload(filename, file_size, sha256, session->state.name);
+}
+
+// 文件夹上传: 一个连接收下整棵目录树，协议见 batch.h
+// 解帧、解压、拆文件和哈希在线程池里做；小文件整个攒在内存里成批交给写盘线程，大文件走 DiskWriter
+// 都不单独 fdatasync，最后 syncfs 一次，落盘后再统一改名、登记和通知
+Co<void> handle_batch_upload(AsyncSock& sock, std::string folder, uint64_t file_count, uint64_t total_size, std::string initial_data)
+{
+    if (!catalog_valid_name(folder) || file_count > BATCH_FILES_MAX)
+    {
+        log_warn("Invalid folder upload: %s %llu files", folder.c_str(), (unsigned long long)file_count);
+        co_await reply_line(sock, "ERROR bad folder");
+        co_return;
+    }
+    Session* session = session_find(sock.fd());
+    session->state.kind = SESSION_BATCH;
+    session->state.filename = folder;
+    session->state.file_size = total_size;
+    sock_set_role(sock.fd(), SOCK_ROLE_UPLOAD);
+    SockTuner tuner(sock.fd(), false);
 
-        while (bytes_to_send > 0)
+    struct BatchFile
+    {
+        std::string name;
+        uint64_t size;
+        std::string sha256;
+    };
+    std::vector<BatchFile> files;  // 收齐的文件，还是临时文件
+    FrameDecoder frames;
+    BatchDecoder decoder;
+    std::vector<BatchOp> ops;
+    std::unique_ptr<Sha256> digest;
+    DiskPack pack;
+    DiskWriter large;
+    std::string name;   // 当前文件在目录里的名字，检查过的
+    // 这次上传自己建的临时文件记在会话里，热升级交接后新进程也能删掉
+    std::vector<std::string>& temp_files = session->state.temp_files;
+    std::string small;  // 当前小文件的内容
+    uint64_t size = 0;
+    uint64_t announced = 0;  // 头里声明的大小之和
+    size_t wire_bytes = 0;
+    std::string chunk = initial_data;
+    std::string raw;
+    const char* error = NULL;
+    while (!decoder.done && !error)
+    {
+        if (chunk.empty())
         {
-            ssize_t sent = send(client_sock, send_ptr, bytes_to_send, 0);
-            if (sent < 0)
+            ssize_t bytes = co_await sock.read(rx_buf, sizeof(rx_buf), STALL_TIMEOUT);
+            if (bytes <= 0)
+            {
+                log_warn("Folder upload: %s", bytes < 0 ? strerror(errno) : "connection closed");
+                break;
+            }
+            chunk.assign(rx_buf, bytes);
+        }
+        wire_bytes += chunk.size();
+        bool valid = true;
+        co_await cpu_run([&] {
+            raw.clear();
+            ops.clear();
+            valid = frames.feed(chunk.data(), chunk.size(), raw) && decoder.feed(raw.data(), raw.size(), ops);
+            for (size_t i = 0; i < ops.size() && valid; i++)
             {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                if (ops[i].type == BATCH_OP_BEGIN)
+                    digest = std::make_unique<Sha256>();
+                else if (ops[i].type == BATCH_OP_DATA)
+                    digest->update(ops[i].data, ops[i].len);
+                else
+                    ops[i].sha256 = digest->hex();
+            }
+        });
+        chunk.clear();
+        if (!valid)
+        {
+            error = "ERROR bad stream";
+            break;
+        }
+        for (size_t i = 0; i < ops.size() && !error; i++)
+        {
+            BatchOp& op = ops[i];
+            if (op.type == BATCH_OP_BEGIN)
+            {
+                // **名字检查通过之前不能碰这个路径，出错时的清理也不能**
+                std::string path_name = folder + "/" + op.path;
+                size = op.size;
+                announced += size;
+                small.clear();
+                if (!catalog_valid_path(path_name))
+                    error = "ERROR bad file name";
+                else if (files.size() >= file_count || announced > total_size)
+                    error = "ERROR size mismatch";
+                else if (!catalog_make_parents(path_name))
+                    error = "ERROR cannot create folder";
+                else if (size > BATCH_SMALL_MAX && !large.open(catalog_path(path_name) + UPLOAD_TMP_SUFFIX, size))
+                    error = "ERROR cannot create file";
+                if (error)
+                    break;
+                name = path_name;
+                if (size > BATCH_SMALL_MAX)
+                    temp_files.push_back(catalog_path(name) + UPLOAD_TMP_SUFFIX);
+                else
+                    small.reserve(size);
+            }
+            else if (op.type == BATCH_OP_DATA)
+            {
+                if (size <= BATCH_SMALL_MAX)
+                    small.append(op.data, op.len);
+                else if (!(co_await large.write(op.data, op.len)))
+                    error = "ERROR write failed";
+            }
+            else
+            {
+                std::string tmp_name = catalog_path(name) + UPLOAD_TMP_SUFFIX;
+                bool written;
+                if (size <= BATCH_SMALL_MAX)
                 {
-                    if (retry_count < 10)  // **最多重试 10 次**
-                    {
-                        std::cerr << "TCP缓冲区满，等待50ms..." << std::endl;
-                        usleep(50000);  // **等待 50ms
-                        retry_count++;
-                        continue;
-                    }
-                    else
-                    {
-                        std::cerr << "重试失败，断开连接。" << std::endl;
-                        fclose(fp);
-                        close(client_sock);
-                        return;
-                    }
+                    temp_files.push_back(tmp_name);
+                    written = co_await pack.add(tmp_name, std::move(small));
                 }
-                std::cerr << "send() 错误: " << strerror(errno) << "，断开连接。" << std::endl;
-                fclose(fp);
-                close(client_sock);
-                return;
+                else
+                    written = co_await large.commit(false);
+                if (!written)
+                    error = "ERROR write failed";
+                files.push_back(BatchFile{name, size, op.sha256});
             }
-            send_ptr += sent;
-            bytes_to_send -= sent;
-            retry_count = 0;  // 发送成功后重置重试次数
+        }
+        session->state.offset = announced;
+        tuner.update(wire_bytes);
+    }
+
+    // **所有文件一起落盘，出错时也要等在写的批写完才能删临时文件**
+    bool complete = !error && decoder.done;
+    if (complete && (decoder.count != files.size() || files.size() != file_count || announced != total_size))
+    {
+        error = "ERROR size mismatch";
+        complete = false;
+    }
+    large.close();
+    bool synced = co_await pack.finish(catalog_path(folder), complete);
+    if (complete && !synced)
+    {
+        log_error("Folder upload sync error: %s", strerror(errno));
+        error = "ERROR write failed";
+        complete = false;
+    }
+    if (!complete)
+    {
+        // 只删这次上传建过的临时文件: 收齐的文件和正在写的大文件，小文件收齐之前还没有建
+        for (size_t i = 0; i < temp_files.size(); i++)
+            remove(temp_files[i].c_str());
+        temp_files.clear();
+        log_warn("Folder upload aborted: %s %zu/%llu files %s", folder.c_str(), files.size(),
+                 (unsigned long long)file_count, error ? error : "incomplete");
+        if (error)
+            co_await reply_line(sock, error);
+        co_return;
+    }
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        std::string path = catalog_path(files[i].name);
+        if (rename((path + UPLOAD_TMP_SUFFIX).c_str(), path.c_str()) != 0)
+        {
+            log_error("rename() error: %s", strerror(errno));
+            remove((path + UPLOAD_TMP_SUFFIX).c_str());
+            continue;
+        }
+        announce_upload(files[i].name, files[i].size, files[i].sha256, session->state.name, false);
+    }
+    temp_files.clear();
+    log_info("Folder upload complete: %s %zu files, %llu bytes, %zu bytes on the wire", folder.c_str(), files.size(),
+             (unsigned long long)total_size, wire_bytes);
+    co_await reply_line(sock, "OK " + std::to_string(files.size()));
+    std::string notification = "上传了文件夹: " + folder + " (" + std::to_string(files.size()) + " 个文件)";
+    send_msg_all((void*)notification.c_str(), notification.size() + 1);
+}
+
+// 连接由 handle_client 统一关闭
+// resume 不为空时从旧进程发到的位置继续，文件大小已经发过了(热升级)
+Co<void> handle_file_download(AsyncSock& sock, std::string filename, bool compressed = false, const SessionState* resume = nullptr)
+{
+    int client_sock = sock.fd();
+    size_t bytes_sent = 0;
+    FrameEncoder encoder;
+    std::string frame;
+    Session* session = session_find(client_sock);
+    session->state.kind = SESSION_DOWNLOAD;
+    session->state.filename = filename;
+    session->state.compressed = compressed;
+    session->encoder = &encoder;
+    // **同一个文件的并发下载共用缓存里的 fd 和映射**
+    // 只提供存储目录里的文件
+    FileRef file;
+    if (catalog_valid_path(filename))
+        file = filecache_open(catalog_path(filename));
+    else
+        errno = EINVAL;
+
+    if (!file)
+    {
+        log_error("open() 错误: %s", strerror(errno));
+        co_await sock.write_all("ERROR", 5);  // 发送错误信息
+        co_return;
+    }
+
+    int fd = file->fd;
+    size_t file_size = file->size;
+    session->state.file_size = file_size;
+    BulkTransfer transfer(client_sock);
+    bool ok;
+    // **内核里没发出的数据保持很少，发送缓冲区按带宽时延积放大**
+    sock_set_role(client_sock, SOCK_ROLE_DOWNLOAD);
+    SockTuner tuner(client_sock, true);
+
+    if (resume)
+    {
+        // 交接期间文件被新的上传替换了，接着发会拼出错误的内容
+        if (file_size != resume->file_size)
+        {
+            log_warn("文件已改变，无法继续下载: %s", filename.c_str());
+            co_return;
+        }
+        bytes_sent = resume->offset;
+        encoder.decided = resume->encoder_decided;
+        encoder.bypass = resume->encoder_bypass;
+        session->state.offset = bytes_sent;
+        log_info("继续发送文件: %s, 从 %zu / %zu 字节", filename.c_str(), bytes_sent, file_size);
+    }
+    else
+    {
+        log_info("开始发送文件: %s, 大小: %zu 字节", filename.c_str(), file_size);
+        // 发送文件大小，加塞后和第一块数据凑在同一个报文段里
+        sock_cork(client_sock, true);
+        std::string file_size_str = std::to_string(file_size) + "\n";
+        ok = co_await sock.write_all(file_size_str);
+        if (!ok)
+        {
+            log_error("发送文件大小失败: %s", strerror(errno));
+            co_return;
+        }
+    }
+
+    // **明文或 kTLS 连接直接 sendfile()，文件数据不经过用户态**
+    // **缓冲区满时挂起等待可写，不再 sleep 重试**
+    bool zero_copy = !compressed && sock_can_sendfile(client_sock);
+    while (zero_copy && bytes_sent < file_size)
+    {
+        size_t chunk = std::min((size_t)BUF_SIZE, file_size - bytes_sent);
+        co_await acquire_bandwidth(transfer.id, chunk);
+        ssize_t sent = co_await sock.sendfile(fd, bytes_sent, chunk);
+        if (sent < 0)
+        {
+            log_error("sendfile() 错误: %s，断开连接。", strerror(errno));
+            co_return;
+        }
+        if (sent == 0)
+            break;  // 文件被截断
+        bytes_sent += sent;
+        session->state.offset = bytes_sent;
+        tuner.update(bytes_sent);
+        co_await reactor_yield();  // 每发一块让出一次，别的连接不用等整个文件
+    }
+
+    while (!zero_copy && bytes_sent < file_size)
+    {
+        // 直接从映射发送，不再 fread 到自己的缓冲区
+        size_t bytes_read = std::min((size_t)BUF_SIZE, file_size - bytes_sent);
+        co_await acquire_bandwidth(transfer.id, bytes_read);
+        const char *data = file->data + bytes_sent;
+
+        size_t bytes_to_send = bytes_read;
+        const char *send_ptr = data;
+        if (compressed)
+        {
+            // 压缩在线程池里做，映射和 frame 在等待期间不会变
+            co_await cpu_run([&] {
+                frame.clear();
+                encoder.encode(data, bytes_read, frame);
+            });
+            bytes_to_send = frame.size();
+            send_ptr = frame.data();
+        }
+        // 挂起时这一块要么已经写出，要么在发送队列里，交接时随队列一起交出去
+        session->state.offset = bytes_sent + bytes_read;
+        ok = co_await sock.write_all(send_ptr, bytes_to_send);
+        if (!ok)
+        {
+            log_error("send() 错误: %s，断开连接。", strerror(errno));
+            co_return;
         }
 
         bytes_sent += bytes_read;
-        usleep(500);  // **延迟，避免过快发送导致 TCP 队列积压**
+        tuner.update(bytes_sent);
+        co_await reactor_yield();
     }
+    // 最后不满一个报文段的数据马上发出
+    sock_cork(client_sock, false);
 
-    printf("文件发送完成: %s, 总共发送 %zu 字节\n", filename.c_str(), bytes_sent);
-    
-    fclose(fp);
-    close(client_sock);
+    log_info("文件发送完成: %s, 总共发送 %zu 字节", filename.c_str(), bytes_sent);
 }
 
 
@@ -217,194 +848,714 @@ void handle_file_download(int client_sock, const std::string &filename)
 
 void broadcast_userlist()
 {
-    std::string userlist = "USERLIST ";
+    std::string users;
     for (auto it = map_clients->begin(); it != map_clients->end(); it++)
     {
-        userlist += it->second + "\n";
+        users += it->second + "\n";
     }
-    printf("Broadcasting user list: \n%s\n", userlist.c_str());
-    send_msg_all((void*)userlist.c_str(), userlist.size() + 1);
+    // 断线等待重连的用户还算在线
+    users += resume_parked_users();
+    // 多节点时合并所有节点的用户，每个节点算出的列表相同，只发给本节点的客户端
+    std::string userlist = "USERLIST " + relay_merge_users(users);
+    log_debug("Broadcasting user list: \n%s", userlist.c_str());
+    send_msg_local((void*)userlist.c_str(), userlist.size() + 1);
 }
 
-void* handle_client(void* arg)
+static std::string catalog_line(const CatalogEntry& entry)
 {
-    int client_sock = *((int*)arg);
-    setnonblockingmode(client_sock);
+    return entry.name + " " + std::to_string(entry.size) + " " + entry.sha256 + " " +
+           (entry.uploader.empty() ? "-" : entry.uploader) + " " + std::to_string(entry.mtime);
+}
 
-    int epfd = epoll_create(1);
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-    event.data.fd = client_sock;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &event);
+// "LIST [数量 [上一页最后的文件名]]"，只回复请求者:
+// "CATALOG <下一页从这个名字之后开始，没有了为 ->\n" + 每行 "名字 大小 SHA-256 上传者 时间"
+void reply_catalog_list(int client_sock, const std::string& request)
+{
+    std::istringstream iss(request.substr(4));
+    size_t limit = CATALOG_PAGE_DEFAULT;
+    std::string after;
+    iss >> limit >> after;
+    limit = std::min<size_t>(std::max<size_t>(limit, 1), CATALOG_PAGE_MAX);
+    std::vector<CatalogEntry> entries;
+    bool more = catalog_list(after, limit, entries);
+    std::string reply = "CATALOG " + (more ? entries.back().name : std::string("-")) + "\n";
+    for (size_t i = 0; i < entries.size(); i++)
+        reply += catalog_line(entries[i]) + "\n";
+    send_msg_to(client_sock, reply);
+}
 
-    char msg[BUF_SIZE];
-    bool name_saved = false;
+// "STAT 名字" -> "STAT 名字 大小 SHA-256 上传者 时间"，没有这个文件时为 "STAT 名字 -"
+void reply_catalog_stat(int client_sock, const std::string& request)
+{
+    std::istringstream iss(request.c_str());
+    std::string name;
+    iss >> name;
+    CatalogEntry entry;
+    if (catalog_stat(name, entry))
+        send_msg_to(client_sock, "STAT " + catalog_line(entry));
+    else
+        send_msg_to(client_sock, "STAT " + name + " -");
+}
 
-    while (true)
+// 客户端在 CAPS 里协商过这个能力
+static bool client_has_cap(int fd, unsigned cap)
+{
+    pthread_mutex_lock(&mutex);
+    auto caps = map_caps->find(fd);
+    bool has = caps != map_caps->end() && (caps->second & cap);
+    pthread_mutex_unlock(&mutex);
+    return has;
+}
+
+// "OFFER 文件名 端口": 客户端可以直接提供目录里这个文件的当前版本
+// 和 PEER 一样只接受协商了 p2p 的客户端
+void handle_peer_offer(int client_sock, const std::string& request)
+{
+    if (!client_has_cap(client_sock, CAP_P2P))
+    {
+        send_msg_to(client_sock, "ERROR p2p not negotiated");
+        return;
+    }
+    std::istringstream iss(request);
+    std::string name;
+    int port = 0;
+    iss >> name >> port;
+    CatalogEntry entry;
+    if (port <= 0 || port > 65535 || !catalog_stat(name, entry))
+        return;
+    PeerOffer offer;
+    offer.fd = client_sock;
+    offer.port = port;
+    offer.sha256 = entry.sha256;
+    pthread_mutex_lock(&mutex);
+    auto client = map_clients->find(client_sock);
+    if (client != map_clients->end())
+        offer.ip = client->second.substr(0, client->second.find(':'));
+    pthread_mutex_unlock(&mutex);
+    if (offer.ip.empty())
+        return;
+    p2p_offer(name, offer);
+    log_info("P2P offer: %s from %s:%d", name.c_str(), offer.ip.c_str(), port);
+}
+
+// "PEER 文件名": 给下载者找一个提供者，两边各拿到同一个一次性令牌
+void handle_peer_request(int client_sock, const std::string& request)
+{
+    if (!client_has_cap(client_sock, CAP_P2P))
+    {
+        send_msg_to(client_sock, "ERROR p2p not negotiated");
+        return;
+    }
+    std::istringstream iss(request);
+    std::string name;
+    iss >> name;
+    CatalogEntry entry;
+    PeerOffer offer;
+    if (!catalog_stat(name, entry) || !p2p_find(name, entry.sha256, offer) || offer.fd == client_sock)
+    {
+        send_msg_to(client_sock, "PEER " + name + " -");
+        return;
+    }
+    std::string token = p2p_token();
+    send_msg_to(offer.fd, "PEERTOKEN " + name + " " + token);
+    send_msg_to(client_sock, "PEER " + name + " " + offer.ip + " " + std::to_string(offer.port) + " " + token + " " +
+                std::to_string(entry.size) + " " + entry.sha256);
+}
+
+// "SEARCH 关键词..."，只回复请求者: "SEARCHRESULT <条数>\n" + 每行 "编号 时间(秒) 消息"，新的在前
+// 查询在计算线程池里执行，回复前确认请求者还在线(fd 可能已经关闭后给了新连接)
+Task reply_search(int client_sock, std::string query)
+{
+    std::string owner;
+    pthread_mutex_lock(&mutex);
+    auto it = map_clients->find(client_sock);
+    if (it != map_clients->end())
+        owner = it->second;
+    pthread_mutex_unlock(&mutex);
+
+    std::vector<SearchHit> hits;
+    co_await search_run(query, SEARCH_LIMIT_DEFAULT, hits);
+
+    pthread_mutex_lock(&mutex);
+    it = map_clients->find(client_sock);
+    bool same = it != map_clients->end() && it->second == owner;
+    pthread_mutex_unlock(&mutex);
+    if (!same)
+        co_return;
+    std::string reply = "SEARCHRESULT " + std::to_string(hits.size()) + "\n";
+    for (auto& hit : hits)
+    {
+        std::replace(hit.text.begin(), hit.text.end(), '\n', ' ');
+        reply += std::to_string(hit.id) + " " + std::to_string(hit.time_ms / 1000) + " " + hit.text + "\n";
+    }
+    send_msg_to(client_sock, reply);
+}
+
+// "RESUME <令牌>": 断线重连，接回原来的会话，不再问候，其他人看不到这个用户离开又进来
+// 先回复收到了多少条，再补发断线期间的房间消息
+void handle_resume(int client_sock, const std::string& token, bool& name_saved)
+{
+    std::string user;
+    uint64_t received;
+    std::vector<std::string> missed;
+    int old_fd;
+    if (!resume_take(token, client_sock, user, received, missed, old_fd))
+    {
+        send_msg_to(client_sock, "RESUMEFAIL");
+        return;
+    }
+    name_saved = true;
+    pthread_mutex_lock(&mutex);
+    if (old_fd >= 0)
+    {
+        map_clients->erase(old_fd);
+        map_caps->erase(old_fd);
+    }
+    // 地址换成新连接的
+    std::string& entry = map_clients->at(client_sock);
+    entry += user.substr(user.find(':'));
+    log_info("Client %d resumed session of %s, %zu missed messages", client_sock, entry.c_str(), missed.size());
+    pthread_mutex_unlock(&mutex);
+    // 旧连接读到 EOF 后自己清理，不会再保留会话
+    if (old_fd >= 0)
+        shutdown(old_fd, SHUT_RDWR);
+    publish_presence();
+    send_msg_to(client_sock, "RESUMED " + std::to_string(received));
+    // 客户端接着一口气重发没确认的消息，不能被消息限速丢掉
+    admit_allow(client_sock, RESUME_REPLAY_MAX);
+    for (auto& msg : missed)
+        send_msg_to(client_sock, msg);
+}
+
+// 聊天连接上的一条消息是哪种请求，其余都是房间消息(第一条是问候语)
+enum ChatCommand
+{
+    CHAT_ROOM,
+    CHAT_PONG,
+    CHAT_USERLIST,
+    CHAT_LIST,
+    CHAT_STAT,
+    CHAT_OFFER,
+    CHAT_PEER,
+    CHAT_RESUME,
+    CHAT_BYE,
+    CHAT_SEARCH,
+};
+
+static ChatCommand parse_chat_command(const std::string& message, bool name_saved)
+{
+    if (message.compare("PONG") == 0)
+        return CHAT_PONG;
+    if (message.compare("USERLIST") == 0)
+        return CHAT_USERLIST;
+    if (message.compare(0, 4, "LIST") == 0 && (message.size() == 4 || message[4] == ' '))
+        return CHAT_LIST;
+    if (message.compare(0, 5, "STAT ") == 0)
+        return CHAT_STAT;
+    if (message.compare(0, 6, "OFFER ") == 0)
+        return CHAT_OFFER;
+    if (message.compare(0, 5, "PEER ") == 0)
+        return CHAT_PEER;
+    if (!name_saved && message.compare(0, 7, "RESUME ") == 0)
+        return CHAT_RESUME;
+    if (message.compare("BYE") == 0)
+        return CHAT_BYE;
+    if (message.compare(0, 7, "SEARCH ") == 0)
+        return CHAT_SEARCH;
+    return CHAT_ROOM;
+}
+
+// 处理一条聊天消息: USERLIST/LIST/STAT/OFFER/PEER/SEARCH 请求、第一次的问候语(带用户名)或普通聊天
+// msg 以 '\0' 结尾；terminated 表示客户端发来的消息本身带着 '\0'，转发时一起转发
+// complete 表示这是一条完整的消息('\0' 结尾或一个 MUX 帧)，只有完整的房间消息计入会话恢复的条数
+void handle_chat_message(int client_sock, char* msg, int len, bool& name_saved, bool terminated, bool complete)
+{
+    std::string message(msg, len);
+    ChatCommand command = parse_chat_command(message, name_saved);
+    // 问候语之后的房间消息才计数，客户端也只重发这些；被限速丢掉的也算收到了，重连后客户端不再重发
+    if (command == CHAT_ROOM && name_saved && complete)
+        resume_count(client_sock);
+    // 超出速率的消息直接丢弃，不占用广播和检索
+    int retry_ms;
+    bool notify;
+    if (command != CHAT_PONG && !admit_message(client_sock, retry_ms, notify))
+    {
+        if (notify)
+            send_msg_to(client_sock, admit_busy(retry_ms, "rate"));
+        return;
+    }
+    switch (command)
+    {
+    case CHAT_PONG:
+        // 心跳回应只说明连接还活着，不广播
+        break;
+    case CHAT_USERLIST:
+        log_debug("User list request");
+        broadcast_userlist();
+        break;
+    case CHAT_LIST:
+        reply_catalog_list(client_sock, message);
+        break;
+    case CHAT_STAT:
+        reply_catalog_stat(client_sock, message.substr(5));
+        break;
+    case CHAT_OFFER:
+        handle_peer_offer(client_sock, message.substr(6));
+        break;
+    case CHAT_PEER:
+        handle_peer_request(client_sock, message.substr(5));
+        break;
+    case CHAT_RESUME:
+        handle_resume(client_sock, message.substr(7), name_saved);
+        break;
+    case CHAT_BYE:
+        resume_close(client_sock);
+        break;
+    case CHAT_SEARCH:
+        if (admit_heavy(retry_ms))
+            reply_search(client_sock, message.substr(7));
+        else
+            send_msg_to(client_sock, admit_busy(retry_ms, "overload"));
+        break;
+    case CHAT_ROOM:
+        log_debug("Message: %s", msg);
+        if (!name_saved)
+        {
+            name_saved = true;
+            std::string str(msg);
+            std::string name = str.substr(0, str.find(' '));
+            log_debug("Client Username: %s", name.c_str());
+            map_clients->at(client_sock) += ":" + name;
+            log_info("Client Username Saved: %d %s", client_sock, map_clients->at(client_sock).c_str());
+            publish_presence();
+            if (client_has_cap(client_sock, CAP_RESUME))
+                send_msg_to(client_sock, "SESSION " + resume_open(client_sock, map_clients->at(client_sock)));
+        }
+        send_msg_all(msg, terminated ? len + 1 : len);
+        break;
+    }
+}
+
+// 一次读到的聊天数据里可能有好几条以 '\0' 分隔的消息
+// **整个缓冲区一次找出所有分隔符、一次校验 UTF-8**，不合法的消息不转发给别人
+// buf[len] 必须是 '\0'
+// pending 为空指针时(MUX 帧)每次给的都是完整的消息；否则没有 '\0' 结尾的半条消息留在 pending 里，
+// 和下一次读到的数据拼起来再处理。从来不发 '\0' 的老客户端一次读到的就是一条消息
+// 半条消息超过 CHAT_PENDING_MAX 返回 false，调用方断开连接
+bool handle_chat_buffer(int client_sock, char* buf, size_t len, bool& name_saved, std::string* pending, bool terminating)
+{
+    if (pending && !pending->empty())
+    {
+        // 接上上次剩下的半条消息，在拼好的副本上处理
+        pending->append(buf, len);
+        std::string data;
+        data.swap(*pending);
+        return handle_chat_buffer(client_sock, &data[0], data.size(), name_saved, pending, true);
+    }
+
+    static std::vector<uint32_t> ends;  // 只在反应器线程上使用
+    ends.clear();
+    scan_split(buf, len, '\0', ends);
+    size_t complete = len;  // 要当作消息处理的部分
+    if (pending && (terminating || !ends.empty()))
     {
-        int n = epoll_wait(epfd, &event, 1, -1);
-        if (n == 1 && event.events & EPOLLIN)
+        complete = ends.empty() ? 0 : ends.back() + 1;
+        if (len - complete > CHAT_PENDING_MAX)
         {
-            // **1. 读取客户端数据**
-            ssize_t bytes_read = recv(client_sock, msg, BUF_SIZE - 1, 0);
-            if (bytes_read == 0)
+            log_warn("client: %d message longer than %d bytes", client_sock, CHAT_PENDING_MAX);
+            return false;
+        }
+        pending->assign(buf + complete, len - complete);
+    }
+    bool all_valid = utf8_valid(buf, complete);
+    size_t start = 0;
+    for (size_t i = 0; i <= ends.size() && start < complete; i++)
+    {
+        size_t end = i < ends.size() ? ends[i] : len;
+        if (end > start)
+        {
+            if (all_valid || utf8_valid(buf + start, end - start))
+                handle_chat_message(client_sock, buf + start, end - start, name_saved, i < ends.size(), i < ends.size() || !pending);
+            else
+                log_warn("client: %d dropped a message that is not valid UTF-8", client_sock);
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// 多路复用连接: 聊天消息走流 0，文件流交给 MuxSession
+// 有下载流可以发送时不等待读，每轮每个流发一片，聊天帧可以插在片之间
+// heartbeat: 客户端支持 ping，空闲时发心跳；否则空闲太久直接断开
+// resume 不为空时恢复旧进程里的文件流和没处理完的帧(热升级)
+Co<void> handle_mux_client(AsyncSock& sock, std::string initial, bool& name_saved, bool heartbeat, const SessionState* resume = nullptr)
+{
+    int client_sock = sock.fd();
+    int idle_limit = heartbeat ? HEARTBEAT_INTERVAL : IDLE_TIMEOUT;
+    int64_t idle_deadline = reactor_now() + idle_limit;
+    int missed = 0;
+    MuxSession session(sock, [client_sock](const std::string& filename, size_t file_size, const std::string& sha256) {
+        pthread_mutex_lock(&mutex);
+        auto name = map_clients->find(client_sock);
+        std::string uploader = name == map_clients->end() ? "" : name->second;
+        pthread_mutex_unlock(&mutex);
+        announce_upload(filename, file_size, sha256, uploader);
+    });
+    MuxDecoder decoder;
+    Session* live = session_find(client_sock);
+    live->state.kind = SESSION_MUX;
+    live->mux = &session;
+    live->mux_decoder = &decoder;
+    decoder.feed(initial.data(), initial.size());
+    if (resume)
+    {
+        decoder.feed(resume->input.data(), resume->input.size());
+        if (!(co_await session.restore(resume->mux)))
+            co_return;
+    }
+    char* buf = rx_buf;
+    bool alive = true;
+
+    while (alive)
+    {
+        MuxFrame frame;
+        bool error = false;
+        while (alive && decoder.next(frame, error))
+        {
+            if (frame.stream != MUX_CHAT_STREAM)
             {
-                // 断开连接
-                break;
+                alive = co_await session.handle_frame(frame);
+                continue;
             }
-            else if (bytes_read < 0)
+            if (frame.type != MUX_DATA || frame.payload.empty())
+                continue;
+            size_t len = std::min(frame.payload.size(), (size_t)BUF_SIZE - 1);
+            memcpy(buf, frame.payload.data(), len);
+            buf[len] = '\0';
+            handle_chat_buffer(client_sock, buf, len, name_saved);
+        }
+        if (error || !alive)
+            break;
+
+        int timeout = -1;
+        if (session.has_pending_send())
+        {
+            alive = co_await session.pump(timeout);
+            if (!alive)
+                break;
+        }
+
+        // **把已到达的数据读到 EAGAIN 为止**
+        ssize_t bytes_read = sock.try_read(buf, BUF_SIZE);
+        if (bytes_read > 0)
+        {
+            decoder.feed(buf, bytes_read);
+            idle_deadline = reactor_now() + idle_limit;
+            missed = 0;
+            continue;
+        }
+        if (bytes_read == 0 || errno != EAGAIN)
+            break;
+
+        int64_t now = reactor_now();
+        if (now >= idle_deadline)
+        {
+            if (!heartbeat || ++missed > HEARTBEAT_MISSES)
             {
-                if (errno == EAGAIN)
-                    continue;
+                log_info("Mux client: %d idle timeout", client_sock);
                 break;
             }
+            std::string ping = mux_frame(MUX_DATA, MUX_CHAT_STREAM, "PING", 5);
+            sock.queue(ping.data(), ping.size());
+            idle_deadline = now + HEARTBEAT_INTERVAL;
+        }
+        if (!(co_await session.reap_stalled(now, STALL_TIMEOUT)))
+            break;
 
-            msg[bytes_read] = '\0';
-            std::string message(msg);
+        // 至少每个心跳周期醒一次，检查卡住的文件流
+        int wait = (int)std::min<int64_t>(idle_deadline - now, HEARTBEAT_INTERVAL);
+        if (timeout >= 0)
+            wait = std::min(wait, timeout);
+        if (wait == 0)
+            co_await reactor_yield();  // 还有数据要发，让其他连接也跑一轮
+        else
+            co_await sock.readable(wait);  // 被限速时最多等到可以再发
+    }
+    log_info("Mux client: %d disconnected", client_sock);
+}
 
-            // **2. 解析上传命令**
-            if (message.substr(0, 6) == "UPLOAD")
-            {
-                puts("Upload file message");
-                
-                std::istringstream iss(msg);
-                std::string cmd, filename;
-                size_t filesize;
-                iss >> cmd >> filename >> filesize;
-                
-                std::cout << "Filename: " << filename << " Filesize: " << filesize << std::endl;
-
-                // **3. 获取 UPLOAD 后的剩余数据（可能部分文件数据已被 `recv()` 读取）**
-                size_t header_length = message.find("\n");  // 计算 `UPLOAD <filename> <filesize>` 头部长度
-                if (header_length == std::string::npos)
-                    header_length = message.length();
-                else
-                    header_length += 1;  // 可能有换行符
+// 接手旧进程的连接: 先把旧进程没写出的数据排进发送队列，再从中断的地方继续
+// 返回 true 表示是聊天连接，继续进入聊天循环
+Co<bool> resume_session(AsyncSock& sock, Session& session, const SessionState& state)
+{
+    session.state.name_saved = state.name_saved;
+    session.state.caps = state.caps;
+    if (!sock.queue(state.output.data(), state.output.size()))
+        co_return false;
+    if (state.kind == SESSION_UPLOAD)
+        co_await handle_file_upload(sock, state.filename, state.file_size, "", 0, state.compressed, &state);
+    else if (state.kind == SESSION_DOWNLOAD)
+        co_await handle_file_download(sock, state.filename, state.compressed, &state);
+    else if (state.kind == SESSION_MUX)
+        co_await handle_mux_client(sock, "", session.state.name_saved, state.caps & CAP_PING, &state);
+    else if (state.kind == SESSION_DELTA)
+        remove((catalog_path(state.filename) + UPLOAD_TMP_SUFFIX).c_str());
+    else if (state.kind == SESSION_BATCH)
+    {
+        log_warn("Folder upload %s interrupted by upgrade", state.filename.c_str());
+        for (const std::string& path : state.temp_files)
+            remove(path.c_str());
+    }
+    else
+        session.state.input = state.input;  // 聊天连接上还没收完的半条消息
+    co_return state.kind == SESSION_CHAT;
+}
 
-                std::string file_data = message.substr(header_length);  // 提取已读取的部分文件数据
-                size_t initial_data_size = file_data.size();
+TransferRequest parse_transfer_request(const std::string& message)
+{
+    TransferRequest request;
+    request.compressed = message[0] == 'Z' && (message.compare(1, 6, "UPLOAD") == 0 || message.compare(1, 8, "DOWNLOAD") == 0);
+    size_t start = request.compressed ? 1 : 0;
+    if (message.compare(start, 6, "UPLOAD") == 0)
+        request.kind = TRANSFER_UPLOAD;
+    else if (!request.compressed && message.compare(0, 6, "DELTA ") == 0)
+        request.kind = TRANSFER_DELTA;
+    else if (message.compare(start, 8, "DOWNLOAD") == 0)
+        request.kind = TRANSFER_DOWNLOAD;
+    else if (!request.compressed && message.compare(0, 6, "BATCH ") == 0)
+        request.kind = TRANSFER_BATCH;
+    else
+        return request;
 
-                // **4. 传递文件数据**
-                handle_file_upload(client_sock, filename, filesize, file_data, initial_data_size);
-                break;
-            }
-            else if (message.substr(0, 8) == "DOWNLOAD")
+    if (request.kind == TRANSFER_DOWNLOAD)
+    {
+        // "DOWNLOAD <filename>"，文件名可以带空格，一直到这次读到的末尾
+        size_t name_start = start + strlen("DOWNLOAD") + 1;
+        if (name_start < message.size())
+            request.filename = message.substr(name_start);
+        request.data_offset = message.size();
+        return request;
+    }
+    // "UPLOAD <filename> <filesize>\n"、"DELTA <filename> <filesize>\n" 和 "BATCH <目录名> <文件数> <总字节数>\n"，
+    // 头后面可能紧跟数据
+    std::istringstream iss(message.substr(start));
+    std::string cmd;
+    iss >> cmd >> request.filename;
+    if (request.kind == TRANSFER_BATCH)
+        iss >> request.file_count;
+    iss >> request.file_size;
+    size_t header_end = scan_find(message.data(), message.size(), '\n');
+    request.data_offset = header_end == message.size() ? header_end : header_end + 1;
+    return request;
+}
+
+// 每个连接一个协程，读写都挂起等待反应器，不再占用线程
+// restored 不为空时是热升级从旧进程接手的连接
+Task handle_client(int client_sock, std::unique_ptr<SessionState> restored)
+{
+    AsyncSock sock(client_sock);
+    Session session(client_sock, &sock);
+    uint32_t capture_conn = capture_conn_open();
+    sock.set_capture(capture_conn);
+    sock_open(client_sock);
+    sock.set_write_timeout(STALL_TIMEOUT);  // 不读数据的客户端不能一直占着下载
+
+    bool ok = true;
+    if (restored)
+        ok = co_await resume_session(sock, session, *restored);
+    else if (tls_enabled())
+        ok = co_await sock.tls_accept();
+
+    char* msg = rx_buf;
+    bool& name_saved = session.state.name_saved;
+    unsigned& session_caps = session.state.caps;
+    int missed = 0;
+
+    while (ok)
+    {
+        // **1. 读取客户端数据，空闲太久发心跳或断开**
+        int idle_limit = (session_caps & CAP_PING) ? HEARTBEAT_INTERVAL : name_saved ? IDLE_TIMEOUT : LOGIN_TIMEOUT;
+        ssize_t bytes_read = co_await sock.read(msg, BUF_SIZE - 1, idle_limit);
+        if (bytes_read < 0 && errno == ETIMEDOUT)
+        {
+            if (!(session_caps & CAP_PING) || ++missed > HEARTBEAT_MISSES)
             {
-                puts("Download file message");
-                std::string filename = message.substr(strlen("DOWNLOAD") + 1);
-                printf("Download filename: [%s]\n", filename.c_str());
-                handle_file_download(client_sock, filename);
-                puts("Download file Finished");
+                log_info("client: %d idle timeout", client_sock);
                 break;
             }
-            else if (message.compare("USERLIST") == 0)
-            {
-                puts("User list request");
-                broadcast_userlist();
-            }
-            else
+            sock.queue("PING", 5);
+            continue;
+        }
+        missed = 0;
+        if (bytes_read == 0)
+        {
+            // 断开连接
+            break;
+        }
+        else if (bytes_read < 0)
+        {
+            log_warn("client: %d %s recv() error", client_sock, map_clients->at(client_sock).c_str());
+            break;
+        }
+
+        msg[bytes_read] = '\0';
+        std::string message(msg, bytes_read);  // 上传头后面可能紧跟含 '\0' 的文件数据
+
+        // 上次剩下半条聊天消息时，这次读到的是它的后半截，不是命令
+        bool continued = !session.state.input.empty();
+
+        // **CAPS 能力协商，后面可能紧跟着问候语**
+        if (!continued && message.substr(0, 5) == "CAPS ")
+        {
+            size_t line_end = scan_find(message.data(), message.size(), '\n');
+            if (line_end == message.size())
+                line_end = std::string::npos;
+            unsigned caps = parse_caps(message.substr(0, line_end)) & (CAP_ZLIB | CAP_MUX | CAP_PING | CAP_P2P | CAP_RESUME);
+            session_caps = caps;
+            std::string reply = caps_string(caps);
+            // 回复必须排在切换成帧格式之后的所有广播前面
+            pthread_mutex_lock(&mutex);
+            sock.queue(reply.c_str(), reply.size() + 1);
+            (*map_caps)[client_sock] = caps;
+            pthread_mutex_unlock(&mutex);
+            log_info("Client %d caps: %s", client_sock, reply.c_str());
+            size_t rest = line_end == std::string::npos ? 0 : bytes_read - line_end - 1;
+            if (caps & CAP_MUX)
             {
-                printf("Message: %s\n", msg);
-                if (!name_saved)
-                {
-                    name_saved = true;
-                    std::string str(msg);
-                    std::string name = str.substr(0, str.find(' '));
-                    std::cout << "Client Username: " << name << std::endl;
-                    map_clients->at(client_sock) += ":" + name;
-                    printf("Client Username Saved: %d %s\n", client_sock, map_clients->at(client_sock).c_str());
-                }
-                send_msg_all(msg, bytes_read);
+                sock_set_role(client_sock, SOCK_ROLE_MUX);
+                co_await handle_mux_client(sock, message.substr(bytes_read - rest), name_saved, caps & CAP_PING);
+                break;
             }
+            if (rest == 0)
+                continue;
+            bytes_read = rest;
+            memmove(msg, msg + line_end + 1, bytes_read + 1);
+            message.assign(msg, bytes_read);
         }
 
-        if (n == -1 || event.events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+        // **2. 解析上传命令**
+        TransferRequest request = continued ? TransferRequest() : parse_transfer_request(message);
+        int retry_ms;
+        if (request.kind != TRANSFER_NONE && !admit_heavy(retry_ms))
         {
-            printf("client: %d %s epoll_wait() error\n", client_sock, map_clients->at(client_sock).c_str());
+            // 过载时不开始新的传输，客户端过一会儿重试
+            log_info("client: %d transfer rejected, overloaded", client_sock);
+            std::string busy = admit_busy(retry_ms, "overload");
+            co_await sock.write_all(busy.c_str(), busy.size() + 1);
             break;
         }
+        if (request.kind != TRANSFER_NONE)
+        {
+            // 传输连接不是聊天会话，不能再收到广播，否则会混进文件数据
+            // 名字留在会话里，上传完成时记为上传者
+            pthread_mutex_lock(&mutex);
+            session.state.name = map_clients->at(client_sock);
+            map_clients->erase(client_sock);
+            map_caps->erase(client_sock);
+            pthread_mutex_unlock(&mutex);
+            publish_presence();
+        }
+        if (request.kind == TRANSFER_UPLOAD)
+        {
+            log_debug("Upload file message");
+            log_info("Filename: %s Filesize: %zu", request.filename.c_str(), request.file_size);
+
+            // **3. 获取 UPLOAD 后的剩余数据（可能部分文件数据已被 `recv()` 读取）**
+            std::string file_data = message.substr(request.data_offset);  // 提取已读取的部分文件数据
+            size_t initial_data_size = file_data.size();
+
+            // **4. 传递文件数据**
+            co_await handle_file_upload(sock, request.filename, request.file_size, file_data, initial_data_size, request.compressed);
+            break;
+        }
+        else if (request.kind == TRANSFER_DELTA)
+        {
+            // "DELTA <filename> <filesize>\n"，后面紧跟指令
+            log_info("Delta upload: %s Filesize: %zu", request.filename.c_str(), request.file_size);
+            co_await handle_delta_upload(sock, request.filename, request.file_size, message.substr(request.data_offset));
+            break;
+        }
+        else if (request.kind == TRANSFER_BATCH)
+        {
+            log_info("Folder upload: %s %llu files, %zu bytes", request.filename.c_str(),
+                     (unsigned long long)request.file_count, request.file_size);
+            co_await handle_batch_upload(sock, request.filename, request.file_count, request.file_size,
+                                         message.substr(request.data_offset));
+            break;
+        }
+        else if (request.kind == TRANSFER_DOWNLOAD)
+        {
+            log_debug("Download file message");
+            log_info("Download filename: [%s]", request.filename.c_str());
+            co_await handle_file_download(sock, request.filename, request.compressed);
+            log_debug("Download file Finished");
+            break;
+        }
+        else
+        {
+            // 协商了 RESUME 的客户端每条消息都以 '\0' 结尾，没读完的留到下一次
+            if (!handle_chat_buffer(client_sock, msg, bytes_read, name_saved, &session.state.input, session_caps & CAP_RESUME))
+                break;
+        }
     }
 
     // 清理资源
+    capture_conn_close(capture_conn);
+    p2p_withdraw(client_sock);
+    // 支持恢复的会话先保留，名字留在用户列表里，等客户端重连
+    if (resume_park(client_sock))
+        log_info("client: %d session parked", client_sock);
     pthread_mutex_lock(&mutex);
     map_clients->erase(client_sock);
-    epoll_ctl(epfd, EPOLL_CTL_DEL, client_sock, NULL);
-    close(client_sock);
-    printf("Closed client: %d\n", client_sock);
+    map_caps->erase(client_sock);
     pthread_mutex_unlock(&mutex);
-
-    return NULL;
+    publish_presence();
+    sock_close(client_sock);
+    admit_release(client_sock);
+    log_info("Closed client: %d", client_sock);
 }
 
-
-int run_server(int port)
+// 边沿触发，每次可读都要 accept 到 EAGAIN 为止
+Task accept_loop(int server_sock)
 {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_size = sizeof(client_addr);
-
-    // init mutex
-    pthread_mutex_init(&mutex, NULL);
-
-    // prepare server socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1)
-        error_handling("bind() error");
-    if (listen(server_sock, 5) == -1)
-        error_handling("listen() error");
-
-   
-    int epfd = epoll_create(1);
-    
-    struct epoll_event event;
-    
-    event.events = EPOLLIN | EPOLLET,
-        event.data.fd = server_sock,
-        epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &event);
-
-    int str_len;
-    char buf[BUF_SIZE];
-    map_clients = new std::map<int, std::string>();
+    AsyncSock listener(server_sock);
     while (true)
     {
-        int ret = epoll_wait(epfd, &event, EPOLL_SIZE, -1);
-        if (ret == -1)
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+        int client_sock = accept4(server_sock, (struct sockaddr*)&client_addr, &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock == -1)
         {
-            puts("epoll_wait() error");
-            break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                co_await listener.readable();
+            else if (errno == EMFILE || errno == ENFILE)
+            {
+                log_error("accept() error: %s", strerror(errno));
+                co_await reactor_sleep(100);  // fd 用完了，等有连接关闭
+            }
+            continue;
         }
-        // server sock IO ready
-        if (event.data.fd == server_sock && (event.events & EPOLLIN))
+        int retry_ms;
+        const char* reason;
+        if (!admit_connection(client_sock, ntohl(client_addr.sin_addr.s_addr), retry_ms, reason))
         {
-            // new connection, wait/block until accept
-            client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_addr_size);
-            map_clients->insert(std::pair<int, std::string>(client_sock, inet_ntoa(client_addr.sin_addr)));
-            pthread_mutex_lock(&mutex);
-            printf("New Connected client: %d\n", client_sock);
-            pthread_t tid;
-            pthread_create(&tid, NULL, handle_client, (void*)&client_sock);
-            pthread_detach(tid);
-            pthread_mutex_unlock(&mutex);
+            // 尽力告诉客户端多久后重试，发不出去也不等；TLS 连接还没握手，只能直接关闭
+            if (!tls_enabled())
+            {
+                std::string busy = admit_busy(retry_ms, reason);
+                send(client_sock, busy.c_str(), busy.size() + 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            }
+            shutdown(client_sock, SHUT_WR);
+            close(client_sock);
+            continue;
         }
+        pthread_mutex_lock(&mutex);
+        map_clients->insert(std::pair<int, std::string>(client_sock, inet_ntoa(client_addr.sin_addr)));
+        log_info("New Connected client: %d", client_sock);
+        pthread_mutex_unlock(&mutex);
+        // 先按聊天连接设置，发来传输命令或协商了 mux 时再改
+        sock_set_role(client_sock, SOCK_ROLE_CHAT);
+        publish_presence();
+        handle_client(client_sock);
     }
-    close(server_sock);
-    close(epfd);
-    delete map_clients;
-    return 0;
-}
-
-int main(int argc, char* argv[])
-{
-    signal(SIGPIPE, SIG_IGN);
-    if (argc != 2)
-    {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-    run_server(atoi(argv[1]));
-    return 0;
 }
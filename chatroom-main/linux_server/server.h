@@ -0,0 +1,77 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <stddef.h>
+#include <pthread.h>
+#include "reactor.h"
+#include "upgrade.h"
+
+// 连接处理: 聊天消息、文件传输、广播和在线用户登记
+// 启动参数、监听和事件循环在 main.cpp；除 main.cpp 以外的源文件打包成静态库 libchatserver.a，
+// 服务器和微基准(bench/server_bench.cpp)都链接这个库，微基准在进程内直接调用这些函数
+// 仓库没有 Makefile/CMake，库和程序都按 server.cpp 第一行的命令手工编译
+
+extern pthread_mutex_t mutex;
+// client socket fd, client user，name(ip)
+extern std::map<int, std::string>* map_clients;
+// client socket fd, CAPS 协商出的能力位
+extern std::map<int, unsigned>* map_caps;
+
+// 初始化锁和在线用户表，在使用下面的函数之前调用一次
+void server_init();
+void error_handling(const char* msg);
+
+// 按对方协商的能力(压缩、多路复用)放进 fd 的发送队列，packed 是同一条消息的压缩结果，只压缩一次
+size_t queue_client_msg(int fd, const char* msg, int len, std::string& packed, bool& packed_tried);
+// 只发给本节点的客户端
+void* send_msg_local(void* msg, int len);
+// 只回复给一个客户端(查询结果)
+void send_msg_to(int client_sock, const std::string& msg);
+// 发给本节点的客户端并转发给其他节点
+void* send_msg_all(void* msg, int len);
+void on_relay_message(const std::string& msg);
+void publish_presence();
+void broadcast_userlist();
+
+// 处理一条聊天消息，msg 以 '\0' 结尾；terminated 表示客户端发来的消息本身带着 '\0'
+// complete 表示是一条完整的消息，只有完整的房间消息计入会话恢复的条数
+void handle_chat_message(int client_sock, char* msg, int len, bool& name_saved, bool terminated = false,
+                         bool complete = false);
+// 一次读到的聊天数据里可能有好几条以 '\0' 分隔的消息，buf[len] 必须是 '\0'
+// pending 不为空时没收完的半条消息留在里面等下一次；terminating 表示客户端的每条消息都以 '\0' 结尾
+// 半条消息太长返回 false
+bool handle_chat_buffer(int client_sock, char* buf, size_t len, bool& name_saved, std::string* pending = nullptr,
+                        bool terminating = false);
+
+// 传输连接的第一条命令: "[Z]UPLOAD <文件名> <大小>\n" + 数据、"[Z]DOWNLOAD <文件名>"、"DELTA <文件名> <大小>\n" + 指令、
+// "BATCH <目录名> <文件数> <总字节数>\n" + 归档流
+enum TransferKind
+{
+    TRANSFER_NONE,  // 不是传输命令，按聊天消息处理
+    TRANSFER_UPLOAD,
+    TRANSFER_DOWNLOAD,
+    TRANSFER_DELTA,
+    TRANSFER_BATCH,  // 文件夹上传，见 batch.h
+};
+
+struct TransferRequest
+{
+    TransferKind kind = TRANSFER_NONE;
+    bool compressed = false;  // 'Z' 前缀
+    std::string filename;
+    size_t file_size = 0;
+    uint64_t file_count = 0;  // BATCH 的文件数
+    size_t data_offset = 0;   // 头后面紧跟的数据从这里开始
+};
+
+// 解析一次读到的数据开头的传输命令
+TransferRequest parse_transfer_request(const std::string& message);
+
+// 每个连接一个协程；restored 不为空时是热升级从旧进程接手的连接
+Task handle_client(int client_sock, std::unique_ptr<SessionState> restored = nullptr);
+Task accept_loop(int server_sock);
+
+#endif // SERVER_H
@@ -0,0 +1,81 @@
+#include "sockopt.h"
+#include "log.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void set_int(int fd, int level, int name, int value)
+{
+    setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+void sock_set_role(int fd, SockRole role)
+{
+    switch (role)
+    {
+    case SOCK_ROLE_CHAT:
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+        break;
+    case SOCK_ROLE_MUX:
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+        set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, SOCK_NOTSENT_LOWAT);
+        break;
+    case SOCK_ROLE_DOWNLOAD:
+        set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, SOCK_NOTSENT_LOWAT);
+        break;
+    case SOCK_ROLE_UPLOAD:
+        break;
+    }
+}
+
+void sock_cork(int fd, bool on)
+{
+    set_int(fd, IPPROTO_TCP, TCP_CORK, on ? 1 : 0);
+}
+
+void SockTuner::update(uint64_t bytes)
+{
+    int64_t now = now_ms();
+    if (last_ms == 0)
+    {
+        last_ms = now;
+        last_bytes = bytes;
+        return;
+    }
+    if (now - last_ms < SOCK_TUNE_INTERVAL || bytes < SOCK_TUNE_MIN_BYTES)
+        return;
+    double rate = (bytes - last_bytes) * 1000.0 / (now - last_ms);
+    last_ms = now;
+    last_bytes = bytes;
+
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+        return;
+    // 接收方向的 RTT 估计没有样本时用连接的 RTT
+    uint32_t rtt_us = sending || info.tcpi_rcv_rtt == 0 ? info.tcpi_rtt : info.tcpi_rcv_rtt;
+    // 缓冲区本身是瓶颈时测到的速率约等于 缓冲区/RTT，目标取 2 倍，几轮之后就不再是瓶颈
+    size_t target = std::min<size_t>(SOCK_BUF_MAX, (size_t)(2 * rate * rtt_us / 1e6));
+    int opt = sending ? SO_SNDBUF : SO_RCVBUF;
+    int cur = 0;
+    len = sizeof(cur);
+    if (getsockopt(fd, SOL_SOCKET, opt, &cur, &len) != 0)
+        return;
+    // 内核报告的值是设置值的 2 倍(包含元数据开销)
+    if (target <= (size_t)cur / 2)
+        return;
+    set_int(fd, SOL_SOCKET, opt, (int)target);
+    buf = (int)target;
+    log_info("socket %d %s buffer -> %zu KB (rtt %.1f ms, %.1f MB/s)", fd, sending ? "send" : "receive", target / 1024,
+             rtt_us / 1000.0, rate / (1024 * 1024));
+}
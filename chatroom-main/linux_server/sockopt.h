@@ -0,0 +1,47 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 每个连接按用途设置 TCP 选项:
+//   聊天     TCP_NODELAY，一条消息不会因为 Nagle 等上一个 ACK
+//   多路复用 TCP_NODELAY + TCP_NOTSENT_LOWAT: 内核里没发出的数据保持很少，聊天帧和取消不用排在几 MB 文件数据后面
+//   下载     TCP_NOTSENT_LOWAT，文件大小头和数据之间用 TCP_CORK 凑满报文段，发送缓冲区按带宽时延积放大
+//   上传     接收缓冲区按带宽时延积放大
+// 缓冲区只放大不缩小: 从 TCP_INFO 取 RTT 和发送速率，目标是 2 倍带宽时延积
+// 内核的自动调整够用时(目标不超过当前大小)不去设置，设置后内核不再自动调整这个连接
+
+#define SOCK_NOTSENT_LOWAT (128 * 1024)
+#define SOCK_BUF_MAX (8 * 1024 * 1024)
+#define SOCK_TUNE_INTERVAL 500            // 传输中每隔这么久(毫秒)重新估计一次
+#define SOCK_TUNE_MIN_BYTES (1024 * 1024) // 至少传了这么多才估计，开头的慢启动不算
+
+enum SockRole
+{
+    SOCK_ROLE_CHAT,
+    SOCK_ROLE_MUX,
+    SOCK_ROLE_DOWNLOAD,
+    SOCK_ROLE_UPLOAD,
+};
+
+// 连接的用途变了(聊天连接发来 UPLOAD/DOWNLOAD、协商了 mux)时重新设置
+void sock_set_role(int fd, SockRole role);
+// 下载的头和数据之间加塞，结束时拔掉，剩下不满一个报文段的数据马上发出
+void sock_cork(int fd, bool on);
+
+// 传输中定期调用，按测到的速率和 RTT 放大缓冲区
+struct SockTuner
+{
+    int fd;
+    bool sending;
+    int64_t last_ms = 0;     // 上次估计的时间和字节数，按这段时间的速率估计
+    uint64_t last_bytes = 0;
+    int buf = 0;  // 已经设置的大小，0 表示还是内核自动调整
+
+    SockTuner(int fd, bool sending) : fd(fd), sending(sending) {}
+    // bytes 为这次传输到目前为止的字节数
+    void update(uint64_t bytes);
+};
+
+#endif // SOCKOPT_H
@@ -0,0 +1,205 @@
+#include "tls.h"
+#include "log.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <map>
+
+struct SockConn
+{
+    SSL *ssl;  // 明文连接为 NULL
+    bool handshaking;
+    bool ktls_send;
+};
+
+static SSL_CTX *ctx = NULL;
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+// client socket fd, 连接状态
+static std::map<int, SockConn *> conns;
+
+static SockConn *find_conn(int fd)
+{
+    pthread_mutex_lock(&conns_mutex);
+    auto it = conns.find(fd);
+    SockConn *conn = it == conns.end() ? NULL : it->second;
+    pthread_mutex_unlock(&conns_mutex);
+    return conn;
+}
+
+bool tls_init(const char *cert_file, const char *key_file)
+{
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return false;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return false;
+    }
+
+    // **会话票据: 文件传输每次都是新连接，复用聊天连接的会话可以跳过完整握手**
+    static const unsigned char sid_ctx[] = "chatroom";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(ctx, 2);
+
+    // **kTLS: 加密交给内核，下载时 sendfile 仍然零拷贝**
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return true;
+}
+
+bool tls_enabled()
+{
+    return ctx != NULL;
+}
+
+void sock_open(int fd)
+{
+    SockConn *conn = new SockConn;
+    conn->ssl = NULL;
+    conn->handshaking = false;
+    conn->ktls_send = false;
+    pthread_mutex_lock(&conns_mutex);
+    conns[fd] = conn;
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+int tls_accept_step(int client_sock)
+{
+    SockConn *conn = find_conn(client_sock);
+    if (!conn)
+        return TLS_FAILED;
+    if (!conn->ssl)
+    {
+        conn->ssl = SSL_new(ctx);
+        if (!conn->ssl)
+            return TLS_FAILED;
+        SSL_set_fd(conn->ssl, client_sock);
+        conn->handshaking = true;
+    }
+
+    SSL *ssl = conn->ssl;
+    int ret = SSL_accept(ssl);
+    if (ret != 1)
+    {
+        int err = SSL_get_error(ssl, ret);
+        if (err == SSL_ERROR_WANT_READ)
+            return TLS_WANT_READ;
+        if (err == SSL_ERROR_WANT_WRITE)
+            return TLS_WANT_WRITE;
+        log_warn("TLS handshake failed: %d", client_sock);
+        ERR_print_errors_fp(stderr);
+        return TLS_FAILED;
+    }
+
+    conn->handshaking = false;
+    conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    log_info("TLS client: %d %s %s%s%s", client_sock, SSL_get_version(ssl), SSL_get_cipher(ssl),
+           SSL_session_reused(ssl) ? " resumed" : "", conn->ktls_send ? " ktls" : "");
+    return TLS_DONE;
+}
+
+ssize_t sock_recv(int fd, void *buf, size_t len)
+{
+    SockConn *conn = find_conn(fd);
+    if (!conn || !conn->ssl)
+        return recv(fd, buf, len, 0);
+
+    // 一次读完所有已到达的记录，边沿触发的 epoll 不会为 OpenSSL 缓冲里的数据再通知
+    size_t total = 0;
+    int err = SSL_ERROR_NONE;
+    while (total < len)
+    {
+        int ret = SSL_read(conn->ssl, (char *)buf + total, len - total);
+        if (ret <= 0)
+        {
+            err = SSL_get_error(conn->ssl, ret);
+            break;
+        }
+        total += ret;
+    }
+
+    if (total > 0)
+        return total;
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        errno = EAGAIN;
+    else if (err != SSL_ERROR_SYSCALL)
+        errno = EIO;
+    return -1;
+}
+
+ssize_t sock_send(int fd, const void *buf, size_t len)
+{
+    SockConn *conn = find_conn(fd);
+    if (!conn || !conn->ssl)
+        return send(fd, buf, len, 0);
+    if (len == 0)
+        return 0;
+
+    int ret = SSL_write(conn->ssl, buf, len);
+    if (ret > 0)
+        return ret;
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        errno = EAGAIN;
+    else if (err != SSL_ERROR_SYSCALL)
+        errno = EIO;
+    return -1;
+}
+
+bool sock_can_sendfile(int fd)
+{
+    SockConn *conn = find_conn(fd);
+    return !conn || !conn->ssl || conn->ktls_send;
+}
+
+ssize_t sock_sendfile(int fd, int file_fd, off_t offset, size_t len)
+{
+    SockConn *conn = find_conn(fd);
+    if (!conn || !conn->ssl)
+        return sendfile(fd, file_fd, &offset, len);
+    if (!conn->ktls_send)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return SSL_sendfile(conn->ssl, file_fd, offset, len, 0);
+}
+
+void sock_close(int fd)
+{
+    SockConn *conn = NULL;
+    pthread_mutex_lock(&conns_mutex);
+    auto it = conns.find(fd);
+    if (it != conns.end())
+    {
+        conn = it->second;
+        conns.erase(it);
+    }
+    pthread_mutex_unlock(&conns_mutex);
+    if (conn)
+    {
+        if (conn->ssl)
+        {
+            // 握手没完成时不发 close_notify
+            if (!conn->handshaking)
+                SSL_shutdown(conn->ssl);
+            SSL_free(conn->ssl);
+        }
+        delete conn;
+    }
+    close(fd);
+}
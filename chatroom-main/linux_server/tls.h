@@ -0,0 +1,40 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+// 客户端 socket 的读写都经过这里，TLS 模式下透明地走 OpenSSL
+// 没有调用 tls_init() 时退化为普通的 recv/send
+// 所有调用都不阻塞，等待可读/可写由 reactor.h 负责
+
+#define TLS_HANDSHAKE_TIMEOUT 5000  // ms
+
+#define TLS_DONE 0
+#define TLS_WANT_READ 1
+#define TLS_WANT_WRITE 2
+#define TLS_FAILED -1
+
+// 加载证书和私钥，开启会话票据和 kTLS
+bool tls_init(const char *cert_file, const char *key_file);
+bool tls_enabled();
+
+// 新连接登记到 socket 层，之后才能 tls_accept_step()
+void sock_open(int fd);
+
+// 推进一步服务器端握手，返回 TLS_DONE / TLS_WANT_READ / TLS_WANT_WRITE / TLS_FAILED
+int tls_accept_step(int client_sock);
+
+// 与 recv/send 语义相同: 没有数据或缓冲区满时返回 -1 且 errno 为 EAGAIN
+// TLS 下 sock_send 返回 EAGAIN 后，下次必须从同样的数据开始重试(长度可以更长)
+ssize_t sock_recv(int fd, void *buf, size_t len);
+ssize_t sock_send(int fd, const void *buf, size_t len);
+
+// 零拷贝发送文件: 明文走 sendfile()，TLS 需要内核 kTLS 支持
+bool sock_can_sendfile(int fd);
+ssize_t sock_sendfile(int fd, int file_fd, off_t offset, size_t len);
+
+// 关闭 TLS 会话并关闭 socket
+void sock_close(int fd);
+
+#endif // TLS_H
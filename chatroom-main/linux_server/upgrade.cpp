@@ -0,0 +1,475 @@
+#include "upgrade.h"
+#include "mux.h"
+#include "tls.h"
+#include "cpupool.h"
+#include "digest.h"
+#include "diskio.h"
+#include "log.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+
+// 交接协议，SOCK_SEQPACKET 保留消息边界:
+// 新 -> 旧: "TAKEOVER"
+// 旧 -> 新: 'L' + 版本号(带监听 fd)，每个连接一个 'S' + 长度 + 状态(带连接 fd)，
+//           状态太长时后面跟若干 'C' + 数据，最后 'E'；线程池一直忙时回 'B'
+// 新 -> 旧: "OK"，之后连接只归新进程
+#define UPGRADE_VERSION 1
+#define UPGRADE_CHUNK 60000
+
+static std::unordered_map<int, Session *> sessions;
+
+Session::Session(int client_fd, AsyncSock *client_sock) : fd(client_fd), sock(client_sock)
+{
+    sessions[fd] = this;
+}
+
+Session::~Session()
+{
+    auto it = sessions.find(fd);
+    if (it != sessions.end() && it->second == this)
+        sessions.erase(it);
+}
+
+Session *session_find(int fd)
+{
+    auto it = sessions.find(fd);
+    return it == sessions.end() ? NULL : it->second;
+}
+
+int session_count()
+{
+    return sessions.size();
+}
+
+void StateWriter::u64(uint64_t v)
+{
+    for (int i = 7; i >= 0; i--)
+        data.push_back((char)(v >> (i * 8)));
+}
+
+void StateWriter::str(const std::string &s)
+{
+    u64(s.size());
+    data.append(s);
+}
+
+unsigned StateReader::u8()
+{
+    if (pos + 1 > data.size())
+    {
+        ok = false;
+        return 0;
+    }
+    return (unsigned char)data[pos++];
+}
+
+uint64_t StateReader::u64()
+{
+    if (pos + 8 > data.size())
+    {
+        ok = false;
+        return 0;
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | (unsigned char)data[pos++];
+    return v;
+}
+
+std::string StateReader::str()
+{
+    uint64_t len = u64();
+    if (!ok || len > data.size() - pos)
+    {
+        ok = false;
+        return std::string();
+    }
+    std::string s = data.substr(pos, len);
+    pos += len;
+    return s;
+}
+
+static std::string serialize(const SessionState &st)
+{
+    StateWriter w;
+    w.u8(st.kind);
+    w.str(st.name);
+    w.u64(st.caps);
+    w.u8(st.name_saved);
+    w.str(st.output);
+    w.str(st.input);
+    w.str(st.filename);
+    w.u64(st.file_size);
+    w.u64(st.offset);
+    w.u8(st.compressed);
+    w.u8(st.encoder_decided);
+    w.u8(st.encoder_bypass);
+    w.str(st.mux);
+    w.u64(st.temp_files.size());
+    for (const std::string &path : st.temp_files)
+        w.str(path);
+    return w.data;
+}
+
+static bool deserialize(const std::string &data, SessionState &st)
+{
+    StateReader r(data);
+    st.kind = r.u8();
+    st.name = r.str();
+    st.caps = r.u64();
+    st.name_saved = r.u8();
+    st.output = r.str();
+    st.input = r.str();
+    st.filename = r.str();
+    st.file_size = r.u64();
+    st.offset = r.u64();
+    st.compressed = r.u8();
+    st.encoder_decided = r.u8();
+    st.encoder_bypass = r.u8();
+    st.mux = r.str();
+    uint64_t temp_count = r.u64();
+    for (uint64_t i = 0; i < temp_count && r.ok; i++)
+        st.temp_files.push_back(r.str());
+    return r.ok && r.pos == data.size();
+}
+
+// 发一条消息，fd >= 0 时附带这个 fd
+static bool send_packet(int conn, const std::string &data, int fd)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)data.data();
+    iov.iov_len = data.size();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)data.size())
+    {
+        log_error("upgrade sendmsg() error: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// 收一条消息，附带的 fd 放在 fd 里(没有为 -1)
+static bool recv_packet(int conn, std::string &data, int &fd)
+{
+    data.resize(UPGRADE_CHUNK + 64);
+    struct iovec iov;
+    iov.iov_base = &data[0];
+    iov.iov_len = data.size();
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    fd = -1;
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+    {
+        if (n < 0)
+            log_error("upgrade recvmsg() error: %s", strerror(errno));
+        return false;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    data.resize(n);
+    return true;
+}
+
+static bool send_record(int conn, const std::string &record, int fd)
+{
+    StateWriter head;
+    head.u8('S');
+    head.u64(record.size());
+    size_t first = std::min(record.size(), (size_t)UPGRADE_CHUNK);
+    if (!send_packet(conn, head.data + record.substr(0, first), fd))
+        return false;
+    for (size_t pos = first; pos < record.size(); pos += UPGRADE_CHUNK)
+    {
+        if (!send_packet(conn, "C" + record.substr(pos, UPGRADE_CHUNK), -1))
+            return false;
+    }
+    return true;
+}
+
+static void set_timeouts(int conn)
+{
+    struct timeval tv;
+    tv.tv_sec = UPGRADE_TIMEOUT / 1000;
+    tv.tv_usec = (UPGRADE_TIMEOUT % 1000) * 1000;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// 在挂起点上取下连接的状态，只在反应器线程、线程池空闲时调用
+static SessionState snapshot(Session &s, const std::function<void(int, SessionState &)> &fill)
+{
+    SessionState st = s.state;
+    st.output = s.sock->pending_output();
+    if (s.out)
+        s.out->flush_sync();
+    if (s.encoder)
+    {
+        st.encoder_decided = s.encoder->decided;
+        st.encoder_bypass = s.encoder->bypass;
+    }
+    if (s.decoder)
+        st.input = s.decoder->pending;
+    if (s.mux_decoder)
+        st.input = s.mux_decoder->pending.substr(s.mux_decoder->pos);
+    if (s.mux)
+        st.mux = s.mux->save();
+    fill(s.fd, st);
+    return st;
+}
+
+// 和一个新进程完成交接，成功返回 true；失败时旧进程的状态没有任何改变
+static Co<bool> handoff(int conn, int listen_fd, std::function<void(int, SessionState &)> fill, bool &all)
+{
+    // 新进程连上后马上发请求，不能让别的程序连上来卡住反应器
+    AsyncSock waiter(conn);
+    char request[16];
+    ssize_t n = recv(conn, request, sizeof(request), 0);
+    if (n < 0 && errno == EAGAIN)
+    {
+        bool ok = co_await waiter.readable(UPGRADE_TIMEOUT);
+        n = ok ? recv(conn, request, sizeof(request), 0) : -1;
+    }
+    if (n != 8 || memcmp(request, "TAKEOVER", 8) != 0)
+        co_return false;
+
+    // 线程池里还有任务时，等待它的连接状态是一半，等它们都回到反应器
+    // 写盘阶段同样: 交出去的块写完，新进程才能从临时文件里读到已收到的数据
+    int64_t deadline = reactor_now() + UPGRADE_QUIESCE_TIMEOUT;
+    while (cpupool_inflight() > 0 || diskio_inflight() > 0)
+    {
+        if (reactor_now() > deadline)
+        {
+            send_packet(conn, "B", -1);
+            co_return false;
+        }
+        co_await reactor_yield();
+    }
+
+    // **从这里开始不再挂起，所有连接都停在一致的状态上**
+    fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) & ~O_NONBLOCK);
+    set_timeouts(conn);
+    StateWriter hello;
+    hello.u8('L');
+    hello.u8(UPGRADE_VERSION);
+    if (!send_packet(conn, hello.data, listen_fd))
+        co_return false;
+
+    // TLS 连接的状态在 OpenSSL 里，不能交接
+    all = !tls_enabled();
+    std::vector<Session *> handed;
+    for (auto it = sessions.begin(); all && it != sessions.end(); it++)
+    {
+        Session *s = it->second;
+        if (!send_record(conn, serialize(snapshot(*s, fill)), s->fd))
+            co_return false;
+        handed.push_back(s);
+    }
+    if (!send_packet(conn, "E", -1))
+        co_return false;
+
+    char reply[4];
+    n = recv(conn, reply, sizeof(reply), 0);
+    if (n != 2 || memcmp(reply, "OK", 2) != 0)
+    {
+        log_warn("Takeover aborted by the new process");
+        co_return false;
+    }
+
+    // 新进程已经接手，这里不再碰这些 fd
+    AsyncSock *listener = AsyncSock::find(listen_fd);
+    if (listener)
+        listener->detach();
+    close(listen_fd);
+    for (size_t i = 0; i < handed.size(); i++)
+        handed[i]->sock->detach();
+    log_info("Handed over listener and %zu connections", handed.size());
+    co_return true;
+}
+
+Task upgrade_listen(std::string path, int listen_fd,
+                    std::function<void(int, SessionState &)> fill,
+                    std::function<void(bool)> on_handoff)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        log_warn("Upgrade socket path too long: %s", path.c_str());
+        co_return;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // 新进程接手后会在同一路径上重新监听
+    unlink(path.c_str());
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1)
+    {
+        log_error("upgrade socket error: %s", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        co_return;
+    }
+    log_info("Waiting for takeover on %s", path.c_str());
+
+    AsyncSock listener(fd);
+    while (true)
+    {
+        int conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                co_await listener.readable();
+            continue;
+        }
+        bool all = false;
+        bool done = co_await handoff(conn, listen_fd, fill, all);
+        close(conn);
+        if (done)
+        {
+            on_handoff(all);
+            break;
+        }
+        log_warn("Takeover failed, still serving");
+    }
+    listener.detach();
+    close(fd);
+}
+
+int upgrade_takeover(const char *path, std::vector<std::pair<int, SessionState>> &restored)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn == -1 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        log_error("takeover connect() error: %s", strerror(errno));
+        if (conn != -1)
+            close(conn);
+        return -1;
+    }
+    set_timeouts(conn);
+
+    int listen_fd = -1;
+    bool done = false;
+    std::string packet;
+    int fd;
+    if (send_packet(conn, "TAKEOVER", -1))
+    {
+        while (recv_packet(conn, packet, fd))
+        {
+            if (packet[0] == 'L' && packet.size() == 2 && fd >= 0)
+            {
+                if ((unsigned char)packet[1] != UPGRADE_VERSION)
+                {
+                    log_warn("Takeover: state version %d not supported", packet[1]);
+                    close(fd);
+                    break;
+                }
+                listen_fd = fd;
+                continue;
+            }
+            if (packet[0] == 'S' && packet.size() >= 9 && fd >= 0)
+            {
+                StateReader head(packet);
+                head.u8();
+                uint64_t len = head.u64();
+                std::string record = packet.substr(9);
+                int more_fd;
+                while (record.size() < len && recv_packet(conn, packet, more_fd) && packet[0] == 'C')
+                    record.append(packet, 1, std::string::npos);
+                SessionState st;
+                if (record.size() != len || !deserialize(record, st))
+                {
+                    log_warn("Takeover: bad session state");
+                    close(fd);
+                    break;
+                }
+                restored.push_back(std::make_pair(fd, st));
+                continue;
+            }
+            if (packet[0] == 'B')
+                log_warn("Takeover: old server busy, try again");
+            done = packet[0] == 'E' && listen_fd >= 0;
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+    }
+
+    if (done && send_packet(conn, "OK", -1))
+    {
+        close(conn);
+        log_info("Took over listener and %zu connections", restored.size());
+        return listen_fd;
+    }
+    // 旧进程没收到 OK 会继续服务，这里收到的 fd 全部放弃
+    for (size_t i = 0; i < restored.size(); i++)
+        close(restored[i].first);
+    restored.clear();
+    if (listen_fd >= 0)
+        close(listen_fd);
+    close(conn);
+    return -1;
+}
+
+Co<bool> digest_file(Sha256 &digest, std::string path, uint64_t len)
+{
+    bool ok = true;
+    co_await cpu_run([&] {
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (!fp)
+        {
+            ok = false;
+            return;
+        }
+        std::string buf(1024 * 1024, '\0');
+        while (len > 0)
+        {
+            size_t n = fread(&buf[0], 1, std::min((uint64_t)buf.size(), len), fp);
+            if (n == 0)
+            {
+                ok = false;
+                break;
+            }
+            digest.update(buf.data(), n);
+            len -= n;
+        }
+        fclose(fp);
+    });
+    co_return ok;
+}
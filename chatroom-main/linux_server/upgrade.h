@@ -0,0 +1,110 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include "reactor.h"
+#include "compress.h"
+
+// 热升级: 新进程通过 Unix socket 从旧进程接手监听 socket 和所有连接，连接不断开
+// 旧进程用 --upgrade-sock <path> 等待，新进程用 --takeover <path> 接手
+// 每个连接的状态(用户名、未发出的数据、传输偏移)在每个挂起点之前都是一致的，
+// 交接时在反应器线程上一次性取下来，连同 fd(SCM_RIGHTS)发给新进程
+// TLS 会话状态在 OpenSSL 里，不能交接: TLS 模式下只交出监听 socket，旧进程处理完已有连接再退出
+
+#define UPGRADE_TIMEOUT 10000         // 交接时等待对方的时间
+#define UPGRADE_QUIESCE_TIMEOUT 2000  // 等线程池里的任务全部回到反应器的时间
+#define UPGRADE_DRAIN_TIMEOUT 60000   // 交接后旧进程最多再跑这么久
+
+enum SessionKind
+{
+    SESSION_CHAT,
+    SESSION_UPLOAD,
+    SESSION_DOWNLOAD,
+    SESSION_MUX,
+    SESSION_DELTA,   // 增量上传的拼接状态不交接，新进程断开连接，客户端重新上传
+    SESSION_BATCH,   // 文件夹上传同上，新进程删掉已经建了的临时文件
+};
+
+// 一个连接交给新进程的全部状态
+struct SessionState
+{
+    int kind = SESSION_CHAT;
+    std::string name;       // map_clients 里的 "ip" 或 "ip:用户名"
+    unsigned caps = 0;
+    bool name_saved = false;
+    std::string output;     // 发送队列里还没写出的数据
+    std::string input;      // 收到还没处理完的数据(压缩上传或 mux 的半帧)
+    std::string filename;
+    uint64_t file_size = 0;
+    uint64_t offset = 0;    // 上传: 已落盘的字节数；下载: 已写入 socket 或发送队列的原始字节数
+    bool compressed = false;
+    bool encoder_decided = false;
+    bool encoder_bypass = false;
+    std::string mux;        // MuxSession::save() 的结果
+    std::vector<std::string> temp_files;  // 文件夹上传已经建了的临时文件
+};
+
+class MuxSession;
+struct MuxDecoder;
+class DiskWriter;
+
+// 连接协程登记的状态，指针指向协程帧里的对象，交接时读取
+struct Session
+{
+    Session(int fd, AsyncSock *sock);
+    ~Session();
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    int fd;
+    AsyncSock *sock;
+    SessionState state;
+    DiskWriter *out = nullptr;
+    FrameEncoder *encoder = nullptr;
+    FrameDecoder *decoder = nullptr;
+    MuxSession *mux = nullptr;
+    MuxDecoder *mux_decoder = nullptr;
+};
+
+Session *session_find(int fd);
+int session_count();
+
+// 状态的序列化
+struct StateWriter
+{
+    std::string data;
+
+    void u8(unsigned v) { data.push_back((char)v); }
+    void u64(uint64_t v);
+    void str(const std::string &s);
+};
+
+struct StateReader
+{
+    const std::string &data;
+    size_t pos = 0;
+    bool ok = true;
+
+    explicit StateReader(const std::string &src) : data(src) {}
+    unsigned u8();
+    uint64_t u64();
+    std::string str();
+};
+
+// 旧进程: 在 path 上等待新进程接手，一直运行
+// fill 补充连接的用户名等服务器层面的状态；交接成功后调用 on_handoff(是否交出了全部连接)
+Task upgrade_listen(std::string path, int listen_fd,
+                    std::function<void(int, SessionState &)> fill,
+                    std::function<void(bool)> on_handoff);
+
+// 新进程: 在启动反应器之前调用，返回接手的监听 socket，失败返回 -1
+int upgrade_takeover(const char *path, std::vector<std::pair<int, SessionState>> &sessions);
+
+// 把上传临时文件已有的前 len 字节重新算进哈希，在线程池里读
+class Sha256;
+Co<bool> digest_file(Sha256 &digest, std::string path, uint64_t len);
+
+#endif // UPGRADE_H